@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Member.h"
+
+using namespace std;
+
+/**
+The AdmissionPolicy class holds the rules deciding whether a bracelet may pass a turnstile.
+It is shared by the BraceletReaderService, which answers the physical readers, and by tools such as the TapReplayer
+that replay recorded taps, so both always make the same decision.
+*/
+class AdmissionPolicy
+{
+public:
+
+	/**
+	The enumerated "Decision" type is the answer sent back to a reader.
+	*/
+	enum Decision { DENY, ADMIT };
+
+	/**
+	The enumerated "Reason" type explains a decision, so readers can show why a bracelet was refused.
+	*/
+	enum Reason { OK, UNKNOWN_BRACELET, INACTIVE_SUBSCRIPTION, NO_CREDITS };
+
+	static const int REASON_COUNT = 4;
+
+	/**
+	Decides whether a bracelet may pass a turnstile. Staff are always admitted.
+	Customers are admitted if their subscription is active and they have gym credits left.
+	*/
+	static Decision decide(Member* member, Reason& reason)
+	{
+		if (member == NULL)
+		{
+			reason = UNKNOWN_BRACELET;
+			return DENY;
+		}
+
+		if (member->getMemberType() == Member::Type::CUSTOMER)
+		{
+			Customer* c = (Customer*)member;
+			if (c->getSubscriptionLevel() == Customer::SubscriptionLevel::INACTIVE)
+			{
+				reason = INACTIVE_SUBSCRIPTION;
+				return DENY;
+			}
+			if (c->getGymCredits() <= 0)
+			{
+				reason = NO_CREDITS;
+				return DENY;
+			}
+		}
+
+		reason = OK;
+		return ADMIT;
+	}
+};
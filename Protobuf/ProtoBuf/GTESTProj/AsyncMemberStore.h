@@ -0,0 +1,391 @@
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FileBackend.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "PersistenceQueue.h"
+#include "ThreadPool.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <exception>
+#define ASYNC_MEMBER_STORE_COROUTINES
+#endif
+
+using namespace std;
+
+/**
+The AsyncResult class holds the result of an operation that completes later, without blocking a thread while it waits.
+
+Continuations added with then() are run on the result's executor once the result is set by complete(),
+so the thread that completes an operation, e.g. an I/O thread, only hands the result on.
+Copies of an AsyncResult share the same result.
+*/
+template <class T>
+class AsyncResult
+{
+private:
+
+	struct State
+	{
+		mutex lock;
+		condition_variable completed;
+		bool ready;
+		T value;
+		vector<function<void(T)> > continuations;
+		ThreadPool* executor;
+	};
+
+public:
+
+	/**
+	Constructor for AsyncResult. Continuations will run on "executor", which must outlive the result.
+	*/
+	AsyncResult(ThreadPool& executor) : state(new State())
+	{
+		state->ready = false;
+		state->value = T();
+		state->executor = &executor;
+	}
+
+	/**
+	Sets the result and schedules every continuation. Only the first call has any effect.
+	*/
+	void complete(T value)
+	{
+		/*A waiter in get() may destroy this AsyncResult as soon as it sees the result, so hold on to the state*/
+		shared_ptr<State> keep(state);
+		vector<function<void(T)> > continuations;
+		{
+			lock_guard<mutex> lock(keep->lock);
+			if (keep->ready)
+				return;
+			keep->ready = true;
+			keep->value = value;
+			continuations.swap(keep->continuations);
+		}
+		keep->completed.notify_all();
+
+		for (size_t i = 0; i < continuations.size(); i++)
+			schedule(keep, continuations[i], value);
+	}
+
+	/**
+	Runs "continuation" with the result on the executor, as soon as the result is set.
+	*/
+	void then(function<void(T)> continuation)
+	{
+		{
+			lock_guard<mutex> lock(state->lock);
+			if (!state->ready)
+			{
+				state->continuations.push_back(continuation);
+				return;
+			}
+		}
+		schedule(state, continuation, state->value);
+	}
+
+	/**
+	Returns whether the result has been set.
+	*/
+	bool isReady()
+	{
+		lock_guard<mutex> lock(state->lock);
+		return state->ready;
+	}
+
+	/**
+	Blocks until the result is set, then returns it. Meant for code that is not itself asynchronous, such as shutdown.
+	*/
+	T get()
+	{
+		unique_lock<mutex> lock(state->lock);
+		while (!state->ready)
+			state->completed.wait(lock);
+		return state->value;
+	}
+
+private:
+	shared_ptr<State> state;
+
+	static void schedule(shared_ptr<State> state, function<void(T)> continuation, T value)
+	{
+		state->executor->submit([continuation, value]() { continuation(value); });
+	}
+};
+
+/**
+The AsyncMemberStore class loads and saves members without blocking the calling thread, so that thousands of member
+operations can be in flight on the few threads of an executor.
+
+load() returns the member from the registry, or reads it from its per-member file on a reader thread and publishes it.
+save() publishes the member to the registry and queues its file to be written by a PersistenceQueue.
+Both return an AsyncResult, whose continuations are resumed on the executor when the I/O completes.
+With a C++20 compiler, an AsyncResult can also be awaited with co_await from a MemberTask coroutine.
+
+Files are named "<directory><membership ID>.member" and use the format of Member::serialize().
+*/
+class AsyncMemberStore
+{
+public:
+
+	static const size_t MAX_BATCH = 256;
+
+	/**
+	Constructor for AsyncMemberStore. Files are read through "backend" unless it is NULL, and written through "queue".
+	The registry, executor, queue and backend must outlive the store. The backend is only used from the store's reader thread.
+	*/
+	AsyncMemberStore(MemberRegistry& registry, ThreadPool& executor, PersistenceQueue& queue, FileBackend* backend, string directory)
+		: registry(registry), executor(executor), queue(queue), backend(backend), directory(directory)
+	{
+		stopping = false;
+		files_read = 0;
+		reader = thread(&AsyncMemberStore::readerLoop, this);
+	}
+
+	/**
+	Destructor for AsyncMemberStore. Completes every queued load, then stops the reader thread.
+	*/
+	~AsyncMemberStore()
+	{
+		{
+			lock_guard<mutex> lock(load_lock);
+			stopping = true;
+		}
+		load_ready.notify_all();
+		reader.join();
+	}
+
+	/**
+	Loads the member with the given membership ID. The result is a copy of the member for this load alone, which is deleted
+	when the last continuation holding it lets go, or NULL if the member is neither in the registry nor in a readable file.
+	*/
+	AsyncResult<shared_ptr<Member> > load(unsigned long membership_id)
+	{
+		AsyncResult<shared_ptr<Member> > result(executor);
+		{
+			MemberRegistry::ReadGuard guard(registry);
+			Member* member = guard.findByMembershipID(membership_id);
+			if (member != NULL)
+			{
+				result.complete(shared_ptr<Member>(member->clone()));
+				return result;
+			}
+		}
+
+		/*Loads of the same member share a single read*/
+		{
+			lock_guard<mutex> lock(load_lock);
+			vector<AsyncResult<shared_ptr<Member> > >& waiting = pending[membership_id];
+			waiting.push_back(result);
+		}
+		load_ready.notify_one();
+		return result;
+	}
+
+	/**
+	Publishes a copy of "member" to the registry and queues it to be written to its file.
+	The result is whether the file was written. The member can be changed or deleted as soon as save() returns.
+	*/
+	AsyncResult<bool> save(Member* member)
+	{
+		AsyncResult<bool> result(executor);
+
+		/*Publishing and queueing in one step keeps concurrent saves of a member in the same order in the registry and the file*/
+		lock_guard<mutex> lock(save_lock);
+		registry.publish(member->clone());
+		queue.save(member, getFileName(member->getMembershipID()), [result](bool written) mutable { result.complete(written); });
+		return result;
+	}
+
+	/**
+	Returns the name of the file the member with the given membership ID is stored in.
+	*/
+	string getFileName(unsigned long membership_id)
+	{
+		return directory + to_string(membership_id) + ".member";
+	}
+
+	/**
+	Retreives the number of member files the reader thread has read.
+	*/
+	unsigned long long getFilesRead()
+	{
+		lock_guard<mutex> lock(load_lock);
+		return files_read;
+	}
+
+private:
+	MemberRegistry& registry;
+	ThreadPool& executor;
+	PersistenceQueue& queue;
+	FileBackend* backend;
+	string directory;
+
+	mutex save_lock;
+
+	thread reader;
+	mutex load_lock;
+	condition_variable load_ready;
+	bool stopping;
+	map<unsigned long, vector<AsyncResult<shared_ptr<Member> > > > pending;
+	unsigned long long files_read;
+
+	void readerLoop()
+	{
+		for (;;)
+		{
+			vector<unsigned long> ids;
+			vector<vector<AsyncResult<shared_ptr<Member> > > > waiting;
+			{
+				unique_lock<mutex> lock(load_lock);
+				while (!stopping && pending.empty())
+					load_ready.wait(lock);
+
+				if (pending.empty())
+					return;
+
+				while (!pending.empty() && ids.size() < MAX_BATCH)
+				{
+					ids.push_back(pending.begin()->first);
+					waiting.push_back(vector<AsyncResult<shared_ptr<Member> > >());
+					waiting.back().swap(pending.begin()->second);
+					pending.erase(pending.begin());
+				}
+			}
+
+			vector<string> file_names(ids.size());
+			for (size_t i = 0; i < ids.size(); i++)
+				file_names[i] = getFileName(ids[i]);
+
+			vector<string> contents;
+			vector<char> ok;
+			readFiles(file_names, contents, ok);
+			{
+				lock_guard<mutex> lock(load_lock);
+				files_read += ids.size();
+			}
+
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				Member* member = NULL;
+				seng330a2::Member m;
+				if (ok[i] && m.ParseFromString(contents[i]))
+				{
+					if (m.member_type() == seng330a2::Member_Type::Member_Type_STAFF)
+						member = new Staff();
+					else
+						member = new Customer();
+					member->fromProto(m);
+					member->clearDirtyFields();
+					publishUnlessNewer(member);
+				}
+
+				/*Every waiting load gets its own copy*/
+				for (size_t w = 0; w < waiting[i].size(); w++)
+					waiting[i][w].complete(shared_ptr<Member>(member == NULL || w + 1 == waiting[i].size() ? member : member->clone()));
+			}
+		}
+	}
+
+	/*A save() made while the file was being read is newer than the file, so it wins and "member" becomes a copy of it*/
+	void publishUnlessNewer(Member*& member)
+	{
+		Member* copy = member->clone();
+		if (registry.publishIfAbsent(copy))
+			return;
+		delete copy;
+
+		MemberRegistry::ReadGuard guard(registry);
+		Member* current = guard.findByMembershipID(member->getMembershipID());
+		if (current != NULL)
+		{
+			delete member;
+			member = current->clone();
+		}
+	}
+
+	void readFiles(const vector<string>& file_names, vector<string>& contents, vector<char>& ok)
+	{
+		if (backend != NULL)
+		{
+			backend->readFiles(file_names, contents, ok);
+			return;
+		}
+
+		contents.assign(file_names.size(), string());
+		ok.assign(file_names.size(), 0);
+		for (size_t i = 0; i < file_names.size(); i++)
+		{
+			fstream input(file_names[i], ios::in | ios::binary);
+			if (!input)
+				continue;
+			contents[i].assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+			ok[i] = !input.bad();
+		}
+	}
+
+	AsyncMemberStore(const AsyncMemberStore&);
+	AsyncMemberStore& operator=(const AsyncMemberStore&);
+};
+
+#ifdef ASYNC_MEMBER_STORE_COROUTINES
+
+/**
+The MemberTask class is the return type of coroutines that await AsyncResults, e.g. "shared_ptr<Member> m = co_await store.load(id);".
+The coroutine starts running at once, on the calling thread, and resumes on the executor after each co_await.
+It cleans itself up when it finishes, so the caller does not need to keep the MemberTask.
+*/
+struct MemberTask
+{
+	struct promise_type
+	{
+		MemberTask get_return_object() { return MemberTask(); }
+		suspend_never initial_suspend() { return suspend_never(); }
+		suspend_never final_suspend() noexcept { return suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+};
+
+/*Suspends the awaiting coroutine until the result is set, then resumes it on the result's executor*/
+template <class T>
+struct AsyncResultAwaiter
+{
+	AsyncResult<T> result;
+	T value;
+
+	bool await_ready()
+	{
+		return false;
+	}
+
+	void await_suspend(coroutine_handle<> handle)
+	{
+		result.then([this, handle](T completed) { value = completed; handle.resume(); });
+	}
+
+	T await_resume()
+	{
+		return value;
+	}
+};
+
+template <class T>
+AsyncResultAwaiter<T> operator co_await(AsyncResult<T> result)
+{
+	return AsyncResultAwaiter<T> { result, T() };
+}
+
+#endif
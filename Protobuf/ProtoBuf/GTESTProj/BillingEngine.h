@@ -0,0 +1,343 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "ThreadPool.h"
+#include "TraceSpans.h"
+
+using namespace std;
+
+/**
+The BillingEngine class performs the monthly subscription billing run over every active Customer in a MemberRegistry.
+
+Each Customer whose subscription level is not INACTIVE is charged the monthly price of its level and credited
+that level's monthly allotment of gym credits. One ChargeRecord is produced per billed customer.
+
+The run is split into chunks of CHUNK_SIZE customers ordered by membership ID, and the chunks are billed in parallel on a ThreadPool.
+Every chunk is recorded in a checkpoint file as started before any of its customers are billed, and as finished once its
+charges are written, so a run that was cancelled or interrupted can be resumed by calling run() again with the same period
+and checkpoint file. No chunk is ever billed twice: a chunk that was started but not finished, because the run crashed
+while billing it, may have been billed in part, so resuming skips it and reports it with getChunksInDoubt() instead.
+*/
+class BillingEngine
+{
+public:
+
+	/**
+	The ChargeRecord struct describes one charge made against a customer's credit card by a billing run.
+	*/
+	struct ChargeRecord
+	{
+		unsigned long membership_id;
+		unsigned long credit_card_num;
+		Customer::SubscriptionLevel subscription_level;
+		int amount_cents;
+		int credits_granted;
+	};
+
+	/**
+	The number of customers billed together as one checkpointed unit of work.
+	*/
+	static const size_t CHUNK_SIZE = 4096;
+
+	/**
+	Constructor for BillingEngine. Sets up the default price list, which can be changed with setPrice() and setMonthlyCredits().
+	*/
+	BillingEngine(MemberRegistry& registry, ThreadPool& pool) : registry(registry), pool(pool)
+	{
+		setPrice(Customer::SubscriptionLevel::INACTIVE, 0);
+		setPrice(Customer::SubscriptionLevel::BASIC, 2999);
+		setPrice(Customer::SubscriptionLevel::PREMIUM, 4999);
+		setPrice(Customer::SubscriptionLevel::DELUXE, 7999);
+
+		setMonthlyCredits(Customer::SubscriptionLevel::INACTIVE, 0);
+		setMonthlyCredits(Customer::SubscriptionLevel::BASIC, 20);
+		setMonthlyCredits(Customer::SubscriptionLevel::PREMIUM, 50);
+		setMonthlyCredits(Customer::SubscriptionLevel::DELUXE, 100);
+
+		cancelled = false;
+		customers_billed = 0;
+		amount_charged = 0;
+		complete = false;
+	}
+
+	/**
+	Sets the monthly price, in cents, of a subscription level.
+	*/
+	void setPrice(Customer::SubscriptionLevel subscription_level, int amount_cents)
+	{
+		price_cents[subscription_level] = amount_cents;
+	}
+
+	/**
+	Sets the number of gym credits a subscription level is granted every month.
+	*/
+	void setMonthlyCredits(Customer::SubscriptionLevel subscription_level, int credits)
+	{
+		monthly_credits[subscription_level] = credits;
+	}
+
+	/**
+	Retreives the monthly price, in cents, of a subscription level.
+	*/
+	int getPrice(Customer::SubscriptionLevel subscription_level)
+	{
+		return price_cents[subscription_level];
+	}
+
+	/**
+	Retreives the number of gym credits a subscription level is granted every month.
+	*/
+	int getMonthlyCredits(Customer::SubscriptionLevel subscription_level)
+	{
+		return monthly_credits[subscription_level];
+	}
+
+	/**
+	Bills every active customer for the given period (e.g. "2015-11").
+
+	If "checkpoint_file" already holds a checkpoint for the same period, the run resumes from it and only chunks that were never
+	started are billed.
+	Charge records are appended to "charges_file" as comma separated lines of
+	membership ID, credit card number, subscription level, amount in cents and credits granted. Pass an empty file name to skip them.
+
+	Returns true if every chunk of the period has now been billed or is in doubt, or false if the run was cancelled before finishing.
+	*/
+	bool run(string period, string checkpoint_file, string charges_file)
+	{
+		cancelled = false;
+		customers_billed = 0;
+		amount_charged = 0;
+
+		/*Collect the IDs of every active customer, sorted so chunk boundaries are stable across restarts*/
+		vector<unsigned long> customer_ids;
+		{
+			TraceSpan span("billing.collect", "billing");
+			MemberRegistry::ReadGuard guard(registry);
+			guard.forEach([&](Member* m)
+			{
+				if (m->getMemberType() == Member::Type::CUSTOMER && ((Customer*)m)->getSubscriptionLevel() != Customer::SubscriptionLevel::INACTIVE)
+					customer_ids.push_back(m->getMembershipID());
+			});
+		}
+		{
+			TraceSpan span("billing.sort", "billing");
+			sort(customer_ids.begin(), customer_ids.end());
+		}
+
+		/*Resume from the checkpoint, or plan a new run*/
+		vector<unsigned long> boundaries;
+		set<size_t> started, finished;
+		if (!readCheckpoint(checkpoint_file, period, boundaries, started, finished))
+		{
+			boundaries.push_back(0);
+			for (size_t i = CHUNK_SIZE; i < customer_ids.size(); i += CHUNK_SIZE)
+				boundaries.push_back(customer_ids[i]);
+			writeCheckpointHeader(checkpoint_file, period, boundaries);
+		}
+
+		checkpoint.open(checkpoint_file, ios::out | ios::app);
+		if (!charges_file.empty())
+			charges.open(charges_file, ios::out | ios::app);
+
+		pool.parallelFor(boundaries.size(), [&](size_t chunk)
+		{
+			if (cancelled.load() || started.count(chunk) != 0 || finished.count(chunk) != 0)
+				return;
+
+			/*A chunk holds every customer with a membership ID in [boundaries[chunk], boundaries[chunk + 1])*/
+			vector<unsigned long>::iterator first = lower_bound(customer_ids.begin(), customer_ids.end(), boundaries[chunk]);
+			vector<unsigned long>::iterator last = chunk + 1 < boundaries.size()
+				? lower_bound(customer_ids.begin(), customer_ids.end(), boundaries[chunk + 1])
+				: customer_ids.end();
+
+			billChunk(chunk, vector<unsigned long>(first, last));
+		});
+
+		checkpoint.close();
+		if (charges.is_open())
+			charges.close();
+
+		/*The run is complete once every planned chunk has a DONE entry, or a BEGIN entry alone if it is in doubt*/
+		vector<unsigned long> unused;
+		started.clear();
+		finished.clear();
+		readCheckpoint(checkpoint_file, period, unused, started, finished);
+		chunks_in_doubt.clear();
+		for (set<size_t>::iterator it = started.begin(); it != started.end(); ++it)
+		{
+			if (finished.count(*it) == 0)
+				chunks_in_doubt.push_back(*it);
+		}
+		complete = finished.size() + chunks_in_doubt.size() == boundaries.size();
+		return complete;
+	}
+
+	/**
+	Asks a running billing run to stop. Chunks already being billed are finished and checkpointed, no new chunks are started.
+	*/
+	void cancel()
+	{
+		cancelled = true;
+	}
+
+	/**
+	Retreives the number of customers billed by the last call to run().
+	*/
+	size_t getCustomersBilled()
+	{
+		return customers_billed.load();
+	}
+
+	/**
+	Retreives the total amount, in cents, charged by the last call to run().
+	*/
+	long long getAmountCharged()
+	{
+		return amount_charged.load();
+	}
+
+	/**
+	Retreives the chunks found started but never finished by the last call to run(). Some of their customers may have been billed
+	and some not, so they are left for an operator to reconcile rather than billed again.
+	*/
+	vector<size_t> getChunksInDoubt()
+	{
+		return chunks_in_doubt;
+	}
+
+	/**
+	Returns whether the last call to run() finished billing the whole period.
+	*/
+	bool isComplete()
+	{
+		return complete;
+	}
+
+private:
+	MemberRegistry& registry;
+	ThreadPool& pool;
+	int price_cents[4];
+	int monthly_credits[4];
+
+	atomic<bool> cancelled;
+	atomic<size_t> customers_billed;
+	atomic<long long> amount_charged;
+	bool complete;
+	vector<size_t> chunks_in_doubt;
+
+	/*Output files, shared by all workers of a run*/
+	mutex output_lock;
+	fstream checkpoint;
+	fstream charges;
+
+	/*Credits and charges one chunk of customers, then records the chunk as finished*/
+	void billChunk(size_t chunk, const vector<unsigned long>& customer_ids)
+	{
+		TraceSpan chunk_span("billing.chunk", "billing");
+
+		/*Record the intent first, so a crash from here on leaves the chunk in doubt instead of billing it again on resume*/
+		{
+			lock_guard<mutex> lock(output_lock);
+			checkpoint << "BEGIN " << chunk << '\n';
+			checkpoint.flush();
+		}
+
+		/*Charges are keyed by membership ID, since the registry may call "mutate" again for a member that changed concurrently*/
+		map<unsigned long, ChargeRecord> chunk_charges;
+
+		registry.updateBatch(customer_ids, [&](Member* m)
+		{
+			Customer* c = (Customer*)m;
+			if (m->getMemberType() != Member::Type::CUSTOMER || c->getSubscriptionLevel() == Customer::SubscriptionLevel::INACTIVE)
+			{
+				chunk_charges.erase(m->getMembershipID());
+				return;
+			}
+			Customer::SubscriptionLevel level = c->getSubscriptionLevel();
+
+			c->addGymCredits(monthly_credits[level]);
+
+			ChargeRecord record = { m->getMembershipID(), c->getCreditCard(), level, price_cents[level], monthly_credits[level] };
+			chunk_charges[m->getMembershipID()] = record;
+		});
+
+		/*Format outside the lock so workers only serialize on the actual writes*/
+		ostringstream lines;
+		long long chunk_amount = 0;
+		for (map<unsigned long, ChargeRecord>::iterator it = chunk_charges.begin(); it != chunk_charges.end(); ++it)
+		{
+			ChargeRecord& r = it->second;
+			chunk_amount += r.amount_cents;
+			lines << r.membership_id << ',' << r.credit_card_num << ',' << r.subscription_level << ','
+				<< r.amount_cents << ',' << r.credits_granted << '\n';
+		}
+
+		{
+			TraceSpan span("billing.checkpoint", "billing");
+			lock_guard<mutex> lock(output_lock);
+			if (charges.is_open())
+			{
+				charges << lines.str();
+				charges.flush();
+			}
+			checkpoint << "DONE " << chunk << '\n';
+			checkpoint.flush();
+		}
+
+		customers_billed += chunk_charges.size();
+		amount_charged += chunk_amount;
+	}
+
+	/*Checkpoint format: "BILLING <period> <chunk count>", one chunk boundary per line, then a "BEGIN <chunk>" line per started chunk
+	and a "DONE <chunk>" line per finished chunk*/
+	static bool readCheckpoint(string file_name, string period, vector<unsigned long>& boundaries, set<size_t>& started,
+		set<size_t>& finished)
+	{
+		fstream input(file_name, ios::in);
+		string tag, file_period;
+		size_t chunk_count = 0;
+
+		if (!(input >> tag >> file_period >> chunk_count) || tag != "BILLING" || file_period != period)
+			return false;
+
+		boundaries.clear();
+		for (size_t i = 0; i < chunk_count; i++)
+		{
+			unsigned long boundary;
+			if (!(input >> boundary))
+				return false;
+			boundaries.push_back(boundary);
+		}
+
+		size_t chunk;
+		while (input >> tag >> chunk)
+		{
+			if (tag == "BEGIN" && chunk < chunk_count)
+				started.insert(chunk);
+			else if (tag == "DONE" && chunk < chunk_count)
+				finished.insert(chunk);
+		}
+		return true;
+	}
+
+	static void writeCheckpointHeader(string file_name, string period, const vector<unsigned long>& boundaries)
+	{
+		fstream output(file_name, ios::out | ios::trunc);
+		output << "BILLING " << period << ' ' << boundaries.size() << '\n';
+		for (size_t i = 0; i < boundaries.size(); i++)
+			output << boundaries[i] << '\n';
+	}
+
+	BillingEngine(const BillingEngine&);
+	BillingEngine& operator=(const BillingEngine&);
+};
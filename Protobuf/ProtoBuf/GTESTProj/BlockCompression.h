@@ -0,0 +1,435 @@
+#pragma once
+
+#include <string>
+#include <string.h>
+#include <vector>
+#include "ByteOrder.h"
+#include "ThreadPool.h"
+#include "TraceSpans.h"
+
+using namespace std;
+
+/**
+The CompressionCodec class is the interface of a block compression algorithm used by BlockCompressor.
+New codecs can be plugged in by deriving from it and giving them an unused ID.
+*/
+class CompressionCodec
+{
+public:
+
+	/**
+	Virtual destructor for CompressionCodec.
+	*/
+	virtual ~CompressionCodec() {}
+
+	/**
+	Returns the ID stored in compressed files to identify this codec.
+	*/
+	virtual unsigned char getID() = 0;
+
+	/**
+	Returns a human readable name of this codec.
+	*/
+	virtual string getName() = 0;
+
+	/**
+	Compresses "size" bytes from "in" and appends the result to "out".
+	*/
+	virtual void compress(const char* in, size_t size, string& out) = 0;
+
+	/**
+	Decompresses "size" bytes from "in", which must expand to exactly "raw_size" bytes, and appends the result to "out".
+	Returns false if the input is malformed.
+	*/
+	virtual bool decompress(const char* in, size_t size, size_t raw_size, string& out) = 0;
+};
+
+/**
+The StoreCodec class stores blocks uncompressed. It is useful as a baseline, and for data that does not compress.
+*/
+class StoreCodec : public CompressionCodec
+{
+public:
+
+	static const unsigned char ID = 0;
+
+	unsigned char getID()
+	{
+		return ID;
+	}
+
+	string getName()
+	{
+		return "store";
+	}
+
+	void compress(const char* in, size_t size, string& out)
+	{
+		out.append(in, size);
+	}
+
+	bool decompress(const char* in, size_t size, size_t raw_size, string& out)
+	{
+		if (size != raw_size)
+			return false;
+		out.append(in, size);
+		return true;
+	}
+};
+
+/**
+The LZCodec class is a small in-tree LZ77 compressor in the style of LZ4, so that no external library is needed at build time.
+
+The output is a series of sequences. Each sequence is a token byte holding a literal count (high nibble) and a match length
+minus MIN_MATCH (low nibble), extra length bytes for counts of 15 or more, the literals, then a 2 byte little-endian match offset
+and extra match length bytes. The last sequence holds only literals and no match.
+Matches are found through a hash table of the last position each 4 byte prefix was seen at.
+*/
+class LZCodec : public CompressionCodec
+{
+public:
+
+	static const unsigned char ID = 1;
+	static const size_t MIN_MATCH = 4;
+	static const size_t MAX_OFFSET = 65535;
+	static const int HASH_BITS = 14;
+
+	unsigned char getID()
+	{
+		return ID;
+	}
+
+	string getName()
+	{
+		return "lz";
+	}
+
+	void compress(const char* in, size_t size, string& out)
+	{
+		vector<unsigned int> table(1 << HASH_BITS, 0);
+		size_t anchor = 0;
+		size_t position = 0;
+
+		while (size >= MIN_MATCH && position + MIN_MATCH <= size)
+		{
+			unsigned int sequence = read32(in + position);
+			unsigned int& slot = table[hash(sequence)];
+			size_t candidate = slot;
+			slot = (unsigned int)position + 1;
+
+			/*Slots hold position + 1 so that 0 means empty*/
+			if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET || read32(in + candidate - 1) != sequence)
+			{
+				position++;
+				continue;
+			}
+			candidate--;
+
+			size_t length = MIN_MATCH;
+			while (position + length < size && in[candidate + length] == in[position + length])
+				length++;
+
+			writeSequence(out, in + anchor, position - anchor, position - candidate, length);
+			position += length;
+			anchor = position;
+		}
+
+		/*Final literals-only sequence*/
+		writeSequence(out, in + anchor, size - anchor, 0, 0);
+	}
+
+	bool decompress(const char* in, size_t size, size_t raw_size, string& out)
+	{
+		size_t start = out.size();
+		size_t limit = start + raw_size;
+		size_t position = 0;
+
+		for (;;)
+		{
+			if (position >= size)
+				return false;
+			unsigned char token = (unsigned char)in[position++];
+
+			size_t literals = token >> 4;
+			if (literals == 15 && !readLength(in, size, position, literals))
+				return false;
+			if (size - position < literals || limit - out.size() < literals)
+				return false;
+			out.append(in + position, literals);
+			position += literals;
+
+			if (out.size() == limit)
+				return position == size;
+
+			if (size - position < 2)
+				return false;
+			size_t offset = (unsigned char)in[position] | ((unsigned char)in[position + 1] << 8);
+			position += 2;
+
+			size_t length = token & 15;
+			if (length == 15 && !readLength(in, size, position, length))
+				return false;
+			length += MIN_MATCH;
+
+			if (offset == 0 || offset > out.size() - start || limit - out.size() < length)
+				return false;
+
+			/*A match may overlap the bytes it is copying, so copy at most "offset" bytes at a time*/
+			size_t from = out.size() - offset;
+			while (length > 0)
+			{
+				size_t n = min(offset, length);
+				out.append(out, from, n);
+				from += n;
+				length -= n;
+			}
+		}
+	}
+
+private:
+
+	static unsigned int read32(const char* p)
+	{
+		unsigned int value;
+		memcpy(&value, p, 4);
+		return value;
+	}
+
+	static unsigned int hash(unsigned int sequence)
+	{
+		return (sequence * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	static void writeLength(string& out, size_t length)
+	{
+		while (length >= 255)
+		{
+			out.push_back((char)255);
+			length -= 255;
+		}
+		out.push_back((char)length);
+	}
+
+	static bool readLength(const char* in, size_t size, size_t& position, size_t& length)
+	{
+		for (;;)
+		{
+			if (position >= size)
+				return false;
+			unsigned char extra = (unsigned char)in[position++];
+			length += extra;
+			if (extra != 255)
+				return true;
+		}
+	}
+
+	/*A match length of 0 marks the final, literals-only sequence*/
+	static void writeSequence(string& out, const char* literals, size_t literal_count, size_t offset, size_t match_length)
+	{
+		size_t match_code = match_length == 0 ? 0 : match_length - MIN_MATCH;
+		unsigned char token = (unsigned char)((min(literal_count, (size_t)15) << 4) | min(match_code, (size_t)15));
+		out.push_back((char)token);
+
+		if (literal_count >= 15)
+			writeLength(out, literal_count - 15);
+		out.append(literals, literal_count);
+
+		if (match_length == 0)
+			return;
+
+		out.push_back((char)(offset & 0xFF));
+		out.push_back((char)(offset >> 8));
+		if (match_code >= 15)
+			writeLength(out, match_code - 15);
+	}
+};
+
+/**
+The BlockCompressor class splits data into independently compressed blocks, so that blocks can be compressed and
+decompressed in parallel, and so that a corrupted block is detected by its CRC-32 before it is ever decompressed.
+
+Layout, all integers little-endian: magic "S330BLKS" (8), codec ID (1), block count (4),
+then per block: raw size (4), compressed size (4), CRC-32 of the compressed bytes (4), compressed bytes.
+*/
+class BlockCompressor
+{
+public:
+
+	static const size_t HEADER_SIZE = 13;
+	static const size_t BLOCK_HEADER_SIZE = 12;
+	static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+	/**
+	Returns whether "data" starts like the output of compress().
+	*/
+	static bool isCompressed(const string& data)
+	{
+		return data.size() >= HEADER_SIZE && memcmp(data.data(), "S330BLKS", 8) == 0;
+	}
+
+	/**
+	Compresses "raw" into blocks of "block_size" bytes with "codec", using "pool" to compress blocks in parallel
+	(or the calling thread if "pool" is NULL). Replaces the contents of "out".
+	*/
+	static void compress(const string& raw, CompressionCodec& codec, ThreadPool* pool, string& out, size_t block_size = DEFAULT_BLOCK_SIZE)
+	{
+		size_t block_count = (raw.size() + block_size - 1) / block_size;
+		vector<string> blocks(block_count);
+
+		forEachBlock(pool, block_count, [&](size_t b)
+		{
+			TraceSpan span("block.compress", "save");
+			size_t start = b * block_size;
+			size_t raw_size = min(block_size, raw.size() - start);
+			string& block = blocks[b];
+
+			block.resize(BLOCK_HEADER_SIZE);
+			codec.compress(raw.data() + start, raw_size, block);
+
+			ByteOrder::putU32(&block[0], (unsigned int)raw_size);
+			ByteOrder::putU32(&block[4], (unsigned int)(block.size() - BLOCK_HEADER_SIZE));
+			ByteOrder::putU32(&block[8], crc32(block.data() + BLOCK_HEADER_SIZE, block.size() - BLOCK_HEADER_SIZE));
+		});
+
+		out.assign("S330BLKS", 8);
+		out.push_back((char)codec.getID());
+		out.resize(HEADER_SIZE);
+		ByteOrder::putU32(&out[9], (unsigned int)block_count);
+		for (size_t b = 0; b < block_count; b++)
+			out += blocks[b];
+	}
+
+	/**
+	Decompresses the output of compress() into "raw", replacing its contents, using "pool" to decompress blocks in parallel
+	(or the calling thread if "pool" is NULL). The codec is picked by the ID in the header from the built-in codecs,
+	unless a "codec" is given. Returns false if any block fails its checksum or is malformed.
+	*/
+	static bool decompress(const string& in, ThreadPool* pool, string& raw, CompressionCodec* codec = NULL)
+	{
+		if (!isCompressed(in))
+			return false;
+
+		if (codec == NULL)
+			codec = builtinCodec((unsigned char)in[8]);
+		if (codec == NULL || codec->getID() != (unsigned char)in[8])
+			return false;
+
+		/*Walk the block headers first, so every block's input and output position is known up front*/
+		size_t block_count = ByteOrder::getU32(&in[9]);
+		vector<size_t> in_offsets, out_offsets;
+		size_t position = HEADER_SIZE;
+		size_t raw_total = 0;
+		for (size_t b = 0; b < block_count; b++)
+		{
+			if (in.size() - position < BLOCK_HEADER_SIZE)
+				return false;
+			size_t compressed_size = ByteOrder::getU32(&in[position + 4]);
+			if (in.size() - position - BLOCK_HEADER_SIZE < compressed_size)
+				return false;
+
+			in_offsets.push_back(position);
+			out_offsets.push_back(raw_total);
+			raw_total += ByteOrder::getU32(&in[position]);
+			position += BLOCK_HEADER_SIZE + compressed_size;
+		}
+		if (position != in.size())
+			return false;
+
+		vector<string> blocks(block_count);
+		vector<char> valid(block_count, 0);
+		forEachBlock(pool, block_count, [&](size_t b)
+		{
+			TraceSpan span("block.decompress", "import");
+			const char* header = in.data() + in_offsets[b];
+			size_t compressed_size = ByteOrder::getU32(header + 4);
+			if (crc32(header + BLOCK_HEADER_SIZE, compressed_size) != ByteOrder::getU32(header + 8))
+				return;
+			valid[b] = codec->decompress(header + BLOCK_HEADER_SIZE, compressed_size, ByteOrder::getU32(header), blocks[b]);
+		});
+
+		raw.clear();
+		for (size_t b = 0; b < block_count; b++)
+		{
+			if (!valid[b])
+				return false;
+		}
+		raw.reserve(raw_total);
+		for (size_t b = 0; b < block_count; b++)
+			raw += blocks[b];
+		return true;
+	}
+
+	/**
+	Returns the built-in codec with the given ID, or NULL if there is none.
+	*/
+	static CompressionCodec* builtinCodec(unsigned char id)
+	{
+		Builtins& builtins = getBuiltins();
+		if (id == StoreCodec::ID)
+			return &builtins.store;
+		if (id == LZCodec::ID)
+			return &builtins.lz;
+		return NULL;
+	}
+
+	/**
+	Computes the CRC-32 (IEEE 802.3 polynomial) of "size" bytes.
+	*/
+	static unsigned int crc32(const char* data, size_t size)
+	{
+		const CrcTable& table = getBuiltins().crc_table;
+
+		unsigned int crc = 0xFFFFFFFFu;
+		for (size_t i = 0; i < size; i++)
+			crc = table.entries[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+		return crc ^ 0xFFFFFFFFu;
+	}
+
+private:
+
+	/*Byte-at-a-time CRC-32 lookup table, built once*/
+	struct CrcTable
+	{
+		unsigned int entries[256];
+
+		CrcTable()
+		{
+			for (unsigned int i = 0; i < 256; i++)
+			{
+				unsigned int c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				entries[i] = c;
+			}
+		}
+	};
+
+	/*The built-in codecs and the CRC table, shared by every caller*/
+	struct Builtins
+	{
+		StoreCodec store;
+		LZCodec lz;
+		CrcTable crc_table;
+	};
+
+	static Builtins& getBuiltins()
+	{
+		static Builtins builtins;
+		return builtins;
+	}
+
+	static void forEachBlock(ThreadPool* pool, size_t block_count, function<void(size_t)> body)
+	{
+		if (pool != NULL)
+		{
+			pool->parallelFor(block_count, body);
+			return;
+		}
+		for (size_t b = 0; b < block_count; b++)
+			body(b);
+	}
+};
+
+/*Builds the built-in codecs and the CRC table before main(), since under VS2013 two threads compressing at once
+could both construct them on first use*/
+static CompressionCodec* builtin_codecs = BlockCompressor::builtinCodec(StoreCodec::ID);
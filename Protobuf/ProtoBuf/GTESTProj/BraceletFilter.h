@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include "MemoryStats.h"
+
+using namespace std;
+
+/**
+The BraceletFilter class is a split block Bloom filter over bracelet IDs, answering "certainly not registered" for most unknown bracelets
+before any hash table is probed.
+
+Each bracelet ID maps to a single 64 byte block, aligned to a cache line, and sets one bit in each of the block's eight words.
+A lookup therefore reads exactly one cache line. At BITS_PER_KEY bits per key, a full filter lets about 1 in 1000 unknown bracelets through.
+Bracelets that were inserted are always let through.
+
+Bits are never cleared, so bracelets that leave can only be forgotten by building a new filter; the MemberRegistry does that
+when stale bracelets pile up. Inserts and lookups can be called concurrently from any thread.
+*/
+class BraceletFilter
+{
+public:
+
+	static const size_t BITS_PER_KEY = 16;
+	static const size_t BLOCK_SIZE = 64;
+
+	/**
+	Constructor for BraceletFilter. The filter is sized for "capacity" bracelets; more can be inserted, at a higher false positive rate.
+	*/
+	BraceletFilter(size_t capacity)
+	{
+		size_t blocks_needed = capacity * BITS_PER_KEY / (BLOCK_SIZE * 8) + 1;
+		block_count = 1;
+		while (block_count < blocks_needed)
+			block_count *= 2;
+
+		storage = new char[block_count * BLOCK_SIZE + BLOCK_SIZE - 1];
+		blocks = (Block*)(((size_t)storage + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1));
+		for (size_t b = 0; b < block_count; b++)
+		{
+			new (&blocks[b]) Block();
+			for (int w = 0; w < 8; w++)
+				blocks[b].words[w].store(0, memory_order_relaxed);
+		}
+		MemoryStats::instance().allocated(MemoryStats::REGISTRY_INDEX, sizeof(BraceletFilter) + block_count * BLOCK_SIZE + BLOCK_SIZE - 1);
+	}
+
+	/**
+	Destructor for BraceletFilter.
+	*/
+	~BraceletFilter()
+	{
+		MemoryStats::instance().freed(MemoryStats::REGISTRY_INDEX, sizeof(BraceletFilter) + block_count * BLOCK_SIZE + BLOCK_SIZE - 1);
+		delete[] storage;
+	}
+
+	/**
+	Adds a bracelet to the filter.
+	*/
+	void insert(unsigned long bracelet_id)
+	{
+		unsigned long long h = mix(bracelet_id);
+		Block& block = blocks[(size_t)(h >> 32) & (block_count - 1)];
+		for (int w = 0; w < 8; w++)
+		{
+			unsigned long long bit = bitOf((unsigned int)h, w);
+			if ((block.words[w].load(memory_order_relaxed) & bit) == 0)
+				block.words[w].fetch_or(bit, memory_order_release);
+		}
+	}
+
+	/**
+	Returns false if the bracelet was certainly never inserted, and true if it may have been.
+	*/
+	bool mayContain(unsigned long bracelet_id) const
+	{
+		unsigned long long h = mix(bracelet_id);
+		const Block& block = blocks[(size_t)(h >> 32) & (block_count - 1)];
+		for (int w = 0; w < 8; w++)
+		{
+			unsigned long long bit = bitOf((unsigned int)h, w);
+			if ((block.words[w].load(memory_order_acquire) & bit) == 0)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	Retreives the number of bracelets the filter was sized for.
+	*/
+	size_t getCapacity() const
+	{
+		return block_count * BLOCK_SIZE * 8 / BITS_PER_KEY;
+	}
+
+	/**
+	Retreives the size of the filter's bit array, in bytes.
+	*/
+	size_t getBytes() const
+	{
+		return block_count * BLOCK_SIZE;
+	}
+
+private:
+
+	struct Block
+	{
+		atomic<unsigned long long> words[8];
+	};
+
+	char* storage;
+	Block* blocks;
+	size_t block_count;
+
+	/*Bracelet IDs are often handed out sequentially, so they are mixed before being split into a block and bit positions*/
+	static unsigned long long mix(unsigned long bracelet_id)
+	{
+		unsigned long long h = (unsigned long long)bracelet_id + 0x9e3779b97f4a7c15ull;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+		return h ^ (h >> 31);
+	}
+
+	/*Each word's bit is picked by multiplying the low half of the hash with a different odd constant*/
+	static unsigned long long bitOf(unsigned int h, int word)
+	{
+		static const unsigned int salts[8] = { 0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u };
+		return 1ull << ((h * salts[word]) >> 26);
+	}
+
+	BraceletFilter(const BraceletFilter&);
+	BraceletFilter& operator=(const BraceletFilter&);
+};
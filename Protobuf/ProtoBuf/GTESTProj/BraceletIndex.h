@@ -0,0 +1,588 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include "ByteOrder.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+
+using namespace std;
+
+/**
+The BraceletIndex class maps bracelet IDs to the members of a snapshot with a minimal perfect hash, built when the snapshot is written.
+
+The hash sends each of the snapshot's n bracelets to its own slot in [0, n), and each slot holds the position of its member
+in the snapshot. A lookup hashes the bracelet once, reads its bucket's pilot value, and lands on the one slot that can hold it,
+so it needs a single probe and no key comparisons beyond checking that the member found really wears the bracelet.
+The hash itself takes about 3.5 bits per bracelet, and the slots 32 bits.
+
+The hash follows PTHash: bracelets are split into buckets, and each bucket, largest first, gets the smallest pilot value that
+sends all of its bracelets to free slots. Slots are searched in a table 1% larger than n, and the few bracelets landing past n
+are remapped to the slots left free below it.
+
+Once the registry has been loaded from the same snapshot, follow() keeps the index current as a MemberRegistry::Listener.
+Every change published from then on (new members, new versions, moved bracelets and removed members) puts a copy of the member,
+or a mark that the bracelet is gone, in a small overlay, and flags the slot of a changed snapshot bracelet. A lookup reads the
+slot first and only goes to the overlay, under a lock, if that slot is flagged or the bracelet is not in the snapshot at all,
+so bracelets unchanged since the snapshot still take a single probe. Lookups can run from any thread, concurrently with
+registry writes; the overlay's copies are retired through the registry's epochs, so a member found there stays valid while
+the caller holds a MemberRegistry::ReadGuard. build(), decode() and attach() must not be called while the index follows a registry.
+*/
+class BraceletIndex : public MemberRegistry::Listener
+{
+public:
+
+	/**
+	Constructor for BraceletIndex. The index is empty until build() or decode() is called.
+	*/
+	BraceletIndex()
+	{
+		members = NULL;
+		registry = NULL;
+		following = false;
+		changed = NULL;
+		has_new_bracelets = false;
+		clearHash();
+	}
+
+	/**
+	Destructor for BraceletIndex. Stops following the registry, if it does.
+	*/
+	~BraceletIndex()
+	{
+		if (registry != NULL)
+			registry->removeListener(this);
+		clearOverlay();
+		delete[] changed;
+	}
+
+	/**
+	Builds the index over the given members, which refer to them by position. The index is attached to "members",
+	which must stay alive and unchanged for as long as it is. Members with duplicate bracelet IDs are indexed once.
+	*/
+	void build(const vector<Member*>& members)
+	{
+		vector<pair<unsigned long long, unsigned int> > keys(members.size());
+		for (size_t i = 0; i < members.size(); i++)
+			keys[i] = make_pair((unsigned long long)members[i]->getBraceletID(), (unsigned int)i);
+		sort(keys.begin(), keys.end());
+		size_t unique = 0;
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			if (unique == 0 || keys[i].first != keys[unique - 1].first)
+				keys[unique++] = keys[i];
+		}
+		keys.resize(unique);
+
+		for (unsigned long long seed = 1;; seed++)
+		{
+			if (buildHash(keys, seed))
+				break;
+		}
+
+		attach(members);
+		clearOverlay();
+		member_count = members.size();
+		member_hash = fingerprint(members);
+		charge();
+	}
+
+	/**
+	Attaches the index to the members its positions refer to, e.g. after decode(). They must be in the same order as when it was built.
+	*/
+	void attach(const vector<Member*>& members)
+	{
+		this->members = &members;
+	}
+
+	/**
+	Returns whether "members" are the members the index was built over: as many of them, with the same membership and bracelet IDs
+	in the same order. An index must not be attached to any others.
+	*/
+	bool matches(const vector<Member*>& members) const
+	{
+		return members.size() == member_count && fingerprint(members) == member_hash;
+	}
+
+	/**
+	Keeps the index current with every change published to "registry" from now on. The registry must hold the members the index
+	was built over, e.g. because it was loaded from the same snapshot; the members already in it are not added to the overlay.
+	The registry must outlive the index.
+	*/
+	void follow(MemberRegistry& registry)
+	{
+		this->registry = &registry;
+		registry.addListener(this);
+		following = true;
+	}
+
+	/**
+	Returns the member wearing the given bracelet, or NULL if there is none. While the index follows a registry,
+	a member changed since the snapshot is a copy that stays valid as long as the caller holds a ReadGuard on the registry.
+	*/
+	Member* find(unsigned long bracelet_id)
+	{
+		if (key_count != 0 && members != NULL)
+		{
+			size_t slot = slotOf(bracelet_id);
+			size_t position = positions[slot];
+			Member* member = position < members->size() ? (*members)[position] : NULL;
+			if (member != NULL && member->getBraceletID() == bracelet_id)
+			{
+				if ((changed[slot / 64].load(memory_order_acquire) & (1ull << (slot % 64))) == 0)
+					return member;
+				return findInOverlay(bracelet_id);
+			}
+		}
+
+		if (!has_new_bracelets.load(memory_order_acquire))
+			return NULL;
+		return findInOverlay(bracelet_id);
+	}
+
+	/**
+	Retreives the number of bracelets in the perfect hash.
+	*/
+	size_t getKeyCount() const
+	{
+		return key_count;
+	}
+
+	/**
+	Retreives the number of bracelets held in the overlay.
+	*/
+	size_t getOverlaySize()
+	{
+		lock_guard<mutex> lock(overlay_lock);
+		return overlay.size();
+	}
+
+	/**
+	Retreives the size of the perfect hash function itself, pilots and remapped slots, in bits.
+	*/
+	size_t getHashBits() const
+	{
+		return pilots.size() * 64 + remap.size() * 32;
+	}
+
+	/**
+	Retreives the memory used by the whole index, including its slots and an estimate for the overlay, in bytes.
+	*/
+	size_t getBytes() const
+	{
+		return sizeof(BraceletIndex) + getHashBits() / 8 + positions.size() * sizeof(unsigned int) + (key_count / 64 + 1) * 8
+			+ MemoryStats::hashMapBytes(overlay);
+	}
+
+	/**
+	Encodes the perfect hash and slots into "out", replacing its contents. The overlay is not saved.
+
+	Layout, all integers little-endian: magic "S330BIDX" (8), seed (8), key count (8), table size (8), bucket count (8),
+	pilot width (4), remap count (4), member count (8), member fingerprint (8), pilot words (8 each), remapped slots (4 each), member positions (4 each)
+	*/
+	void encode(string& out) const
+	{
+		out.assign(HEADER_SIZE + pilots.size() * 8 + (remap.size() + positions.size()) * 4, '\0');
+		memcpy(&out[0], "S330BIDX", 8);
+		ByteOrder::putU64(&out[8], seed);
+		ByteOrder::putU64(&out[16], key_count);
+		ByteOrder::putU64(&out[24], table_size);
+		ByteOrder::putU64(&out[32], bucket_count);
+		ByteOrder::putU32(&out[40], pilot_width);
+		ByteOrder::putU32(&out[44], (unsigned int)remap.size());
+		ByteOrder::putU64(&out[48], member_count);
+		ByteOrder::putU64(&out[56], member_hash);
+
+		char* at = &out[HEADER_SIZE];
+		for (size_t i = 0; i < pilots.size(); i++, at += 8)
+			ByteOrder::putU64(at, pilots[i]);
+		for (size_t i = 0; i < remap.size(); i++, at += 4)
+			ByteOrder::putU32(at, remap[i]);
+		for (size_t i = 0; i < positions.size(); i++, at += 4)
+			ByteOrder::putU32(at, positions[i]);
+	}
+
+	/**
+	Decodes an index made by encode(), replacing this one. attach() must be called before the index is used.
+	Returns false, leaving the index empty, if "in" is malformed.
+	*/
+	bool decode(const string& in)
+	{
+		clearOverlay();
+		clearHash();
+		members = NULL;
+		if (in.size() < HEADER_SIZE || memcmp(in.data(), "S330BIDX", 8) != 0)
+			return false;
+
+		unsigned long long keys = ByteOrder::getU64(&in[16]);
+		unsigned long long size = ByteOrder::getU64(&in[24]);
+		unsigned long long buckets = ByteOrder::getU64(&in[32]);
+		unsigned int width = ByteOrder::getU32(&in[40]);
+		unsigned long long remapped = ByteOrder::getU32(&in[44]);
+		if (keys > 0xffffffffull || size < keys || size - keys != remapped || buckets == 0 || buckets > 0xffffffffull || width > 32)
+			return false;
+
+		unsigned long long pilot_words = (buckets * width + 63) / 64 + 1;
+		if (in.size() != HEADER_SIZE + pilot_words * 8 + (remapped + keys) * 4)
+			return false;
+
+		const char* at = &in[HEADER_SIZE];
+		pilots.resize((size_t)pilot_words);
+		for (size_t i = 0; i < pilots.size(); i++, at += 8)
+			pilots[i] = ByteOrder::getU64(at);
+		remap.resize((size_t)remapped);
+		for (size_t i = 0; i < remap.size(); i++, at += 4)
+			remap[i] = ByteOrder::getU32(at);
+		positions.resize((size_t)keys);
+		for (size_t i = 0; i < positions.size(); i++, at += 4)
+			positions[i] = ByteOrder::getU32(at);
+
+		for (size_t i = 0; i < remap.size(); i++)
+		{
+			if (remap[i] >= keys)
+			{
+				clearHash();
+				return false;
+			}
+		}
+
+		seed = ByteOrder::getU64(&in[8]);
+		key_count = (size_t)keys;
+		table_size = (size_t)size;
+		bucket_count = (size_t)buckets;
+		pilot_width = width;
+		dense_buckets = denseBucketsOf(bucket_count);
+		member_count = (size_t)ByteOrder::getU64(&in[48]);
+		member_hash = ByteOrder::getU64(&in[56]);
+		clearChanged();
+		charge();
+		return true;
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Puts a copy of a newly published version in the overlay, and marks the bracelet it moved away from, if any, as gone.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		if (!following)
+			return;
+
+		lock_guard<mutex> lock(overlay_lock);
+		if (old_version != NULL && old_version->getBraceletID() != new_version->getBraceletID())
+			setOverlay(old_version->getBraceletID(), NULL);
+		setOverlay(new_version->getBraceletID(), new_version->clone());
+		charge();
+	}
+
+	/**
+	Marks the bracelet of a removed member as gone.
+	*/
+	void onRemove(Member* old_version)
+	{
+		if (!following)
+			return;
+
+		lock_guard<mutex> lock(overlay_lock);
+		setOverlay(old_version->getBraceletID(), NULL);
+		charge();
+	}
+
+private:
+
+	static const size_t HEADER_SIZE = 64;
+
+	/*Tuning, as in the PTHash paper: BUCKET_FACTOR * n / log2(n) buckets, with 60% of the bracelets in 30% of the buckets*/
+	static const size_t BUCKET_FACTOR = 5;
+	static const size_t DENSE_BUCKET_PERCENT = 30;
+	static const unsigned long long DENSE_KEY_PERCENT = 60;
+
+	/*Slots are searched in a table this much larger than the number of bracelets*/
+	static const size_t TABLE_SLACK_PERCENT = 1;
+
+	/*A seed is given up, and the next one tried, when a bucket needs a pilot this large*/
+	static const unsigned long long MAX_PILOT = 1ull << 24;
+
+	const vector<Member*>* members;
+
+	/*Overlay of changes published since the snapshot. Copies are owned by the index, NULL marks a bracelet that is gone*/
+	MemberRegistry* registry;
+	bool following;
+	mutex overlay_lock;
+	unordered_map<unsigned long, Member*> overlay;
+	atomic<bool> has_new_bracelets;
+
+	/*One bit per slot, set once the slot's snapshot bracelet has an overlay entry*/
+	atomic<unsigned long long>* changed;
+
+	unsigned long long seed;
+	size_t key_count;
+	size_t table_size;
+	size_t bucket_count;
+	size_t dense_buckets;
+	unsigned int pilot_width;
+	size_t member_count;
+	unsigned long long member_hash;
+	vector<unsigned long long> pilots;
+	vector<unsigned int> remap;
+	vector<unsigned int> positions;
+	MemoryCharge<MemoryStats::MEMBER_INDEXES> memory_charge;
+
+	/*Charges getBytes() to MemoryStats, after every change to the hash or the overlay*/
+	void charge()
+	{
+		memory_charge.resize(getBytes());
+	}
+
+	/*Writer side, only called from listener notifications with "overlay_lock" held*/
+	void setOverlay(unsigned long bracelet_id, Member* member)
+	{
+		Member*& entry = overlay[bracelet_id];
+		if (entry != NULL)
+			registry->retireFromListener(entry, &destroyMember);
+		entry = member;
+
+		/*Flag a snapshot bracelet only once its entry is in place, so a lookup that sees the flag finds the entry*/
+		if (key_count != 0 && members != NULL)
+		{
+			size_t slot = slotOf(bracelet_id);
+			size_t position = positions[slot];
+			if (position < members->size() && (*members)[position]->getBraceletID() == bracelet_id)
+			{
+				changed[slot / 64].fetch_or(1ull << (slot % 64), memory_order_release);
+				return;
+			}
+		}
+		has_new_bracelets.store(true, memory_order_release);
+	}
+
+	Member* findInOverlay(unsigned long bracelet_id)
+	{
+		lock_guard<mutex> lock(overlay_lock);
+		unordered_map<unsigned long, Member*>::iterator it = overlay.find(bracelet_id);
+		return it == overlay.end() ? NULL : it->second;
+	}
+
+	void clearOverlay()
+	{
+		for (unordered_map<unsigned long, Member*>::iterator it = overlay.begin(); it != overlay.end(); ++it)
+			delete it->second;
+		overlay.clear();
+		has_new_bracelets = false;
+	}
+
+	void clearChanged()
+	{
+		delete[] changed;
+		size_t words = key_count / 64 + 1;
+		changed = new atomic<unsigned long long>[words];
+		for (size_t i = 0; i < words; i++)
+			changed[i].store(0);
+	}
+
+	static void destroyMember(void* object) { delete (Member*)object; }
+
+	void clearHash()
+	{
+		seed = 0;
+		key_count = 0;
+		table_size = 0;
+		bucket_count = 1;
+		dense_buckets = 1;
+		pilot_width = 0;
+		member_count = 0;
+		member_hash = 0;
+		pilots.assign(1, 0);
+		remap.clear();
+		positions.clear();
+		clearChanged();
+		charge();
+	}
+
+	/*Tries to find a pilot for every bucket with the given seed. Returns false if some bucket needs too large a pilot*/
+	bool buildHash(const vector<pair<unsigned long long, unsigned int> >& keys, unsigned long long seed)
+	{
+		clearHash();
+		this->seed = seed;
+		key_count = keys.size();
+		if (key_count == 0)
+			return true;
+
+		table_size = key_count + key_count * TABLE_SLACK_PERCENT / 100;
+		size_t log_keys = 1;
+		for (size_t n = key_count; n > 1; n /= 2)
+			log_keys++;
+		bucket_count = (size_t)(BUCKET_FACTOR * key_count / log_keys) + 1;
+		dense_buckets = denseBucketsOf(bucket_count);
+
+		/*Group the bracelets by bucket, then visit the buckets from largest to smallest*/
+		vector<unsigned long long> hashes(key_count);
+		vector<size_t> bucket_start(bucket_count + 1, 0);
+		for (size_t i = 0; i < key_count; i++)
+		{
+			hashes[i] = mix(keys[i].first ^ seed);
+			bucket_start[bucketOf(hashes[i]) + 1]++;
+		}
+		for (size_t b = 0; b < bucket_count; b++)
+			bucket_start[b + 1] += bucket_start[b];
+
+		vector<size_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+		vector<size_t> members_of(key_count);
+		for (size_t i = 0; i < key_count; i++)
+			members_of[fill[bucketOf(hashes[i])]++] = i;
+
+		vector<size_t> order(bucket_count);
+		for (size_t b = 0; b < bucket_count; b++)
+			order[b] = b;
+		stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+		{
+			return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+		});
+
+		vector<unsigned long long> bucket_pilots(bucket_count, 0);
+		vector<bool> taken(table_size, false);
+		vector<size_t> slot_of_key(key_count);
+		vector<size_t> tried;
+		unsigned long long largest = 0;
+
+		for (size_t o = 0; o < bucket_count; o++)
+		{
+			size_t b = order[o];
+			size_t begin = bucket_start[b], end = bucket_start[b + 1];
+			if (begin == end)
+				break;
+
+			unsigned long long pilot = 0;
+			for (;; pilot++)
+			{
+				if (pilot == MAX_PILOT)
+					return false;
+
+				unsigned long long pilot_hash = mix(pilot);
+				tried.clear();
+				bool fits = true;
+				for (size_t k = begin; k < end && fits; k++)
+				{
+					size_t slot = slotInTable(hashes[members_of[k]], pilot_hash);
+					fits = !taken[slot] && std::find(tried.begin(), tried.end(), slot) == tried.end();
+					tried.push_back(slot);
+				}
+				if (fits)
+					break;
+			}
+
+			bucket_pilots[b] = pilot;
+			largest = max(largest, pilot);
+			for (size_t k = begin; k < end; k++)
+			{
+				taken[tried[k - begin]] = true;
+				slot_of_key[members_of[k]] = tried[k - begin];
+			}
+		}
+
+		/*Pack the pilots at the width of the largest one*/
+		pilot_width = 1;
+		while (pilot_width < 32 && (largest >> pilot_width) != 0)
+			pilot_width++;
+		pilots.assign((bucket_count * pilot_width + 63) / 64 + 1, 0);
+		for (size_t b = 0; b < bucket_count; b++)
+		{
+			size_t bit = b * pilot_width;
+			pilots[bit / 64] |= bucket_pilots[b] << (bit % 64);
+			if (bit % 64 + pilot_width > 64)
+				pilots[bit / 64 + 1] |= bucket_pilots[b] >> (64 - bit % 64);
+		}
+
+		/*Send every slot past the end of the table to one of the free slots below it*/
+		remap.assign(table_size - key_count, 0);
+		size_t free_slot = 0;
+		for (size_t slot = key_count; slot < table_size; slot++)
+		{
+			if (!taken[slot])
+				continue;
+			while (taken[free_slot])
+				free_slot++;
+			remap[slot - key_count] = (unsigned int)free_slot++;
+		}
+
+		positions.assign(key_count, 0);
+		for (size_t i = 0; i < key_count; i++)
+		{
+			size_t slot = slot_of_key[i];
+			if (slot >= key_count)
+				slot = remap[slot - key_count];
+			positions[slot] = keys[i].second;
+		}
+		clearChanged();
+		return true;
+	}
+
+	size_t bucketOf(unsigned long long hash) const
+	{
+		/*The top 32 bits pick dense or sparse buckets, the low 32 bits the bucket within them*/
+		if ((hash >> 32) < (DENSE_KEY_PERCENT << 32) / 100 || bucket_count == dense_buckets)
+			return scale(hash, dense_buckets);
+		return dense_buckets + scale(hash, bucket_count - dense_buckets);
+	}
+
+	static size_t denseBucketsOf(size_t bucket_count)
+	{
+		size_t dense = bucket_count * DENSE_BUCKET_PERCENT / 100;
+		return dense == 0 ? 1 : dense;
+	}
+
+	unsigned long long pilotOf(size_t bucket) const
+	{
+		size_t bit = bucket * pilot_width;
+		unsigned long long value = pilots[bit / 64] >> (bit % 64);
+		if (bit % 64 + pilot_width > 64)
+			value |= pilots[bit / 64 + 1] << (64 - bit % 64);
+		return value & ((1ull << pilot_width) - 1);
+	}
+
+	size_t slotOf(unsigned long bracelet_id) const
+	{
+		unsigned long long hash = mix((unsigned long long)bracelet_id ^ seed);
+		size_t slot = slotInTable(hash, mix(pilotOf(bucketOf(hash))));
+		return slot < key_count ? slot : remap[slot - key_count];
+	}
+
+	/*Slots are picked from a fresh mix of the bracelet's hash and its pilot, since bracelets in one bucket share many hash bits*/
+	size_t slotInTable(unsigned long long hash, unsigned long long pilot_hash) const
+	{
+		return scale(mix(hash ^ pilot_hash) >> 32, table_size);
+	}
+
+	/*Maps the low 32 bits of "value" onto [0, range) with a multiply and a shift instead of a division*/
+	static size_t scale(unsigned long long value, size_t range)
+	{
+		return (size_t)(((value & 0xffffffffull) * range) >> 32);
+	}
+
+	/*Hashes the membership and bracelet IDs of every member, in order, so an index is never attached to members it was not built over*/
+	static unsigned long long fingerprint(const vector<Member*>& members)
+	{
+		unsigned long long hash = members.size();
+		for (size_t i = 0; i < members.size(); i++)
+			hash = mix(hash ^ mix(((unsigned long long)members[i]->getMembershipID() << 32) ^ members[i]->getBraceletID()));
+		return hash;
+	}
+
+	/*A bijective mix, so distinct bracelets always get distinct hashes*/
+	static unsigned long long mix(unsigned long long h)
+	{
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+		return h ^ (h >> 31);
+	}
+
+	BraceletIndex(const BraceletIndex&);
+	BraceletIndex& operator=(const BraceletIndex&);
+};
@@ -0,0 +1,513 @@
+#pragma once
+
+/*The reader service uses epoll and Unix domain sockets, so it is only available on Linux*/
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "AdmissionPolicy.h"
+#include "ByteOrder.h"
+#include "LatencyHistogram.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "TapTrace.h"
+
+using namespace std;
+
+/**
+The BraceletReaderService class answers bracelet taps from the gym's physical readers over a local Unix domain socket.
+
+Readers send fixed size tap frames and may pipeline as many as they like on one connection without waiting for replies.
+Each frame is answered, in order, with an AdmissionPolicy decision made from the member data in a MemberRegistry.
+A single thread runs an epoll event loop over every connection, so thousands of readers can share one process.
+A connection whose reader does not collect its answers stops being read once MAX_PENDING_OUTPUT bytes of answers are waiting,
+so a reader can only make the service buffer that much. A reader that shuts down its sending side still gets every answer
+before the service closes the connection.
+Answered taps can be captured for later replay with setRecorder().
+
+Frame layout, all integers little-endian:
+Request (16 bytes): request ID (4), reader ID (4), bracelet ID (8)
+Response (8 bytes): request ID (4), Decision (1), Reason (1), unused (2)
+*/
+class BraceletReaderService : public AdmissionPolicy
+{
+public:
+
+	static const size_t REQUEST_SIZE = 16;
+	static const size_t RESPONSE_SIZE = 8;
+	static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+	/**
+	Constructor for BraceletReaderService. The service does not accept connections until start() is called.
+	*/
+	BraceletReaderService(MemberRegistry& registry) : registry(registry)
+	{
+		listen_fd = -1;
+		epoll_fd = -1;
+		wake_fd = -1;
+		requests_served = 0;
+		recorder = NULL;
+	}
+
+	/**
+	Destructor for BraceletReaderService. Stops the service if it is still running.
+	*/
+	~BraceletReaderService()
+	{
+		stop();
+	}
+
+	/**
+	Starts listening on the Unix domain socket at "socket_path", replacing any stale socket file, and starts the event loop thread.
+	Returns false if the socket could not be set up.
+	*/
+	bool start(string socket_path)
+	{
+		sockaddr_un address;
+		if (socket_path.size() >= sizeof(address.sun_path))
+			return false;
+
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, socket_path.c_str());
+		unlink(socket_path.c_str());
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (listen_fd < 0 || epoll_fd < 0 || wake_fd < 0
+			|| bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0
+			|| listen(listen_fd, SOMAXCONN) != 0
+			|| !watch(listen_fd, EPOLLIN) || !watch(wake_fd, EPOLLIN))
+		{
+			closeAll();
+			return false;
+		}
+
+		this->socket_path = socket_path;
+		loop = thread(&BraceletReaderService::eventLoop, this);
+		return true;
+	}
+
+	/**
+	Stops the event loop, closes every connection and removes the socket file.
+	*/
+	void stop()
+	{
+		if (loop.joinable())
+		{
+			uint64_t one = 1;
+			if (write(wake_fd, &one, sizeof(one)) < 0) {}
+			loop.join();
+		}
+		closeAll();
+	}
+
+	/**
+	Records every tap the service answers from now on into "recorder", or stops recording if it is NULL.
+	Must be called while the service is stopped.
+	*/
+	void setRecorder(TapRecorder* recorder)
+	{
+		this->recorder = recorder;
+	}
+
+	/**
+	Retreives the number of tap frames answered since the service was created.
+	*/
+	size_t getRequestsServed()
+	{
+		return requests_served.load();
+	}
+
+private:
+
+	/*Per connection buffers. Partial frames stay in "input" until the rest arrives.
+	"events" is what the connection is registered with epoll for, and "peer_closed" is set once the reader has sent its last frame*/
+	struct Connection
+	{
+		vector<char> input;
+		vector<char> output;
+		size_t output_sent;
+		unsigned int events;
+		bool peer_closed;
+	};
+
+	MemberRegistry& registry;
+	string socket_path;
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd;
+	thread loop;
+	map<int, Connection> connections;
+	atomic<size_t> requests_served;
+	TapRecorder* recorder;
+
+	bool watch(int fd, unsigned int events)
+	{
+		epoll_event event;
+		event.events = events;
+		event.data.fd = fd;
+		return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+
+	void closeAll()
+	{
+		for (map<int, Connection>::iterator it = connections.begin(); it != connections.end(); ++it)
+			close(it->first);
+		connections.clear();
+
+		if (listen_fd >= 0)
+			close(listen_fd);
+		if (epoll_fd >= 0)
+			close(epoll_fd);
+		if (wake_fd >= 0)
+			close(wake_fd);
+		listen_fd = epoll_fd = wake_fd = -1;
+
+		if (!socket_path.empty())
+			unlink(socket_path.c_str());
+		socket_path.clear();
+	}
+
+	void eventLoop()
+	{
+		epoll_event events[64];
+		for (;;)
+		{
+			int ready = epoll_wait(epoll_fd, events, 64, -1);
+			if (ready < 0 && errno != EINTR)
+				return;
+
+			for (int i = 0; i < ready; i++)
+			{
+				int fd = events[i].data.fd;
+				if (fd == wake_fd)
+					return;
+				if (fd == listen_fd)
+				{
+					acceptConnections();
+					continue;
+				}
+
+				bool open = true;
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					open = readFrames(fd);
+				if (open && (events[i].events & EPOLLOUT))
+					open = flush(fd);
+				if (!open)
+				{
+					close(fd);
+					connections.erase(fd);
+				}
+			}
+		}
+	}
+
+	void acceptConnections()
+	{
+		for (;;)
+		{
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+				return;
+
+			if (!watch(fd, EPOLLIN))
+			{
+				close(fd);
+				continue;
+			}
+
+			Connection& connection = connections[fd];
+			connection.output_sent = 0;
+			connection.events = EPOLLIN;
+			connection.peer_closed = false;
+		}
+	}
+
+	/*Reads what is available, answering the complete frames of each read, until the socket is drained or too many answers are waiting.
+	Then tries to send the answers. Returns false once the connection should be closed*/
+	bool readFrames(int fd)
+	{
+		Connection& connection = connections[fd];
+		char buffer[16384];
+
+		while (!connection.peer_closed && connection.output.size() - connection.output_sent < MAX_PENDING_OUTPUT)
+		{
+			ssize_t n = read(fd, buffer, sizeof(buffer));
+			if (n > 0)
+			{
+				connection.input.insert(connection.input.end(), buffer, buffer + n);
+				answerFrames(connection);
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0)
+				connection.peer_closed = true;
+			else if (errno != EAGAIN)
+				return false;
+			break;
+		}
+
+		return flush(fd);
+	}
+
+	void answerFrames(Connection& connection)
+	{
+		size_t frames = connection.input.size() / REQUEST_SIZE;
+		if (frames == 0)
+			return;
+
+		size_t start = connection.output.size();
+		connection.output.resize(start + frames * RESPONSE_SIZE);
+
+		/*One epoch for the whole batch of frames*/
+		MemberRegistry::ReadGuard guard(registry);
+		for (size_t f = 0; f < frames; f++)
+		{
+			const char* request = &connection.input[f * REQUEST_SIZE];
+			char* response = &connection.output[start + f * RESPONSE_SIZE];
+
+			unsigned long bracelet_id = (unsigned long)ByteOrder::getU64(request + 8);
+			if (recorder != NULL)
+				recorder->record(bracelet_id, ByteOrder::getU32(request + 4));
+
+			Reason reason;
+			Decision decision = decide(guard.findByBraceletID(bracelet_id), reason);
+
+			memcpy(response, request, 4);
+			response[4] = (char)decision;
+			response[5] = (char)reason;
+			response[6] = response[7] = 0;
+		}
+
+		connection.input.erase(connection.input.begin(), connection.input.begin() + frames * REQUEST_SIZE);
+		requests_served += frames;
+	}
+
+	/*Sends as much pending output as the socket accepts, then asks epoll for EPOLLOUT only while some is left over,
+	and for EPOLLIN only while the reader may send more and not too many answers are waiting.
+	Returns false on a send error, or once a reader that has sent its last frame has all its answers*/
+	bool flush(int fd)
+	{
+		Connection& connection = connections[fd];
+
+		while (connection.output_sent < connection.output.size())
+		{
+			ssize_t n = send(fd, &connection.output[connection.output_sent], connection.output.size() - connection.output_sent, MSG_NOSIGNAL);
+			if (n > 0)
+				connection.output_sent += n;
+			else if (n < 0 && errno == EINTR)
+				continue;
+			else if (n < 0 && errno == EAGAIN)
+				break;
+			else
+				return false;
+		}
+
+		if (connection.output_sent == connection.output.size())
+		{
+			connection.output.clear();
+			connection.output_sent = 0;
+		}
+		if (connection.peer_closed && connection.output.empty())
+			return false;
+
+		unsigned int events = 0;
+		if (!connection.peer_closed && connection.output.size() - connection.output_sent < MAX_PENDING_OUTPUT)
+			events |= EPOLLIN;
+		if (!connection.output.empty())
+			events |= EPOLLOUT;
+		if (events != connection.events)
+		{
+			epoll_event event;
+			event.events = events;
+			event.data.fd = fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+			connection.events = events;
+		}
+		return true;
+	}
+
+	BraceletReaderService(const BraceletReaderService&);
+	BraceletReaderService& operator=(const BraceletReaderService&);
+};
+
+/**
+The BraceletLoadGenerator class simulates many bracelet readers tapping against a BraceletReaderService on the same machine,
+to measure its throughput and tail latency.
+
+Each connection runs on its own thread and keeps "pipeline_depth" taps in flight, sending a new tap whenever an answer arrives.
+*/
+class BraceletLoadGenerator
+{
+public:
+
+	/**
+	The Result struct summarizes a load generator run. Latencies are measured from sending a tap to receiving its answer,
+	and percentiles are read from a LatencyHistogram, so they are at most 1.6% high.
+	*/
+	struct Result
+	{
+		size_t requests;
+		size_t admitted;
+		size_t denied;
+		double seconds;
+		double requests_per_second;
+		long long p50_ns;
+		long long p99_ns;
+		long long p999_ns;
+		long long max_ns;
+	};
+
+	/**
+	Sends "requests_per_connection" taps on each of "connections" connections, cycling through "bracelet_ids".
+	Returns false if a connection could not be made or was dropped by the service.
+	*/
+	static bool run(string socket_path, int connections, int pipeline_depth, size_t requests_per_connection,
+		const vector<unsigned long>& bracelet_ids, Result& result)
+	{
+		vector<thread> threads;
+		LatencyHistogram latencies;
+		vector<size_t> admitted(connections, 0);
+		atomic<bool> failed(false);
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int c = 0; c < connections; c++)
+		{
+			threads.push_back(thread([&, c]()
+			{
+				if (!runConnection(socket_path, c, pipeline_depth, requests_per_connection, bracelet_ids, latencies, admitted[c]))
+					failed = true;
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].join();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		result.admitted = 0;
+		for (int c = 0; c < connections; c++)
+			result.admitted += admitted[c];
+
+		LatencyHistogram::Snapshot snapshot = latencies.getSnapshot();
+		result.requests = (size_t)snapshot.getCount();
+		result.denied = result.requests - result.admitted;
+		result.seconds = seconds;
+		result.requests_per_second = seconds > 0 ? result.requests / seconds : 0;
+		result.p50_ns = (long long)snapshot.percentile(0.50);
+		result.p99_ns = (long long)snapshot.percentile(0.99);
+		result.p999_ns = (long long)snapshot.percentile(0.999);
+		result.max_ns = (long long)snapshot.getMax();
+
+		return !failed.load();
+	}
+
+private:
+
+	static bool runConnection(string socket_path, int reader_id, int pipeline_depth, size_t requests,
+		const vector<unsigned long>& bracelet_ids, LatencyHistogram& latencies, size_t& admitted)
+	{
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+
+		vector<chrono::steady_clock::time_point> sent_at(requests);
+		size_t sent = 0;
+		size_t answered = 0;
+		vector<char> input;
+		bool ok = true;
+
+		while (ok && answered < requests)
+		{
+			/*Top up the pipeline*/
+			char frames[BraceletReaderService::REQUEST_SIZE * 64];
+			size_t batch = 0;
+			while (sent < requests && sent - answered < (size_t)pipeline_depth && batch < 64)
+			{
+				char* frame = frames + batch * BraceletReaderService::REQUEST_SIZE;
+				ByteOrder::putU32(frame, (unsigned int)sent);
+				ByteOrder::putU32(frame + 4, (unsigned int)reader_id);
+				ByteOrder::putU64(frame + 8, bracelet_ids[(sent + reader_id) % bracelet_ids.size()]);
+				sent_at[sent] = chrono::steady_clock::now();
+				sent++;
+				batch++;
+			}
+			if (batch > 0 && !writeAll(fd, frames, batch * BraceletReaderService::REQUEST_SIZE))
+				break;
+
+			/*Collect whatever answers have arrived*/
+			char buffer[4096];
+			ssize_t n = read(fd, buffer, sizeof(buffer));
+			if (n <= 0)
+			{
+				ok = n < 0 && errno == EINTR;
+				continue;
+			}
+
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			input.insert(input.end(), buffer, buffer + n);
+
+			size_t frames_read = input.size() / BraceletReaderService::RESPONSE_SIZE;
+			for (size_t f = 0; f < frames_read; f++)
+			{
+				const char* response = &input[f * BraceletReaderService::RESPONSE_SIZE];
+				unsigned int request_id = ByteOrder::getU32(response);
+				if (request_id >= sent)
+				{
+					ok = false;
+					break;
+				}
+
+				latencies.record((unsigned long long)chrono::duration_cast<chrono::nanoseconds>(now - sent_at[request_id]).count());
+				if (response[4] == BraceletReaderService::Decision::ADMIT)
+					admitted++;
+				answered++;
+			}
+			input.erase(input.begin(), input.begin() + frames_read * BraceletReaderService::RESPONSE_SIZE);
+		}
+
+		close(fd);
+		return ok && answered == requests;
+	}
+
+	static bool writeAll(int fd, const char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t n = write(fd, data, size);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+};
+
+#endif
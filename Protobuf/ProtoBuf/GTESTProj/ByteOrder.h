@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+/**
+The ByteOrder class reads and writes the little-endian integers used by every file and wire format of the project,
+one byte at a time so the result is the same on any machine and at any alignment.
+*/
+class ByteOrder
+{
+public:
+
+	/**
+	Writes "value" to the 4 bytes at "out".
+	*/
+	static void putU32(char* out, unsigned int value)
+	{
+		for (int i = 0; i < 4; i++)
+			out[i] = (char)(value >> (8 * i));
+	}
+
+	/**
+	Writes "value" to the 8 bytes at "out".
+	*/
+	static void putU64(char* out, unsigned long long value)
+	{
+		for (int i = 0; i < 8; i++)
+			out[i] = (char)(value >> (8 * i));
+	}
+
+	/**
+	Reads the 4 byte value at "in".
+	*/
+	static unsigned int getU32(const char* in)
+	{
+		unsigned int value = 0;
+		for (int i = 0; i < 4; i++)
+			value |= (unsigned int)(unsigned char)in[i] << (8 * i);
+		return value;
+	}
+
+	/**
+	Reads the 8 byte value at "in".
+	*/
+	static unsigned long long getU64(const char* in)
+	{
+		unsigned long long value = 0;
+		for (int i = 0; i < 8; i++)
+			value |= (unsigned long long)(unsigned char)in[i] << (8 * i);
+		return value;
+	}
+
+	/**
+	Appends the lowest "bytes" bytes of "value" to "out".
+	*/
+	static void appendU64(string& out, unsigned long long value, int bytes = 8)
+	{
+		for (int i = 0; i < bytes; i++)
+			out.push_back((char)(value >> (8 * i)));
+	}
+
+	/**
+	Appends the 4 bytes of "value" to "out".
+	*/
+	static void appendU32(string& out, unsigned int value)
+	{
+		appendU64(out, value, 4);
+	}
+
+	/**
+	Reads a "bytes" byte value at "position" of "in" and moves past it. Returns false, leaving "position" alone,
+	if fewer bytes are left.
+	*/
+	static bool readU64(const string& in, size_t& position, unsigned long long& value, int bytes = 8)
+	{
+		if (in.size() - position < (size_t)bytes)
+			return false;
+		value = 0;
+		for (int i = 0; i < bytes; i++)
+			value |= (unsigned long long)(unsigned char)in[position + i] << (8 * i);
+		position += bytes;
+		return true;
+	}
+
+private:
+	ByteOrder();
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <new>
+#include <stddef.h>
+
+using namespace std;
+
+/**
+The CacheAlignedArray class is a fixed size array whose elements start on cache line boundaries, for per-thread or per-core
+counters that must not share a cache line with their neighbours.
+
+Padding an element to LINE_SIZE bytes is not enough on its own: new[] only aligns to 8 or 16 bytes, so a padded element
+can still straddle two lines. The array over-allocates by a line and rounds its start up to the next one.
+"T" must be padded to a multiple of LINE_SIZE bytes. Elements are default constructed, so atomics still need to be initialized.
+*/
+template <class T>
+class CacheAlignedArray
+{
+public:
+
+	static const size_t LINE_SIZE = 64;
+
+	/**
+	Constructor for CacheAlignedArray. Makes "count" elements.
+	*/
+	CacheAlignedArray(size_t count) : count(count)
+	{
+		static_assert(sizeof(T) % LINE_SIZE == 0, "elements must be padded to whole cache lines");
+
+		storage = new char[count * sizeof(T) + LINE_SIZE - 1];
+		items = (T*)(((size_t)storage + LINE_SIZE - 1) & ~(LINE_SIZE - 1));
+		for (size_t i = 0; i < count; i++)
+			new (&items[i]) T();
+	}
+
+	/**
+	Destructor for CacheAlignedArray.
+	*/
+	~CacheAlignedArray()
+	{
+		for (size_t i = 0; i < count; i++)
+			items[i].~T();
+		delete[] storage;
+	}
+
+	T& operator[](size_t i)
+	{
+		return items[i];
+	}
+
+	const T& operator[](size_t i) const
+	{
+		return items[i];
+	}
+
+	/**
+	Returns the number of elements.
+	*/
+	size_t size() const
+	{
+		return count;
+	}
+
+private:
+	char* storage;
+	T* items;
+	size_t count;
+
+	CacheAlignedArray(const CacheAlignedArray&);
+	CacheAlignedArray& operator=(const CacheAlignedArray&);
+};
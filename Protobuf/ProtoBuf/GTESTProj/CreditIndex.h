@@ -0,0 +1,348 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+
+using namespace std;
+
+/**
+The CreditIndex class keeps every customer ordered by gym credit balance, for low-balance reminders and audits of large balances
+without scanning the whole registry.
+
+It is an order-statistics treap: a binary search tree on (balance, membership ID), balanced by random priorities, where every node
+also counts the nodes below it. Counting the customers under a balance, and finding a customer's rank, therefore take O(log n)
+time, and listing a range of balances takes O(log n) plus the length of the list.
+
+The index registers itself as a MemberRegistry::Listener, so balances changed with setGymCredits(), addGymCredits() or
+deductGymCredits() are reordered as soon as the changed customer is published. Staff are not indexed.
+Every function can be called from any thread.
+*/
+class CreditIndex : public MemberRegistry::Listener
+{
+public:
+
+	/**
+	Constructor for CreditIndex. Indexes every customer already in "registry" and keeps the index up to date from then on.
+	*/
+	CreditIndex(MemberRegistry& registry) : registry(registry)
+	{
+		/*Node 0 stands in for an empty subtree*/
+		Node empty = { 0, 0, 0, 0, 0, 0 };
+		nodes.push_back(empty);
+		root = 0;
+		random_state = 0x2545f4914f6cdd1dull;
+		charge();
+		registry.addListener(this);
+	}
+
+	/**
+	Destructor for CreditIndex.
+	*/
+	~CreditIndex()
+	{
+		registry.removeListener(this);
+	}
+
+	/**
+	Returns the number of customers in the index.
+	*/
+	size_t size()
+	{
+		lock_guard<mutex> lock(index_lock);
+		return nodes[root].size;
+	}
+
+	/**
+	Returns the number of customers whose balance is below "credits".
+	*/
+	size_t countBelow(int credits)
+	{
+		lock_guard<mutex> lock(index_lock);
+		return countLess(credits, 0);
+	}
+
+	/**
+	Returns the number of customers whose balance is between "low" and "high", both included.
+	*/
+	size_t countInRange(int low, int high)
+	{
+		lock_guard<mutex> lock(index_lock);
+		if (low > high)
+			return 0;
+		return countAtMost(high) - countLess(low, 0);
+	}
+
+	/**
+	Appends the membership IDs of the customers whose balance is between "low" and "high", both included, to "membership_ids",
+	lowest balance first, and stops after "limit" IDs. Returns the number of IDs appended.
+	*/
+	size_t findInRange(int low, int high, vector<unsigned long>& membership_ids, size_t limit = (size_t)-1)
+	{
+		lock_guard<mutex> lock(index_lock);
+		size_t before = membership_ids.size();
+		if (low <= high)
+			collect(root, low, high, membership_ids, limit > (size_t)-1 - before ? (size_t)-1 : before + limit);
+		return membership_ids.size() - before;
+	}
+
+	/**
+	Retreives the rank of a customer: the number of customers with a lower balance, or with the same balance and a lower membership ID.
+	Returns false if the customer is not in the index.
+	*/
+	bool getRank(unsigned long membership_id, size_t& rank)
+	{
+		lock_guard<mutex> lock(index_lock);
+		unordered_map<unsigned long, int>::iterator it = balances.find(membership_id);
+		if (it == balances.end())
+			return false;
+		rank = countLess(it->second, membership_id);
+		return true;
+	}
+
+	/**
+	Retreives the membership ID of the customer at a given rank, counting from 0 at the lowest balance.
+	Returns false if "rank" is not below size().
+	*/
+	bool getByRank(size_t rank, unsigned long& membership_id)
+	{
+		lock_guard<mutex> lock(index_lock);
+		unsigned int n = root;
+		while (n != 0)
+		{
+			size_t left = nodes[nodes[n].left].size;
+			if (rank < left)
+				n = nodes[n].left;
+			else if (rank == left)
+			{
+				membership_id = nodes[n].membership_id;
+				return true;
+			}
+			else
+			{
+				rank -= left + 1;
+				n = nodes[n].right;
+			}
+		}
+		return false;
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Moves a customer to its new balance whenever a version with a different balance is published.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		lock_guard<mutex> lock(index_lock);
+
+		bool was_customer = old_version != NULL && old_version->getMemberType() == Member::Type::CUSTOMER;
+		bool is_customer = new_version->getMemberType() == Member::Type::CUSTOMER;
+		if (was_customer && is_customer && ((Customer*)old_version)->getGymCredits() == ((Customer*)new_version)->getGymCredits())
+			return;
+
+		if (was_customer)
+			erase(old_version->getMembershipID());
+		if (is_customer)
+			insert(new_version->getMembershipID(), ((Customer*)new_version)->getGymCredits());
+	}
+
+	/**
+	Drops a removed customer from the index.
+	*/
+	void onRemove(Member* old_version)
+	{
+		lock_guard<mutex> lock(index_lock);
+		if (old_version->getMemberType() == Member::Type::CUSTOMER)
+			erase(old_version->getMembershipID());
+	}
+
+private:
+
+	/*Tree nodes live in one vector and refer to each other by index, 0 meaning none*/
+	struct Node
+	{
+		int credits;
+		unsigned long membership_id;
+		unsigned int priority;
+		unsigned int size;
+		unsigned int left;
+		unsigned int right;
+	};
+
+	MemberRegistry& registry;
+	mutex index_lock;
+	vector<Node> nodes;
+	vector<unsigned int> free_nodes;
+	unsigned int root;
+	unordered_map<unsigned long, int> balances;
+	unsigned long long random_state;
+	MemoryCharge<MemoryStats::MEMBER_INDEXES> memory_charge;
+
+	/*Charges the node pool and the balance table to MemoryStats, after every insert and erase*/
+	void charge()
+	{
+		memory_charge.resize(nodes.capacity() * sizeof(Node) + free_nodes.capacity() * sizeof(unsigned int) + MemoryStats::hashMapBytes(balances));
+	}
+
+	static bool less(int credits, unsigned long membership_id, const Node& node)
+	{
+		return credits < node.credits || (credits == node.credits && membership_id < node.membership_id);
+	}
+
+	void update(unsigned int n)
+	{
+		nodes[n].size = 1 + nodes[nodes[n].left].size + nodes[nodes[n].right].size;
+	}
+
+	/*Splits a subtree into the nodes ordered before (credits, membership ID) and the rest*/
+	void split(unsigned int n, int credits, unsigned long membership_id, unsigned int& before, unsigned int& after)
+	{
+		if (n == 0)
+		{
+			before = after = 0;
+			return;
+		}
+
+		if (less(credits, membership_id, nodes[n]) || (credits == nodes[n].credits && membership_id == nodes[n].membership_id))
+		{
+			split(nodes[n].left, credits, membership_id, before, nodes[n].left);
+			after = n;
+		}
+		else
+		{
+			split(nodes[n].right, credits, membership_id, nodes[n].right, after);
+			before = n;
+		}
+		update(n);
+	}
+
+	/*Joins two subtrees, where every node of "before" is ordered before every node of "after"*/
+	unsigned int merge(unsigned int before, unsigned int after)
+	{
+		if (before == 0 || after == 0)
+			return before == 0 ? after : before;
+
+		if (nodes[before].priority > nodes[after].priority)
+		{
+			nodes[before].right = merge(nodes[before].right, after);
+			update(before);
+			return before;
+		}
+		nodes[after].left = merge(before, nodes[after].left);
+		update(after);
+		return after;
+	}
+
+	void insert(unsigned long membership_id, int credits)
+	{
+		unsigned int n;
+		if (!free_nodes.empty())
+		{
+			n = free_nodes.back();
+			free_nodes.pop_back();
+		}
+		else
+		{
+			n = (unsigned int)nodes.size();
+			nodes.push_back(Node());
+		}
+
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 7;
+		random_state ^= random_state << 17;
+		Node node = { credits, membership_id, (unsigned int)random_state, 1, 0, 0 };
+		nodes[n] = node;
+
+		unsigned int before, after;
+		split(root, credits, membership_id, before, after);
+		root = merge(merge(before, n), after);
+		balances[membership_id] = credits;
+		charge();
+	}
+
+	void erase(unsigned long membership_id)
+	{
+		unordered_map<unsigned long, int>::iterator it = balances.find(membership_id);
+		if (it == balances.end())
+			return;
+
+		/*Cut the tree just before the customer's node, which is then the first node of the second part*/
+		unsigned int before, rest, node;
+		split(root, it->second, membership_id, before, rest);
+		rest = removeFirst(rest, node);
+		root = merge(before, rest);
+
+		free_nodes.push_back(node);
+		balances.erase(it);
+		charge();
+	}
+
+	/*Unlinks the first node of a non-empty subtree. Returns the subtree's new root*/
+	unsigned int removeFirst(unsigned int n, unsigned int& removed)
+	{
+		if (nodes[n].left == 0)
+		{
+			removed = n;
+			return nodes[n].right;
+		}
+		nodes[n].left = removeFirst(nodes[n].left, removed);
+		update(n);
+		return n;
+	}
+
+	/*Counts the nodes ordered before (credits, membership ID)*/
+	size_t countLess(int credits, unsigned long membership_id)
+	{
+		size_t count = 0;
+		unsigned int n = root;
+		while (n != 0)
+		{
+			if (less(credits, membership_id, nodes[n]) || (credits == nodes[n].credits && membership_id == nodes[n].membership_id))
+				n = nodes[n].left;
+			else
+			{
+				count += nodes[nodes[n].left].size + 1;
+				n = nodes[n].right;
+			}
+		}
+		return count;
+	}
+
+	/*Counts the nodes with a balance of at most "credits"*/
+	size_t countAtMost(int credits)
+	{
+		size_t count = 0;
+		unsigned int n = root;
+		while (n != 0)
+		{
+			if (credits < nodes[n].credits)
+				n = nodes[n].left;
+			else
+			{
+				count += nodes[nodes[n].left].size + 1;
+				n = nodes[n].right;
+			}
+		}
+		return count;
+	}
+
+	/*In-order walk of the nodes with balances in [low, high], skipping subtrees that are wholly outside it*/
+	void collect(unsigned int n, int low, int high, vector<unsigned long>& out, size_t limit)
+	{
+		if (n == 0 || out.size() >= limit)
+			return;
+		if (nodes[n].credits >= low)
+			collect(nodes[n].left, low, high, out, limit);
+		if (nodes[n].credits >= low && nodes[n].credits <= high && out.size() < limit)
+			out.push_back(nodes[n].membership_id);
+		if (nodes[n].credits <= high)
+			collect(nodes[n].right, low, high, out, limit);
+	}
+
+	CreditIndex(const CreditIndex&);
+	CreditIndex& operator=(const CreditIndex&);
+};
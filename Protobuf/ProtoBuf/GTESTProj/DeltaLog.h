@@ -0,0 +1,477 @@
+#pragma once
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "ByteOrder.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemberSnapshot.h"
+
+using namespace std;
+
+/**
+The DeltaLog class persists only the fields of members that changed since the last checkpoint, instead of rewriting whole members.
+
+A delta log is an append-only file of blocks, one per checkpoint. Each block holds one record per changed member:
+an UPSERT record carries the member's changed fields (see Member::Field), a REMOVE record drops the member.
+On load, the blocks are merged in order on top of the last full MemberSnapshot. A block that was only partly written,
+e.g. because the process died during a checkpoint, is ignored.
+
+Block layout, all integers little-endian: magic "DLTA" (4), body size (4), body
+Record layout: Operation (1), membership ID (8), field mask (4), then each field in the mask, in Field bit order.
+Strings are stored as length (4) and bytes, IDs and credit card numbers as 8 bytes, gym credits as 4 bytes and enums as 1 byte.
+*/
+class DeltaLog
+{
+public:
+
+	/**
+	The enumerated "Operation" type tells whether a delta record updates or removes a member.
+	*/
+	enum Operation { UPSERT, REMOVE };
+
+	/**
+	Appends one block to a delta log holding the dirty fields of every dirty member in "members", then clears their dirty fields.
+	Returns the number of members written.
+	*/
+	static size_t write(string file_name, const vector<Member*>& members)
+	{
+		string body;
+		size_t written = 0;
+		for (size_t i = 0; i < members.size(); i++)
+		{
+			if (!members[i]->isDirty())
+				continue;
+
+			encodeUpsert(body, members[i], members[i]->getDirtyFields());
+			members[i]->clearDirtyFields();
+			written++;
+		}
+
+		appendBlock(file_name, body);
+		return written;
+	}
+
+	/**
+	Appends one block of already encoded records to a delta log. Nothing is written for an empty body.
+	*/
+	static void appendBlock(string file_name, const string& body)
+	{
+		if (body.empty())
+			return;
+
+		char header[8];
+		memcpy(header, "DLTA", 4);
+		ByteOrder::putU32(header + 4, (unsigned int)body.size());
+
+		fstream output(file_name, ios::out | ios::app | ios::binary);
+		output.write(header, sizeof(header));
+		output.write(body.data(), body.size());
+	}
+
+	/**
+	Encodes an UPSERT record carrying the given fields of a member. Fields that do not apply to the member's type are left out.
+	*/
+	static void encodeUpsert(string& out, Member* m, unsigned int fields)
+	{
+		if (m->getMemberType() == Member::Type::STAFF)
+			fields &= ~(Member::Field::CREDIT_CARD | Member::Field::GYM_CREDITS | Member::Field::SUBSCRIPTION_LEVEL);
+		else
+			fields &= ~(Member::Field::EMPLOYEE_ID | Member::Field::STAFF_CLEARANCE);
+		fields &= ~Member::Field::MEMBERSHIP_ID;
+
+		char header[13];
+		header[0] = (char)UPSERT;
+		ByteOrder::putU64(header + 1, m->getMembershipID());
+		ByteOrder::putU32(header + 9, fields);
+		out.append(header, sizeof(header));
+
+		if (fields & Member::Field::NAME)
+			putString(out, m->getName());
+		if (fields & Member::Field::ADDRESS)
+			putString(out, m->getAddress());
+		if (fields & Member::Field::BRACELET_ID)
+			ByteOrder::appendU64(out, m->getBraceletID());
+		if (fields & Member::Field::MEMBER_TYPE)
+			out.push_back((char)m->getMemberType());
+
+		if (m->getMemberType() == Member::Type::STAFF)
+		{
+			Staff* s = (Staff*)m;
+			if (fields & Member::Field::EMPLOYEE_ID)
+				ByteOrder::appendU64(out, s->getEmployeeID());
+			if (fields & Member::Field::STAFF_CLEARANCE)
+				out.push_back((char)s->getStaffClearance());
+		}
+		else
+		{
+			Customer* c = (Customer*)m;
+			if (fields & Member::Field::CREDIT_CARD)
+				ByteOrder::appendU64(out, c->getCreditCard());
+			if (fields & Member::Field::GYM_CREDITS)
+				ByteOrder::appendU32(out, (unsigned int)c->getGymCredits());
+			if (fields & Member::Field::SUBSCRIPTION_LEVEL)
+				out.push_back((char)c->getSubscriptionLevel());
+		}
+	}
+
+	/**
+	Encodes a REMOVE record for a member.
+	*/
+	static void encodeRemove(string& out, unsigned long membership_id)
+	{
+		char header[13];
+		header[0] = (char)REMOVE;
+		ByteOrder::putU64(header + 1, membership_id);
+		ByteOrder::putU32(header + 9, 0);
+		out.append(header, sizeof(header));
+	}
+
+	/**
+	Merges every block of a delta log, in order, into "members", which is keyed by membership ID.
+	New members are created, removed members are deleted, and a member whose type changed is replaced.
+	Merged members have their dirty fields cleared.
+	Returns false if the log is malformed. A missing log file holds no deltas.
+	*/
+	static bool apply(string file_name, map<unsigned long, Member*>& members)
+	{
+		fstream input(file_name, ios::in | ios::binary);
+		if (!input)
+			return true;
+
+		string data((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+		size_t position = 0;
+
+		while (data.size() - position >= 8)
+		{
+			if (memcmp(data.data() + position, "DLTA", 4) != 0)
+				return false;
+
+			size_t body_size = ByteOrder::getU32(data.data() + position + 4);
+			if (data.size() - position - 8 < body_size)
+				break;
+
+			if (!applyBlock(data.data() + position + 8, body_size, members))
+				return false;
+			position += 8 + body_size;
+		}
+		return true;
+	}
+
+	/**
+	Loads a full snapshot and merges a delta log on top of it, appending the resulting members to "members". The caller owns them.
+	Returns false if either file is malformed.
+	*/
+	static bool load(string snapshot_file, string delta_file, vector<Member*>& members)
+	{
+		vector<Member*> loaded;
+		if (!MemberSnapshot::load(snapshot_file, loaded))
+			return false;
+
+		map<unsigned long, Member*> by_id;
+		for (size_t i = 0; i < loaded.size(); i++)
+		{
+			Member*& slot = by_id[loaded[i]->getMembershipID()];
+			delete slot;
+			slot = loaded[i];
+		}
+
+		bool ok = apply(delta_file, by_id);
+		for (map<unsigned long, Member*>::iterator it = by_id.begin(); it != by_id.end(); ++it)
+		{
+			if (ok)
+				members.push_back(it->second);
+			else
+				delete it->second;
+		}
+		return ok;
+	}
+
+private:
+
+	static void putString(string& out, const string& value)
+	{
+		ByteOrder::appendU32(out, (unsigned int)value.size());
+		out += value;
+	}
+
+	/*Bounds-checked reader over one block body*/
+	struct Cursor
+	{
+		const char* data;
+		size_t size;
+		size_t position;
+
+		bool has(size_t n) { return size - position >= n; }
+		unsigned char u8() { return (unsigned char)data[position++]; }
+		unsigned int u32() { position += 4; return ByteOrder::getU32(data + position - 4); }
+		unsigned long long u64() { position += 8; return ByteOrder::getU64(data + position - 8); }
+	};
+
+	static bool readString(Cursor& cursor, string& value)
+	{
+		if (!cursor.has(4))
+			return false;
+		size_t length = cursor.u32();
+		if (!cursor.has(length))
+			return false;
+		value.assign(cursor.data + cursor.position, length);
+		cursor.position += length;
+		return true;
+	}
+
+	static bool applyBlock(const char* body, size_t size, map<unsigned long, Member*>& members)
+	{
+		Cursor cursor = { body, size, 0 };
+
+		while (cursor.position < size)
+		{
+			if (!cursor.has(13))
+				return false;
+
+			unsigned char operation = cursor.u8();
+			unsigned long membership_id = (unsigned long)cursor.u64();
+			unsigned int fields = cursor.u32();
+
+			map<unsigned long, Member*>::iterator it = members.find(membership_id);
+			if (operation == REMOVE)
+			{
+				if (it != members.end())
+				{
+					delete it->second;
+					members.erase(it);
+				}
+				continue;
+			}
+			if (operation != UPSERT)
+				return false;
+
+			/*Strings and the member type come first, since the type decides which object to create*/
+			string name, address;
+			unsigned long bracelet_id = 0;
+			int type = -1;
+			if ((fields & Member::Field::NAME) && !readString(cursor, name))
+				return false;
+			if ((fields & Member::Field::ADDRESS) && !readString(cursor, address))
+				return false;
+			if (fields & Member::Field::BRACELET_ID)
+			{
+				if (!cursor.has(8))
+					return false;
+				bracelet_id = (unsigned long)cursor.u64();
+			}
+			if (fields & Member::Field::MEMBER_TYPE)
+			{
+				if (!cursor.has(1))
+					return false;
+				type = cursor.u8();
+				if (type > Member::Type::STAFF)
+					return false;
+			}
+
+			Member* m;
+			if (it != members.end() && (type == -1 || type == it->second->getMemberType()))
+				m = it->second;
+			else
+			{
+				/*A member first seen in the log, or whose type changed, is written with all of its fields, type included*/
+				if (type == -1)
+					return false;
+				m = type == Member::Type::STAFF ? (Member*)new Staff() : (Member*)new Customer();
+				m->setMembershipID(membership_id);
+				if (it != members.end())
+				{
+					delete it->second;
+					it->second = m;
+				}
+				else
+					members[membership_id] = m;
+			}
+
+			if (fields & Member::Field::NAME)
+				m->setName(name);
+			if (fields & Member::Field::ADDRESS)
+				m->setAddress(address);
+			if (fields & Member::Field::BRACELET_ID)
+				m->setBraceletID(bracelet_id);
+
+			if (m->getMemberType() == Member::Type::STAFF)
+			{
+				Staff* s = (Staff*)m;
+				if (fields & Member::Field::EMPLOYEE_ID)
+				{
+					if (!cursor.has(8))
+						return false;
+					s->setEmployeeID((unsigned long)cursor.u64());
+				}
+				if (fields & Member::Field::STAFF_CLEARANCE)
+				{
+					if (!cursor.has(1))
+						return false;
+					unsigned char clearance = cursor.u8();
+					if (clearance > Staff::Clearance::ADMINISTRATOR)
+						return false;
+					s->setStaffClearance((Staff::Clearance)clearance);
+				}
+			}
+			else
+			{
+				Customer* c = (Customer*)m;
+				if (fields & Member::Field::CREDIT_CARD)
+				{
+					if (!cursor.has(8))
+						return false;
+					c->setCreditCard((unsigned long)cursor.u64());
+				}
+				if (fields & Member::Field::GYM_CREDITS)
+				{
+					if (!cursor.has(4))
+						return false;
+					c->restoreGymCredits((int)cursor.u32());
+				}
+				if (fields & Member::Field::SUBSCRIPTION_LEVEL)
+				{
+					if (!cursor.has(1))
+						return false;
+					unsigned char level = cursor.u8();
+					if (level > Customer::SubscriptionLevel::DELUXE)
+						return false;
+					c->setSubscriptionLevel((Customer::SubscriptionLevel)level);
+				}
+			}
+
+			m->clearDirtyFields();
+		}
+		return true;
+	}
+};
+
+/**
+The DeltaTracker class collects which fields of which members change in a MemberRegistry, and writes them to a DeltaLog on checkpoint().
+
+Since the registry publishes every change as a new version whose dirty fields are exactly the fields that changed,
+the tracker only has to OR those fields together per member between checkpoints.
+Members already in the registry when the tracker is created are assumed to be in the last full snapshot.
+After writing a new full snapshot, call reset() and start a new delta log.
+*/
+class DeltaTracker : public MemberRegistry::Listener
+{
+public:
+
+	/**
+	Constructor for DeltaTracker. Starts tracking every change published to "registry" from now on.
+	*/
+	DeltaTracker(MemberRegistry& registry) : registry(registry)
+	{
+		tracking = false;
+		registry.addListener(this);
+		tracking = true;
+	}
+
+	/**
+	Destructor for DeltaTracker.
+	*/
+	~DeltaTracker()
+	{
+		registry.removeListener(this);
+	}
+
+	/**
+	Appends the changes made since the last checkpoint to a delta log. Returns the number of members written.
+	Changes published while the checkpoint is running are picked up by the next one.
+	*/
+	size_t checkpoint(string file_name)
+	{
+		map<unsigned long, unsigned int> changed;
+		set<unsigned long> removed;
+		{
+			lock_guard<mutex> lock(pending_lock);
+			changed.swap(pending_fields);
+			removed.swap(pending_removals);
+		}
+
+		string body;
+		{
+			MemberRegistry::ReadGuard guard(registry);
+			for (map<unsigned long, unsigned int>::iterator it = changed.begin(); it != changed.end(); ++it)
+			{
+				Member* m = guard.findByMembershipID(it->first);
+				if (m != NULL)
+					DeltaLog::encodeUpsert(body, m, it->second);
+				else
+					DeltaLog::encodeRemove(body, it->first);
+			}
+		}
+		for (set<unsigned long>::iterator it = removed.begin(); it != removed.end(); ++it)
+			DeltaLog::encodeRemove(body, *it);
+
+		DeltaLog::appendBlock(file_name, body);
+		return changed.size() + removed.size();
+	}
+
+	/**
+	Forgets every change not yet checkpointed, e.g. right after a full snapshot has been written.
+	*/
+	void reset()
+	{
+		lock_guard<mutex> lock(pending_lock);
+		pending_fields.clear();
+		pending_removals.clear();
+	}
+
+	/**
+	Returns the number of members with changes waiting for the next checkpoint.
+	*/
+	size_t getPendingCount()
+	{
+		lock_guard<mutex> lock(pending_lock);
+		return pending_fields.size() + pending_removals.size();
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Records the fields changed by a newly published version. New members, and members whose type changed, e.g. a customer
+	who becomes staff, are recorded with all of their fields so the log can rebuild them from scratch.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		if (!tracking)
+			return;
+
+		bool whole = old_version == NULL || old_version->getMemberType() != new_version->getMemberType();
+		lock_guard<mutex> lock(pending_lock);
+		unsigned long membership_id = new_version->getMembershipID();
+		pending_fields[membership_id] |= whole ? (unsigned int)Member::Field::ALL_FIELDS : new_version->getDirtyFields();
+		pending_removals.erase(membership_id);
+	}
+
+	/**
+	Records that a member was removed.
+	*/
+	void onRemove(Member* old_version)
+	{
+		if (!tracking)
+			return;
+
+		lock_guard<mutex> lock(pending_lock);
+		pending_fields.erase(old_version->getMembershipID());
+		pending_removals.insert(old_version->getMembershipID());
+	}
+
+private:
+	MemberRegistry& registry;
+	bool tracking;
+
+	mutex pending_lock;
+	map<unsigned long, unsigned int> pending_fields;
+	set<unsigned long> pending_removals;
+
+	DeltaTracker(const DeltaTracker&);
+	DeltaTracker& operator=(const DeltaTracker&);
+};
@@ -0,0 +1,562 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "ByteOrder.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+#include "TapTrace.h"
+
+using namespace std;
+
+/**
+The HyperLogLog class estimates how many distinct keys it has seen, in REGISTER_COUNT bytes however many keys there are,
+with a typical error of 1.04 / sqrt(REGISTER_COUNT), about 1.6%.
+
+Each key is hashed; the first PRECISION bits of the hash pick a register, which keeps the longest run of leading zero bits
+seen in the rest of the hash. Sketches of different sets can be merged into a sketch of their union, by keeping the larger
+register of each pair. Small sets are estimated by counting empty registers instead, which is exact to within a few keys.
+*/
+class HyperLogLog
+{
+public:
+
+	static const int PRECISION = 12;
+	static const size_t REGISTER_COUNT = 1 << PRECISION;
+
+	/**
+	Constructor for HyperLogLog. The sketch starts out empty.
+	*/
+	HyperLogLog() : registers(REGISTER_COUNT, 0)
+	{
+	}
+
+	/**
+	Adds a key to the sketch. Adding a key that was already added changes nothing.
+	*/
+	void add(unsigned long long key)
+	{
+		size_t index;
+		unsigned char rank;
+		locate(key, index, rank);
+		raise(index, rank);
+	}
+
+	/**
+	Finds the register a key belongs in, and the rank adding it raises that register to. Lets registers kept outside
+	a HyperLogLog, e.g. atomic ones shared between threads, be filled the same way.
+	*/
+	static void locate(unsigned long long key, size_t& index, unsigned char& rank)
+	{
+		unsigned long long hash = mix(key);
+		index = (size_t)(hash >> (64 - PRECISION));
+		unsigned long long rest = hash << PRECISION;
+
+		rank = 1;
+		while (rank <= 64 - PRECISION && (rest & (1ull << 63)) == 0)
+		{
+			rank++;
+			rest <<= 1;
+		}
+	}
+
+	/**
+	Raises a register to "rank", unless it is already higher.
+	*/
+	void raise(size_t index, unsigned char rank)
+	{
+		if (rank > registers[index])
+			registers[index] = rank;
+	}
+
+	/**
+	Retreives the value of a register.
+	*/
+	unsigned char getRegister(size_t index) const
+	{
+		return registers[index];
+	}
+
+	/**
+	Adds every key of another sketch to this one.
+	*/
+	void merge(const HyperLogLog& other)
+	{
+		for (size_t i = 0; i < REGISTER_COUNT; i++)
+		{
+			if (other.registers[i] > registers[i])
+				registers[i] = other.registers[i];
+		}
+	}
+
+	/**
+	Returns the estimated number of distinct keys added.
+	*/
+	double estimate() const
+	{
+		double m = (double)REGISTER_COUNT;
+		double sum = 0;
+		size_t empty = 0;
+		for (size_t i = 0; i < REGISTER_COUNT; i++)
+		{
+			sum += ldexp(1.0, -registers[i]);
+			if (registers[i] == 0)
+				empty++;
+		}
+
+		double raw = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+		if (raw <= 2.5 * m && empty > 0)
+			return m * log(m / empty);
+		return raw;
+	}
+
+	/**
+	Returns whether no key was ever added.
+	*/
+	bool isEmpty() const
+	{
+		for (size_t i = 0; i < REGISTER_COUNT; i++)
+		{
+			if (registers[i] != 0)
+				return false;
+		}
+		return true;
+	}
+
+	/**
+	Appends the sketch to "out". A sketch with few keys is written as its non-empty registers only, as varint gaps and values,
+	and any other as every register packed in 6 bits, 3KB.
+	*/
+	void encode(string& out) const
+	{
+		string sparse;
+		size_t last = 0;
+		for (size_t i = 0; i < REGISTER_COUNT && sparse.size() < DENSE_SIZE; i++)
+		{
+			if (registers[i] == 0)
+				continue;
+			putVarint(sparse, i - last);
+			sparse.push_back((char)registers[i]);
+			last = i;
+		}
+
+		if (sparse.size() < DENSE_SIZE)
+		{
+			out.push_back((char)SPARSE);
+			putVarint(out, sparse.size());
+			out += sparse;
+			return;
+		}
+
+		out.push_back((char)DENSE);
+		size_t start = out.size();
+		out.resize(start + DENSE_SIZE, '\0');
+		for (size_t i = 0; i < REGISTER_COUNT; i++)
+		{
+			size_t bit = i * 6;
+			unsigned int value = (unsigned int)registers[i] << (bit % 8);
+			out[start + bit / 8] |= (char)(value & 0xff);
+			if (bit % 8 > 2)
+				out[start + bit / 8 + 1] |= (char)(value >> 8);
+		}
+	}
+
+	/**
+	Reads a sketch written by encode() from "in" at "position", replacing this one, and moves "position" past it.
+	Returns false if the sketch is malformed.
+	*/
+	bool decode(const string& in, size_t& position)
+	{
+		registers.assign(REGISTER_COUNT, 0);
+		if (position >= in.size())
+			return false;
+
+		char format = in[position++];
+		if (format == DENSE)
+		{
+			if (in.size() - position < DENSE_SIZE)
+				return false;
+			for (size_t i = 0; i < REGISTER_COUNT; i++)
+			{
+				size_t bit = i * 6;
+				unsigned int value = (unsigned char)in[position + bit / 8];
+				if (bit % 8 > 2)
+					value |= (unsigned int)(unsigned char)in[position + bit / 8 + 1] << 8;
+				registers[i] = (unsigned char)((value >> (bit % 8)) & 0x3f);
+			}
+			position += DENSE_SIZE;
+			return true;
+		}
+
+		unsigned long long size;
+		if (format != SPARSE || !getVarint(in, position, size) || size > in.size() - position)
+			return false;
+
+		size_t end = position + (size_t)size;
+		unsigned long long index = 0;
+		while (position < end)
+		{
+			unsigned long long gap;
+			if (!getVarint(in, position, gap) || position >= end || (index += gap) >= REGISTER_COUNT)
+				return false;
+			registers[(size_t)index] = (unsigned char)in[position++];
+		}
+		return true;
+	}
+
+private:
+
+	enum Format { SPARSE = 1, DENSE = 2 };
+
+	static const size_t DENSE_SIZE = REGISTER_COUNT * 6 / 8;
+
+	vector<unsigned char> registers;
+
+	static unsigned long long mix(unsigned long long h)
+	{
+		h += 0x9e3779b97f4a7c15ull;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+		return h ^ (h >> 31);
+	}
+
+	static void putVarint(string& out, unsigned long long value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back((char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((char)value);
+	}
+
+	static bool getVarint(const string& in, size_t& position, unsigned long long& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && position < in.size(); shift += 7)
+		{
+			unsigned char byte = (unsigned char)in[position++];
+			value |= (unsigned long long)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+};
+
+/**
+The DistinctVisitors class counts unique visitors per day, site and subscription level with a HyperLogLog sketch each,
+so that "how many different members came to site 3 last week" costs a few KB per day and site instead of every bracelet ID.
+
+Sketches are kept in day order, and a query merges the sketches of every day, site and level it covers, so counts for any
+range of days and any set of sites and levels come out of the same data without double counting members who visited more
+than once. Visitors are counted by membership ID, so a member who changes bracelet is still one visitor.
+Days and sites are numbered by the caller, e.g. days since 1970 and one site per gym; sites go up to MAX_SITE.
+
+Each day, site and level has a single sketch whose registers are atomic, so recording threads raise them with compare-and-swap
+instead of taking a lock, and a sketch costs the same however many threads record into it. Recording threads remember the sketch
+they last wrote in a stripe of their own, picked by thread ID, so a run of taps for the same day, site and level skips the map
+of sketches and its lock. Every function can be called from any thread.
+*/
+class DistinctVisitors
+{
+public:
+
+	/**
+	Pass as "site" to a query to cover every site.
+	*/
+	static const unsigned int ALL_SITES = 0xffffffff;
+
+	/**
+	The highest site number that can be recorded.
+	*/
+	static const unsigned int MAX_SITE = 0xffffff;
+
+	/**
+	Pass as "levels" to a query to cover every subscription level. Otherwise "levels" is a bitwise OR of (1 << SubscriptionLevel).
+	*/
+	static const unsigned int ALL_LEVELS = 0xff;
+
+	/**
+	Constructor for DistinctVisitors. No visits are counted yet. "stripe_count" defaults to two stripes per hardware thread.
+	*/
+	DistinctVisitors(size_t stripe_count = 0)
+	{
+		if (stripe_count == 0)
+			stripe_count = 2 * max(1u, thread::hardware_concurrency());
+		for (size_t s = 0; s < stripe_count; s++)
+		{
+			Stripe* stripe = new Stripe();
+			stripe->last_sketch = NULL;
+			stripes.push_back(stripe);
+		}
+	}
+
+	/**
+	Destructor for DistinctVisitors.
+	*/
+	~DistinctVisitors()
+	{
+		for (map<unsigned long long, Sketch*>::iterator it = sketches.begin(); it != sketches.end(); ++it)
+			delete it->second;
+		charge(sketches.size(), 0);
+		for (size_t s = 0; s < stripes.size(); s++)
+			delete stripes[s];
+	}
+
+	/**
+	Counts a visit by a member on a day, at a site, at the subscription level they had at the time.
+	Returns false, counting nothing, if "site" is above MAX_SITE.
+	*/
+	bool record(unsigned int day, unsigned int site, Customer::SubscriptionLevel level, unsigned long membership_id)
+	{
+		if (site > MAX_SITE)
+			return false;
+
+		size_t index;
+		unsigned char rank;
+		HyperLogLog::locate(membership_id, index, rank);
+
+		unsigned long long key = keyOf(day, site, level);
+		Stripe& stripe = *stripes[hash<thread::id>()(this_thread::get_id()) % stripes.size()];
+		lock_guard<mutex> lock(stripe.stripe_lock);
+		if (stripe.last_sketch == NULL || stripe.last_key != key)
+		{
+			stripe.last_key = key;
+			stripe.last_sketch = findOrCreate(key);
+		}
+		raise(stripe.last_sketch->registers[index], rank);
+		return true;
+	}
+
+	/**
+	Counts a tap from a reader at a site, looking its bracelet up through "guard". Taps by staff or unknown bracelets are not visits.
+	Returns false if the tap was not counted.
+	*/
+	bool record(MemberRegistry::ReadGuard& guard, const TapEvent& tap, unsigned int day, unsigned int site)
+	{
+		Member* member = guard.findByBraceletID(tap.bracelet_id);
+		if (member == NULL || member->getMemberType() != Member::Type::CUSTOMER)
+			return false;
+		return record(day, site, ((Customer*)member)->getSubscriptionLevel(), member->getMembershipID());
+	}
+
+	/**
+	Returns the estimated number of distinct members who visited from "first_day" to "last_day", both included,
+	at "site" (or ALL_SITES) with one of the subscription "levels" (or ALL_LEVELS).
+	*/
+	double estimate(unsigned int first_day, unsigned int last_day, unsigned int site, unsigned int levels)
+	{
+		HyperLogLog merged;
+		lock_guard<mutex> lock(sketches_lock);
+		map<unsigned long long, Sketch*>::iterator it = sketches.lower_bound(keyOf(first_day, 0, 0));
+		for (; it != sketches.end() && (it->first >> 32) <= last_day; ++it)
+		{
+			unsigned int key_site = (unsigned int)(it->first >> 8) & MAX_SITE;
+			unsigned int key_level = (unsigned int)it->first & 0xff;
+			if ((site == ALL_SITES || site == key_site) && (levels & (1u << key_level)) != 0)
+				copy(*it->second, merged);
+		}
+		return merged.estimate();
+	}
+
+	/**
+	Retreives the number of days, sites and subscription levels with at least one visit, i.e. the number of sketches
+	save() writes.
+	*/
+	size_t getSketchCount()
+	{
+		lock_guard<mutex> lock(sketches_lock);
+		return sketches.size();
+	}
+
+	/**
+	Forgets every sketch of the days before "first_day".
+	*/
+	void dropBefore(unsigned int first_day)
+	{
+		vector<Sketch*> dropped;
+		{
+			lock_guard<mutex> lock(sketches_lock);
+			map<unsigned long long, Sketch*>::iterator end = sketches.lower_bound(keyOf(first_day, 0, 0));
+			for (map<unsigned long long, Sketch*>::iterator it = sketches.begin(); it != end; ++it)
+				dropped.push_back(it->second);
+			sketches.erase(sketches.begin(), end);
+		}
+
+		/*No recorder can find the dropped sketches any more; once no stripe remembers one, they can go*/
+		for (size_t s = 0; s < stripes.size(); s++)
+		{
+			lock_guard<mutex> lock(stripes[s]->stripe_lock);
+			if (stripes[s]->last_sketch != NULL && stripes[s]->last_key < keyOf(first_day, 0, 0))
+				stripes[s]->last_sketch = NULL;
+		}
+		for (size_t i = 0; i < dropped.size(); i++)
+			delete dropped[i];
+		charge(dropped.size(), 0);
+	}
+
+	/**
+	Adds every visit counted by another DistinctVisitors, e.g. from another site's server, to this one.
+	*/
+	void merge(DistinctVisitors& other)
+	{
+		map<unsigned long long, HyperLogLog> copied;
+		other.copyAll(copied);
+		add(copied);
+	}
+
+	/**
+	Writes every sketch to a file. Returns false if the file could not be written.
+
+	Layout: magic "S330HLLS" (8), then for each sketch its day (4), site (3) and level (1), little-endian,
+	followed by the sketch as written by HyperLogLog::encode()
+	*/
+	bool save(string file_name)
+	{
+		map<unsigned long long, HyperLogLog> copied;
+		copyAll(copied);
+
+		string out("S330HLLS", 8);
+		for (map<unsigned long long, HyperLogLog>::iterator it = copied.begin(); it != copied.end(); ++it)
+		{
+			ByteOrder::appendU64(out, it->first);
+			it->second.encode(out);
+		}
+
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(out.data(), out.size());
+		return output.good();
+	}
+
+	/**
+	Adds every sketch of a file written by save() to this one. Returns false, adding nothing, if the file could not be read or is malformed.
+	*/
+	bool load(string file_name)
+	{
+		fstream input(file_name, ios::in | ios::binary);
+		if (!input)
+			return false;
+		string in((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+		if (in.size() < 8 || memcmp(in.data(), "S330HLLS", 8) != 0)
+			return false;
+
+		map<unsigned long long, HyperLogLog> loaded;
+		size_t position = 8;
+		while (position < in.size())
+		{
+			unsigned long long key;
+			if (!ByteOrder::readU64(in, position, key))
+				return false;
+			if ((key & 0xff) > Customer::SubscriptionLevel::DELUXE || !loaded[key].decode(in, position))
+				return false;
+		}
+
+		add(loaded);
+		return true;
+	}
+
+private:
+
+	/*A HyperLogLog whose registers are raised concurrently by every recording thread*/
+	struct Sketch
+	{
+		atomic<unsigned char> registers[HyperLogLog::REGISTER_COUNT];
+	};
+
+	/*One recording thread's memory of the sketch it last wrote. "last_sketch" is the sketch of "last_key", or NULL*/
+	struct Stripe
+	{
+		mutex stripe_lock;
+		unsigned long long last_key;
+		Sketch* last_sketch;
+	};
+
+	/*Keyed by day (32 bits), site (24 bits) and level (8 bits), from the highest bits down, so a range of days is a range of keys*/
+	mutex sketches_lock;
+	map<unsigned long long, Sketch*> sketches;
+
+	vector<Stripe*> stripes;
+
+	static unsigned long long keyOf(unsigned int day, unsigned int site, unsigned int level)
+	{
+		return ((unsigned long long)day << 32) | ((unsigned long long)site << 8) | (level & 0xff);
+	}
+
+	static void raise(atomic<unsigned char>& reg, unsigned char rank)
+	{
+		unsigned char current = reg.load(memory_order_relaxed);
+		while (rank > current && !reg.compare_exchange_weak(current, rank, memory_order_relaxed))
+		{
+		}
+	}
+
+	/*Raises the registers of "out" to those of "sketch"*/
+	static void copy(const Sketch& sketch, HyperLogLog& out)
+	{
+		for (size_t i = 0; i < HyperLogLog::REGISTER_COUNT; i++)
+			out.raise(i, sketch.registers[i].load(memory_order_relaxed));
+	}
+
+	Sketch* findOrCreate(unsigned long long key)
+	{
+		lock_guard<mutex> lock(sketches_lock);
+		return findOrCreateLocked(key);
+	}
+
+	Sketch* findOrCreateLocked(unsigned long long key)
+	{
+		Sketch*& sketch = sketches[key];
+		if (sketch == NULL)
+		{
+			sketch = new Sketch();
+			for (size_t i = 0; i < HyperLogLog::REGISTER_COUNT; i++)
+				sketch->registers[i].store(0, memory_order_relaxed);
+			charge(0, 1);
+		}
+		return sketch;
+	}
+
+	/*Copies every sketch into "copied", one HyperLogLog per key*/
+	void copyAll(map<unsigned long long, HyperLogLog>& copied)
+	{
+		lock_guard<mutex> lock(sketches_lock);
+		for (map<unsigned long long, Sketch*>::iterator it = sketches.begin(); it != sketches.end(); ++it)
+			copy(*it->second, copied[it->first]);
+	}
+
+	/*Adds sketches from elsewhere, e.g. another server or a file*/
+	void add(const map<unsigned long long, HyperLogLog>& added)
+	{
+		lock_guard<mutex> lock(sketches_lock);
+		for (map<unsigned long long, HyperLogLog>::const_iterator it = added.begin(); it != added.end(); ++it)
+		{
+			Sketch* sketch = findOrCreateLocked(it->first);
+			for (size_t i = 0; i < HyperLogLog::REGISTER_COUNT; i++)
+				raise(sketch->registers[i], it->second.getRegister(i));
+		}
+	}
+
+	/*Charges the sketches gained to MemoryStats, or releases those lost, each a tree node and its registers*/
+	static void charge(size_t before, size_t after)
+	{
+		size_t sketch_bytes = sizeof(pair<const unsigned long long, Sketch*>) + 4 * sizeof(void*) + sizeof(Sketch);
+		if (after > before)
+			MemoryStats::instance().allocated(MemoryStats::TAP_ANALYTICS, (after - before) * sketch_bytes);
+		else if (after < before)
+			MemoryStats::instance().freed(MemoryStats::TAP_ANALYTICS, (before - after) * sketch_bytes);
+	}
+
+	DistinctVisitors(const DistinctVisitors&);
+	DistinctVisitors& operator=(const DistinctVisitors&);
+};
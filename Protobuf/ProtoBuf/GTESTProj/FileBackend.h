@@ -0,0 +1,657 @@
+#pragma once
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "Member.h"
+#include "MemoryStats.h"
+#include "ThreadPool.h"
+#include "TraceSpans.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+The FileBackend class is the interface for reading and writing many small whole files in one call,
+such as the one file per member written by Member::serialize().
+
+Both functions handle every file they are given, and set "ok[i]" to whether the i-th file was read or written.
+*/
+class FileBackend
+{
+public:
+
+	/**
+	Virtual destructor for FileBackend.
+	*/
+	virtual ~FileBackend() {}
+
+	/**
+	Returns a human readable name of this backend.
+	*/
+	virtual string getName() = 0;
+
+	/**
+	Reads the whole of every file in "file_names" into the matching element of "contents".
+	*/
+	virtual void readFiles(const vector<string>& file_names, vector<string>& contents, vector<char>& ok) = 0;
+
+	/**
+	Replaces every file in "file_names" with the matching element of "contents", creating it if needed.
+	*/
+	virtual void writeFiles(const vector<string>& file_names, const vector<string>& contents, vector<char>& ok) = 0;
+};
+
+/**
+The ThreadPoolFileBackend class spreads the files of a call across the workers of a ThreadPool, each using plain fstreams.
+It works on every platform, and is the fallback when no faster backend is available.
+*/
+class ThreadPoolFileBackend : public FileBackend
+{
+public:
+
+	/**
+	Constructor for ThreadPoolFileBackend. The pool must outlive the backend.
+	*/
+	ThreadPoolFileBackend(ThreadPool& pool) : pool(pool)
+	{
+	}
+
+	string getName()
+	{
+		return "thread pool";
+	}
+
+	void readFiles(const vector<string>& file_names, vector<string>& contents, vector<char>& ok)
+	{
+		contents.assign(file_names.size(), string());
+		ok.assign(file_names.size(), 0);
+		pool.parallelFor(file_names.size(), [&](size_t i)
+		{
+			fstream input(file_names[i], ios::in | ios::binary);
+			if (!input)
+				return;
+			contents[i].assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+			ok[i] = !input.bad();
+		});
+	}
+
+	void writeFiles(const vector<string>& file_names, const vector<string>& contents, vector<char>& ok)
+	{
+		ok.assign(file_names.size(), 0);
+		pool.parallelFor(file_names.size(), [&](size_t i)
+		{
+			fstream output(file_names[i], ios::out | ios::trunc | ios::binary);
+			output.write(contents[i].data(), contents[i].size());
+			output.close();
+			ok[i] = !output.fail();
+		});
+	}
+
+private:
+	ThreadPool& pool;
+
+	ThreadPoolFileBackend(const ThreadPoolFileBackend&);
+	ThreadPoolFileBackend& operator=(const ThreadPoolFileBackend&);
+};
+
+#ifdef __linux__
+
+/**
+The IoUringFileBackend class reads and writes files through a Linux io_uring, so that the opens, reads or writes and closes
+of up to QUEUE_DEPTH files are each submitted with a single system call, instead of one call per file and operation.
+
+Files are handled QUEUE_DEPTH at a time, in rounds: open them all, read or write them all (repeating for the few that
+need more than one round), then close them all. isAvailable() tells whether the running kernel supports every operation used;
+createFileBackend() picks this backend when it does and a ThreadPoolFileBackend otherwise.
+
+If the kernel ever refuses the ring for a reason other than a transient one, the ring is given up for good, and the files
+not yet done, then every file of later calls, go to a ThreadPoolFileBackend on the fallback pool, if one was given.
+
+Only one thread may use an IoUringFileBackend at a time.
+*/
+class IoUringFileBackend : public FileBackend
+{
+public:
+
+	static const unsigned int QUEUE_DEPTH = 256;
+	static const size_t READ_CHUNK = 4096;
+
+	/**
+	Constructor for IoUringFileBackend. Only use the backend if isReady() returns true afterwards.
+	"fallback_pool" takes over if the ring later fails, and must then outlive the backend; without one, such files fail.
+	*/
+	IoUringFileBackend(ThreadPool* fallback_pool = NULL) : fallback_pool(fallback_pool)
+	{
+		ring_fd = -1;
+		ring_error = 0;
+		generation = 0;
+		sq_ring = cq_ring = MAP_FAILED;
+		sqes = (io_uring_sqe*)MAP_FAILED;
+		setup();
+	}
+
+	/**
+	Destructor for IoUringFileBackend.
+	*/
+	~IoUringFileBackend()
+	{
+		tearDown();
+	}
+
+	/**
+	Returns whether the ring was set up and the kernel supports every operation this backend submits.
+	*/
+	bool isReady()
+	{
+		return ring_error == 0 && sqes != MAP_FAILED && supportsOperations();
+	}
+
+	/**
+	Returns whether the ring was given up after the kernel refused it, so that files go to the fallback pool.
+	*/
+	bool hasFailed()
+	{
+		return ring_error != 0;
+	}
+
+	/**
+	Returns whether io_uring can be used on the running kernel.
+	*/
+	static bool isAvailable()
+	{
+		IoUringFileBackend probe;
+		return probe.isReady();
+	}
+
+	string getName()
+	{
+		return "io_uring";
+	}
+
+	void readFiles(const vector<string>& file_names, vector<string>& contents, vector<char>& ok)
+	{
+		contents.assign(file_names.size(), string());
+		ok.assign(file_names.size(), 0);
+
+		for (size_t first = 0; first < file_names.size() && ring_error == 0; first += QUEUE_DEPTH)
+		{
+			size_t count = min((size_t)QUEUE_DEPTH, file_names.size() - first);
+			vector<int> fds(count);
+			vector<size_t> done(count, 0);
+			vector<char> finished(count, 0);
+
+			openFiles(file_names, first, count, O_RDONLY, fds);
+
+			/*Regular files only return short reads at end of file, so a short read finishes the file*/
+			for (;;)
+			{
+				vector<size_t> reading;
+				for (size_t i = 0; i < count; i++)
+				{
+					if (fds[i] < 0 || finished[i])
+						continue;
+
+					string& buffer = contents[first + i];
+					buffer.resize(done[i] + max((size_t)READ_CHUNK, done[i]));
+					prepare(IORING_OP_READ, fds[i], &buffer[done[i]], (unsigned int)(buffer.size() - done[i]), done[i], reading.size());
+					reading.push_back(i);
+				}
+				if (reading.empty())
+					break;
+
+				vector<int> results;
+				submitAndWait(reading.size(), results);
+				for (size_t r = 0; r < reading.size(); r++)
+				{
+					size_t i = reading[r];
+					size_t requested = contents[first + i].size() - done[i];
+					if (results[r] < 0)
+					{
+						finished[i] = 1;
+						continue;
+					}
+
+					done[i] += results[r];
+					if ((size_t)results[r] < requested)
+					{
+						contents[first + i].resize(done[i]);
+						finished[i] = 1;
+						ok[first + i] = 1;
+					}
+				}
+			}
+
+			closeFiles(fds);
+		}
+
+		if (ring_error == 0 || fallback_pool == NULL)
+			return;
+
+		vector<size_t> retry;
+		vector<string> retry_names;
+		for (size_t i = 0; i < file_names.size(); i++)
+		{
+			if (ok[i])
+				continue;
+			retry.push_back(i);
+			retry_names.push_back(file_names[i]);
+		}
+
+		vector<string> retry_contents;
+		vector<char> retry_ok;
+		ThreadPoolFileBackend(*fallback_pool).readFiles(retry_names, retry_contents, retry_ok);
+		for (size_t r = 0; r < retry.size(); r++)
+		{
+			contents[retry[r]].swap(retry_contents[r]);
+			ok[retry[r]] = retry_ok[r];
+		}
+	}
+
+	void writeFiles(const vector<string>& file_names, const vector<string>& contents, vector<char>& ok)
+	{
+		ok.assign(file_names.size(), 0);
+
+		for (size_t first = 0; first < file_names.size() && ring_error == 0; first += QUEUE_DEPTH)
+		{
+			size_t count = min((size_t)QUEUE_DEPTH, file_names.size() - first);
+			vector<int> fds(count);
+			vector<size_t> done(count, 0);
+			vector<char> failed(count, 0);
+
+			openFiles(file_names, first, count, O_WRONLY | O_CREAT | O_TRUNC, fds);
+
+			/*Short writes are rare, but are continued in another round*/
+			for (;;)
+			{
+				vector<size_t> writing;
+				for (size_t i = 0; i < count; i++)
+				{
+					const string& data = contents[first + i];
+					if (fds[i] < 0 || failed[i] || done[i] == data.size())
+						continue;
+
+					prepare(IORING_OP_WRITE, fds[i], (void*)(data.data() + done[i]), (unsigned int)(data.size() - done[i]), done[i], writing.size());
+					writing.push_back(i);
+				}
+				if (writing.empty())
+					break;
+
+				vector<int> results;
+				submitAndWait(writing.size(), results);
+				for (size_t r = 0; r < writing.size(); r++)
+				{
+					if (results[r] <= 0)
+						failed[writing[r]] = 1;
+					else
+						done[writing[r]] += results[r];
+				}
+			}
+
+			vector<int> close_results;
+			closeFiles(fds, &close_results);
+			for (size_t i = 0; i < count; i++)
+				ok[first + i] = fds[i] >= 0 && !failed[i] && close_results[i] == 0;
+		}
+
+		if (ring_error == 0 || fallback_pool == NULL)
+			return;
+
+		/*Files are written whole, so one the ring left half written is simply written again*/
+		vector<size_t> retry;
+		vector<string> retry_names;
+		vector<string> retry_contents;
+		for (size_t i = 0; i < file_names.size(); i++)
+		{
+			if (ok[i])
+				continue;
+			retry.push_back(i);
+			retry_names.push_back(file_names[i]);
+			retry_contents.push_back(contents[i]);
+		}
+
+		vector<char> retry_ok;
+		ThreadPoolFileBackend(*fallback_pool).writeFiles(retry_names, retry_contents, retry_ok);
+		for (size_t r = 0; r < retry.size(); r++)
+			ok[retry[r]] = retry_ok[r];
+	}
+
+private:
+	ThreadPool* fallback_pool;
+	int ring_fd;
+	/*The errno the kernel refused the ring with, or 0 while it is usable*/
+	int ring_error;
+	void* sq_ring;
+	void* cq_ring;
+	io_uring_sqe* sqes;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	io_uring_cqe* cqes;
+
+	/*Bumped by every submitAndWait(), and kept in the top bits of each entry's tag, so late completions of a batch given up on are ignored*/
+	unsigned int generation;
+
+	void setup()
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring_fd = (int)syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+		if (ring_fd < 0)
+			return;
+
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+		sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED)
+			return;
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ring = sq_ring;
+		else
+			cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			return;
+
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		void* sqes_map = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes_map == MAP_FAILED)
+			return;
+
+		char* sq = (char*)sq_ring;
+		char* cq = (char*)cq_ring;
+		sq_head = (unsigned int*)(sq + params.sq_off.head);
+		sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+		sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+		sq_array = (unsigned int*)(sq + params.sq_off.array);
+		cq_head = (unsigned int*)(cq + params.cq_off.head);
+		cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+		cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+		sqes = (io_uring_sqe*)sqes_map;
+	}
+
+	void tearDown()
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		if (sq_ring != MAP_FAILED)
+			munmap(sq_ring, sq_ring_size);
+		if (ring_fd >= 0)
+			close(ring_fd);
+		ring_fd = -1;
+		sq_ring = cq_ring = MAP_FAILED;
+		sqes = (io_uring_sqe*)MAP_FAILED;
+	}
+
+	bool supportsOperations()
+	{
+		size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+		vector<char> buffer(probe_size, 0);
+		io_uring_probe* probe = (io_uring_probe*)&buffer[0];
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+			return false;
+
+		int operations[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+		for (int i = 0; i < 4; i++)
+		{
+			if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+		return true;
+	}
+
+	/*Fills the next submission queue entry. "tag" comes back in the completion to say which operation it was*/
+	void prepare(int opcode, int fd, void* address, unsigned int length, unsigned long long offset, size_t tag, int open_flags = 0)
+	{
+		if (ring_error != 0)
+			return;
+
+		unsigned int tail = *sq_tail;
+		unsigned int index = tail & *sq_mask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = (unsigned char)opcode;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long long)(size_t)address;
+		sqe->len = length;
+		sqe->off = offset;
+		sqe->open_flags = open_flags;
+		sqe->user_data = ((unsigned long long)generation << 32) | tag;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	/*Submits the "count" prepared entries and collects their results, indexed by tag.
+	If the kernel refuses the ring for any reason other than a transient one, gives up on it for good: entries not yet submitted
+	are withdrawn, every entry without a result is left at -errno, and the ring is torn down once the entries the kernel did take
+	have completed, as until then they may still be reading into or writing from the caller's buffers*/
+	void submitAndWait(size_t count, vector<int>& results)
+	{
+		results.assign(count, -ring_error);
+		if (ring_error != 0)
+			return;
+
+		vector<char> has_result(count, 0);
+		unsigned int first_entry = *sq_tail - (unsigned int)count;
+		size_t to_submit = count;
+		size_t completed = 0;
+		while (completed < count)
+		{
+			long entered = syscall(__NR_io_uring_enter, ring_fd, (unsigned int)to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				ring_error = errno;
+				break;
+			}
+			if (entered > 0)
+				to_submit -= min(to_submit, (size_t)entered);
+			completed += reap(count, results, has_result);
+		}
+
+		if (ring_error != 0)
+		{
+			__atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+			size_t submitted = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - first_entry;
+
+			/*If the ring cannot even be waited on, closing it has the kernel cancel what is left*/
+			while (completed < submitted)
+			{
+				long waited = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				if (waited < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+					break;
+				completed += reap(count, results, has_result);
+			}
+
+			for (size_t i = 0; i < count; i++)
+			{
+				if (!has_result[i])
+					results[i] = -ring_error;
+			}
+			tearDown();
+		}
+		generation++;
+	}
+
+	/*Takes every completion off the ring, keeping the results of this batch. Returns how many of them there were*/
+	size_t reap(size_t count, vector<int>& results, vector<char>& has_result)
+	{
+		size_t reaped = 0;
+		unsigned int head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		{
+			io_uring_cqe* cqe = &cqes[head & *cq_mask];
+			size_t tag = (size_t)(cqe->user_data & 0xffffffffull);
+			if ((unsigned int)(cqe->user_data >> 32) == generation && tag < count && !has_result[tag])
+			{
+				results[tag] = cqe->res;
+				has_result[tag] = 1;
+				reaped++;
+			}
+			head++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		return reaped;
+	}
+
+	void openFiles(const vector<string>& file_names, size_t first, size_t count, int flags, vector<int>& fds)
+	{
+		for (size_t i = 0; i < count; i++)
+			prepare(IORING_OP_OPENAT, AT_FDCWD, (void*)file_names[first + i].c_str(), 0644, 0, i, flags);
+		submitAndWait(count, fds);
+	}
+
+	void closeFiles(const vector<int>& fds, vector<int>* results = NULL)
+	{
+		vector<size_t> closing;
+		for (size_t i = 0; i < fds.size(); i++)
+		{
+			if (fds[i] < 0)
+				continue;
+			prepare(IORING_OP_CLOSE, fds[i], NULL, 0, 0, closing.size());
+			closing.push_back(i);
+		}
+
+		vector<int> closed;
+		submitAndWait(closing.size(), closed);
+
+		/*Closes the ring never got to are done directly, so a failed ring leaks no files*/
+		for (size_t c = 0; c < closing.size(); c++)
+		{
+			if (ring_error != 0 && closed[c] == -ring_error)
+				closed[c] = close(fds[closing[c]]) == 0 ? 0 : -errno;
+		}
+		if (results == NULL)
+			return;
+
+		results->assign(fds.size(), -1);
+		for (size_t c = 0; c < closing.size(); c++)
+			(*results)[closing[c]] = closed[c];
+	}
+
+	IoUringFileBackend(const IoUringFileBackend&);
+	IoUringFileBackend& operator=(const IoUringFileBackend&);
+};
+
+#endif
+
+/**
+Returns the fastest FileBackend available on this system: an IoUringFileBackend on Linux kernels that support it,
+falling back to "pool" if its ring fails, otherwise a ThreadPoolFileBackend on "pool". The pool must outlive the backend. The caller owns the returned backend.
+*/
+inline FileBackend* createFileBackend(ThreadPool& pool)
+{
+#ifdef __linux__
+	IoUringFileBackend* ring = new IoUringFileBackend(&pool);
+	if (ring->isReady())
+		return ring;
+	delete ring;
+#endif
+	return new ThreadPoolFileBackend(pool);
+}
+
+/**
+The MemberFiles class loads and saves members in the legacy one file per member layout of Member::serialize(),
+handing the file I/O for the whole set to a FileBackend in one call.
+*/
+class MemberFiles
+{
+public:
+
+	/**
+	Reads every file in "file_names" and appends the members in them to "members". The caller owns the new members.
+	Returns the number of files that could not be read or parsed, which are skipped.
+	*/
+	static size_t load(FileBackend& backend, const vector<string>& file_names, vector<Member*>& members)
+	{
+		vector<string> contents;
+		vector<char> ok;
+		{
+			TraceSpan span("files.read", "import");
+			backend.readFiles(file_names, contents, ok);
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> contents_charge(totalSize(contents));
+
+		TraceSpan span("files.decode", "import");
+		size_t failures = 0;
+		for (size_t i = 0; i < file_names.size(); i++)
+		{
+			seng330a2::Member m;
+			if (!ok[i] || !m.ParseFromString(contents[i]))
+			{
+				failures++;
+				continue;
+			}
+
+			Member* member;
+			if (m.member_type() == seng330a2::Member_Type::Member_Type_STAFF)
+				member = new Staff();
+			else
+				member = new Customer();
+			member->fromProto(m);
+			members.push_back(member);
+		}
+		return failures;
+	}
+
+	/**
+	Writes every member in "members" to the matching file in "file_names". Returns the number of files that could not be written.
+	*/
+	static size_t save(FileBackend& backend, const vector<string>& file_names, const vector<Member*>& members)
+	{
+		vector<string> contents(members.size());
+		{
+			TraceSpan span("files.encode", "save");
+			for (size_t i = 0; i < members.size(); i++)
+			{
+				seng330a2::Member m;
+				members[i]->toProto(m);
+				m.SerializeToString(&contents[i]);
+			}
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> contents_charge(totalSize(contents));
+
+		vector<char> ok;
+		{
+			TraceSpan span("files.write", "save");
+			backend.writeFiles(file_names, contents, ok);
+		}
+
+		size_t failures = 0;
+		for (size_t i = 0; i < ok.size(); i++)
+			failures += ok[i] ? 0 : 1;
+		return failures;
+	}
+
+private:
+
+	static size_t totalSize(const vector<string>& contents)
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < contents.size(); i++)
+			total += contents[i].size();
+		return total;
+	}
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+#include "TapTrace.h"
+
+using namespace std;
+
+/**
+The SpaceSaving class finds the most frequent keys of a stream in a fixed number of counters, without storing the stream.
+
+It keeps "capacity" keys with a count each. A key that is not counted yet takes over the counter of the least counted key,
+inheriting its count as an error bound. Counts are therefore never too low, and too high by at most total / capacity,
+so every key seen more often than that is guaranteed to be counted. Summaries of several streams, e.g. from several threads
+or time slices, can be merged into a summary of the combined stream with the same guarantee.
+*/
+class SpaceSaving
+{
+public:
+
+	/**
+	The Item struct is one counted key. Its true count is between count - error and count.
+	*/
+	struct Item
+	{
+		unsigned long long key;
+		unsigned long long count;
+		unsigned long long error;
+	};
+
+	/**
+	Constructor for SpaceSaving.
+	*/
+	SpaceSaving(size_t capacity) : capacity(capacity)
+	{
+		total = 0;
+	}
+
+	/**
+	Counts "count" occurrences of a key.
+	*/
+	void offer(unsigned long long key, unsigned long long count = 1)
+	{
+		total += count;
+
+		unordered_map<unsigned long long, size_t>::iterator it = positions.find(key);
+		if (it != positions.end())
+		{
+			items[it->second].count += count;
+			siftDown(it->second);
+			return;
+		}
+
+		if (items.size() < capacity)
+		{
+			Item item = { key, count, 0 };
+			items.push_back(item);
+			positions[key] = items.size() - 1;
+			siftUp(items.size() - 1);
+			return;
+		}
+
+		/*Evict the least counted key*/
+		positions.erase(items[0].key);
+		items[0].error = items[0].count;
+		items[0].count += count;
+		items[0].key = key;
+		positions[key] = 0;
+		siftDown(0);
+	}
+
+	/**
+	Adds the counts of another summary to this one. A key missing from a full summary may have been counted up to that
+	summary's smallest count, so that much is added to its count and its error, which keeps the merged counts from being too low.
+	*/
+	void merge(const SpaceSaving& other)
+	{
+		unsigned long long own_floor = items.size() < capacity ? 0 : items[0].count;
+		unsigned long long other_floor = other.items.size() < other.capacity ? 0 : other.items[0].count;
+
+		unordered_map<unsigned long long, Item> merged;
+		for (size_t i = 0; i < items.size(); i++)
+		{
+			Item item = items[i];
+			item.count += other_floor;
+			item.error += other_floor;
+			merged[item.key] = item;
+		}
+		for (size_t i = 0; i < other.items.size(); i++)
+		{
+			unordered_map<unsigned long long, Item>::iterator it = merged.find(other.items[i].key);
+			if (it != merged.end())
+			{
+				it->second.count += other.items[i].count - other_floor;
+				it->second.error += other.items[i].error - other_floor;
+				continue;
+			}
+			Item item = other.items[i];
+			item.count += own_floor;
+			item.error += own_floor;
+			merged[item.key] = item;
+		}
+
+		items.clear();
+		for (unordered_map<unsigned long long, Item>::iterator it = merged.begin(); it != merged.end(); ++it)
+			items.push_back(it->second);
+		if (items.size() > capacity)
+		{
+			nth_element(items.begin(), items.begin() + capacity, items.end(), moreFrequent);
+			items.resize(capacity);
+		}
+		total += other.total;
+
+		/*Rebuild the heap from the kept items*/
+		positions.clear();
+		for (size_t i = 0; i < items.size(); i++)
+			positions[items[i].key] = i;
+		for (size_t i = items.size() / 2; i-- > 0;)
+			siftDown(i);
+	}
+
+	/**
+	Returns the "n" most counted keys, most counted first.
+	*/
+	vector<Item> top(size_t n) const
+	{
+		vector<Item> sorted(items);
+		sort(sorted.begin(), sorted.end(), moreFrequent);
+		if (sorted.size() > n)
+			sorted.resize(n);
+		return sorted;
+	}
+
+	/**
+	Retreives the number of occurrences counted, of all keys together.
+	*/
+	unsigned long long getTotal() const
+	{
+		return total;
+	}
+
+	/**
+	Returns an estimate of the memory held by a full summary of "capacity" keys: its counters and the hash table of their positions.
+	*/
+	static size_t getBytesFor(size_t capacity)
+	{
+		return sizeof(SpaceSaving) + capacity * (sizeof(Item) + sizeof(pair<const unsigned long long, size_t>) + 3 * sizeof(void*));
+	}
+
+	/**
+	Retreives the number of keys the summary can hold.
+	*/
+	size_t getCapacity() const
+	{
+		return capacity;
+	}
+
+	/**
+	Forgets every count.
+	*/
+	void clear()
+	{
+		items.clear();
+		positions.clear();
+		total = 0;
+	}
+
+private:
+	size_t capacity;
+	unsigned long long total;
+
+	/*A min-heap on count, so the key to evict is always items[0]. "positions" tracks where each key is in the heap*/
+	vector<Item> items;
+	unordered_map<unsigned long long, size_t> positions;
+
+	static bool moreFrequent(const Item& a, const Item& b)
+	{
+		return a.count > b.count || (a.count == b.count && a.key < b.key);
+	}
+
+	void swapItems(size_t a, size_t b)
+	{
+		swap(items[a], items[b]);
+		positions[items[a].key] = a;
+		positions[items[b].key] = b;
+	}
+
+	void siftUp(size_t i)
+	{
+		while (i > 0 && items[i].count < items[(i - 1) / 2].count)
+		{
+			swapItems(i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	}
+
+	void siftDown(size_t i)
+	{
+		for (;;)
+		{
+			size_t smallest = i;
+			size_t left = 2 * i + 1, right = 2 * i + 2;
+			if (left < items.size() && items[left].count < items[smallest].count)
+				smallest = left;
+			if (right < items.size() && items[right].count < items[smallest].count)
+				smallest = right;
+			if (smallest == i)
+				return;
+			swapItems(i, smallest);
+			i = smallest;
+		}
+	}
+};
+
+/**
+The HeavyHitters class tracks the most frequent visitors, by membership ID, and the busiest machines, by reader ID,
+over a sliding window of the tap stream, e.g. for a live "top 100" view.
+
+The window is split into "window_slots" time slices, each with a SpaceSaving summary of its own, so taps older than the window
+drop out a slice at a time. Recording threads write into stripes of their own, picked by thread ID, so they rarely meet on a lock;
+queries merge the summaries of every stripe and slice in the window. Memory is fixed by the capacity, slice and stripe counts.
+*/
+class HeavyHitters
+{
+public:
+
+	/**
+	Constructor for HeavyHitters. Each summary holds "capacity" keys, and reported counts are too high by at most the taps
+	in the window divided by "capacity". "stripe_count" defaults to two stripes per hardware thread.
+	*/
+	HeavyHitters(size_t capacity, unsigned long long window_us, size_t window_slots, size_t stripe_count = 0)
+		: capacity(capacity), window_slots(window_slots)
+	{
+		if (stripe_count == 0)
+			stripe_count = 2 * max(1u, thread::hardware_concurrency());
+		slot_us = max(1ull, window_us / window_slots);
+
+		for (size_t s = 0; s < stripe_count; s++)
+		{
+			Stripe* stripe = new Stripe();
+			for (size_t i = 0; i < window_slots; i++)
+			{
+				stripe->slot_numbers.push_back((unsigned long long)NO_SLOT);
+				stripe->members.push_back(SpaceSaving(capacity));
+				stripe->machines.push_back(SpaceSaving(capacity));
+			}
+			stripes.push_back(stripe);
+		}
+
+		/*Summaries fill up within a window, so they are charged at their full size from the start*/
+		memory_charge.resize(stripe_count * (sizeof(Stripe) + window_slots * (sizeof(unsigned long long) + 2 * SpaceSaving::getBytesFor(capacity))));
+	}
+
+	/**
+	Destructor for HeavyHitters.
+	*/
+	~HeavyHitters()
+	{
+		for (size_t s = 0; s < stripes.size(); s++)
+			delete stripes[s];
+	}
+
+	/**
+	Records a tap by a member on a machine at "time_us". Can be called from any thread.
+	Taps should arrive roughly in time order; a tap older than its slice's current contents is dropped.
+	*/
+	void record(unsigned long membership_id, unsigned int machine_id, unsigned long long time_us)
+	{
+		add(&membership_id, machine_id, time_us);
+	}
+
+	/**
+	Records a tap from a reader, looking its bracelet up through "guard". Taps from unknown bracelets only count for their machine.
+	*/
+	void record(MemberRegistry::ReadGuard& guard, const TapEvent& tap)
+	{
+		Member* member = guard.findByBraceletID(tap.bracelet_id);
+		unsigned long membership_id = member == NULL ? 0 : member->getMembershipID();
+		add(member == NULL ? NULL : &membership_id, tap.reader_id, tap.time_us);
+	}
+
+	/**
+	Returns the "n" members with the most taps in the window ending at "now_us", most taps first. Keys are membership IDs.
+	*/
+	vector<SpaceSaving::Item> topMembers(size_t n, unsigned long long now_us)
+	{
+		return collect(true, now_us).top(n);
+	}
+
+	/**
+	Returns the "n" machines with the most taps in the window ending at "now_us", most taps first. Keys are reader IDs.
+	*/
+	vector<SpaceSaving::Item> topMachines(size_t n, unsigned long long now_us)
+	{
+		return collect(false, now_us).top(n);
+	}
+
+private:
+
+	static const unsigned long long NO_SLOT = ~0ull;
+
+	/*One thread's share of the summaries, a member and a machine summary per slice of the window*/
+	struct Stripe
+	{
+		mutex stripe_lock;
+		vector<unsigned long long> slot_numbers;
+		vector<SpaceSaving> members;
+		vector<SpaceSaving> machines;
+	};
+
+	size_t capacity;
+	size_t window_slots;
+	unsigned long long slot_us;
+	vector<Stripe*> stripes;
+	MemoryCharge<MemoryStats::TAP_ANALYTICS> memory_charge;
+
+	/*Counts a tap in the calling thread's stripe, starting its slice afresh if the slice still holds an older window's taps*/
+	void add(const unsigned long* membership_id, unsigned int machine_id, unsigned long long time_us)
+	{
+		Stripe& stripe = *stripes[hash<thread::id>()(this_thread::get_id()) % stripes.size()];
+		unsigned long long slot_number = time_us / slot_us;
+		size_t slot = (size_t)(slot_number % window_slots);
+
+		lock_guard<mutex> lock(stripe.stripe_lock);
+		if (stripe.slot_numbers[slot] != slot_number)
+		{
+			if (stripe.slot_numbers[slot] != NO_SLOT && stripe.slot_numbers[slot] > slot_number)
+				return;
+			stripe.slot_numbers[slot] = slot_number;
+			stripe.members[slot].clear();
+			stripe.machines[slot].clear();
+		}
+		if (membership_id != NULL)
+			stripe.members[slot].offer(*membership_id);
+		stripe.machines[slot].offer(machine_id);
+	}
+
+	SpaceSaving collect(bool members, unsigned long long now_us)
+	{
+		unsigned long long newest = now_us / slot_us;
+		unsigned long long oldest = newest + 1 >= window_slots ? newest + 1 - window_slots : 0;
+
+		SpaceSaving merged(capacity);
+		for (size_t s = 0; s < stripes.size(); s++)
+		{
+			lock_guard<mutex> lock(stripes[s]->stripe_lock);
+			for (size_t i = 0; i < window_slots; i++)
+			{
+				unsigned long long slot_number = stripes[s]->slot_numbers[i];
+				if (slot_number == NO_SLOT || slot_number < oldest || slot_number > newest)
+					continue;
+				merged.merge(members ? stripes[s]->members[i] : stripes[s]->machines[i]);
+			}
+		}
+		return merged;
+	}
+
+	HeavyHitters(const HeavyHitters&);
+	HeavyHitters& operator=(const HeavyHitters&);
+};
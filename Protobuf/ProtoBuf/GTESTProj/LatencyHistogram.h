@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "CacheAligned.h"
+
+using namespace std;
+
+/**
+The LatencyHistogram class records how long an operation takes, in nanoseconds, with high dynamic range:
+every value from 1ns to about 78 hours (2^48ns) is kept to within 1.6% (values under 128ns exactly); longer values are counted
+in the top bucket. Each stripe (see below) is a fixed 22KB of counters, and there are two stripes per hardware thread by default,
+e.g. 352KB per histogram on 8 hardware threads.
+
+Values below 128 get a bucket each. Above that, every power of two is split into 64 equal buckets, so a bucket is never wider
+than 1/64 of its values. Percentiles are reported as the top of their bucket, so they never understate a latency; the maximum is exact.
+
+Threads record into stripes of their own, picked by thread ID, so recording is a few uncontended atomic adds.
+Reading merges the stripes into a Snapshot. takeSnapshot() also empties the histogram, for per-interval reporting,
+without losing values recorded while it runs.
+*/
+class LatencyHistogram
+{
+public:
+
+	static const int SUB_BUCKETS = 64;
+	static const int MAX_EXPONENT = 47;
+	static const size_t BUCKET_COUNT = 2 * SUB_BUCKETS + (MAX_EXPONENT - 6) * SUB_BUCKETS;
+
+	/**
+	The Snapshot class holds the merged counts of a LatencyHistogram at one moment, and answers percentile queries on them.
+	Snapshots of several histograms, e.g. from several processes or intervals, can be merged.
+	*/
+	class Snapshot
+	{
+	public:
+
+		Snapshot() : counts(BUCKET_COUNT, 0)
+		{
+			count = 0;
+			sum = 0;
+			max = 0;
+		}
+
+		/**
+		Retreives the number of values recorded.
+		*/
+		unsigned long long getCount() const
+		{
+			return count;
+		}
+
+		/**
+		Retreives the sum of the values recorded.
+		*/
+		unsigned long long getSum() const
+		{
+			return sum;
+		}
+
+		/**
+		Retreives the largest value recorded, or 0 if there are none.
+		*/
+		unsigned long long getMax() const
+		{
+			return max;
+		}
+
+		/**
+		Returns the value that "fraction" (e.g. 0.99) of the recorded values are at or below, or 0 if there are none.
+		*/
+		unsigned long long percentile(double fraction) const
+		{
+			if (count == 0)
+				return 0;
+
+			unsigned long long rank = (unsigned long long)(fraction * count + 0.5);
+			rank = rank < 1 ? 1 : (rank > count ? count : rank);
+
+			unsigned long long seen = 0;
+			for (size_t i = 0; i < BUCKET_COUNT; i++)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+				{
+					unsigned long long top = bucketTop(i);
+					return top < max ? top : max;
+				}
+			}
+			return max;
+		}
+
+		/**
+		Returns how many recorded values are at or below "value", counting a value by the top of its bucket.
+		*/
+		unsigned long long countAtOrBelow(unsigned long long value) const
+		{
+			unsigned long long below = 0;
+			for (size_t i = 0; i < BUCKET_COUNT && bucketTop(i) <= value; i++)
+				below += counts[i];
+			return below;
+		}
+
+		/**
+		Adds the values of another snapshot to this one.
+		*/
+		void merge(const Snapshot& other)
+		{
+			for (size_t i = 0; i < BUCKET_COUNT; i++)
+				counts[i] += other.counts[i];
+			count += other.count;
+			sum += other.sum;
+			if (other.max > max)
+				max = other.max;
+		}
+
+	private:
+		friend class LatencyHistogram;
+		vector<unsigned long long> counts;
+		unsigned long long count;
+		unsigned long long sum;
+		unsigned long long max;
+	};
+
+	/**
+	Constructor for LatencyHistogram. "stripe_count" defaults to two stripes per hardware thread.
+	*/
+	LatencyHistogram(size_t stripe_count = 0)
+	{
+		if (stripe_count == 0)
+			stripe_count = 2 * max(1u, thread::hardware_concurrency());
+		this->stripe_count = stripe_count;
+
+		stripes = new CacheAlignedArray<Stripe>(stripe_count);
+		for (size_t s = 0; s < stripe_count; s++)
+		{
+			for (size_t i = 0; i < BUCKET_COUNT; i++)
+				(*stripes)[s].counts[i].store(0, memory_order_relaxed);
+			(*stripes)[s].sum.store(0, memory_order_relaxed);
+			(*stripes)[s].max.store(0, memory_order_relaxed);
+		}
+	}
+
+	/**
+	Destructor for LatencyHistogram.
+	*/
+	~LatencyHistogram()
+	{
+		delete stripes;
+	}
+
+	/**
+	Records one value, in nanoseconds. Can be called from any thread.
+	*/
+	void record(unsigned long long nanoseconds)
+	{
+		Stripe& stripe = (*stripes)[hash<thread::id>()(this_thread::get_id()) % stripe_count];
+		stripe.counts[bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+		stripe.sum.fetch_add(nanoseconds, memory_order_relaxed);
+
+		unsigned long long current = stripe.max.load(memory_order_relaxed);
+		while (nanoseconds > current && !stripe.max.compare_exchange_weak(current, nanoseconds, memory_order_relaxed)) {}
+	}
+
+	/**
+	Returns every value recorded so far, merged from all stripes.
+	*/
+	Snapshot getSnapshot()
+	{
+		return collect(false);
+	}
+
+	/**
+	Returns every value recorded since the last takeSnapshot() or reset(), and empties the histogram.
+	*/
+	Snapshot takeSnapshot()
+	{
+		return collect(true);
+	}
+
+	/**
+	Empties the histogram.
+	*/
+	void reset()
+	{
+		collect(true);
+	}
+
+	/**
+	Returns the bucket a value is counted in.
+	*/
+	static size_t bucketOf(unsigned long long value)
+	{
+		if (value < 2 * SUB_BUCKETS)
+			return (size_t)value;
+
+		int exponent = highestBit(value);
+		if (exponent > MAX_EXPONENT)
+			return BUCKET_COUNT - 1;
+		int shift = exponent - 6;
+		return 2 * SUB_BUCKETS + (size_t)(exponent - 7) * SUB_BUCKETS + (size_t)((value >> shift) - SUB_BUCKETS);
+	}
+
+	/**
+	Returns the largest value counted in a bucket.
+	*/
+	static unsigned long long bucketTop(size_t bucket)
+	{
+		if (bucket < 2 * SUB_BUCKETS)
+			return bucket;
+
+		int exponent = (int)((bucket - 2 * SUB_BUCKETS) / SUB_BUCKETS) + 7;
+		unsigned long long sub = (bucket - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+		int shift = exponent - 6;
+		return ((sub + 1) << shift) - 1;
+	}
+
+private:
+
+	/*One thread's share of the counters, padded so that neighbouring stripes do not share a cache line*/
+	struct Stripe
+	{
+		atomic<unsigned long long> counts[BUCKET_COUNT];
+		atomic<unsigned long long> sum;
+		atomic<unsigned long long> max;
+		char padding[64 - sizeof(atomic<unsigned long long>) * 2];
+	};
+
+	CacheAlignedArray<Stripe>* stripes;
+	size_t stripe_count;
+
+	Snapshot collect(bool empty)
+	{
+		Snapshot snapshot;
+		for (size_t s = 0; s < stripe_count; s++)
+		{
+			for (size_t i = 0; i < BUCKET_COUNT; i++)
+			{
+				unsigned long long n = empty ? (*stripes)[s].counts[i].exchange(0, memory_order_relaxed)
+					: (*stripes)[s].counts[i].load(memory_order_relaxed);
+				snapshot.counts[i] += n;
+				snapshot.count += n;
+			}
+
+			snapshot.sum += empty ? (*stripes)[s].sum.exchange(0, memory_order_relaxed) : (*stripes)[s].sum.load(memory_order_relaxed);
+			unsigned long long stripe_max = empty ? (*stripes)[s].max.exchange(0, memory_order_relaxed) : (*stripes)[s].max.load(memory_order_relaxed);
+			if (stripe_max > snapshot.max)
+				snapshot.max = stripe_max;
+		}
+		return snapshot;
+	}
+
+	static int highestBit(unsigned long long value)
+	{
+		int bit = 0;
+		for (int step = 32; step > 0; step /= 2)
+		{
+			if (value >> step)
+			{
+				value >>= step;
+				bit += step;
+			}
+		}
+		return bit;
+	}
+
+	LatencyHistogram(const LatencyHistogram&);
+	LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+/**
+The LatencyStats class keeps a LatencyHistogram for each public member operation whose slow cases customers feel.
+There is one process-wide instance, filled in by LatencyTimers placed in the operations themselves.
+Recording can be switched off with setEnabled(false), which leaves each timed operation with a flag check and a count.
+
+Every operation is also counted apart from its histogram, in per-thread stripes like the histograms'. Those counts are never
+reset and keep counting while recording is off, so they can be exported as monotonic counters.
+*/
+class LatencyStats
+{
+public:
+
+	/**
+	The enumerated "Operation" type names each timed operation.
+	*/
+	enum Operation { FACTORY_CREATE, LOOKUP, CREDIT_MUTATION, SERIALIZE, DESERIALIZE };
+
+	static const int OPERATION_COUNT = 5;
+
+	/**
+	Returns the process-wide LatencyStats.
+	*/
+	static LatencyStats& instance()
+	{
+		static LatencyStats stats;
+		return stats;
+	}
+
+	/**
+	Returns the name of an operation, for reports.
+	*/
+	static const char* getName(Operation operation)
+	{
+		const char* names[] = { "factory_create", "lookup", "credit_mutation", "serialize", "deserialize" };
+		return names[operation];
+	}
+
+	/**
+	Turns recording on or off. It is on by default.
+	*/
+	void setEnabled(bool enabled)
+	{
+		this->enabled.store(enabled, memory_order_relaxed);
+	}
+
+	/**
+	Returns whether recording is on.
+	*/
+	bool isEnabled()
+	{
+		return enabled.load(memory_order_relaxed);
+	}
+
+	/**
+	Retreives the histogram of an operation.
+	*/
+	LatencyHistogram& getHistogram(Operation operation)
+	{
+		return *histograms[operation];
+	}
+
+	/**
+	Empties the histogram of every operation. Operation counts are kept.
+	*/
+	void reset()
+	{
+		for (int i = 0; i < OPERATION_COUNT; i++)
+			histograms[i]->reset();
+	}
+
+	/**
+	Counts one run of an operation, whether recording is on or not.
+	*/
+	void countOperation(Operation operation)
+	{
+		(*counters)[hash<thread::id>()(this_thread::get_id()) % counters->size()].counts[operation].fetch_add(1, memory_order_relaxed);
+	}
+
+	/**
+	Retreives the number of times an operation has run since the process started.
+	*/
+	unsigned long long getOperationCount(Operation operation)
+	{
+		unsigned long long count = 0;
+		for (size_t s = 0; s < counters->size(); s++)
+			count += (*counters)[s].counts[operation].load(memory_order_relaxed);
+		return count;
+	}
+
+private:
+
+	/*One thread's share of the operation counts, padded to a cache line*/
+	struct Counters
+	{
+		atomic<unsigned long long> counts[OPERATION_COUNT];
+		char padding[64 - sizeof(atomic<unsigned long long>) * OPERATION_COUNT];
+	};
+
+	atomic<bool> enabled;
+	LatencyHistogram* histograms[OPERATION_COUNT];
+	CacheAlignedArray<Counters>* counters;
+
+	LatencyStats()
+	{
+		enabled.store(true);
+		for (int i = 0; i < OPERATION_COUNT; i++)
+			histograms[i] = new LatencyHistogram();
+
+		counters = new CacheAlignedArray<Counters>(2 * max(1u, thread::hardware_concurrency()));
+		for (size_t s = 0; s < counters->size(); s++)
+		{
+			for (int i = 0; i < OPERATION_COUNT; i++)
+				(*counters)[s].counts[i].store(0, memory_order_relaxed);
+		}
+	}
+
+	~LatencyStats()
+	{
+		for (int i = 0; i < OPERATION_COUNT; i++)
+			delete histograms[i];
+		delete counters;
+	}
+
+	LatencyStats(const LatencyStats&);
+	LatencyStats& operator=(const LatencyStats&);
+};
+
+/*VS2013 does not guard function-local statics against concurrent first use, so the stats are created during static
+initialization, before main() can start a thread that times something*/
+static LatencyStats& latency_stats = LatencyStats::instance();
+
+/**
+The LatencyTimer class times the scope it is declared in and records it in the LatencyStats histogram of an operation.
+*/
+class LatencyTimer
+{
+public:
+
+	LatencyTimer(LatencyStats::Operation operation) : operation(operation)
+	{
+		LatencyStats& stats = LatencyStats::instance();
+		stats.countOperation(operation);
+		running = stats.isEnabled();
+		if (running)
+			start = chrono::steady_clock::now();
+	}
+
+	~LatencyTimer()
+	{
+		if (running)
+		{
+			long long elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+			LatencyStats::instance().getHistogram(operation).record((unsigned long long)(elapsed < 0 ? 0 : elapsed));
+		}
+	}
+
+private:
+	LatencyStats::Operation operation;
+	bool running;
+	chrono::steady_clock::time_point start;
+
+	LatencyTimer(const LatencyTimer&);
+	LatencyTimer& operator=(const LatencyTimer&);
+};
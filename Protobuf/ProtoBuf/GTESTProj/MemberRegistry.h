@@ -0,0 +1,686 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "BraceletFilter.h"
+#include "CacheAligned.h"
+#include "Member.h"
+#include "MemoryStats.h"
+#include "TraceSpans.h"
+
+using namespace std;
+
+/**
+The MemberRegistry class holds every live Member of the gym, indexed by membership ID and by bracelet ID.
+
+Reads are epoch-protected instead of locked: a ReadGuard announces the epoch it entered in, and every Member, index node
+and table it can reach stays allocated until the guard is destroyed. Turnstile lookups therefore never wait on a writer,
+even while a bulk import or a billing run is publishing thousands of members.
+
+Writers never modify a published Member. They publish a new version instead (see publish() and update()),
+and the old version is retired. Retired objects are reclaimed once every reader that might still see them has left.
+Writers are serialized among themselves by a mutex that readers never touch.
+
+Bracelet lookups first ask a BraceletFilter, so that taps from unregistered bracelets are usually turned away after reading
+a single cache line. The filter is rebuilt from the bracelet index whenever it fills up with bracelets that have left.
+*/
+class MemberRegistry
+{
+private:
+
+	/*One registry entry per membership ID. "version" always points at the latest published Member*/
+	struct Record
+	{
+		atomic<Member*> version;
+	};
+
+	/*Chained hash node, shared by both indexes*/
+	struct Node
+	{
+		unsigned long key;
+		Record* record;
+		atomic<Node*> next;
+	};
+
+	/*A power of two sized bucket array. Tables are replaced as a whole when the registry grows*/
+	struct Table
+	{
+		size_t mask;
+		atomic<Node*>* buckets;
+	};
+
+	/*An object waiting for every reader of its epoch to leave before being deleted*/
+	struct Retired
+	{
+		void* object;
+		void(*destroy)(void*);
+		unsigned long long epoch;
+	};
+
+	/*Reader epoch announcement, padded to a cache line so readers on different cores do not share one*/
+	struct ReaderSlot
+	{
+		atomic<unsigned long long> epoch;
+		char padding[64 - sizeof(atomic<unsigned long long>)];
+	};
+
+public:
+
+	/**
+	The maximum number of ReadGuards that can be active at the same time. Additional readers spin until a slot frees up.
+	*/
+	static const int MAX_READERS = 128;
+
+	/**
+	The number of retired objects after which a writer attempts to reclaim memory.
+	*/
+	static const size_t RECLAIM_THRESHOLD = 1024;
+
+	/**
+	The ReadGuard class pins the registry's current epoch for as long as it is alive.
+	Members returned by its find functions remain valid until the guard is destroyed, and form a consistent view of the registry.
+
+	Members returned through a ReadGuard are shared with every other reader and must be treated as read-only.
+	To change a member, use MemberRegistry::update() instead.
+	*/
+	class ReadGuard
+	{
+	public:
+
+		/**
+		Constructor for ReadGuard. Enters the registry's current epoch without taking any lock.
+		*/
+		ReadGuard(MemberRegistry& registry) : registry(registry)
+		{
+			slot = registry.enterEpoch();
+		}
+
+		/**
+		Destructor for ReadGuard. Leaves the epoch, allowing memory retired since then to be reclaimed.
+		*/
+		~ReadGuard()
+		{
+			registry.leaveEpoch(slot);
+		}
+
+		/**
+		Returns the latest published version of the member with the given membership ID, or NULL if there is none.
+		*/
+		Member* findByMembershipID(unsigned long membership_id)
+		{
+			LatencyTimer timer(LatencyStats::LOOKUP);
+			return registry.find(registry.by_membership_id, membership_id);
+		}
+
+		/**
+		Returns the latest published version of the member wearing the given bracelet, or NULL if there is none.
+		*/
+		Member* findByBraceletID(unsigned long bracelet_id)
+		{
+			LatencyTimer timer(LatencyStats::LOOKUP);
+			if (!registry.bracelet_filter.load(memory_order_acquire)->mayContain(bracelet_id))
+				return NULL;
+			return registry.find(registry.by_bracelet_id, bracelet_id);
+		}
+
+		/**
+		Calls "visit" with the latest published version of every member in the registry, in no particular order.
+		*/
+		void forEach(function<void(Member*)> visit)
+		{
+			Table* table = registry.by_membership_id.load();
+			for (size_t i = 0; i <= table->mask; i++)
+			{
+				for (Node* node = table->buckets[i].load(); node != NULL; node = node->next.load())
+					visit(node->record->version.load());
+			}
+		}
+
+	private:
+		MemberRegistry& registry;
+		int slot;
+
+		ReadGuard(const ReadGuard&);
+		ReadGuard& operator=(const ReadGuard&);
+	};
+
+	/**
+	The Listener class is notified of every change published to the registry, e.g. to maintain a secondary index.
+	Notifications are made by the writer that made the change, while it holds the writer lock, so they are never concurrent.
+	*/
+	class Listener
+	{
+	public:
+
+		/**
+		Virtual destructor for Listener.
+		*/
+		virtual ~Listener() {}
+
+		/**
+		Called when "new_version" is published. "old_version" is the version it replaces, or NULL for a new member.
+		*/
+		virtual void onPublish(Member* old_version, Member* new_version) = 0;
+
+		/**
+		Called when a member is removed from the registry. "old_version" is its last published version.
+		*/
+		virtual void onRemove(Member* old_version) = 0;
+	};
+
+	/**
+	Constructor for MemberRegistry.
+	*/
+	MemberRegistry() : reader_slots(MAX_READERS)
+	{
+		global_epoch = 1;
+		member_count = 0;
+		by_membership_id = createTable(1024);
+		by_bracelet_id = createTable(1024);
+		bracelet_filter = new BraceletFilter(1024);
+		stale_bracelets = 0;
+
+		for (int i = 0; i < MAX_READERS; i++)
+			reader_slots[i].epoch = 0;
+	}
+
+	/**
+	Destructor for MemberRegistry. No ReadGuard may be alive while the registry is destroyed.
+	*/
+	~MemberRegistry()
+	{
+		/*Records are only reachable through the membership ID index, so free them from there*/
+		Table* table = by_membership_id.load();
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			for (Node* node = table->buckets[i].load(); node != NULL; node = node->next.load())
+			{
+				delete node->record->version.load();
+				destroyRecord(node->record);
+			}
+		}
+
+		destroyTable(by_membership_id.load());
+		destroyTable(by_bracelet_id.load());
+		delete bracelet_filter.load();
+
+		for (size_t i = 0; i < retired.size(); i++)
+			retired[i].destroy(retired[i].object);
+	}
+
+	/**
+	Publishes a member to the registry, taking ownership of it.
+	If a member with the same membership ID already exists, the given member becomes its new version and the old version is retired.
+	The member must not be modified after it has been published.
+	*/
+	void publish(Member* member)
+	{
+		lock_guard<mutex> lock(writer_lock);
+		publishLocked(member);
+		reclaimIfNeeded();
+	}
+
+	/**
+	Publishes a member only if there is no member with the same membership ID yet, checking and publishing under one writer lock.
+	Returns whether it was published. If it was not, the caller keeps ownership of the member.
+	*/
+	bool publishIfAbsent(Member* member)
+	{
+		lock_guard<mutex> lock(writer_lock);
+		if (findNode(by_membership_id.load(), member->getMembershipID()) != NULL)
+			return false;
+		publishLocked(member);
+		reclaimIfNeeded();
+		return true;
+	}
+
+	/**
+	Publishes a batch of members, taking ownership of all of them. Equivalent to calling publish() on each member,
+	but the writer lock is only taken once every RECLAIM_THRESHOLD members so that other writers can interleave with a bulk import.
+	*/
+	void publishBatch(const vector<Member*>& members)
+	{
+		size_t i = 0;
+		while (i < members.size())
+		{
+			lock_guard<mutex> lock(writer_lock);
+			TraceSpan span("registry.index", "import");
+			size_t end = min(members.size(), i + RECLAIM_THRESHOLD);
+			for (; i < end; i++)
+				publishLocked(members[i]);
+			reclaimIfNeeded();
+		}
+	}
+
+	/**
+	Copy-on-write update of a member. The latest version is cloned, the clone is passed to "mutate", and the result is published.
+	The clone's dirty fields are cleared before "mutate" runs, so the published version's dirty fields are exactly the fields it changed.
+	Returns false if there is no member with the given membership ID.
+	*/
+	bool update(unsigned long membership_id, function<void(Member*)> mutate)
+	{
+		lock_guard<mutex> lock(writer_lock);
+
+		Node* node = findNode(by_membership_id.load(), membership_id);
+		if (node == NULL)
+			return false;
+
+		Member* next = node->record->version.load()->clone();
+		next->clearDirtyFields();
+		mutate(next);
+		publishLocked(next);
+		reclaimIfNeeded();
+		return true;
+	}
+
+	/**
+	Copy-on-write update of many members at once, e.g. by a billing run. Returns the number of members that were updated.
+
+	The clones are made and mutated outside the writer lock, so several threads can prepare batches in parallel.
+	They are then published under a single lock acquisition. If another writer published a member in the meantime,
+	that member is cloned and mutated again from its latest version so that no update is lost.
+	*/
+	size_t updateBatch(const vector<unsigned long>& membership_ids, function<void(Member*)> mutate)
+	{
+		vector<Member*> bases(membership_ids.size(), NULL);
+		vector<Member*> clones(membership_ids.size(), NULL);
+
+		/*The guard stays alive until publishing is done, so no base version can be reclaimed and its address reused*/
+		ReadGuard guard(*this);
+		for (size_t i = 0; i < membership_ids.size(); i++)
+		{
+			bases[i] = guard.findByMembershipID(membership_ids[i]);
+			if (bases[i] == NULL)
+				continue;
+			clones[i] = bases[i]->clone();
+			clones[i]->clearDirtyFields();
+			mutate(clones[i]);
+		}
+
+		size_t updated = 0;
+		lock_guard<mutex> lock(writer_lock);
+		for (size_t i = 0; i < membership_ids.size(); i++)
+		{
+			Node* node = findNode(by_membership_id.load(), membership_ids[i]);
+
+			if (node == NULL || node->record->version.load() != bases[i])
+			{
+				/*Removed or republished since the clone was made*/
+				delete clones[i];
+				if (node == NULL)
+					continue;
+				clones[i] = node->record->version.load()->clone();
+				clones[i]->clearDirtyFields();
+				mutate(clones[i]);
+			}
+
+			publishLocked(clones[i]);
+			updated++;
+		}
+		reclaimIfNeeded();
+		return updated;
+	}
+
+	/**
+	Removes the member with the given membership ID from the registry. Returns false if there is no such member.
+	Readers that already found the member can keep using it until their ReadGuard is destroyed.
+	*/
+	bool remove(unsigned long membership_id)
+	{
+		lock_guard<mutex> lock(writer_lock);
+
+		Node* node = unlinkNode(by_membership_id.load(), membership_id, NULL);
+		if (node == NULL)
+			return false;
+
+		Record* record = node->record;
+		Member* version = record->version.load();
+		Node* bracelet_node = unlinkNode(by_bracelet_id.load(), version->getBraceletID(), record);
+
+		for (size_t i = 0; i < listeners.size(); i++)
+			listeners[i]->onRemove(version);
+
+		unsigned long long epoch = global_epoch.load();
+		retire(version, &destroyMember, epoch);
+		retire(record, &destroyRecord, epoch);
+		retire(node, &destroyNode, epoch);
+		if (bracelet_node != NULL)
+			retire(bracelet_node, &destroyNode, epoch);
+
+		member_count--;
+		stale_bracelets++;
+		refreshFilterIfNeeded();
+		reclaimIfNeeded();
+		return true;
+	}
+
+	/**
+	Registers a listener to be notified of every later change. The listener must stay alive until it is removed with removeListener().
+	Members already in the registry are passed to the listener's onPublish() as new members, so it starts out complete.
+	*/
+	void addListener(Listener* listener)
+	{
+		lock_guard<mutex> lock(writer_lock);
+		listeners.push_back(listener);
+
+		Table* table = by_membership_id.load();
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			for (Node* node = table->buckets[i].load(); node != NULL; node = node->next.load())
+				listener->onPublish(NULL, node->record->version.load());
+		}
+	}
+
+	/**
+	Stops notifying a listener registered with addListener().
+	*/
+	void removeListener(Listener* listener)
+	{
+		lock_guard<mutex> lock(writer_lock);
+		listeners.erase(std::remove(listeners.begin(), listeners.end(), listener), listeners.end());
+	}
+
+	/**
+	Deletes "object" with "destroy" once no ReadGuard that might still see it is left, e.g. a listener's own copy of a member
+	or a table it has replaced. Only to be called from a Listener notification, which runs under the writer lock.
+	*/
+	void retireFromListener(void* object, void(*destroy)(void*))
+	{
+		retire(object, destroy, global_epoch.load());
+	}
+
+	/**
+	Returns the number of members currently in the registry.
+	*/
+	size_t size()
+	{
+		return member_count.load();
+	}
+
+	/**
+	Frees every retired object that no active reader can still see. Writers call this automatically,
+	but it can also be called explicitly, e.g. after a bulk import has finished.
+	*/
+	void reclaim()
+	{
+		lock_guard<mutex> lock(writer_lock);
+		reclaimLocked();
+	}
+
+private:
+	atomic<Table*> by_membership_id;
+	atomic<Table*> by_bracelet_id;
+	atomic<BraceletFilter*> bracelet_filter;
+	atomic<unsigned long long> global_epoch;
+	atomic<size_t> member_count;
+	CacheAlignedArray<ReaderSlot> reader_slots;
+
+	/*Writer-only state*/
+	mutex writer_lock;
+	vector<Retired> retired;
+	vector<Listener*> listeners;
+	size_t stale_bracelets;
+
+	/*Epoch management*/
+
+	/*Claims a free reader slot and announces the current epoch in it. Returns the slot index*/
+	int enterEpoch()
+	{
+		int start = (int)(hash<thread::id>()(this_thread::get_id()) % MAX_READERS);
+
+		for (;;)
+		{
+			for (int n = 0; n < MAX_READERS; n++)
+			{
+				int i = (start + n) % MAX_READERS;
+				unsigned long long expected = 0;
+				unsigned long long epoch = global_epoch.load();
+
+				if (!reader_slots[i].epoch.compare_exchange_strong(expected, epoch))
+					continue;
+
+				/*The epoch may have advanced between reading and announcing it; re-announce until they agree*/
+				while (epoch != global_epoch.load())
+				{
+					epoch = global_epoch.load();
+					reader_slots[i].epoch.store(epoch);
+				}
+				return i;
+			}
+			this_thread::yield();
+		}
+	}
+
+	void leaveEpoch(int slot)
+	{
+		reader_slots[slot].epoch.store(0, memory_order_release);
+	}
+
+	void retire(void* object, void(*destroy)(void*), unsigned long long epoch)
+	{
+		Retired r = { object, destroy, epoch };
+		retired.push_back(r);
+	}
+
+	void reclaimIfNeeded()
+	{
+		if (retired.size() >= RECLAIM_THRESHOLD)
+			reclaimLocked();
+	}
+
+	/*Advances the epoch, then frees everything retired before the oldest epoch still announced by a reader*/
+	void reclaimLocked()
+	{
+		unsigned long long oldest = global_epoch.fetch_add(1) + 1;
+		for (int i = 0; i < MAX_READERS; i++)
+		{
+			unsigned long long epoch = reader_slots[i].epoch.load();
+			if (epoch != 0 && epoch < oldest)
+				oldest = epoch;
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < retired.size(); i++)
+		{
+			if (retired[i].epoch < oldest)
+				retired[i].destroy(retired[i].object);
+			else
+				retired[kept++] = retired[i];
+		}
+		retired.resize(kept);
+	}
+
+	static void destroyMember(void* object) { delete (Member*)object; }
+	static void destroyTableObject(void* object) { destroyTable((Table*)object); }
+	static void destroyFilter(void* object) { delete (BraceletFilter*)object; }
+
+	static void destroyRecord(void* object)
+	{
+		delete (Record*)object;
+		MemoryStats::instance().freed(MemoryStats::REGISTRY_RECORDS, sizeof(Record));
+	}
+
+	static void destroyNode(void* object)
+	{
+		delete (Node*)object;
+		MemoryStats::instance().freed(MemoryStats::REGISTRY_INDEX, sizeof(Node));
+	}
+
+	/*Hash table management*/
+
+	static size_t bucketOf(Table* table, unsigned long key)
+	{
+		/*Fibonacci hashing spreads sequential IDs across buckets*/
+		unsigned long long h = (unsigned long long)key * 11400714819323198485ull;
+		return (size_t)(h >> 32) & table->mask;
+	}
+
+	static Table* createTable(size_t bucket_count)
+	{
+		Table* table = new Table();
+		table->mask = bucket_count - 1;
+		table->buckets = new atomic<Node*>[bucket_count];
+		MemoryStats::instance().allocated(MemoryStats::REGISTRY_INDEX, sizeof(Table) + bucket_count * sizeof(atomic<Node*>));
+		for (size_t i = 0; i < bucket_count; i++)
+			table->buckets[i].store(NULL);
+		return table;
+	}
+
+	/*Deletes a table and its nodes, but not the records the nodes point to*/
+	static void destroyTable(Table* table)
+	{
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			Node* node = table->buckets[i].load();
+			while (node != NULL)
+			{
+				Node* next = node->next.load();
+				destroyNode(node);
+				node = next;
+			}
+		}
+		MemoryStats::instance().freed(MemoryStats::REGISTRY_INDEX, sizeof(Table) + (table->mask + 1) * sizeof(atomic<Node*>));
+		delete[] table->buckets;
+		delete table;
+	}
+
+	Member* find(atomic<Table*>& index, unsigned long key)
+	{
+		Node* node = findNode(index.load(), key);
+		if (node == NULL)
+			return NULL;
+		return node->record->version.load();
+	}
+
+	static Node* findNode(Table* table, unsigned long key)
+	{
+		for (Node* node = table->buckets[bucketOf(table, key)].load(); node != NULL; node = node->next.load())
+		{
+			if (node->key == key)
+				return node;
+		}
+		return NULL;
+	}
+
+	/*Prepends a node to its bucket. Readers either see the old head or the fully initialized new node*/
+	static void linkNode(Table* table, unsigned long key, Record* record)
+	{
+		atomic<Node*>& bucket = table->buckets[bucketOf(table, key)];
+		Node* node = new Node();
+		MemoryStats::instance().allocated(MemoryStats::REGISTRY_INDEX, sizeof(Node));
+		node->key = key;
+		node->record = record;
+		node->next.store(bucket.load());
+		bucket.store(node);
+	}
+
+	/*Unlinks the node for "key" (and "record", if given) without freeing it. The caller retires the returned node*/
+	static Node* unlinkNode(Table* table, unsigned long key, Record* record)
+	{
+		atomic<Node*>* link = &table->buckets[bucketOf(table, key)];
+		for (Node* node = link->load(); node != NULL; node = link->load())
+		{
+			if (node->key == key && (record == NULL || node->record == record))
+			{
+				link->store(node->next.load());
+				return node;
+			}
+			link = &node->next;
+		}
+		return NULL;
+	}
+
+	/*Rebuilds an index into a table twice the size. The old table stays readable until it is reclaimed*/
+	void grow(atomic<Table*>& index)
+	{
+		Table* old_table = index.load();
+		Table* new_table = createTable((old_table->mask + 1) * 2);
+
+		for (size_t i = 0; i <= old_table->mask; i++)
+		{
+			for (Node* node = old_table->buckets[i].load(); node != NULL; node = node->next.load())
+				linkNode(new_table, node->key, node->record);
+		}
+
+		index.store(new_table);
+		retire(old_table, &destroyTableObject, global_epoch.load());
+	}
+
+	void publishLocked(Member* member)
+	{
+		unsigned long long epoch = global_epoch.load();
+		Node* node = findNode(by_membership_id.load(), member->getMembershipID());
+
+		if (node != NULL)
+		{
+			/*Existing member: swap in the new version and move its bracelet if it changed*/
+			Record* record = node->record;
+			Member* old_version = record->version.load();
+			record->version.store(member);
+
+			if (old_version->getBraceletID() != member->getBraceletID())
+			{
+				Node* bracelet_node = unlinkNode(by_bracelet_id.load(), old_version->getBraceletID(), record);
+				if (bracelet_node != NULL)
+					retire(bracelet_node, &destroyNode, epoch);
+				bracelet_filter.load()->insert(member->getBraceletID());
+				linkNode(by_bracelet_id.load(), member->getBraceletID(), record);
+				stale_bracelets++;
+				refreshFilterIfNeeded();
+			}
+
+			for (size_t i = 0; i < listeners.size(); i++)
+				listeners[i]->onPublish(old_version, member);
+
+			retire(old_version, &destroyMember, epoch);
+			return;
+		}
+
+		/*New member*/
+		Record* record = new Record();
+		MemoryStats::instance().allocated(MemoryStats::REGISTRY_RECORDS, sizeof(Record));
+		record->version.store(member);
+		linkNode(by_membership_id.load(), member->getMembershipID(), record);
+		bracelet_filter.load()->insert(member->getBraceletID());
+		linkNode(by_bracelet_id.load(), member->getBraceletID(), record);
+		member_count++;
+
+		for (size_t i = 0; i < listeners.size(); i++)
+			listeners[i]->onPublish(NULL, member);
+
+		if (member_count.load() > by_membership_id.load()->mask + 1)
+		{
+			grow(by_membership_id);
+			grow(by_bracelet_id);
+		}
+		refreshFilterIfNeeded();
+	}
+
+	/*Replaces the bracelet filter once its live and stale bracelets together exceed its capacity.
+	The new filter holds twice the live bracelets, so rebuilds cost O(1) per change amortized*/
+	void refreshFilterIfNeeded()
+	{
+		BraceletFilter* old_filter = bracelet_filter.load();
+		if (member_count.load() + stale_bracelets <= old_filter->getCapacity())
+			return;
+
+		BraceletFilter* new_filter = new BraceletFilter(max((size_t)1024, 2 * member_count.load()));
+		Table* table = by_bracelet_id.load();
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			for (Node* node = table->buckets[i].load(); node != NULL; node = node->next.load())
+				new_filter->insert(node->key);
+		}
+
+		bracelet_filter.store(new_filter, memory_order_release);
+		stale_bracelets = 0;
+		retire(old_filter, &destroyFilter, global_epoch.load());
+	}
+
+	MemberRegistry(const MemberRegistry&);
+	MemberRegistry& operator=(const MemberRegistry&);
+};
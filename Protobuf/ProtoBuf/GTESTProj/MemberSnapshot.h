@@ -0,0 +1,372 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string.h>
+#include <vector>
+#include "BlockCompression.h"
+#include "BraceletIndex.h"
+#include "ByteOrder.h"
+#include "Member.h"
+#include "MemoryStats.h"
+#include "TraceSpans.h"
+#include "seng330a2.pb.h"
+
+using namespace std;
+
+/**
+The MemberSnapshot class saves and loads a whole set of members as one snapshot file, using one of two codecs.
+
+PROTOBUF stores a seng330a2::MemberList, exactly as the per-member serialize() functions would.
+FIXED_WIDTH stores one RECORD_SIZE byte little-endian record per member, holding every numeric field at a fixed offset,
+followed by a single blob holding all names and addresses. Records refer to their strings by offset and length into the blob,
+so encoding and decoding need no varints or field tags.
+
+The codec is chosen per snapshot when saving, and recorded in the snapshot header so that loading picks it up automatically.
+Snapshot files can also be written split into independently compressed blocks (see BlockCompressor), which load() detects as well.
+A BraceletIndex over the snapshot's members can be saved next to it with saveIndex(), so that loading needs no index build.
+Saving a snapshot removes any index left next to an earlier snapshot of the same name, and an index only loads with the
+members it was built over, so a stale index is never used.
+
+Header layout (HEADER_SIZE bytes): magic "S330SNAP" (8), Codec (4), member count (4)
+FIXED_WIDTH record layout: membership ID (8), bracelet ID (8), credit card number or employee ID (8),
+name offset (4), name length (4), address offset (4), address length (4), gym credits (4),
+member type (1), subscription level or staff clearance (1), reserved (2)
+*/
+class MemberSnapshot
+{
+public:
+
+	/**
+	The enumerated "Codec" type selects how the members of a snapshot are encoded.
+	*/
+	enum Codec { PROTOBUF, FIXED_WIDTH };
+
+	static const size_t HEADER_SIZE = 16;
+	static const size_t RECORD_SIZE = 48;
+
+	/**
+	Encodes the given members into "out", replacing its contents.
+	*/
+	static void encode(const vector<Member*>& members, Codec codec, string& out)
+	{
+		out.clear();
+		out.resize(HEADER_SIZE);
+		memcpy(&out[0], "S330SNAP", 8);
+		ByteOrder::putU32(&out[8], (unsigned int)codec);
+		ByteOrder::putU32(&out[12], (unsigned int)members.size());
+
+		if (codec == FIXED_WIDTH)
+			encodeFixedWidth(members, out);
+		else
+			encodeProtobuf(members, out);
+	}
+
+	/**
+	Decodes a snapshot made by encode(), appending the decoded members to "members". The caller owns the new members.
+	Returns false, without appending anything, if the snapshot is malformed.
+	*/
+	static bool decode(const string& in, vector<Member*>& members)
+	{
+		Codec codec;
+		if (!readCodec(in, codec))
+			return false;
+
+		vector<Member*> decoded;
+		bool ok = codec == FIXED_WIDTH ? decodeFixedWidth(in, decoded) : decodeProtobuf(in, decoded);
+		if (!ok)
+		{
+			for (size_t i = 0; i < decoded.size(); i++)
+				delete decoded[i];
+			return false;
+		}
+
+		members.insert(members.end(), decoded.begin(), decoded.end());
+		return true;
+	}
+
+	/**
+	Reads which codec a snapshot was encoded with. Returns false if "in" does not start with a snapshot header.
+	*/
+	static bool readCodec(const string& in, Codec& codec)
+	{
+		if (in.size() < HEADER_SIZE || memcmp(in.data(), "S330SNAP", 8) != 0)
+			return false;
+
+		unsigned int value = ByteOrder::getU32(&in[8]);
+		if (value != PROTOBUF && value != FIXED_WIDTH)
+			return false;
+
+		codec = (Codec)value;
+		return true;
+	}
+
+	/**
+	Encodes the given members with the given codec and writes them to a snapshot file. Returns false if the file could not be written.
+	Any index saved next to the file before is removed.
+	*/
+	static bool save(string file_name, const vector<Member*>& members, Codec codec)
+	{
+		string data;
+		{
+			TraceSpan span("snapshot.encode", "save");
+			encode(members, codec, data);
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data.size());
+
+		TraceSpan span("snapshot.write", "save");
+		remove(indexFileName(file_name).c_str());
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(data.data(), data.size());
+		return output.good();
+	}
+
+	/**
+	Encodes the given members with the given codec, then writes them to a snapshot file split into independently compressed blocks.
+	Blocks are compressed in parallel on "pool", or on the calling thread if "pool" is NULL. Returns false if the file could not be written.
+	Any index saved next to the file before is removed.
+	*/
+	static bool save(string file_name, const vector<Member*>& members, Codec codec, CompressionCodec& compression, ThreadPool* pool,
+		size_t block_size = BlockCompressor::DEFAULT_BLOCK_SIZE)
+	{
+		string data, compressed;
+		{
+			TraceSpan span("snapshot.encode", "save");
+			encode(members, codec, data);
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data.size());
+		{
+			TraceSpan span("snapshot.compress", "save");
+			BlockCompressor::compress(data, compression, pool, compressed, block_size);
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> compressed_charge(compressed.size());
+
+		TraceSpan span("snapshot.write", "save");
+		remove(indexFileName(file_name).c_str());
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(compressed.data(), compressed.size());
+		return output.good();
+	}
+
+	/**
+	Reads a snapshot file written by either save(), whatever its codec and compression, and appends its members to "members".
+	Compressed blocks are checksummed and decompressed in parallel on "pool", or on the calling thread if "pool" is NULL.
+	The caller owns the new members. Returns false if the file could not be read, is corrupted or is malformed.
+	*/
+	static bool load(string file_name, vector<Member*>& members, ThreadPool* pool = NULL)
+	{
+		string data;
+		{
+			TraceSpan span("snapshot.read", "import");
+			fstream input(file_name, ios::in | ios::binary);
+			if (!input)
+				return false;
+			data.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data.size());
+		if (!BlockCompressor::isCompressed(data))
+			return decode(data, members);
+
+		string raw;
+		{
+			TraceSpan span("snapshot.decompress", "import");
+			if (!BlockCompressor::decompress(data, pool, raw))
+				return false;
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> raw_charge(raw.size());
+		return decode(raw, members);
+	}
+
+	/**
+	Builds a BraceletIndex over the given members and writes it next to the snapshot file "file_name", in indexFileName(file_name).
+	The members must be the ones saved in the snapshot, in the same order. Returns false if the file could not be written.
+	*/
+	static bool saveIndex(string file_name, const vector<Member*>& members)
+	{
+		string data;
+		{
+			TraceSpan span("snapshot.index", "save");
+			BraceletIndex index;
+			index.build(members);
+			index.encode(data);
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data.size());
+
+		TraceSpan span("snapshot.write", "save");
+		fstream output(indexFileName(file_name), ios::out | ios::trunc | ios::binary);
+		output.write(data.data(), data.size());
+		return output.good();
+	}
+
+	/**
+	Reads the BraceletIndex saved next to the snapshot file "file_name" into "index", and attaches it to "members",
+	which must hold exactly the members loaded from that snapshot. Returns false if the index could not be read, is malformed,
+	or was built over other members.
+	*/
+	static bool loadIndex(string file_name, const vector<Member*>& members, BraceletIndex& index)
+	{
+		string data;
+		{
+			TraceSpan span("snapshot.read", "import");
+			fstream input(indexFileName(file_name), ios::in | ios::binary);
+			if (!input)
+				return false;
+			data.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+		}
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data.size());
+
+		if (!index.decode(data) || !index.matches(members))
+			return false;
+		index.attach(members);
+		return true;
+	}
+
+	/**
+	Returns the name of the BraceletIndex file kept next to a snapshot file.
+	*/
+	static string indexFileName(string file_name)
+	{
+		return file_name + ".bidx";
+	}
+
+private:
+
+	static void encodeProtobuf(const vector<Member*>& members, string& out)
+	{
+		seng330a2::MemberList list;
+		for (size_t i = 0; i < members.size(); i++)
+			members[i]->toProto(*list.add_member());
+
+		string body;
+		list.SerializeToString(&body);
+		out += body;
+	}
+
+	static bool decodeProtobuf(const string& in, vector<Member*>& members)
+	{
+		seng330a2::MemberList list;
+		{
+			TraceSpan span("snapshot.parse", "import");
+			if (!list.ParseFromArray(in.data() + HEADER_SIZE, (int)(in.size() - HEADER_SIZE)))
+				return false;
+		}
+		if ((unsigned int)list.member_size() != ByteOrder::getU32(&in[12]))
+			return false;
+
+		TraceSpan span("snapshot.convert", "import");
+		for (int i = 0; i < list.member_size(); i++)
+		{
+			const seng330a2::Member& m = list.member(i);
+			Member* member;
+			if (m.member_type() == seng330a2::Member_Type::Member_Type_STAFF)
+				member = new Staff();
+			else
+				member = new Customer();
+
+			member->fromProto(m);
+			members.push_back(member);
+		}
+		return true;
+	}
+
+	static void encodeFixedWidth(const vector<Member*>& members, string& out)
+	{
+		size_t records_start = out.size();
+		out.resize(records_start + members.size() * RECORD_SIZE);
+
+		string blob;
+		for (size_t i = 0; i < members.size(); i++)
+		{
+			Member* m = members[i];
+			char* record = &out[records_start + i * RECORD_SIZE];
+			string name = m->getName();
+			string address = m->getAddress();
+
+			ByteOrder::putU64(record, m->getMembershipID());
+			ByteOrder::putU64(record + 8, m->getBraceletID());
+			ByteOrder::putU32(record + 24, (unsigned int)blob.size());
+			ByteOrder::putU32(record + 28, (unsigned int)name.size());
+			blob += name;
+			ByteOrder::putU32(record + 32, (unsigned int)blob.size());
+			ByteOrder::putU32(record + 36, (unsigned int)address.size());
+			blob += address;
+			record[44] = (char)m->getMemberType();
+			record[46] = record[47] = 0;
+
+			if (m->getMemberType() == Member::Type::STAFF)
+			{
+				Staff* s = (Staff*)m;
+				ByteOrder::putU64(record + 16, s->getEmployeeID());
+				ByteOrder::putU32(record + 40, 0);
+				record[45] = (char)s->getStaffClearance();
+			}
+			else
+			{
+				Customer* c = (Customer*)m;
+				ByteOrder::putU64(record + 16, c->getCreditCard());
+				ByteOrder::putU32(record + 40, (unsigned int)c->getGymCredits());
+				record[45] = (char)c->getSubscriptionLevel();
+			}
+		}
+
+		out += blob;
+	}
+
+	static bool decodeFixedWidth(const string& in, vector<Member*>& members)
+	{
+		TraceSpan span("snapshot.convert", "import");
+		size_t count = ByteOrder::getU32(&in[12]);
+		if ((in.size() - HEADER_SIZE) / RECORD_SIZE < count)
+			return false;
+
+		const char* records = in.data() + HEADER_SIZE;
+		const char* blob = records + count * RECORD_SIZE;
+		size_t blob_size = in.size() - HEADER_SIZE - count * RECORD_SIZE;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			const char* record = records + i * RECORD_SIZE;
+			size_t name_offset = ByteOrder::getU32(record + 24);
+			size_t name_length = ByteOrder::getU32(record + 28);
+			size_t address_offset = ByteOrder::getU32(record + 32);
+			size_t address_length = ByteOrder::getU32(record + 36);
+			unsigned char type = (unsigned char)record[44];
+			unsigned char level = (unsigned char)record[45];
+
+			if (name_offset + name_length > blob_size || address_offset + address_length > blob_size || type > Member::Type::STAFF)
+				return false;
+
+			Member* member;
+			if (type == Member::Type::STAFF)
+			{
+				if (level > Staff::Clearance::ADMINISTRATOR)
+					return false;
+
+				Staff* s = new Staff();
+				s->setEmployeeID((unsigned long)ByteOrder::getU64(record + 16));
+				s->setStaffClearance((Staff::Clearance)level);
+				member = s;
+			}
+			else
+			{
+				if (level > Customer::SubscriptionLevel::DELUXE)
+					return false;
+
+				Customer* c = new Customer();
+				c->setCreditCard((unsigned long)ByteOrder::getU64(record + 16));
+				c->restoreGymCredits((int)ByteOrder::getU32(record + 40));
+				c->setSubscriptionLevel((Customer::SubscriptionLevel)level);
+				member = c;
+			}
+
+			member->setMembershipID((unsigned long)ByteOrder::getU64(record));
+			member->setBraceletID((unsigned long)ByteOrder::getU64(record + 8));
+			member->setName(string(blob + name_offset, name_length));
+			member->setAddress(string(blob + address_offset, address_length));
+			members.push_back(member);
+		}
+		return true;
+	}
+};
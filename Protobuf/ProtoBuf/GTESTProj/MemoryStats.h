@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+using namespace std;
+
+/**
+The MemoryStats class accounts for the memory held by each subsystem, so hosts can be sized from real numbers:
+live bytes, the peak of live bytes, and the number of allocations and frees.
+
+Subsystems report their own allocations with allocated() and freed(), or hold a MemoryCharge that does it for them.
+Byte counts are what the subsystem asked for, without allocator overhead. There is one process-wide instance,
+and every function can be called from any thread.
+*/
+class MemoryStats
+{
+public:
+
+	/**
+	The enumerated "Subsystem" type names each accounted subsystem.
+	MEMBER_OBJECTS counts every Customer and Staff, including the MemberFactory's templates, and STRINGS their names and addresses.
+	REGISTRY_RECORDS and REGISTRY_INDEX are a MemberRegistry's records, and the hash tables and nodes of its two indexes and its bracelet filter.
+	PERSISTENCE_BUFFERS counts encoded data on its way to or from snapshot and member files.
+	MEMBER_INDEXES are the indexes kept beside the registry: BraceletIndex, StaffDirectory and CreditIndex, without the member copies
+	they hold, which count as MEMBER_OBJECTS. TAP_ANALYTICS are the HeavyHitters summaries and DistinctVisitors sketches.
+	*/
+	enum Subsystem { MEMBER_OBJECTS, STRINGS, REGISTRY_RECORDS, REGISTRY_INDEX, PERMISSION_CACHE, PERSISTENCE_BUFFERS, MEMBER_INDEXES, TAP_ANALYTICS };
+
+	static const int SUBSYSTEM_COUNT = 8;
+
+	/**
+	The Usage struct is the memory use of one subsystem at one moment.
+	*/
+	struct Usage
+	{
+		long long live_bytes;
+		long long peak_bytes;
+		unsigned long long allocations;
+		unsigned long long frees;
+	};
+
+	/**
+	Returns the process-wide MemoryStats.
+	*/
+	static MemoryStats& instance()
+	{
+		static MemoryStats stats;
+		return stats;
+	}
+
+	/**
+	Returns the name of a subsystem, for reports.
+	*/
+	static const char* getName(Subsystem subsystem)
+	{
+		const char* names[] = { "member_objects", "strings", "registry_records", "registry_index", "permission_cache", "persistence_buffers",
+			"member_indexes", "tap_analytics" };
+		return names[subsystem];
+	}
+
+	/**
+	Records an allocation of "bytes" bytes by a subsystem.
+	*/
+	void allocated(Subsystem subsystem, size_t bytes)
+	{
+		Counters& c = counters[subsystem];
+		long long live = c.live_bytes.fetch_add((long long)bytes, memory_order_relaxed) + (long long)bytes;
+		c.allocations.fetch_add(1, memory_order_relaxed);
+
+		long long peak = c.peak_bytes.load(memory_order_relaxed);
+		while (live > peak && !c.peak_bytes.compare_exchange_weak(peak, live, memory_order_relaxed)) {}
+	}
+
+	/**
+	Records that a subsystem freed "bytes" bytes it had allocated.
+	*/
+	void freed(Subsystem subsystem, size_t bytes)
+	{
+		Counters& c = counters[subsystem];
+		c.live_bytes.fetch_sub((long long)bytes, memory_order_relaxed);
+		c.frees.fetch_add(1, memory_order_relaxed);
+	}
+
+	/**
+	Retreives the memory use of a subsystem.
+	*/
+	Usage getUsage(Subsystem subsystem)
+	{
+		Counters& c = counters[subsystem];
+		Usage usage;
+		usage.live_bytes = c.live_bytes.load(memory_order_relaxed);
+		usage.peak_bytes = c.peak_bytes.load(memory_order_relaxed);
+		usage.allocations = c.allocations.load(memory_order_relaxed);
+		usage.frees = c.frees.load(memory_order_relaxed);
+		return usage;
+	}
+
+	/**
+	Starts a new peak for every subsystem from its current live bytes.
+	*/
+	void resetPeaks()
+	{
+		for (int i = 0; i < SUBSYSTEM_COUNT; i++)
+			counters[i].peak_bytes.store(counters[i].live_bytes.load(memory_order_relaxed), memory_order_relaxed);
+	}
+
+	/**
+	Returns the heap bytes held by a string's characters, or 0 if it is short enough to be stored inside the string itself.
+	Counted by length rather than capacity, so that a string and its copy count the same.
+	How much fits inside differs between libraries (15 characters for MSVC and libstdc++, 22 for libc++), and is the capacity
+	of an empty string in all of them, so it is read from one rather than hard-coded.
+	*/
+	static size_t stringBytes(const string& value)
+	{
+		return value.size() > string().capacity() ? value.size() + 1 : 0;
+	}
+
+	/**
+	Returns an estimate of the heap bytes held by an unordered_map: a node per entry, holding the entry, the next pointer
+	and the cached hash, and a pointer per bucket.
+	*/
+	template <class Map>
+	static size_t hashMapBytes(const Map& map)
+	{
+		return map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*)) + map.bucket_count() * sizeof(void*);
+	}
+
+private:
+
+	/*One subsystem's counters, padded so that busy subsystems do not share a cache line*/
+	struct Counters
+	{
+		atomic<long long> live_bytes;
+		atomic<long long> peak_bytes;
+		atomic<unsigned long long> allocations;
+		atomic<unsigned long long> frees;
+		char padding[64 - sizeof(atomic<long long>) * 4];
+	};
+
+	Counters counters[SUBSYSTEM_COUNT];
+
+	MemoryStats()
+	{
+		for (int i = 0; i < SUBSYSTEM_COUNT; i++)
+		{
+			counters[i].live_bytes.store(0);
+			counters[i].peak_bytes.store(0);
+			counters[i].allocations.store(0);
+			counters[i].frees.store(0);
+		}
+	}
+
+	MemoryStats(const MemoryStats&);
+	MemoryStats& operator=(const MemoryStats&);
+};
+
+/*Created during static initialization rather than on first use, which VS2013 does not make thread-safe*/
+static MemoryStats& memory_stats = MemoryStats::instance();
+
+/**
+The MemoryCharge class charges a number of bytes to a subsystem for as long as it lives, for objects whose memory is easiest
+accounted from inside them. A copy charges the same bytes again, and assignment moves the charge to the new size.
+*/
+template <MemoryStats::Subsystem SUBSYSTEM>
+class MemoryCharge
+{
+public:
+
+	MemoryCharge(size_t bytes = 0) : bytes(bytes)
+	{
+		if (bytes != 0)
+			MemoryStats::instance().allocated(SUBSYSTEM, bytes);
+	}
+
+	MemoryCharge(const MemoryCharge& other) : bytes(other.bytes)
+	{
+		if (bytes != 0)
+			MemoryStats::instance().allocated(SUBSYSTEM, bytes);
+	}
+
+	~MemoryCharge()
+	{
+		if (bytes != 0)
+			MemoryStats::instance().freed(SUBSYSTEM, bytes);
+	}
+
+	MemoryCharge& operator=(const MemoryCharge& other)
+	{
+		resize(other.bytes);
+		return *this;
+	}
+
+	/**
+	Changes the number of bytes charged.
+	*/
+	void resize(size_t new_bytes)
+	{
+		if (new_bytes == bytes)
+			return;
+		if (bytes != 0)
+			MemoryStats::instance().freed(SUBSYSTEM, bytes);
+		if (new_bytes != 0)
+			MemoryStats::instance().allocated(SUBSYSTEM, new_bytes);
+		bytes = new_bytes;
+	}
+
+private:
+	size_t bytes;
+};
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "LatencyHistogram.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+/**
+The MetricsExporter class renders the state of a MemberRegistry and the LatencyStats histograms in the Prometheus text format,
+so that the monitoring system can scrape them.
+
+Memory use per subsystem comes from MemoryStats. Member counts per type and subscription level, and the gym credit ledger, are kept in atomic counters that the exporter updates
+as a MemberRegistry::Listener. Rendering only reads those counters and the histograms' stripes, so a scrape takes no lock
+and never makes a tap wait.
+
+Metrics can be written to a file every interval, for a node exporter's textfile collector, and on Linux served over HTTP
+on a loopback port. Operation counts come from LatencyStats' own counters, which are never reset, so they stay monotonic
+while the histograms are reset or switched off. The duration histograms restart from 0 whenever LatencyStats is reset,
+which Prometheus treats as a counter reset.
+*/
+class MetricsExporter : public MemberRegistry::Listener
+{
+public:
+
+	/**
+	Constructor for MetricsExporter. Counts every member already in "registry" and keeps the counts up to date from then on.
+	*/
+	MetricsExporter(MemberRegistry& registry) : registry(registry)
+	{
+		staff_count = 0;
+		for (int i = 0; i < 4; i++)
+			customer_count[i] = 0;
+		credits_outstanding = 0;
+		credits_added = 0;
+		credits_deducted = 0;
+		stopping = false;
+#ifdef __linux__
+		listen_fd = -1;
+		wake_fd = -1;
+		port = 0;
+#endif
+		registry.addListener(this);
+	}
+
+	/**
+	Destructor for MetricsExporter. Stops the file writer and HTTP server, if running.
+	*/
+	~MetricsExporter()
+	{
+		stop();
+		registry.removeListener(this);
+	}
+
+	/**
+	Returns every metric in the Prometheus text exposition format, version 0.0.4.
+	*/
+	string render()
+	{
+		const char* levels[] = { "inactive", "basic", "premium", "deluxe" };
+		ostringstream out;
+
+		out << "# HELP s330_registry_members Members in the registry.\n";
+		out << "# TYPE s330_registry_members gauge\n";
+		out << "s330_registry_members " << registry.size() << "\n";
+
+		out << "# HELP s330_members Members by type and subscription level.\n";
+		out << "# TYPE s330_members gauge\n";
+		for (int i = 0; i < 4; i++)
+			out << "s330_members{type=\"customer\",subscription_level=\"" << levels[i] << "\"} " << customer_count[i].load(memory_order_relaxed) << "\n";
+		out << "s330_members{type=\"staff\"} " << staff_count.load(memory_order_relaxed) << "\n";
+
+		out << "# HELP s330_gym_credits_outstanding Gym credits held by all customers.\n";
+		out << "# TYPE s330_gym_credits_outstanding gauge\n";
+		out << "s330_gym_credits_outstanding " << credits_outstanding.load(memory_order_relaxed) << "\n";
+		out << "# HELP s330_gym_credits_added_total Gym credits added to customers' balances.\n";
+		out << "# TYPE s330_gym_credits_added_total counter\n";
+		out << "s330_gym_credits_added_total " << credits_added.load(memory_order_relaxed) << "\n";
+		out << "# HELP s330_gym_credits_deducted_total Gym credits deducted from customers' balances.\n";
+		out << "# TYPE s330_gym_credits_deducted_total counter\n";
+		out << "s330_gym_credits_deducted_total " << credits_deducted.load(memory_order_relaxed) << "\n";
+
+		MemoryStats& memory = MemoryStats::instance();
+		out << "# HELP s330_memory_live_bytes Bytes held by each subsystem.\n";
+		out << "# TYPE s330_memory_live_bytes gauge\n";
+		for (int i = 0; i < MemoryStats::SUBSYSTEM_COUNT; i++)
+			out << "s330_memory_live_bytes{subsystem=\"" << MemoryStats::getName((MemoryStats::Subsystem)i) << "\"} " << memory.getUsage((MemoryStats::Subsystem)i).live_bytes << "\n";
+		out << "# HELP s330_memory_peak_bytes Most bytes held by each subsystem at once.\n";
+		out << "# TYPE s330_memory_peak_bytes gauge\n";
+		for (int i = 0; i < MemoryStats::SUBSYSTEM_COUNT; i++)
+			out << "s330_memory_peak_bytes{subsystem=\"" << MemoryStats::getName((MemoryStats::Subsystem)i) << "\"} " << memory.getUsage((MemoryStats::Subsystem)i).peak_bytes << "\n";
+		out << "# HELP s330_memory_allocations_total Allocations made by each subsystem.\n";
+		out << "# TYPE s330_memory_allocations_total counter\n";
+		for (int i = 0; i < MemoryStats::SUBSYSTEM_COUNT; i++)
+			out << "s330_memory_allocations_total{subsystem=\"" << MemoryStats::getName((MemoryStats::Subsystem)i) << "\"} " << memory.getUsage((MemoryStats::Subsystem)i).allocations << "\n";
+
+		LatencyHistogram::Snapshot snapshots[LatencyStats::OPERATION_COUNT];
+		for (int op = 0; op < LatencyStats::OPERATION_COUNT; op++)
+			snapshots[op] = LatencyStats::instance().getHistogram((LatencyStats::Operation)op).getSnapshot();
+
+		out << "# HELP s330_operations_total Member operations performed.\n";
+		out << "# TYPE s330_operations_total counter\n";
+		for (int op = 0; op < LatencyStats::OPERATION_COUNT; op++)
+			out << "s330_operations_total{operation=\"" << LatencyStats::getName((LatencyStats::Operation)op) << "\"} "
+				<< LatencyStats::instance().getOperationCount((LatencyStats::Operation)op) << "\n";
+
+		/*Bucket bounds in nanoseconds, and as Prometheus "le" labels in seconds*/
+		const unsigned long long bounds[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+			1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000, 1000000000 };
+		const char* labels[] = { "1e-07", "2.5e-07", "5e-07", "1e-06", "2.5e-06", "5e-06", "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025", "0.0005",
+			"0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1" };
+
+		out << "# HELP s330_operation_duration_seconds Time taken by member operations.\n";
+		out << "# TYPE s330_operation_duration_seconds histogram\n";
+		for (int op = 0; op < LatencyStats::OPERATION_COUNT; op++)
+		{
+			const char* name = LatencyStats::getName((LatencyStats::Operation)op);
+			for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++)
+				out << "s330_operation_duration_seconds_bucket{operation=\"" << name << "\",le=\"" << labels[b] << "\"} " << snapshots[op].countAtOrBelow(bounds[b]) << "\n";
+			out << "s330_operation_duration_seconds_bucket{operation=\"" << name << "\",le=\"+Inf\"} " << snapshots[op].getCount() << "\n";
+			out << "s330_operation_duration_seconds_sum{operation=\"" << name << "\"} " << seconds(snapshots[op].getSum()) << "\n";
+			out << "s330_operation_duration_seconds_count{operation=\"" << name << "\"} " << snapshots[op].getCount() << "\n";
+		}
+		return out.str();
+	}
+
+	/**
+	Writes the metrics to a file, replacing it whole so that a collector never reads a half written file.
+	Returns false if the file could not be written.
+	*/
+	bool writeFile(string file_name)
+	{
+		string text = render();
+		string temporary = file_name + ".tmp";
+		{
+			fstream output(temporary, ios::out | ios::trunc | ios::binary);
+			output.write(text.data(), text.size());
+			if (!output.good())
+				return false;
+		}
+
+		/*rename() does not replace an existing file on Windows*/
+		if (rename(temporary.c_str(), file_name.c_str()) != 0)
+		{
+			remove(file_name.c_str());
+			return rename(temporary.c_str(), file_name.c_str()) == 0;
+		}
+		return true;
+	}
+
+	/**
+	Starts a thread writing the metrics to "file_name" now and then every "interval", until stop() is called.
+	Returns false if a file writer is already running.
+	*/
+	bool startFileWriter(string file_name, chrono::milliseconds interval)
+	{
+		if (file_writer.joinable())
+			return false;
+
+		{
+			lock_guard<mutex> lock(stop_lock);
+			stopping = false;
+		}
+		file_writer = thread([this, file_name, interval]()
+		{
+			unique_lock<mutex> lock(stop_lock);
+			while (!stopping)
+			{
+				lock.unlock();
+				writeFile(file_name);
+				lock.lock();
+				stop_requested.wait_for(lock, interval, [this]() { return stopping; });
+			}
+		});
+		return true;
+	}
+
+#ifdef __linux__
+	/**
+	Starts serving the metrics over HTTP on 127.0.0.1 at "port", or at a free port if it is 0, on a thread of its own.
+	Returns false if the port could not be opened or the server is already running.
+	*/
+	bool startHttp(unsigned short port = 0)
+	{
+		if (server.joinable())
+			return false;
+
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+		socklen_t length = sizeof(address);
+		int reuse = 1;
+
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (listen_fd < 0 || wake_fd < 0
+			|| setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+			|| bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0
+			|| listen(listen_fd, 16) != 0
+			|| getsockname(listen_fd, (sockaddr*)&address, &length) != 0)
+		{
+			closeSockets();
+			return false;
+		}
+
+		this->port = ntohs(address.sin_port);
+		server = thread(&MetricsExporter::serve, this);
+		return true;
+	}
+
+	/**
+	Retreives the port the HTTP server listens on, or 0 if it is not running.
+	*/
+	unsigned short getPort()
+	{
+		return port;
+	}
+#endif
+
+	/**
+	Stops the file writer and the HTTP server.
+	*/
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(stop_lock);
+			stopping = true;
+		}
+		stop_requested.notify_all();
+		if (file_writer.joinable())
+			file_writer.join();
+
+#ifdef __linux__
+		if (server.joinable())
+		{
+			uint64_t one = 1;
+			if (write(wake_fd, &one, sizeof(one)) < 0) {}
+			server.join();
+		}
+		closeSockets();
+#endif
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Moves a member between the counts of its old and new version, and books any change in its gym credits.
+	A new member's opening balance enters the ledger without being counted as added.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		long long new_credits = count(new_version);
+		if (old_version == NULL)
+			return;
+
+		long long old_credits = uncount(old_version);
+		if (new_credits > old_credits)
+			credits_added.fetch_add(new_credits - old_credits, memory_order_relaxed);
+		else if (new_credits < old_credits)
+			credits_deducted.fetch_add(old_credits - new_credits, memory_order_relaxed);
+	}
+
+	/**
+	Takes a removed member out of the counts. Its credits leave the ledger without being counted as deducted.
+	*/
+	void onRemove(Member* old_version)
+	{
+		uncount(old_version);
+	}
+
+private:
+	MemberRegistry& registry;
+
+	atomic<long long> staff_count;
+	atomic<long long> customer_count[4];
+	atomic<long long> credits_outstanding;
+	atomic<long long> credits_added;
+	atomic<long long> credits_deducted;
+
+	thread file_writer;
+	mutex stop_lock;
+	condition_variable stop_requested;
+	bool stopping;
+
+#ifdef __linux__
+	thread server;
+	int listen_fd;
+	int wake_fd;
+	unsigned short port;
+#endif
+
+	/*Adds a member to the counts and returns its credits*/
+	long long count(Member* member)
+	{
+		if (member->getMemberType() == Member::Type::STAFF)
+		{
+			staff_count.fetch_add(1, memory_order_relaxed);
+			return 0;
+		}
+
+		Customer* c = (Customer*)member;
+		customer_count[c->getSubscriptionLevel()].fetch_add(1, memory_order_relaxed);
+		credits_outstanding.fetch_add(c->getGymCredits(), memory_order_relaxed);
+		return c->getGymCredits();
+	}
+
+	/*Takes a member out of the counts and returns its credits*/
+	long long uncount(Member* member)
+	{
+		if (member->getMemberType() == Member::Type::STAFF)
+		{
+			staff_count.fetch_sub(1, memory_order_relaxed);
+			return 0;
+		}
+
+		Customer* c = (Customer*)member;
+		customer_count[c->getSubscriptionLevel()].fetch_sub(1, memory_order_relaxed);
+		credits_outstanding.fetch_sub(c->getGymCredits(), memory_order_relaxed);
+		return c->getGymCredits();
+	}
+
+	static string seconds(unsigned long long nanoseconds)
+	{
+		ostringstream out;
+		out.precision(12);
+		out << nanoseconds / 1e9;
+		return out.str();
+	}
+
+#ifdef __linux__
+	/*Answers one connection at a time; a scrape is a single short request*/
+	void serve()
+	{
+		for (;;)
+		{
+			pollfd fds[2];
+			fds[0].fd = listen_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = wake_fd;
+			fds[1].events = POLLIN;
+			if (poll(fds, 2, -1) < 0)
+				continue;
+			if (fds[1].revents != 0)
+				return;
+
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			answer(fd);
+			close(fd);
+		}
+	}
+
+	void answer(int fd)
+	{
+		/*A client that stalls mid-request must not hold up the next scrape for long*/
+		timeval timeout;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		string request;
+		char buffer[1024];
+		while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
+		{
+			ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+			if (n <= 0)
+				return;
+			request.append(buffer, n);
+		}
+
+		string response;
+		if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0)
+		{
+			string body = render();
+			response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size())
+				+ "\r\nConnection: close\r\n\r\n" + body;
+		}
+		else
+			response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+		for (size_t sent = 0; sent < response.size();)
+		{
+			ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			sent += n;
+		}
+	}
+
+	void closeSockets()
+	{
+		if (listen_fd >= 0)
+			close(listen_fd);
+		if (wake_fd >= 0)
+			close(wake_fd);
+		listen_fd = -1;
+		wake_fd = -1;
+		port = 0;
+	}
+#endif
+
+	MetricsExporter(const MetricsExporter&);
+	MetricsExporter& operator=(const MetricsExporter&);
+};
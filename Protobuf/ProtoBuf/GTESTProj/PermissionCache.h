@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemoryStats.h"
+
+using namespace std;
+
+/**
+The PermissionCache class maps staff bracelet IDs to their precomputed capability bitsets (see Staff::Capability),
+so that authorizing a bracelet at a door, till or admin screen is one table probe and a single AND.
+
+The cache registers itself as a MemberRegistry::Listener and is kept up to date by every publish: a staff whose clearance
+or bracelet changes through setStaffClearance() or setBraceletID() has its entry replaced when the new version is published.
+
+Lookups are lock-free and can run concurrently with updates. Each holds a MemberRegistry::ReadGuard, so a table replaced
+while it is being probed is only freed through the registry's epochs once no lookup can still be reading it.
+Bracelet ID 0 is reserved to mark empty slots.
+*/
+class PermissionCache : public MemberRegistry::Listener
+{
+private:
+
+	/*Open addressing slot. "capabilities" is written before "bracelet_id", so a reader finding the key also sees its bits*/
+	struct Slot
+	{
+		atomic<unsigned long> bracelet_id;
+		atomic<unsigned int> capabilities;
+	};
+
+	struct Table
+	{
+		size_t mask;
+		size_t used;
+		Slot* slots;
+	};
+
+public:
+
+	/**
+	Constructor for PermissionCache. Fills the cache from every staff already in "registry" and keeps it up to date from then on.
+	*/
+	PermissionCache(MemberRegistry& registry) : registry(registry)
+	{
+		table = createTable(256);
+		registry.addListener(this);
+	}
+
+	/**
+	Destructor for PermissionCache.
+	*/
+	~PermissionCache()
+	{
+		registry.removeListener(this);
+		destroyTable(table.load());
+	}
+
+	/**
+	Retreives the capability bitset of the staff wearing the given bracelet, or 0 if the bracelet does not belong to any staff.
+	*/
+	unsigned int getCapabilities(unsigned long bracelet_id)
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		Table* t = table.load(memory_order_acquire);
+		for (size_t i = slotOf(t, bracelet_id);; i = (i + 1) & t->mask)
+		{
+			unsigned long key = t->slots[i].bracelet_id.load(memory_order_acquire);
+			if (key == bracelet_id)
+				return t->slots[i].capabilities.load(memory_order_relaxed);
+			if (key == 0)
+				return 0;
+		}
+	}
+
+	/**
+	Returns whether the staff wearing the given bracelet holds every capability in "required", a bitwise OR of Staff::Capability values.
+	*/
+	bool authorize(unsigned long bracelet_id, unsigned int required)
+	{
+		return (getCapabilities(bracelet_id) & required) == required;
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Replaces the cached capabilities of a staff whenever a new version of it is published.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		if (old_version != NULL && old_version->getMemberType() == Member::Type::STAFF
+			&& (old_version->getBraceletID() != new_version->getBraceletID() || new_version->getMemberType() != Member::Type::STAFF))
+			store(old_version->getBraceletID(), 0);
+
+		if (new_version->getMemberType() == Member::Type::STAFF)
+			store(new_version->getBraceletID(), ((Staff*)new_version)->getCapabilities());
+	}
+
+	/**
+	Revokes every capability of a staff removed from the registry.
+	*/
+	void onRemove(Member* old_version)
+	{
+		if (old_version->getMemberType() == Member::Type::STAFF)
+			store(old_version->getBraceletID(), 0);
+	}
+
+private:
+	MemberRegistry& registry;
+	atomic<Table*> table;
+
+	static size_t slotOf(Table* t, unsigned long bracelet_id)
+	{
+		unsigned long long h = (unsigned long long)bracelet_id * 11400714819323198485ull;
+		return (size_t)(h >> 32) & t->mask;
+	}
+
+	static Table* createTable(size_t slot_count)
+	{
+		Table* t = new Table();
+		t->mask = slot_count - 1;
+		t->used = 0;
+		t->slots = new Slot[slot_count];
+		MemoryStats::instance().allocated(MemoryStats::PERMISSION_CACHE, sizeof(Table) + slot_count * sizeof(Slot));
+		for (size_t i = 0; i < slot_count; i++)
+		{
+			t->slots[i].bracelet_id.store(0);
+			t->slots[i].capabilities.store(0);
+		}
+		return t;
+	}
+
+	static void destroyTable(Table* t)
+	{
+		MemoryStats::instance().freed(MemoryStats::PERMISSION_CACHE, sizeof(Table) + (t->mask + 1) * sizeof(Slot));
+		delete[] t->slots;
+		delete t;
+	}
+
+	static void destroyTableObject(void* object) { destroyTable((Table*)object); }
+
+	/*Writer side, only called from listener notifications, which the registry never makes concurrently*/
+	void store(unsigned long bracelet_id, unsigned int capabilities)
+	{
+		if (bracelet_id == 0)
+			return;
+
+		Table* t = table.load();
+		size_t i = slotOf(t, bracelet_id);
+		for (;; i = (i + 1) & t->mask)
+		{
+			unsigned long key = t->slots[i].bracelet_id.load();
+			if (key == bracelet_id)
+			{
+				t->slots[i].capabilities.store(capabilities, memory_order_release);
+				return;
+			}
+			if (key == 0)
+				break;
+		}
+
+		/*Revoking a bracelet that was never cached needs no slot*/
+		if (capabilities == 0)
+			return;
+
+		/*Keep the table at most half full so probe sequences stay short*/
+		if ((t->used + 1) * 2 > t->mask + 1)
+		{
+			grow();
+			store(bracelet_id, capabilities);
+			return;
+		}
+
+		t->slots[i].capabilities.store(capabilities, memory_order_relaxed);
+		t->slots[i].bracelet_id.store(bracelet_id, memory_order_release);
+		t->used++;
+	}
+
+	/*Copies every live entry into a table sized for them, at most a quarter full, so a cache whose slots are mostly
+	revoked entries is rebuilt at the same size or smaller rather than doubled. Revoked entries are dropped*/
+	void grow()
+	{
+		Table* old_table = table.load();
+		size_t live = 0;
+		for (size_t i = 0; i <= old_table->mask; i++)
+		{
+			if (old_table->slots[i].bracelet_id.load() != 0 && old_table->slots[i].capabilities.load() != 0)
+				live++;
+		}
+
+		size_t slot_count = 256;
+		while (slot_count < (live + 1) * 4)
+			slot_count *= 2;
+		Table* new_table = createTable(slot_count);
+
+		for (size_t i = 0; i <= old_table->mask; i++)
+		{
+			unsigned long key = old_table->slots[i].bracelet_id.load();
+			unsigned int capabilities = old_table->slots[i].capabilities.load();
+			if (key == 0 || capabilities == 0)
+				continue;
+
+			size_t j = slotOf(new_table, key);
+			while (new_table->slots[j].bracelet_id.load() != 0)
+				j = (j + 1) & new_table->mask;
+
+			new_table->slots[j].capabilities.store(capabilities);
+			new_table->slots[j].bracelet_id.store(key);
+			new_table->used++;
+		}
+
+		table.store(new_table, memory_order_release);
+		registry.retireFromListener(old_table, destroyTableObject);
+	}
+
+	PermissionCache(const PermissionCache&);
+	PermissionCache& operator=(const PermissionCache&);
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FileBackend.h"
+#include "Member.h"
+#include "MemoryStats.h"
+#include "TraceSpans.h"
+
+using namespace std;
+
+/**
+The PersistenceQueue class saves members to their per-member files on a dedicated writer thread,
+so that callers such as kiosk UI threads never block on file I/O.
+
+save() takes a copy of the member and returns at once with a completion token that becomes ready once the file is written.
+Saving a member again while its previous save is still queued replaces the queued copy instead of queueing a second write,
+and both callers get the same token. The writer takes every queued save at once, up to MAX_BATCH, and writes them as one batch.
+
+Files are written in the same format as Member::serialize(), so Member::deserialize() reads them back.
+Batches are written with fstreams on the writer thread, or handed whole to a FileBackend if one is given.
+flush() blocks until every save queued before it has been written, and the destructor flushes before stopping the writer.
+*/
+class PersistenceQueue
+{
+private:
+
+	/*One queued save. "ticket" orders entries, so the writer can report how far it has got*/
+	struct Entry
+	{
+		string file_name;
+		Member* member;
+		unsigned long long ticket;
+		promise<bool> done;
+		shared_future<bool> token;
+		vector<function<void(bool)> > callbacks;
+	};
+
+public:
+
+	static const size_t MAX_BATCH = 256;
+
+	/**
+	Constructor for PersistenceQueue. Starts the writer thread, which writes batches through "backend" unless it is NULL.
+	The backend must outlive the queue, and is only used from the writer thread.
+	*/
+	PersistenceQueue(FileBackend* backend = NULL) : backend(backend)
+	{
+		stopping = false;
+		next_ticket = 1;
+		written_ticket = 0;
+		saves_coalesced = 0;
+		batches_written = 0;
+		files_written = 0;
+		writer = thread(&PersistenceQueue::writerLoop, this);
+	}
+
+	/**
+	Destructor for PersistenceQueue. Writes every queued save, then stops the writer thread.
+	*/
+	~PersistenceQueue()
+	{
+		{
+			lock_guard<mutex> lock(queue_lock);
+			stopping = true;
+		}
+		queue_ready.notify_all();
+		writer.join();
+	}
+
+	/**
+	Queues a copy of "member" to be written to "file_name", and returns a token that becomes true once it is written,
+	or false if the file could not be written. The member can be changed or deleted as soon as save() returns.
+	*/
+	shared_future<bool> save(Member* member, string file_name)
+	{
+		return save(member, file_name, function<void(bool)>());
+	}
+
+	/**
+	Same as save(), but also calls "on_written" with the result once the file is written, instead of the caller having to wait.
+	It is called on the writer thread, so it should only hand the result on, e.g. to an executor, rather than do any real work.
+	*/
+	shared_future<bool> save(Member* member, string file_name, function<void(bool)> on_written)
+	{
+		Member* copy = member->clone();
+
+		lock_guard<mutex> lock(queue_lock);
+		map<string, Entry*>::iterator queued = by_file.find(file_name);
+		if (queued != by_file.end())
+		{
+			/*Still waiting for the writer, so only the newest copy needs writing*/
+			delete queued->second->member;
+			queued->second->member = copy;
+			if (on_written)
+				queued->second->callbacks.push_back(on_written);
+			saves_coalesced++;
+			return queued->second->token;
+		}
+
+		Entry* entry = new Entry();
+		entry->file_name = file_name;
+		entry->member = copy;
+		entry->ticket = next_ticket++;
+		entry->token = entry->done.get_future().share();
+		if (on_written)
+			entry->callbacks.push_back(on_written);
+		pending.push_back(entry);
+		by_file[file_name] = entry;
+
+		queue_ready.notify_one();
+		return entry->token;
+	}
+
+	/**
+	Blocks until every save queued before the call has been written.
+	*/
+	void flush()
+	{
+		unique_lock<mutex> lock(queue_lock);
+		unsigned long long target = next_ticket - 1;
+		while (written_ticket < target)
+			batch_written.wait(lock);
+	}
+
+	/**
+	Retreives the number of saves that were merged into an already queued save of the same file.
+	*/
+	unsigned long long getSavesCoalesced()
+	{
+		lock_guard<mutex> lock(queue_lock);
+		return saves_coalesced;
+	}
+
+	/**
+	Retreives the number of batches the writer thread has written.
+	*/
+	unsigned long long getBatchesWritten()
+	{
+		lock_guard<mutex> lock(queue_lock);
+		return batches_written;
+	}
+
+	/**
+	Retreives the number of files the writer thread has written.
+	*/
+	unsigned long long getFilesWritten()
+	{
+		lock_guard<mutex> lock(queue_lock);
+		return files_written;
+	}
+
+private:
+	FileBackend* backend;
+	thread writer;
+	mutex queue_lock;
+	condition_variable queue_ready;
+	condition_variable batch_written;
+	bool stopping;
+
+	/*Queued saves in ticket order, and the same entries by file name for coalescing*/
+	list<Entry*> pending;
+	map<string, Entry*> by_file;
+
+	unsigned long long next_ticket;
+	unsigned long long written_ticket;
+	unsigned long long saves_coalesced;
+	unsigned long long batches_written;
+	unsigned long long files_written;
+
+	void writerLoop()
+	{
+		for (;;)
+		{
+			vector<Entry*> batch;
+			{
+				unique_lock<mutex> lock(queue_lock);
+				while (!stopping && pending.empty())
+					queue_ready.wait(lock);
+
+				if (pending.empty())
+					return;
+
+				/*Once taken off "by_file", a later save of the same file queues a new entry instead of changing this one*/
+				while (!pending.empty() && batch.size() < MAX_BATCH)
+				{
+					batch.push_back(pending.front());
+					by_file.erase(pending.front()->file_name);
+					pending.pop_front();
+				}
+			}
+
+			writeBatch(batch);
+			for (size_t i = 0; i < batch.size(); i++)
+			{
+				for (size_t c = 0; c < batch[i]->callbacks.size(); c++)
+					batch[i]->callbacks[c](batch[i]->token.get());
+			}
+
+			{
+				lock_guard<mutex> lock(queue_lock);
+				written_ticket = batch.back()->ticket;
+				batches_written++;
+				files_written += batch.size();
+			}
+			batch_written.notify_all();
+
+			for (size_t i = 0; i < batch.size(); i++)
+				delete batch[i];
+		}
+	}
+
+	/*Encodes the whole batch first, then writes the files back to back*/
+	void writeBatch(vector<Entry*>& batch)
+	{
+		vector<string> data(batch.size());
+		{
+			TraceSpan span("persist.encode", "save");
+			for (size_t i = 0; i < batch.size(); i++)
+			{
+				seng330a2::Member m;
+				batch[i]->member->toProto(m);
+				m.SerializeToString(&data[i]);
+				delete batch[i]->member;
+				batch[i]->member = NULL;
+			}
+		}
+
+		size_t data_bytes = 0;
+		for (size_t i = 0; i < data.size(); i++)
+			data_bytes += data[i].size();
+		MemoryCharge<MemoryStats::PERSISTENCE_BUFFERS> data_charge(data_bytes);
+
+		TraceSpan span("persist.write", "save");
+		if (backend != NULL)
+		{
+			vector<string> file_names(batch.size());
+			for (size_t i = 0; i < batch.size(); i++)
+				file_names[i] = batch[i]->file_name;
+
+			vector<char> ok;
+			backend->writeFiles(file_names, data, ok);
+			for (size_t i = 0; i < batch.size(); i++)
+				batch[i]->done.set_value(ok[i] != 0);
+			return;
+		}
+
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			fstream output(batch[i]->file_name, ios::out | ios::trunc | ios::binary);
+			output.write(data[i].data(), data[i].size());
+			output.close();
+			batch[i]->done.set_value(!output.fail());
+		}
+	}
+
+	PersistenceQueue(const PersistenceQueue&);
+	PersistenceQueue& operator=(const PersistenceQueue&);
+};
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemberSnapshot.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/**
+The PopulationOptions struct configures the members made by a PopulationGenerator. Its constructor fills in realistic defaults.
+
+Names are a first name and a last name, each picked uniformly. Addresses are picked from "address_count" distinct addresses
+with a Zipfian skew of "address_skew", so a few addresses are shared by many members (families, dorms) and most by one or two.
+Subscription levels and staff clearances are picked with the given relative weights, and gym credits uniformly
+between 0 and the level's "max_credits".
+*/
+struct PopulationOptions
+{
+	unsigned long long seed;
+	double staff_fraction;
+	vector<string> first_names;
+	vector<string> last_names;
+	vector<string> streets;
+	size_t address_count;
+	double address_skew;
+	double level_weights[4];
+	int max_credits[4];
+	double clearance_weights[3];
+	unsigned long first_membership_id;
+	unsigned long first_bracelet_id;
+
+	PopulationOptions()
+	{
+		seed = 330;
+		staff_fraction = 0.02;
+
+		const char* firsts[] = { "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda", "William", "Elizabeth",
+			"David", "Barbara", "Richard", "Susan", "Joseph", "Jessica", "Thomas", "Sarah", "Wei", "Priya", "Mohammed", "Aiko", "Olga", "Mateo" };
+		const char* lasts[] = { "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis", "Rodriguez", "Martinez",
+			"Hernandez", "Lopez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore", "Jackson", "Martin", "Lee", "Nguyen", "Chen", "Patel", "Kim" };
+		const char* street_names[] = { "Maple Rd", "Oak St", "Finnerty Rd", "Shelbourne St", "Cedar Hill Rd", "Fort St", "Yates St",
+			"Douglas St", "Cook St", "Richmond Rd", "Foul Bay Rd", "Henderson Rd", "McKenzie Ave", "Gordon Head Rd", "Dallas Rd", "Blanshard St" };
+		first_names.assign(firsts, firsts + sizeof(firsts) / sizeof(firsts[0]));
+		last_names.assign(lasts, lasts + sizeof(lasts) / sizeof(lasts[0]));
+		streets.assign(street_names, street_names + sizeof(street_names) / sizeof(street_names[0]));
+
+		address_count = 100000;
+		address_skew = 1.0;
+
+		/*INACTIVE, BASIC, PREMIUM, DELUXE*/
+		level_weights[0] = 10;
+		level_weights[1] = 50;
+		level_weights[2] = 30;
+		level_weights[3] = 10;
+		max_credits[0] = 0;
+		max_credits[1] = 20;
+		max_credits[2] = 50;
+		max_credits[3] = 100;
+
+		/*GENERAL, MANAGER, ADMINISTRATOR*/
+		clearance_weights[0] = 80;
+		clearance_weights[1] = 15;
+		clearance_weights[2] = 5;
+
+		first_membership_id = 1;
+		first_bracelet_id = 1000000;
+	}
+};
+
+/**
+The PopulationGenerator class makes large, realistic and reproducible sets of Customers and Staff through a MemberFactory,
+so that benchmarks and load tests start from the same data every time.
+
+Member i (counting from 0) always comes out the same for the same options, whatever the thread count or chunking,
+since all of its random choices come from a generator seeded with the options' seed and i.
+It gets membership ID first_membership_id + i and bracelet ID first_bracelet_id + i.
+*/
+class PopulationGenerator
+{
+public:
+
+	static const size_t CHUNK_SIZE = 65536;
+
+	/**
+	Constructor for PopulationGenerator.
+	*/
+	PopulationGenerator(const PopulationOptions& options) : options(options)
+	{
+		/*Cumulative Zipf weights of the addresses, searched with a random point in [0, total)*/
+		address_cdf.resize(max((size_t)1, options.address_count));
+		double total = 0;
+		for (size_t r = 0; r < address_cdf.size(); r++)
+		{
+			total += 1.0 / pow((double)(r + 1), options.address_skew);
+			address_cdf[r] = total;
+		}
+	}
+
+	/**
+	Makes member number "index". The caller owns the returned member.
+	*/
+	Member* generate(size_t index)
+	{
+		Random random(options.seed, index);
+		Member* member;
+
+		if (random.nextDouble() < options.staff_fraction)
+		{
+			Staff* s = factory.getStaff();
+			s->setEmployeeID((unsigned long)(10000 + index));
+			s->setStaffClearance((Staff::Clearance)pick(random, options.clearance_weights, 3));
+			member = s;
+		}
+		else
+		{
+			Customer* c = factory.getCustomer();
+			int level = pick(random, options.level_weights, 4);
+			c->setSubscriptionLevel((Customer::SubscriptionLevel)level);
+			c->restoreGymCredits((int)(random.next() % (unsigned long long)(options.max_credits[level] + 1)));
+			c->setCreditCard(creditCardNumber(random));
+			member = c;
+		}
+
+		member->setName(options.first_names[random.next() % options.first_names.size()] + " "
+			+ options.last_names[random.next() % options.last_names.size()]);
+		member->setAddress(address(random));
+		member->setMembershipID(options.first_membership_id + (unsigned long)index);
+		member->setBraceletID(options.first_bracelet_id + (unsigned long)index);
+		member->clearDirtyFields();
+		return member;
+	}
+
+	/**
+	Makes members [first, first + count) into "members", replacing its contents, using "pool" if it is not NULL.
+	The caller owns the new members.
+	*/
+	void generate(size_t first, size_t count, vector<Member*>& members, ThreadPool* pool)
+	{
+		members.assign(count, (Member*)NULL);
+		size_t chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		function<void(size_t)> body = [&](size_t chunk)
+		{
+			size_t end = min(count, (chunk + 1) * CHUNK_SIZE);
+			for (size_t i = chunk * CHUNK_SIZE; i < end; i++)
+				members[i] = generate(first + i);
+		};
+
+		if (pool != NULL)
+			pool->parallelFor(chunks, body);
+		else
+		{
+			for (size_t chunk = 0; chunk < chunks; chunk++)
+				body(chunk);
+		}
+	}
+
+	/**
+	Makes "count" members and publishes them straight into "registry", a chunk at a time, using "pool" if it is not NULL.
+	*/
+	void generateInto(MemberRegistry& registry, size_t count, ThreadPool* pool)
+	{
+		size_t chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		function<void(size_t)> body = [&](size_t chunk)
+		{
+			size_t first = chunk * CHUNK_SIZE;
+			vector<Member*> members(min((size_t)CHUNK_SIZE, count - first));
+			for (size_t i = 0; i < members.size(); i++)
+				members[i] = generate(first + i);
+			registry.publishBatch(members);
+		};
+
+		if (pool != NULL)
+			pool->parallelFor(chunks, body);
+		else
+		{
+			for (size_t chunk = 0; chunk < chunks; chunk++)
+				body(chunk);
+		}
+	}
+
+	/**
+	Makes "count" members and saves them as a snapshot file with the given codec, using "pool" if it is not NULL.
+	Returns false if the file could not be written.
+	*/
+	bool generateSnapshot(string file_name, size_t count, MemberSnapshot::Codec codec, ThreadPool* pool)
+	{
+		vector<Member*> members;
+		generate(0, count, members, pool);
+		bool saved = MemberSnapshot::save(file_name, members, codec);
+
+		for (size_t i = 0; i < members.size(); i++)
+			delete members[i];
+		return saved;
+	}
+
+private:
+	PopulationOptions options;
+	MemberFactory factory;
+	vector<double> address_cdf;
+
+	/*SplitMix64. The seed and member index are mixed before use, so neighbouring seeds or indexes give unrelated sequences*/
+	struct Random
+	{
+		unsigned long long state;
+
+		Random(unsigned long long seed, size_t index)
+		{
+			state = mix(mix(seed) ^ ((unsigned long long)index * 0xD1B54A32D192ED03ull));
+		}
+
+		unsigned long long next()
+		{
+			return mix(state += 0x9E3779B97F4A7C15ull);
+		}
+
+		static unsigned long long mix(unsigned long long z)
+		{
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		double nextDouble()
+		{
+			return (next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+	};
+
+	static int pick(Random& random, const double* weights, int count)
+	{
+		double total = 0;
+		for (int i = 0; i < count; i++)
+			total += weights[i];
+
+		double point = random.nextDouble() * total;
+		for (int i = 0; i < count - 1; i++)
+		{
+			if (point < weights[i])
+				return i;
+			point -= weights[i];
+		}
+		return count - 1;
+	}
+
+	/*Each address rank maps to its own house number and street, so members share an address exactly when they share a rank*/
+	string address(Random& random)
+	{
+		double point = random.nextDouble() * address_cdf.back();
+		size_t rank = upper_bound(address_cdf.begin(), address_cdf.end(), point) - address_cdf.begin();
+		rank = min(rank, address_cdf.size() - 1);
+
+		size_t streets = options.streets.size();
+		return to_string(rank / streets + 1) + " " + options.streets[rank % streets];
+	}
+
+	/*16 digits where unsigned long is 64 bits, 9 digits where it is only 32*/
+	static unsigned long creditCardNumber(Random& random)
+	{
+		if (sizeof(unsigned long) >= 8)
+			return (unsigned long)(4000000000000000ull + random.next() % 1000000000000000ull);
+		return (unsigned long)(400000000ull + random.next() % 100000000ull);
+	}
+
+	PopulationGenerator(const PopulationGenerator&);
+	PopulationGenerator& operator=(const PopulationGenerator&);
+};
@@ -1,625 +1,2971 @@
 #include "stdafx.h"  
 #include <iostream>
-#include <fstream>
+#include <chrono>
+#include <thread>
 #include "gtest/gtest.h"
-#include "seng330a2.pb.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "ThreadPool.h"
+#include "BillingEngine.h"
+#include "PermissionCache.h"
+#include "BraceletReaderService.h"
+#include "MemberSnapshot.h"
+#include "BlockCompression.h"
+#include "DeltaLog.h"
+#include "FileBackend.h"
+#include "PersistenceQueue.h"
+#include "AsyncMemberStore.h"
+#include "UsageSeriesStore.h"
+#include "ZoneOccupancy.h"
+#include "PopulationGenerator.h"
+#include "TapTrace.h"
+#include "LatencyHistogram.h"
+#include "MetricsExporter.h"
+#include "TraceSpans.h"
+#include "MemoryStats.h"
+#include "BraceletFilter.h"
+#include "ByteOrder.h"
+#include "CacheAligned.h"
+#include "BraceletIndex.h"
+#include "StaffDirectory.h"
+#include "CreditIndex.h"
+#include "HeavyHitters.h"
+#include "DistinctVisitors.h"
+#include "RetentionAnalysis.h"
+#include <unordered_map>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
 
 
 
 using namespace std;
 
-/**
-*	This is the Member base class. It represents all the common data all members of a gym have.
-Number of basic functions are included allowing setting and retrieving data for a member type.
-Currently, there are two types of Members: CUSTOMER and STAFF. This is represented using enum Type.
+int main(int argc, char** argv)
+{
+	/*Test stuff*/
+	testing::InitGoogleTest(&argc, argv);
+	RUN_ALL_TESTS();
 
-Any subclass of member must implement a print, clone, and serialize function.
-The print() function simply prints out any data associated with that specific member to the console.
-The clone() function returns a copy of itself, used by the prototype pattern
-The serialize() function turns the data associated with a member into a structured form to be stored in a file.
-*/
+	/*Use as a pause*/
+	getchar(); 
+}
+
+/*Test macros for gtest*/
 
-class Member
+/*Testing publishing, updating and removing members in the MemberRegistry*/
+TEST(test_registry_case1, test_registry)
 {
-public:
+	MemberFactory member_factory;
+	MemberRegistry registry;
+
+	Customer* c = member_factory.getCustomer();
+	c->initialize("John Doe", "123 Maple Rd", 123456789, 987654321, Customer::SubscriptionLevel::BASIC);
+	c->setMembershipID(1);
+	registry.publish(c);
 
-	enum Type { CUSTOMER, STAFF };
+	Staff* s = member_factory.getStaff();
+	s->initialize("Mary Janes", "420 Dank Hill", 2214356879, 87654321, Staff::Clearance::MANAGER);
+	s->setMembershipID(2);
+	registry.publish(s);
 
-	/*Pure virtual functions to be implemented by derived classes*/
+	EXPECT_EQ(2, registry.size());
 
-	/**
-	Prints out all information related to this member into the console
-	*/
-	virtual void print(void) = 0;
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		EXPECT_EQ(c, guard.findByMembershipID(1));
+		EXPECT_EQ(c, guard.findByBraceletID(987654321));
+		EXPECT_EQ(s, guard.findByBraceletID(87654321));
+		EXPECT_EQ(NULL, guard.findByBraceletID(1111));
+	}
 
-	/**
-	Clones and returns another instance of the current Member.
-	*/
-	virtual Member* clone() = 0;
+	/*Check that an update publishes a new version and moves the bracelet*/
+	MemberRegistry::ReadGuard old_guard(registry);
+	Member* old_version = old_guard.findByMembershipID(1);
 
-	/**
-	Serializes the current Member object into a readable structure for file storage.
-	*/
-	virtual void serialize(string file_name) = 0;
+	EXPECT_TRUE(registry.update(1, [](Member* m) { ((Customer*)m)->deductGymCredits(5); m->setBraceletID(555); }));
+	EXPECT_FALSE(registry.update(3, [](Member*) {}));
 
-	/**
-	Reads a structured serialized file and returns an appropriate member object from it
-	*/
-	virtual Member* deserialize(string file_name) = 0;
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		Customer* latest = (Customer*)guard.findByBraceletID(555);
+		ASSERT_TRUE(latest != NULL);
+		EXPECT_NE(old_version, latest);
+		EXPECT_EQ(15, latest->getGymCredits());
+		EXPECT_EQ(NULL, guard.findByBraceletID(987654321));
+	}
+
+	/*The old version is still readable by the guard that found it*/
+	registry.reclaim();
+	EXPECT_EQ(20, ((Customer*)old_version)->getGymCredits());
+
+	/*Check removal*/
+	EXPECT_TRUE(registry.remove(2));
+	EXPECT_FALSE(registry.remove(2));
+	EXPECT_EQ(1, registry.size());
+
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(NULL, guard.findByMembershipID(2));
+	EXPECT_EQ(NULL, guard.findByBraceletID(87654321));
+}
+
+/*Testing that readers always see a consistent member while writers keep publishing*/
+TEST(test_registry_case2, test_registry)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+
+	for (unsigned long i = 1; i <= 100; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i + 1000);
+		c->setCreditCard(0);
+		registry.publish(c);
+	}
 
-	/*Other functions shared by all derived classes*/
+	/*Writers keep credits and credit card number equal, so any reader seeing them differ has seen a torn update*/
+	atomic<bool> done(false);
+	atomic<int> torn(0);
+	vector<thread> readers;
+	for (int t = 0; t < 4; t++)
+	{
+		readers.push_back(thread([&]()
+		{
+			while (!done.load())
+			{
+				MemberRegistry::ReadGuard guard(registry);
+				for (unsigned long i = 1; i <= 100; i++)
+				{
+					Customer* c = (Customer*)guard.findByBraceletID(i + 1000);
+					if (c == NULL || (unsigned long)c->getGymCredits() != 20 + c->getCreditCard())
+						torn++;
+				}
+			}
+		}));
+	}
 
-	/**
-	Sets the current member's full name.
-	*/
-	void setName(string name)
+	for (int round = 0; round < 100; round++)
 	{
-		this->name = name;
+		for (unsigned long i = 1; i <= 100; i++)
+			registry.update(i, [](Member* m) { ((Customer*)m)->addGymCredits(1); ((Customer*)m)->setCreditCard(((Customer*)m)->getCreditCard() + 1); });
 	}
 
-	/**
-	Sets the current member's address.
-	*/
-	void setAddress(string address)
+	/*Bulk import while readers are running, forcing the indexes to grow*/
+	vector<Member*> batch;
+	for (unsigned long i = 101; i <= 20000; i++)
 	{
-		this->address = address;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i + 1000);
+		c->setCreditCard(0);
+		batch.push_back(c);
 	}
+	registry.publishBatch(batch);
+
+	done = true;
+	for (size_t t = 0; t < readers.size(); t++)
+		readers[t].join();
+
+	EXPECT_EQ(0, torn.load());
+	EXPECT_EQ(20000, registry.size());
+
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(120, ((Customer*)guard.findByMembershipID(50))->getGymCredits());
+}
 
-	/**
-	Sets the current member's member type. This function should not be called again after initial construction for security reasons.
-	*/
-	void setMemberType(Type member_type)
+/*Benchmark: turnstile lookup latency while a 1M member import is running. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_registry, DISABLED_bench_registry_import)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+
+	for (unsigned long i = 1; i <= 1000; i++)
 	{
-		this->member_type = member_type;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		registry.publish(c);
 	}
 
-	/**
-	Sets the current member's gym membership ID explicitly instead of using the randomly generated one.
-	*/
-	void setMembershipID(unsigned long membership_id)
+	/*Measures the slowest of 100000 single lookups*/
+	auto measure = [&]()
 	{
-		this->membership_id = membership_id;
+		long long worst = 0;
+		for (unsigned long i = 0; i < 100000; i++)
+		{
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			{
+				MemberRegistry::ReadGuard guard(registry);
+				guard.findByBraceletID(i % 1000 + 1);
+			}
+			long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - start).count();
+			worst = max(worst, ns);
+		}
+		return worst;
+	};
+
+	long long idle = measure();
+
+	thread importer([&]()
+	{
+		vector<Member*> batch;
+		for (unsigned long i = 1001; i <= 1000000; i++)
+		{
+			Customer* c = member_factory.getCustomer();
+			c->setMembershipID(i);
+			c->setBraceletID(i);
+			batch.push_back(c);
+		}
+		registry.publishBatch(batch);
+	});
+	long long busy = measure();
+	importer.join();
+
+	cout << "Worst lookup idle: " << idle << "ns, during import: " << busy << "ns" << endl;
+	EXPECT_EQ(1000000, registry.size());
+}
+
+/*Testing a complete monthly billing run, and that billing the same period again does nothing*/
+TEST(test_billing_case1, test_billing)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	ThreadPool pool(4);
+
+	for (unsigned long i = 1; i <= 10000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		c->setCreditCard(i);
+		c->setSubscriptionLevel((Customer::SubscriptionLevel)(i % 4));
+		registry.publish(c);
 	}
 
-	/**
-	Sets the current member's bracelet ID used to interact with machines.
-	*/
-	void setBraceletID(unsigned long bracelet_id)
+	Staff* s = member_factory.getStaff();
+	s->setMembershipID(10001);
+	s->setBraceletID(10001);
+	registry.publish(s);
+
+	remove("billing_test.checkpoint");
+	remove("billing_test.charges");
+
+	BillingEngine billing(registry, pool);
+	EXPECT_TRUE(billing.run("2015-11", "billing_test.checkpoint", "billing_test.charges"));
+	EXPECT_EQ(7500, billing.getCustomersBilled());
+	EXPECT_EQ(2500LL * (2999 + 4999 + 7999), billing.getAmountCharged());
+
 	{
-		this->bracelet_id = bracelet_id;
+		MemberRegistry::ReadGuard guard(registry);
+		EXPECT_EQ(20, ((Customer*)guard.findByMembershipID(4))->getGymCredits());
+		EXPECT_EQ(40, ((Customer*)guard.findByMembershipID(5))->getGymCredits());
+		EXPECT_EQ(70, ((Customer*)guard.findByMembershipID(6))->getGymCredits());
+		EXPECT_EQ(120, ((Customer*)guard.findByMembershipID(7))->getGymCredits());
 	}
 
-	/**
-	Retreives the current member's full name as a string.
-	*/
-	string getName()
+	/*One charge line per billed customer*/
+	fstream charges("billing_test.charges", ios::in);
+	string line;
+	int lines = 0;
+	while (getline(charges, line))
+		lines++;
+	EXPECT_EQ(7500, lines);
+
+	/*The period has been billed already*/
+	EXPECT_TRUE(billing.run("2015-11", "billing_test.checkpoint", ""));
+	EXPECT_EQ(0, billing.getCustomersBilled());
+
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(40, ((Customer*)guard.findByMembershipID(5))->getGymCredits());
+
+	remove("billing_test.checkpoint");
+	remove("billing_test.charges");
+}
+
+/*Testing that an interrupted billing run resumes with only the unfinished chunks*/
+TEST(test_billing_case2, test_billing)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	ThreadPool pool(4);
+
+	for (unsigned long i = 1; i <= 10000; i++)
 	{
-		return name;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		c->setSubscriptionLevel(Customer::SubscriptionLevel::BASIC);
+		registry.publish(c);
 	}
 
-	/**
-	Retreives the current member's address as a string.
-	*/
-	string getAddress()
+	/*Checkpoint left behind by a run that finished chunk 1 (IDs 4097 to 8192) and was then interrupted*/
+	fstream checkpoint("billing_test.checkpoint", ios::out | ios::trunc);
+	checkpoint << "BILLING 2015-12 3\n0\n4097\n8193\nDONE 1\n";
+	checkpoint.close();
+
+	BillingEngine billing(registry, pool);
+	EXPECT_TRUE(billing.run("2015-12", "billing_test.checkpoint", ""));
+	EXPECT_EQ(10000 - 4096, billing.getCustomersBilled());
+
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(40, ((Customer*)guard.findByMembershipID(1))->getGymCredits());
+	EXPECT_EQ(20, ((Customer*)guard.findByMembershipID(5000))->getGymCredits());
+	EXPECT_EQ(40, ((Customer*)guard.findByMembershipID(9000))->getGymCredits());
+
+	remove("billing_test.checkpoint");
+}
+
+/*Testing that a chunk a crashed run may have billed in part is reported instead of billed twice*/
+TEST(test_billing_case3, test_billing)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	ThreadPool pool(4);
+
+	for (unsigned long i = 1; i <= 10000; i++)
 	{
-		return address;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		c->setCreditCard(4000000000ul + i);
+		c->setSubscriptionLevel(Customer::SubscriptionLevel::BASIC);
+		registry.publish(c);
 	}
 
-	/**
-	Retreives the current member's gym membership ID as an unsigned long.
-	*/
-	unsigned long getMembershipID()
+	/*Checkpoint left behind by a run that crashed while billing chunk 0, after finishing chunk 1*/
+	fstream checkpoint("billing_test.checkpoint", ios::out | ios::trunc);
+	checkpoint << "BILLING 2016-01 3\n0\n4097\n8193\nBEGIN 1\nBEGIN 0\nDONE 1\n";
+	checkpoint.close();
+	remove("billing_test.charges");
+
+	/*Chunk 0 may have been billed in part, so it is reported rather than billed again*/
+	BillingEngine billing(registry, pool);
+	EXPECT_TRUE(billing.run("2016-01", "billing_test.checkpoint", "billing_test.charges"));
+	EXPECT_EQ(10000 - 8192, billing.getCustomersBilled());
+	ASSERT_EQ(1, billing.getChunksInDoubt().size());
+	EXPECT_EQ(0, billing.getChunksInDoubt()[0]);
 	{
-		return membership_id;
+		MemberRegistry::ReadGuard guard(registry);
+		EXPECT_EQ(20, ((Customer*)guard.findByMembershipID(1))->getGymCredits());
+		EXPECT_EQ(20, ((Customer*)guard.findByMembershipID(5000))->getGymCredits());
+		EXPECT_EQ(40, ((Customer*)guard.findByMembershipID(9000))->getGymCredits());
 	}
 
-	/**
-	Retreives the current member's gym bracelet ID as an unsigned long.
-	*/
-	unsigned long getBraceletID()
+	/*Charge records carry the whole credit card number*/
+	fstream charges("billing_test.charges", ios::in);
+	string line;
+	ASSERT_TRUE((bool)getline(charges, line));
+	EXPECT_EQ("8193,4000008193,1,2999,20", line);
+	charges.close();
+
+	/*Running again bills nothing more, and still reports the chunk in doubt*/
+	EXPECT_TRUE(billing.run("2016-01", "billing_test.checkpoint", ""));
+	EXPECT_EQ(0, billing.getCustomersBilled());
+	EXPECT_EQ(1, billing.getChunksInDoubt().size());
+
+	remove("billing_test.checkpoint");
+	remove("billing_test.charges");
+}
+
+/*Benchmark: billing run over 10M customers. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_billing, DISABLED_bench_billing_10m)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	ThreadPool pool;
+
+	vector<Member*> batch;
+	for (unsigned long i = 1; i <= 10000000; i++)
 	{
-		return bracelet_id;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		c->setSubscriptionLevel((Customer::SubscriptionLevel)(1 + i % 3));
+		batch.push_back(c);
 	}
+	registry.publishBatch(batch);
+
+	remove("billing_bench.checkpoint");
+	BillingEngine billing(registry, pool);
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	EXPECT_TRUE(billing.run("2015-11", "billing_bench.checkpoint", "billing_bench.charges"));
+	long long ms = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
 
-	/**
-	Returns what type of member this is.
-	*/
-	Type getMemberType()
+	cout << "Billed " << billing.getCustomersBilled() << " customers on " << pool.size() << " threads in " << ms << "ms" << endl;
+	EXPECT_LT(ms, 60000);
+
+	remove("billing_bench.checkpoint");
+	remove("billing_bench.charges");
+}
+
+/*Testing staff capabilities and the bracelet permission cache*/
+TEST(test_permissions_case1, test_permissions)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+
+	Staff* manager = member_factory.getStaff();
+	manager->initialize("Mary Janes", "420 Dank Hill", 2214356879, 87654321, Staff::Clearance::MANAGER);
+	manager->setMembershipID(1);
+	EXPECT_TRUE(manager->hasCapabilities(Staff::Capability::OPEN_OFFICE | Staff::Capability::OPEN_TILL));
+	EXPECT_FALSE(manager->hasCapabilities(Staff::Capability::ADMIN_SCREENS));
+	registry.publish(manager);
+
+	/*The cache picks up staff published before it was created*/
+	long long cache_base = MemoryStats::instance().getUsage(MemoryStats::PERMISSION_CACHE).live_bytes;
+	PermissionCache permissions(registry);
+	EXPECT_TRUE(permissions.authorize(87654321, Staff::Capability::OPEN_TILL));
+	EXPECT_FALSE(permissions.authorize(87654321, Staff::Capability::ADMIN_SCREENS));
+
+	Customer* c = member_factory.getCustomer();
+	c->initialize("John Doe", "123 Maple Rd", 123456789, 987654321, Customer::SubscriptionLevel::BASIC);
+	c->setMembershipID(2);
+	registry.publish(c);
+	EXPECT_EQ(0, permissions.getCapabilities(987654321));
+	EXPECT_FALSE(permissions.authorize(987654321, Staff::Capability::OPEN_STAFF_ROOM));
+
+	/*Changing the clearance invalidates the cached capabilities*/
+	registry.update(1, [](Member* m) { ((Staff*)m)->setStaffClearance(Staff::Clearance::ADMINISTRATOR); });
+	EXPECT_TRUE(permissions.authorize(87654321, Staff::Capability::ADMIN_SCREENS));
+
+	registry.update(1, [](Member* m) { ((Staff*)m)->setStaffClearance(Staff::Clearance::GENERAL); });
+	EXPECT_TRUE(permissions.authorize(87654321, Staff::Capability::OPEN_STAFF_ROOM));
+	EXPECT_FALSE(permissions.authorize(87654321, Staff::Capability::OPEN_OFFICE));
+
+	/*A new bracelet moves the capabilities with it*/
+	registry.update(1, [](Member* m) { m->setBraceletID(555); });
+	EXPECT_EQ(0, permissions.getCapabilities(87654321));
+	EXPECT_EQ(Staff::capabilitiesOf(Staff::Clearance::GENERAL), permissions.getCapabilities(555));
+
+	/*Many staff force the cache to grow*/
+	for (unsigned long i = 10; i < 1010; i++)
 	{
-		return member_type;
+		Staff* s = member_factory.getStaff();
+		s->setMembershipID(i);
+		s->setBraceletID(i);
+		s->setStaffClearance(Staff::Clearance::MANAGER);
+		registry.publish(s);
 	}
+	EXPECT_TRUE(permissions.authorize(500, Staff::Capability::OPEN_TILL));
+	EXPECT_TRUE(permissions.authorize(555, Staff::Capability::OPEN_STAFF_ROOM));
+
+	/*Staff coming and going leave revoked slots behind. Rebuilding drops them, so the table stays sized for the staff
+	still there instead of doubling, and replaced tables are freed once no lookup can be reading them*/
+	atomic<bool> churning(true);
+	atomic<int> wrong(0);
+	thread reader([&]()
+	{
+		while (churning.load())
+		{
+			if (!permissions.authorize(500, Staff::Capability::OPEN_TILL))
+				wrong++;
+		}
+	});
+	for (unsigned long round = 0; round < 20; round++)
+	{
+		for (unsigned long i = 0; i < 1000; i++)
+		{
+			Staff* s = member_factory.getStaff();
+			s->setMembershipID(2000 + round * 1000 + i);
+			s->setBraceletID(2000 + round * 1000 + i);
+			s->setStaffClearance(Staff::Clearance::GENERAL);
+			registry.publish(s);
+		}
+		EXPECT_EQ(Staff::capabilitiesOf(Staff::Clearance::GENERAL), permissions.getCapabilities(2000 + round * 1000 + 999));
+		for (unsigned long i = 0; i < 1000; i++)
+			registry.remove(2000 + round * 1000 + i);
+	}
+	churning.store(false);
+	reader.join();
+	EXPECT_EQ(0, wrong.load());
+	EXPECT_EQ(0, permissions.getCapabilities(2999));
 
-private:
-	string name;
-	string address;
-	unsigned long membership_id;
-	unsigned long bracelet_id;
-	Member::Type member_type;
-};
+	registry.reclaim();
+	EXPECT_LE(MemoryStats::instance().getUsage(MemoryStats::PERMISSION_CACHE).live_bytes - cache_base, 8192 * 16 + 1024);
 
-/**
-The Customer class is a derived class of Members. It's used to represent a client of a gym.
-On top of the datas used in a Member type, a Customer needs to specify a credit card number (unsigned long credit_card_num),
-the amount of credits the customer has in his/her account (int gym_credit), and a membership tier the customer is paying.
-The membership tier is represented by a enum SubscriptionLevel, which can be INACTIVE, BASIC, PREMIUM, DELUXE.
+	registry.remove(1);
+	EXPECT_EQ(0, permissions.getCapabilities(555));
+}
 
-The Customer class requires to be manually initialized after construction, since the constructor does not take any arguments.
-Use the "intialize" function to fill in the data for the customer. Alternatively, each of the data fields can be set individually using individual set methods.
-*/
-class Customer : public Member
+#ifdef __linux__
+
+/*Testing admit/deny decisions from the bracelet reader service, with pipelined taps on several connections*/
+TEST(test_reader_service_case1, test_reader_service)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+
+	Customer* active = member_factory.getCustomer();
+	active->initialize("John Doe", "123 Maple Rd", 123456789, 100, Customer::SubscriptionLevel::BASIC);
+	active->setMembershipID(1);
+	registry.publish(active);
+
+	Customer* inactive = member_factory.getCustomer();
+	inactive->initialize("Doe John", "321 Rd Maple", 123456789, 200, Customer::SubscriptionLevel::INACTIVE);
+	inactive->setMembershipID(2);
+	registry.publish(inactive);
+
+	Staff* staff = member_factory.getStaff();
+	staff->initialize("Mary Janes", "420 Dank Hill", 2214356879, 300, Staff::Clearance::GENERAL);
+	staff->setMembershipID(3);
+	registry.publish(staff);
+
+	BraceletReaderService service(registry);
+	TapRecorder recorder;
+	service.setRecorder(&recorder);
+	ASSERT_TRUE(service.start("reader_test.sock"));
+
+	/*Bracelets 100 and 300 are admitted, 200 is inactive and 400 is unknown*/
+	vector<unsigned long> bracelets;
+	bracelets.push_back(100);
+	bracelets.push_back(200);
+	bracelets.push_back(300);
+	bracelets.push_back(400);
+
+	BraceletLoadGenerator::Result result;
+	EXPECT_TRUE(BraceletLoadGenerator::run("reader_test.sock", 4, 16, 1000, bracelets, result));
+	EXPECT_EQ(4000, result.requests);
+	EXPECT_EQ(2000, result.admitted);
+	EXPECT_EQ(2000, result.denied);
+	EXPECT_EQ(4000, service.getRequestsServed());
+	EXPECT_EQ(4000, recorder.size());
+
+	/*Running out of credits denies the next tap*/
+	registry.update(1, [](Member* m) { ((Customer*)m)->setGymCredits(0); });
+	BraceletReaderService::Reason reason;
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(BraceletReaderService::Decision::DENY, BraceletReaderService::decide(guard.findByBraceletID(100), reason));
+	EXPECT_EQ(BraceletReaderService::Reason::NO_CREDITS, reason);
+
+	service.stop();
+}
+
+/*Testing that a reader which stops reading is throttled, and still gets every answer after shutting down its sending side*/
+TEST(test_reader_service_case2, test_reader_service)
 {
-public:
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	Customer* c = member_factory.getCustomer();
+	c->initialize("John Doe", "123 Maple Rd", 123456789, 100, Customer::SubscriptionLevel::BASIC);
+	c->setMembershipID(1);
+	registry.publish(c);
+
+	BraceletReaderService service(registry);
+	ASSERT_TRUE(service.start("reader_test.sock"));
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, "reader_test.sock");
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	ASSERT_EQ(0, connect(fd, (sockaddr*)&address, sizeof(address)));
+
+	/*Write taps without reading any answers until the service stops taking them*/
+	char frames[BraceletReaderService::REQUEST_SIZE * 1024];
+	for (size_t f = 0; f < 1024; f++)
+	{
+		ByteOrder::putU32(frames + f * BraceletReaderService::REQUEST_SIZE, (unsigned int)f);
+		ByteOrder::putU32(frames + f * BraceletReaderService::REQUEST_SIZE + 4, 1);
+		ByteOrder::putU64(frames + f * BraceletReaderService::REQUEST_SIZE + 8, 100);
+	}
+	size_t written = 0;
+	int idle = 0;
+	while (written < 64 * BraceletReaderService::MAX_PENDING_OUTPUT && idle < 50)
+	{
+		ssize_t n = write(fd, frames, sizeof(frames));
+		if (n > 0)
+		{
+			written += n;
+			idle = 0;
+		}
+		else
+		{
+			idle++;
+			this_thread::sleep_for(chrono::milliseconds(2));
+		}
+	}
+	EXPECT_LT(written, 8 * BraceletReaderService::MAX_PENDING_OUTPUT);
+	EXPECT_EQ(0, written % BraceletReaderService::REQUEST_SIZE);
+
+	/*Shut down the sending side, then read every answer until the service closes the connection*/
+	shutdown(fd, SHUT_WR);
+	size_t answers = 0;
+	char buffer[65536];
+	for (;;)
+	{
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n == 0)
+			break;
+		if (n < 0 && errno == EAGAIN)
+		{
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+		ASSERT_GT(n, 0);
+		answers += n;
+	}
+	close(fd);
+	EXPECT_EQ(written / BraceletReaderService::REQUEST_SIZE * BraceletReaderService::RESPONSE_SIZE, answers);
+	EXPECT_EQ(written / BraceletReaderService::REQUEST_SIZE, service.getRequestsServed());
 
-	enum SubscriptionLevel { INACTIVE, BASIC, PREMIUM, DELUXE };
+	service.stop();
+}
 
-	/**
-	Constructor for Customer.
-	*/
-	Customer()
+/*Benchmark: tap throughput and tail latency over loopback. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_reader_service, DISABLED_bench_reader_service)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	vector<unsigned long> bracelets;
+
+	for (unsigned long i = 1; i <= 100000; i++)
 	{
-		setMemberType(CUSTOMER);
-		setGymCredits(20);
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i);
+		c->setSubscriptionLevel(Customer::SubscriptionLevel::BASIC);
+		registry.publish(c);
+		bracelets.push_back(i * 2);
 	}
 
-	/*Implemeting Member's Virtual Functions*/
+	BraceletReaderService service(registry);
+	ASSERT_TRUE(service.start("reader_bench.sock"));
+
+	BraceletLoadGenerator::Result result;
+	EXPECT_TRUE(BraceletLoadGenerator::run("reader_bench.sock", 16, 64, 200000, bracelets, result));
+
+	cout << result.requests << " taps in " << result.seconds << "s (" << (long long)result.requests_per_second << "/s), latency p50 "
+		<< result.p50_ns << "ns, p99 " << result.p99_ns << "ns, p999 " << result.p999_ns << "ns, max " << result.max_ns << "ns" << endl;
+}
 
-	/**
-	Prints out all data related to the current customer to the console. The output takes the following format:
+#endif
 
-	Name
-	Address
-	Membership ID
-	Bracelet ID
-	Credit Card Number
-	Gym Credits
-	*/
-	void print(void)
+/*Testing that both snapshot codecs round trip customers and staff*/
+TEST(test_snapshot_case1, test_snapshot)
+{
+	MemberFactory member_factory;
+	vector<Member*> members;
+
+	Customer* c = member_factory.getCustomer();
+	c->initialize("John Doe", "123 Maple Rd", 123456789, 987654321, Customer::SubscriptionLevel::PREMIUM);
+	c->setMembershipID(11);
+	c->deductGymCredits(25);
+	members.push_back(c);
+
+	Staff* s = member_factory.getStaff();
+	s->initialize("Mary Janes", "420 Dank Hill", 2214356879, 87654321, Staff::Clearance::ADMINISTRATOR);
+	s->setMembershipID(22);
+	s->setEmployeeID(4242);
+	members.push_back(s);
+
+	MemberSnapshot::Codec codecs[] = { MemberSnapshot::Codec::PROTOBUF, MemberSnapshot::Codec::FIXED_WIDTH };
+	for (int i = 0; i < 2; i++)
 	{
-		cout << getName() << endl << getAddress() << endl << getMembershipID() << endl << getBraceletID()
-			<< endl << getCreditCard() << endl << getGymCredits() << endl;
+		ASSERT_TRUE(MemberSnapshot::save("snapshot_test.snap", members, codecs[i]));
+
+		vector<Member*> loaded;
+		ASSERT_TRUE(MemberSnapshot::load("snapshot_test.snap", loaded));
+		ASSERT_EQ(2, loaded.size());
+
+		Customer* lc = (Customer*)loaded[0];
+		EXPECT_EQ(Member::Type::CUSTOMER, lc->getMemberType());
+		EXPECT_STREQ("John Doe", lc->getName().c_str());
+		EXPECT_STREQ("123 Maple Rd", lc->getAddress().c_str());
+		EXPECT_EQ(11, lc->getMembershipID());
+		EXPECT_EQ(987654321, lc->getBraceletID());
+		EXPECT_EQ(123456789, lc->getCreditCard());
+		EXPECT_EQ(-5, lc->getGymCredits());
+		EXPECT_EQ(Customer::SubscriptionLevel::PREMIUM, lc->getSubscriptionLevel());
+
+		Staff* ls = (Staff*)loaded[1];
+		EXPECT_EQ(Member::Type::STAFF, ls->getMemberType());
+		EXPECT_STREQ("Mary Janes", ls->getName().c_str());
+		EXPECT_STREQ("420 Dank Hill", ls->getAddress().c_str());
+		EXPECT_EQ(22, ls->getMembershipID());
+		EXPECT_EQ(87654321, ls->getBraceletID());
+		EXPECT_EQ(4242, ls->getEmployeeID());
+		EXPECT_EQ(Staff::Clearance::ADMINISTRATOR, ls->getStaffClearance());
+
+		for (size_t j = 0; j < loaded.size(); j++)
+			delete loaded[j];
 	}
 
-	/**
-	To be used by the MemberFactory, the clone() function returns another instance of the current Customer.
-	*/
-	Customer* clone()
+	/*Truncated snapshots are rejected*/
+	string data;
+	MemberSnapshot::encode(members, MemberSnapshot::Codec::FIXED_WIDTH, data);
+	vector<Member*> loaded;
+	EXPECT_FALSE(MemberSnapshot::decode(data.substr(0, MemberSnapshot::HEADER_SIZE + MemberSnapshot::RECORD_SIZE), loaded));
+	EXPECT_FALSE(MemberSnapshot::decode("not a snapshot", loaded));
+	EXPECT_EQ(0, loaded.size());
+
+	/*Per-member serialization still round trips*/
+	c->serialize("snapshot_test.member");
+	Customer* dc = c->deserialize("snapshot_test.member");
+	EXPECT_EQ(-5, dc->getGymCredits());
+	delete dc;
+
+	s->serialize("snapshot_test.member");
+	Staff* ds = s->deserialize("snapshot_test.member");
+	EXPECT_EQ(Member::Type::STAFF, ds->getMemberType());
+	EXPECT_EQ(Staff::Clearance::ADMINISTRATOR, ds->getStaffClearance());
+	delete ds;
+
+	delete c;
+	delete s;
+	remove("snapshot_test.snap");
+	remove("snapshot_test.member");
+}
+
+/*Benchmark: encode/decode throughput and size of both snapshot codecs. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_snapshot, DISABLED_bench_snapshot_codecs)
+{
+	MemberFactory member_factory;
+	vector<Member*> members;
+
+	for (unsigned long i = 1; i <= 1000000; i++)
 	{
-		return new Customer(*this);
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer Number " + to_string(i), to_string(i % 5000) + " Maple Rd", 4500000000ul + i, 9000000 + i, (Customer::SubscriptionLevel)(i % 4));
+		c->setMembershipID(i);
+		members.push_back(c);
+	}
+
+	const char* names[] = { "PROTOBUF", "FIXED_WIDTH" };
+	MemberSnapshot::Codec codecs[] = { MemberSnapshot::Codec::PROTOBUF, MemberSnapshot::Codec::FIXED_WIDTH };
+	for (int i = 0; i < 2; i++)
+	{
+		string data;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		MemberSnapshot::encode(members, codecs[i], data);
+		double encode_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+		vector<Member*> decoded;
+		start = chrono::high_resolution_clock::now();
+		EXPECT_TRUE(MemberSnapshot::decode(data, decoded));
+		double decode_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+		cout << names[i] << ": " << data.size() << " bytes, encode " << (long long)(members.size() / encode_s) << " members/s, decode "
+			<< (long long)(members.size() / decode_s) << " members/s" << endl;
+
+		for (size_t j = 0; j < decoded.size(); j++)
+			delete decoded[j];
 	}
 
-	/**
-	Serializes the current Staff object into a structured object to be stored in text.
-	*/
-	void serialize(string file_name)
+	for (size_t j = 0; j < members.size(); j++)
+		delete members[j];
+}
+
+/*Testing dirty field tracking in the set functions*/
+TEST(test_dirty_fields_case1, test_dirty_fields)
+{
+	Customer c;
+	c.initialize("John Doe", "123 Maple Rd", 123456789, 987654321, Customer::SubscriptionLevel::BASIC);
+	EXPECT_TRUE(c.isDirty());
+
+	c.clearDirtyFields();
+	EXPECT_FALSE(c.isDirty());
+	c.deductGymCredits(1);
+	EXPECT_EQ(Member::Field::GYM_CREDITS, c.getDirtyFields());
+	c.setName("Doe John");
+	EXPECT_EQ(Member::Field::GYM_CREDITS | Member::Field::NAME, c.getDirtyFields());
+
+	Staff s;
+	s.clearDirtyFields();
+	s.setStaffClearance(Staff::Clearance::MANAGER);
+	s.setEmployeeID(7);
+	EXPECT_EQ(Member::Field::STAFF_CLEARANCE | Member::Field::EMPLOYEE_ID, s.getDirtyFields());
+}
+
+/*Testing that delta logs written from the registry merge on top of a full snapshot*/
+TEST(test_delta_log_case1, test_delta_log)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	vector<Member*> members;
+
+	for (unsigned long i = 1; i <= 1000; i++)
 	{
-		/*Create a customer protobuff object*/
-		seng330a2::Customer c;
-		c.set_credit_card_num(getCreditCard());
-		c.set_gym_credits(getGymCredits());
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer " + to_string(i), to_string(i) + " Maple Rd", 4500000000ul + i, i, Customer::SubscriptionLevel::BASIC);
+		c->setMembershipID(i);
+		members.push_back(c);
+	}
+	Staff* s = member_factory.getStaff();
+	s->initialize("Mary Janes", "420 Dank Hill", 0, 5000, Staff::Clearance::GENERAL);
+	s->setMembershipID(5000);
+	members.push_back(s);
+
+	remove("delta_test.snap");
+	remove("delta_test.delta");
+	ASSERT_TRUE(MemberSnapshot::save("delta_test.snap", members, MemberSnapshot::Codec::FIXED_WIDTH));
+	registry.publishBatch(members);
 
-		/*Set the subscription level for protobuff*/
-		switch (getSubscriptionLevel())
+	DeltaTracker tracker(registry);
+	EXPECT_EQ(0, tracker.getPendingCount());
+
+	/*A day of taps only changes gym credits*/
+	for (int tap = 0; tap < 5; tap++)
+	{
+		for (unsigned long i = 1; i <= 1000; i++)
+			registry.update(i, [](Member* m) { ((Customer*)m)->deductGymCredits(1); });
+	}
+	EXPECT_EQ(1000, tracker.checkpoint("delta_test.delta"));
+
+	fstream snapshot_file("delta_test.snap", ios::in | ios::binary | ios::ate);
+	fstream delta_file("delta_test.delta", ios::in | ios::binary | ios::ate);
+	EXPECT_LT(delta_file.tellg() * 4, snapshot_file.tellg());
+	delta_file.close();
+
+	/*Second checkpoint: a promotion, a new member and a removal*/
+	registry.update(5000, [](Member* m) { ((Staff*)m)->setStaffClearance(Staff::Clearance::ADMINISTRATOR); });
+	registry.update(7, [](Member* m) { m->setAddress("7 Oak St"); });
+	Customer* added = member_factory.getCustomer();
+	added->initialize("New Customer", "1 New Rd", 1, 6000, Customer::SubscriptionLevel::DELUXE);
+	added->setMembershipID(6000);
+	registry.publish(added);
+	registry.remove(8);
+	EXPECT_EQ(4, tracker.checkpoint("delta_test.delta"));
+	EXPECT_EQ(0, tracker.checkpoint("delta_test.delta"));
+
+	/*A torn block at the end of the log is ignored*/
+	fstream torn("delta_test.delta", ios::out | ios::app | ios::binary);
+	torn.write("DLTA\x40\x00\x00\x00\x00", 9);
+	torn.close();
+
+	vector<Member*> loaded;
+	ASSERT_TRUE(DeltaLog::load("delta_test.snap", "delta_test.delta", loaded));
+	ASSERT_EQ(1001, loaded.size());
+
+	map<unsigned long, Member*> by_id;
+	for (size_t i = 0; i < loaded.size(); i++)
+		by_id[loaded[i]->getMembershipID()] = loaded[i];
+
+	EXPECT_EQ(15, ((Customer*)by_id[1])->getGymCredits());
+	EXPECT_STREQ("7 Oak St", by_id[7]->getAddress().c_str());
+	EXPECT_STREQ("Customer 7", by_id[7]->getName().c_str());
+	EXPECT_EQ(0, by_id.count(8));
+	EXPECT_EQ(Staff::Clearance::ADMINISTRATOR, ((Staff*)by_id[5000])->getStaffClearance());
+	EXPECT_EQ(Customer::SubscriptionLevel::DELUXE, ((Customer*)by_id[6000])->getSubscriptionLevel());
+	EXPECT_STREQ("New Customer", by_id[6000]->getName().c_str());
+	EXPECT_FALSE(by_id[1]->isDirty());
+
+	for (size_t i = 0; i < loaded.size(); i++)
+		delete loaded[i];
+	remove("delta_test.snap");
+	remove("delta_test.delta");
+}
+
+/*Testing that members whose type changes under the same membership ID replay from the delta log*/
+TEST(test_delta_log_case2, test_delta_log)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	vector<Member*> members;
+
+	Customer* c = member_factory.getCustomer();
+	c->initialize("Joe Bloggs", "1 Elm St", 4500000000ul, 100, Customer::SubscriptionLevel::BASIC);
+	c->setMembershipID(1);
+	members.push_back(c);
+	Staff* s = member_factory.getStaff();
+	s->initialize("Mary Janes", "420 Dank Hill", 0, 200, Staff::Clearance::GENERAL);
+	s->setMembershipID(2);
+	members.push_back(s);
+
+	remove("delta_type_test.snap");
+	remove("delta_type_test.delta");
+	ASSERT_TRUE(MemberSnapshot::save("delta_type_test.snap", members, MemberSnapshot::Codec::FIXED_WIDTH));
+	registry.publishBatch(members);
+	DeltaTracker tracker(registry);
+
+	/*The customer is hired: staff published straight over the customer*/
+	Staff* hired = member_factory.getStaff();
+	hired->initialize("Joe Bloggs", "1 Elm St", 0, 100, Staff::Clearance::MANAGER);
+	hired->setMembershipID(1);
+	hired->clearDirtyFields();
+	hired->setEmployeeID(77);
+	registry.publish(hired);
+	EXPECT_EQ(1, tracker.checkpoint("delta_type_test.delta"));
+
+	/*The staff member leaves and comes back as a customer before the next checkpoint*/
+	registry.remove(2);
+	Customer* returning = member_factory.getCustomer();
+	returning->initialize("Mary Janes", "9 New Rd", 4500000002ul, 200, Customer::SubscriptionLevel::DELUXE);
+	returning->setMembershipID(2);
+	registry.publish(returning);
+	EXPECT_EQ(1, tracker.checkpoint("delta_type_test.delta"));
+
+	vector<Member*> loaded;
+	ASSERT_TRUE(DeltaLog::load("delta_type_test.snap", "delta_type_test.delta", loaded));
+	ASSERT_EQ(2, loaded.size());
+
+	map<unsigned long, Member*> by_id;
+	for (size_t i = 0; i < loaded.size(); i++)
+		by_id[loaded[i]->getMembershipID()] = loaded[i];
+
+	ASSERT_EQ(Member::Type::STAFF, by_id[1]->getMemberType());
+	EXPECT_EQ(Staff::Clearance::MANAGER, ((Staff*)by_id[1])->getStaffClearance());
+	EXPECT_EQ(77, ((Staff*)by_id[1])->getEmployeeID());
+	EXPECT_STREQ("Joe Bloggs", by_id[1]->getName().c_str());
+	EXPECT_EQ(100, by_id[1]->getBraceletID());
+
+	ASSERT_EQ(Member::Type::CUSTOMER, by_id[2]->getMemberType());
+	EXPECT_EQ(Customer::SubscriptionLevel::DELUXE, ((Customer*)by_id[2])->getSubscriptionLevel());
+	EXPECT_EQ(4500000002ul, ((Customer*)by_id[2])->getCreditCard());
+	EXPECT_STREQ("9 New Rd", by_id[2]->getAddress().c_str());
+
+	for (size_t i = 0; i < loaded.size(); i++)
+		delete loaded[i];
+	remove("delta_type_test.snap");
+	remove("delta_type_test.delta");
+}
+
+/*Testing both block codecs on edge cases, and that compressed snapshots load and reject corruption*/
+TEST(test_block_compression_case1, test_block_compression)
+{
+	StoreCodec store;
+	LZCodec lz;
+	ThreadPool pool(4);
+
+	string random_data;
+	srand(330);
+	for (int i = 0; i < 100000; i++)
+		random_data.push_back((char)(rand() & 0xFF));
+
+	string inputs[] = { "", "a", "abcabcabcabcabcabcabcabcabcabcabcabc", string(200000, 'x'), random_data };
+	CompressionCodec* codecs[] = { &store, &lz };
+	for (int c = 0; c < 2; c++)
+	{
+		for (int i = 0; i < 5; i++)
 		{
-			case Customer::SubscriptionLevel::BASIC:
-				c.set_subscription_level(seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_BASIC);
-				break;
-			case Customer::SubscriptionLevel::PREMIUM:
-				c.set_subscription_level(seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_PREMIUM);
-				break;
-			case Customer::SubscriptionLevel::DELUXE:
-				c.set_subscription_level(seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_DELUXE);
-				break;
-			default:
-				c.set_subscription_level(seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_INACTIVE);
-				break;
+			string compressed, raw;
+			BlockCompressor::compress(inputs[i], *codecs[c], &pool, compressed, 4096);
+			ASSERT_TRUE(BlockCompressor::decompress(compressed, NULL, raw));
+			EXPECT_TRUE(raw == inputs[i]);
 		}
+	}
 
-		/*Create a Member protobuff object*/
-		seng330a2::Member m;
-		m.set_name(getName());
-		m.set_address(getAddress());
-		m.set_membership_id(getMembershipID());
-		m.set_bracelet_id(getBraceletID());
-		m.set_member_type(seng330a2::Member_Type::Member_Type_CUSTOMER);
-
-
-		/*Insert the Customer protobuff object into the Member object*/
-		m.set_allocated_customer(&c);
-
-		/*Save the created Member protobuff object to file*/
-		fstream output(file_name, ios::out | ios::trunc | ios::binary);
-		m.SerializeToOstream(&output);
-	}
-
-	/**
-	Reads a structured serialized file and returns an appropriate Customer object from it
-	*/
-	Customer* deserialize(string file_name)
-	{
-		
-		/*Read serialized file for the current Member and extract it*/
-		fstream input(file_name, ios::in | ios::binary);
-		seng330a2::Member m;
-		m.ParseFromIstream(&input);
-
-		/*Extract the Customer from the Member protobuff object*/
-		seng330a2::Customer c;
-		c = m.customer();
-
-		/*Create a new Customer object and returns it*/
-		Customer cr;
-		cr.setName(m.name());
-		cr.setAddress(m.address());
-		cr.setMembershipID(m.membership_id());
-		cr.setBraceletID(m.bracelet_id());
-		cr.setMemberType(Member::Type::CUSTOMER);
-		cr.setCreditCard(c.credit_card_num());
-		cr.setGymCredits(c.gym_credits());
-
-		/*Set Subscription Level*/
-		switch (c.subscription_level())
-		{
-			case seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_BASIC:
-				cr.setSubscriptionLevel(Customer::SubscriptionLevel::BASIC);
-				break;
-			case seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_PREMIUM:
-				cr.setSubscriptionLevel(Customer::SubscriptionLevel::PREMIUM);
-				break;
-			case seng330a2::Customer_SubscriptionLevel::Customer_SubscriptionLevel_DELUXE:
-				cr.setSubscriptionLevel(Customer::SubscriptionLevel::DELUXE);
-				break;
-			default:
-				cr.setSubscriptionLevel(Customer::SubscriptionLevel::INACTIVE);
-				break;
-		}
+	/*Repetitive data shrinks, random data grows by no more than the block headers and a few bytes per block*/
+	string compressed;
+	BlockCompressor::compress(inputs[3], lz, NULL, compressed);
+	EXPECT_LT(compressed.size(), 2000);
+	BlockCompressor::compress(random_data, lz, NULL, compressed);
+	EXPECT_LT(compressed.size(), random_data.size() + 1000);
+
+	MemberFactory member_factory;
+	vector<Member*> members;
+	for (unsigned long i = 1; i <= 5000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer " + to_string(i), to_string(i) + " Maple Rd", 4500000000ul + i, i, Customer::SubscriptionLevel::BASIC);
+		c->setMembershipID(i);
+		members.push_back(c);
+	}
+
+	ASSERT_TRUE(MemberSnapshot::save("compression_test.snap", members, MemberSnapshot::Codec::FIXED_WIDTH, lz, &pool, 16 * 1024));
+	vector<Member*> loaded;
+	ASSERT_TRUE(MemberSnapshot::load("compression_test.snap", loaded, &pool));
+	ASSERT_EQ(5000, loaded.size());
+	EXPECT_STREQ("Customer 4321", loaded[4320]->getName().c_str());
+	EXPECT_EQ(4321, loaded[4320]->getBraceletID());
+	for (size_t i = 0; i < loaded.size(); i++)
+		delete loaded[i];
+	loaded.clear();
+
+	/*Flip one byte in the middle of the file, the CRC of its block catches it*/
+	fstream file("compression_test.snap", ios::in | ios::out | ios::binary | ios::ate);
+	streamoff middle = file.tellg() / 2;
+	file.seekg(middle);
+	char byte = (char)file.get();
+	file.seekp(middle);
+	file.put((char)(byte ^ 0x5A));
+	file.close();
+	EXPECT_FALSE(MemberSnapshot::load("compression_test.snap", loaded, &pool));
+	EXPECT_EQ(0, loaded.size());
+
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+	remove("compression_test.snap");
+}
+
+/*Benchmark: compression ratio against compress/decompress throughput per codec and block size. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_block_compression, DISABLED_bench_block_compression)
+{
+	MemberFactory member_factory;
+	vector<Member*> members;
 
-		return &cr;
+	for (unsigned long i = 1; i <= 1000000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer Number " + to_string(i), to_string(i % 5000) + " Maple Rd", 4500000000ul + i, 9000000 + i, (Customer::SubscriptionLevel)(i % 4));
+		c->setMembershipID(i);
+		members.push_back(c);
 	}
 
-	/*Other functions*/
+	string data;
+	MemberSnapshot::encode(members, MemberSnapshot::Codec::FIXED_WIDTH, data);
 
-	/**
-	Since the default constructor does not take paramters, this function must be ran to add the necessary data needed for a Customer.
-	Alternatively, the data can be added individually using each of the set functions.
-	*/
-	void initialize(string name, string address, unsigned long credit_card_num, unsigned long bracelet_id, SubscriptionLevel subscription_level)
+	ThreadPool pool;
+	StoreCodec store;
+	LZCodec lz;
+	CompressionCodec* codecs[] = { &store, &lz };
+	size_t block_sizes[] = { 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+	for (int c = 0; c < 2; c++)
 	{
-		srand(time(NULL));
-		setMembershipID(rand());
+		for (int b = 0; b < 4; b++)
+		{
+			string compressed, raw;
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+			BlockCompressor::compress(data, *codecs[c], &pool, compressed, block_sizes[b]);
+			double compress_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+			start = chrono::high_resolution_clock::now();
+			EXPECT_TRUE(BlockCompressor::decompress(compressed, &pool, raw));
+			double decompress_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+			cout << codecs[c]->getName() << " " << block_sizes[b] / 1024 << "K blocks: ratio " << (double)data.size() / compressed.size()
+				<< ", compress " << (long long)(data.size() / compress_s / 1e6) << " MB/s, decompress "
+				<< (long long)(data.size() / decompress_s / 1e6) << " MB/s" << endl;
+		}
+	}
+
+	for (size_t j = 0; j < members.size(); j++)
+		delete members[j];
+}
 
-		setName(name);
-		setAddress(address);
-		setBraceletID(bracelet_id);
-		setCreditCard(credit_card_num);
-		setSubscriptionLevel(subscription_level);
+/*Testing that queued saves coalesce, land in the legacy per-member format and are all written by flush()*/
+TEST(test_persistence_queue_case1, test_persistence_queue)
+{
+	PersistenceQueue queue;
+	Customer c;
+	c.initialize("John Doe", "123 Maple Rd", 123456789, 987654321, Customer::SubscriptionLevel::BASIC);
+
+	vector<shared_future<bool> > tokens;
+	for (int round = 0; round < 10; round++)
+	{
+		c.setGymCredits(round);
+		for (int i = 0; i < 100; i++)
+		{
+			c.setMembershipID(i);
+			tokens.push_back(queue.save(&c, "queue_test_" + to_string(i) + ".member"));
+		}
 	}
+	queue.flush();
 
-	/**
-	Sets a credit card number for the current customer.
-	*/
-	void setCreditCard(unsigned long credit_card_num)
+	/*Every save was either written or merged into a queued one*/
+	EXPECT_EQ(1000, queue.getFilesWritten() + queue.getSavesCoalesced());
+	for (size_t i = 0; i < tokens.size(); i++)
 	{
-		this->credit_card_num = credit_card_num;
+		ASSERT_EQ(future_status::ready, tokens[i].wait_for(chrono::seconds(0)));
+		EXPECT_TRUE(tokens[i].get());
 	}
 
-	/**
-	Sets a fixed amount of gym credit for the current customer.
-	*/
-	void setGymCredits(int gym_credits)
+	for (int i = 0; i < 100; i++)
 	{
-		this->gym_credits = gym_credits;
+		Customer* loaded = c.deserialize("queue_test_" + to_string(i) + ".member");
+		EXPECT_EQ(i, loaded->getMembershipID());
+		EXPECT_EQ(9, loaded->getGymCredits());
+		delete loaded;
+		remove(("queue_test_" + to_string(i) + ".member").c_str());
 	}
 
-	/**
-	Adds a fixed amount of gym credit for the current customer on top of his/her current balance.
-	*/
-	void addGymCredits(int amount)
+	/*A file that cannot be opened completes with false*/
+	EXPECT_FALSE(queue.save(&c, "no_such_directory/queue_test.member").get());
+}
+
+/*Testing that every file backend writes and reads back legacy per-member files, reports missing files, and that a failed ring falls back to the thread pool*/
+TEST(test_file_backend_case1, test_file_backend)
+{
+	ThreadPool pool(4);
+	vector<FileBackend*> backends;
+	backends.push_back(new ThreadPoolFileBackend(pool));
+	backends.push_back(createFileBackend(pool));
+
+	MemberFactory member_factory;
+	vector<Member*> members;
+	vector<string> file_names;
+	for (unsigned long i = 1; i <= 600; i++)
 	{
-		gym_credits += amount;
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer " + to_string(i), string(i * 10, 'a'), 4500000000ul + i, i, Customer::SubscriptionLevel::BASIC);
+		c->setMembershipID(i);
+		members.push_back(c);
+		file_names.push_back("backend_test_" + to_string(i) + ".member");
 	}
 
-	/**
-	Deducts a fixed amount of gym credit for the current customer on top of his/her current balance.
-	*/
-	void deductGymCredits(int amount)
+	for (size_t b = 0; b < backends.size(); b++)
 	{
-		gym_credits -= amount;
+		EXPECT_EQ(0, MemberFiles::save(*backends[b], file_names, members));
+
+		/*Files written by one backend are read by the other and by Member::deserialize()*/
+		vector<Member*> loaded;
+		EXPECT_EQ(0, MemberFiles::load(*backends[1 - b], file_names, loaded));
+		ASSERT_EQ(600, loaded.size());
+		for (size_t i = 0; i < loaded.size(); i++)
+		{
+			EXPECT_EQ(i + 1, loaded[i]->getMembershipID());
+			EXPECT_EQ((i + 1) * 10, loaded[i]->getAddress().size());
+			delete loaded[i];
+		}
+		loaded.clear();
+
+		Customer* c = ((Customer*)members[0])->deserialize(file_names[599]);
+		EXPECT_EQ(600, c->getBraceletID());
+		delete c;
+
+		vector<string> missing(1, "no_such_file.member");
+		EXPECT_EQ(1, MemberFiles::load(*backends[b], missing, loaded));
+		EXPECT_EQ(0, loaded.size());
 	}
 
-	/**
-	Change the membership subscription level of the current customer.
-	*/
-	void setSubscriptionLevel(SubscriptionLevel subscription_level)
+	/*The persistence queue writes its batches through a backend too*/
+	{
+		PersistenceQueue queue(backends[1]);
+		((Customer*)members[0])->setGymCredits(77);
+		EXPECT_TRUE(queue.save(members[0], file_names[0]).get());
+	}
+	Customer* saved = ((Customer*)members[0])->deserialize(file_names[0]);
+	EXPECT_EQ(77, saved->getGymCredits());
+	delete saved;
+
+#ifdef __linux__
+	/*Once the kernel refuses a ring, here by putting /dev/null in place of its file descriptor, the backend gives it up
+	and hands every file, then and later, to the thread pool*/
+	if (IoUringFileBackend::isAvailable())
 	{
-		this->subscription_level = subscription_level;
+		vector<char> was_ring(1024, 0);
+		for (int fd = 0; fd < 1024; fd++)
+		{
+			char target[64] = {};
+			was_ring[fd] = readlink(("/proc/self/fd/" + to_string(fd)).c_str(), target, sizeof(target) - 1) > 0
+				&& string(target) == "anon_inode:[io_uring]";
+		}
+
+		IoUringFileBackend failing(&pool);
+		ASSERT_TRUE(failing.isReady());
+		int null_fd = open("/dev/null", O_RDONLY);
+		for (int fd = 0; fd < 1024; fd++)
+		{
+			char target[64] = {};
+			if (!was_ring[fd] && readlink(("/proc/self/fd/" + to_string(fd)).c_str(), target, sizeof(target) - 1) > 0
+				&& string(target) == "anon_inode:[io_uring]")
+				dup2(null_fd, fd);
+		}
+		close(null_fd);
+
+		vector<Member*> loaded;
+		EXPECT_EQ(0, MemberFiles::load(failing, file_names, loaded));
+		EXPECT_TRUE(failing.hasFailed());
+		EXPECT_FALSE(failing.isReady());
+		ASSERT_EQ(600, loaded.size());
+		EXPECT_EQ(600, loaded[599]->getMembershipID());
+		for (size_t i = 0; i < loaded.size(); i++)
+			delete loaded[i];
+
+		EXPECT_EQ(0, MemberFiles::save(failing, file_names, members));
+		Customer* rewritten = ((Customer*)members[0])->deserialize(file_names[0]);
+		EXPECT_EQ(77, rewritten->getGymCredits());
+		delete rewritten;
 	}
+#endif
 
-	/**
-	Retreives the current member's credit card number as an unsigned long.
-	*/
-	int getCreditCard()
+	for (size_t i = 0; i < members.size(); i++)
 	{
-		return credit_card_num;
+		delete members[i];
+		remove(file_names[i].c_str());
 	}
+	for (size_t b = 0; b < backends.size(); b++)
+		delete backends[b];
+}
 
-	/**
-	Retreives the current member's gym credit amount as an int.
-	*/
-	int getGymCredits()
+#ifdef __linux__
+
+/*Benchmark: loading 100k legacy per-member files with Member::deserialize(), the thread pool and io_uring. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_file_backend, DISABLED_bench_file_backend_100k)
+{
+	ThreadPool pool;
+	ThreadPoolFileBackend pool_backend(pool);
+	IoUringFileBackend ring_backend;
+
+	MemberFactory member_factory;
+	vector<Member*> members;
+	vector<string> file_names;
+	mkdir("bench_members", 0755);
+	for (unsigned long i = 1; i <= 100000; i++)
 	{
-		return gym_credits;
+		Customer* c = member_factory.getCustomer();
+		c->initialize("Customer Number " + to_string(i), to_string(i % 5000) + " Maple Rd", 4500000000ul + i, 9000000 + i, (Customer::SubscriptionLevel)(i % 4));
+		c->setMembershipID(i);
+		members.push_back(c);
+		file_names.push_back("bench_members/" + to_string(i) + ".member");
+	}
+	EXPECT_EQ(0, MemberFiles::save(pool_backend, file_names, members));
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < file_names.size(); i++)
+		delete ((Customer*)members[0])->deserialize(file_names[i]);
+	double serial_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	cout << "deserialize(): " << (long long)(file_names.size() / serial_s) << " files/s" << endl;
+
+	vector<FileBackend*> backends;
+	backends.push_back(&pool_backend);
+	if (ring_backend.isReady())
+		backends.push_back(&ring_backend);
+	else
+		cout << "io_uring is not available, skipping it" << endl;
+
+	for (size_t b = 0; b < backends.size(); b++)
+	{
+		vector<Member*> loaded;
+		start = chrono::high_resolution_clock::now();
+		EXPECT_EQ(0, MemberFiles::load(*backends[b], file_names, loaded));
+		double load_s = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+		cout << backends[b]->getName() << ": " << (long long)(file_names.size() / load_s) << " files/s" << endl;
+
+		for (size_t i = 0; i < loaded.size(); i++)
+			delete loaded[i];
 	}
 
-	/**
-	Retreives the current member's membership subscription level.
-	*/
-	SubscriptionLevel getSubscriptionLevel()
+	for (size_t i = 0; i < members.size(); i++)
 	{
-		return subscription_level;
+		delete members[i];
+		remove(file_names[i].c_str());
 	}
+	rmdir("bench_members");
+}
 
-private:
-	unsigned long credit_card_num;
-	int gym_credits;
-	SubscriptionLevel subscription_level;
+#endif
 
-};
+/*Testing that chained loads and saves run on a two thread executor, and that loaded members stay in the registry*/
+TEST(test_async_store_case1, test_async_store)
+{
+	MemberRegistry registry;
+	ThreadPool executor(2);
+	PersistenceQueue queue;
+
+	{
+		AsyncMemberStore store(registry, executor, queue, NULL, "async_test_");
+		for (unsigned long i = 1; i <= 200; i++)
+		{
+			Customer c;
+			c.initialize("Customer " + to_string(i), "123 Maple Rd", 123456789, i, Customer::SubscriptionLevel::BASIC);
+			c.setMembershipID(i);
+			c.setGymCredits((int)i);
+			c.serialize(store.getFileName(i));
+		}
+
+		atomic<int> remaining(200);
+		AsyncResult<bool> all_done(executor);
+		for (unsigned long i = 1; i <= 200; i++)
+		{
+			store.load(i).then([&store, &remaining, &all_done](shared_ptr<Member> m)
+			{
+				((Customer*)m.get())->addGymCredits(1000);
+				store.save(m.get()).then([&remaining, &all_done](bool written)
+				{
+					EXPECT_TRUE(written);
+					if (--remaining == 0)
+						all_done.complete(true);
+				});
+			});
+		}
+		EXPECT_TRUE(all_done.get());
+		EXPECT_EQ(200, store.getFilesRead());
+		EXPECT_EQ(200, registry.size());
+
+		/*Loading again is served from the registry without reading any file*/
+		shared_ptr<Member> again = store.load(7).get();
+		EXPECT_EQ(1007, ((Customer*)again.get())->getGymCredits());
+		EXPECT_TRUE(store.load(999).get() == NULL);
+
+		/*Continuations of one load share its copy, other loads get copies of their own*/
+		AsyncResult<shared_ptr<Member> > shared = store.load(7);
+		shared_ptr<Member> copy = shared.get();
+		AsyncResult<bool> seen(executor);
+		shared.then([copy, &seen](shared_ptr<Member> m) { seen.complete(m == copy); });
+		EXPECT_TRUE(seen.get());
+		EXPECT_TRUE(store.load(7).get() != copy);
+
+		/*The copy is freed with the last result holding it*/
+		weak_ptr<Member> released;
+		{
+			AsyncResult<shared_ptr<Member> > unused = store.load(7);
+			released = unused.get();
+			EXPECT_FALSE(released.expired());
+		}
+		EXPECT_TRUE(released.expired());
+		EXPECT_EQ(201, store.getFilesRead());
+
+		/*Loads never publish over a member that is already in the registry*/
+		Customer* stale = new Customer();
+		stale->setMembershipID(7);
+		EXPECT_FALSE(registry.publishIfAbsent(stale));
+		delete stale;
+
+		/*Concurrent saves of one member leave the registry and the file holding the same version*/
+		vector<thread> savers;
+		for (int t = 0; t < 4; t++)
+		{
+			savers.push_back(thread([&store, t]()
+			{
+				Customer c;
+				c.initialize("Customer 300", "123 Maple Rd", 123456789, 300, Customer::SubscriptionLevel::BASIC);
+				c.setMembershipID(300);
+				for (int i = 0; i < 200; i++)
+				{
+					c.setGymCredits(t * 1000 + i);
+					store.save(&c);
+				}
+			}));
+		}
+		for (size_t t = 0; t < savers.size(); t++)
+			savers[t].join();
+	}
+	queue.flush();
 
-/**
-The Staff class is a derived class of Members. It's used to represent a staff member of a gym.
-On top of the datas used in a Member type, a staff must specify his/her employee number (unsigned long employee_id),
-as well as its role in the gym (Clearance staff_clearance).
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		Customer* saved = Customer().deserialize("async_test_300.member");
+		EXPECT_EQ(((Customer*)guard.findByMembershipID(300))->getGymCredits(), saved->getGymCredits());
+		delete saved;
+		remove("async_test_300.member");
+	}
 
-The role is represented using a enum Clearance, and has the values of GENERAL, MANAGER, ADMINISTRATOR.
+	for (unsigned long i = 1; i <= 200; i++)
+	{
+		Customer* loaded = Customer().deserialize("async_test_" + to_string(i) + ".member");
+		EXPECT_EQ(i + 1000, loaded->getGymCredits());
+		delete loaded;
+		remove(("async_test_" + to_string(i) + ".member").c_str());
+	}
+}
 
-The Staff class requires to be manually initialized after construction, since the constructor does not take any arguments.
-Use the "intialize" function to fill in the data for the Staff. Alternatively, each of the data fields can be set individually using individual set methods.
-*/
+#ifdef ASYNC_MEMBER_STORE_COROUTINES
 
-class Staff : public Member
+MemberTask addCreditsCoroutine(AsyncMemberStore& store, unsigned long membership_id, atomic<int>& remaining, AsyncResult<bool>& all_done)
 {
-public:
+	shared_ptr<Member> m = co_await store.load(membership_id);
+	((Customer*)m.get())->addGymCredits(1);
+	bool written = co_await store.save(m.get());
+	EXPECT_TRUE(written);
 
-	enum Clearance { GENERAL, MANAGER, ADMINISTRATOR };
+	if (--remaining == 0)
+		all_done.complete(true);
+}
 
-	/**
-	Constructor for Staff.
-	*/
-	Staff()
+/*Testing that a thousand coroutines awaiting loads and saves share a two thread executor*/
+TEST(test_async_store_case2, test_async_store)
+{
+	MemberRegistry registry;
+	ThreadPool executor(2);
+	PersistenceQueue queue;
+	AsyncMemberStore store(registry, executor, queue, NULL, "coroutine_test_");
+
+	vector<Member*> members;
+	for (unsigned long i = 1; i <= 1000; i++)
 	{
-		setMemberType(STAFF);
+		Customer* c = new Customer();
+		c->initialize("Customer " + to_string(i), "123 Maple Rd", 123456789, i, Customer::SubscriptionLevel::BASIC);
+		c->setMembershipID(i);
+		members.push_back(c);
+	}
+	int initial_credits = ((Customer*)members[0])->getGymCredits();
+	registry.publishBatch(members);
+
+	atomic<int> remaining(1000);
+	AsyncResult<bool> all_done(executor);
+	for (unsigned long i = 1; i <= 1000; i++)
+		addCreditsCoroutine(store, i, remaining, all_done);
+	EXPECT_TRUE(all_done.get());
+	queue.flush();
+
+	MemberRegistry::ReadGuard guard(registry);
+	EXPECT_EQ(initial_credits + 1, ((Customer*)guard.findByMembershipID(500))->getGymCredits());
+	for (unsigned long i = 1; i <= 1000; i++)
+		remove(store.getFileName(i).c_str());
+}
+
+#endif
+
+/*Testing that usage scans match a brute force search, only decode relevant blocks, and survive save/load*/
+TEST(test_usage_series_case1, test_usage_series)
+{
+	UsageSeriesStore store;
+	vector<UsageSession> all;
+	unsigned long long day = 24 * 60 * 60;
+	unsigned long long start = 1444000000ull / UsageSeriesStore::DEFAULT_PARTITION_SECONDS * UsageSeriesStore::DEFAULT_PARTITION_SECONDS;
+
+	/*40 days: each member visits 2 of the 10 machines every day, at a fairly regular time*/
+	srand(330);
+	for (unsigned long long d = 0; d < 40; d++)
+	{
+		for (unsigned long member = 1; member <= 50; member++)
+		{
+			for (int visit = 0; visit < 2; visit++)
+			{
+				UsageSession session;
+				session.bracelet_id = member;
+				session.machine_id = (member + visit) % 10;
+				session.timestamp = start + d * day + 3600 * (6 + member % 12) + visit * 1800 + rand() % 120;
+				session.duration = 600 + (rand() % 4) * 300;
+				store.append(session);
+				all.push_back(session);
+			}
+		}
+	}
+	ASSERT_EQ(all.size(), store.size());
+	EXPECT_LT(store.getCompressedBytes(), all.size() * 6);
+
+	/*Member 7, last 30 days: two machines in each of the five or six weekly partitions overlapped*/
+	unsigned long long end = start + 40 * day;
+	vector<UsageSession> found;
+	unsigned long long decoded_before = store.getBlocksDecoded();
+	EXPECT_EQ(60, store.scanMember(7, end - 30 * day, end, found));
+	EXPECT_GE(12, store.getBlocksDecoded() - decoded_before);
+	for (size_t i = 0; i < found.size(); i++)
+	{
+		bool matched = false;
+		for (size_t j = 0; j < all.size() && !matched; j++)
+			matched = all[j].bracelet_id == 7 && all[j].timestamp == found[i].timestamp && all[j].machine_id == found[i].machine_id && all[j].duration == found[i].duration;
+		EXPECT_TRUE(matched);
 	}
 
-	/*Implemeting Member's Virtual Functions*/
+	/*Machine 3, one day*/
+	size_t expected = 0;
+	for (size_t j = 0; j < all.size(); j++)
+		expected += all[j].machine_id == 3 && all[j].timestamp >= start + 39 * day ? 1 : 0;
+	found.clear();
+	decoded_before = store.getBlocksDecoded();
+	EXPECT_EQ(expected, store.scanMachine(3, start + 39 * day, end, found));
+	EXPECT_EQ(10, store.getBlocksDecoded() - decoded_before);
+
+	ASSERT_TRUE(store.save("usage_test.tsdb"));
+	UsageSeriesStore loaded;
+	ASSERT_TRUE(loaded.load("usage_test.tsdb"));
+	EXPECT_EQ(all.size(), loaded.size());
+
+	/*Appends continue the loaded blocks*/
+	UsageSession late = { 7, 7, end - 100, 900 };
+	loaded.append(late);
+	found.clear();
+	EXPECT_EQ(61, loaded.scanMember(7, end - 30 * day, end, found));
+
+	EXPECT_EQ(50 * 2 * 14, loaded.dropBefore(start + 14 * day));
+	EXPECT_EQ(all.size() + 1 - 1400, loaded.size());
+	remove("usage_test.tsdb");
+}
+
+/*Testing timestamps whose delta-of-delta sits right on the edge of each encoding bucket*/
+TEST(test_usage_series_case2, test_usage_series)
+{
+	UsageSeriesStore store;
+	unsigned long long start = 1444000000ull / UsageSeriesStore::DEFAULT_PARTITION_SECONDS * UsageSeriesStore::DEFAULT_PARTITION_SECONDS;
+	long long dods[] = { 10000, 64, -64, 63, -63, 65, -65, 256, -256, 255, -255, 257, -257, 2048, -2048, 2047, -2047, 2049, -2049, 0 };
+
+	vector<UsageSession> all;
+	unsigned long long timestamp = start;
+	long long delta = 0;
+	for (size_t i = 0; i <= sizeof(dods) / sizeof(dods[0]); i++)
+	{
+		UsageSession session = { 1, 1, timestamp, 600 };
+		store.append(session);
+		all.push_back(session);
+		if (i < sizeof(dods) / sizeof(dods[0]))
+		{
+			delta += dods[i];
+			timestamp += delta;
+		}
+	}
 
-	/**
-	Prints out all data related to the current customer to the console. The output takes the following format:
+	vector<UsageSession> found;
+	ASSERT_EQ(all.size(), store.scanMember(1, start, timestamp + 1, found));
+	for (size_t i = 0; i < all.size(); i++)
+		EXPECT_EQ(all[i].timestamp, found[i].timestamp);
+
+	/*Files whose blocks claim more sessions than their bits hold, or hold the same series twice, are refused*/
+	ASSERT_TRUE(store.save("usage_edge_test.tsdb"));
+	fstream input("usage_edge_test.tsdb", ios::in | ios::binary);
+	string saved((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+	input.close();
+
+	string corrupt = saved;
+	ByteOrder::putU64(&corrupt[24 + 24], all.size() + 1);
+	fstream("usage_edge_test.tsdb", ios::out | ios::trunc | ios::binary).write(corrupt.data(), corrupt.size());
+	UsageSeriesStore loaded;
+	EXPECT_FALSE(loaded.load("usage_edge_test.tsdb"));
+
+	corrupt = saved;
+	ByteOrder::putU64(&corrupt[24 + 32], ByteOrder::getU64(&corrupt[24 + 32]) - 8);
+	corrupt.erase(24 + 40, 1);
+	fstream("usage_edge_test.tsdb", ios::out | ios::trunc | ios::binary).write(corrupt.data(), corrupt.size());
+	EXPECT_FALSE(loaded.load("usage_edge_test.tsdb"));
+
+	corrupt = saved + saved.substr(24);
+	ByteOrder::putU64(&corrupt[16], 2);
+	fstream("usage_edge_test.tsdb", ios::out | ios::trunc | ios::binary).write(corrupt.data(), corrupt.size());
+	EXPECT_FALSE(loaded.load("usage_edge_test.tsdb"));
+
+	fstream("usage_edge_test.tsdb", ios::out | ios::trunc | ios::binary).write(saved.data(), saved.size());
+	ASSERT_TRUE(loaded.load("usage_edge_test.tsdb"));
+	found.clear();
+	EXPECT_EQ(all.size(), loaded.scanMember(1, start, timestamp + 1, found));
+	remove("usage_edge_test.tsdb");
+
+	/*A partition length of 0 falls back to the default instead of dividing by it*/
+	UsageSeriesStore unpartitioned(0);
+	unpartitioned.append(all[0]);
+	found.clear();
+	EXPECT_EQ(1, unpartitioned.scanMember(1, start, start + 1, found));
+}
+
+/*Testing zone capacity caps from one and from many threads, and moving between zones*/
+TEST(test_zone_occupancy_case1, test_zone_occupancy)
+{
+	const size_t WEIGHT_ROOM = 0, POOL = 1;
+	ZoneOccupancy occupancy(2, 10000, 4);
+	occupancy.setCapacity(WEIGHT_ROOM, 100);
+	occupancy.setCapacity(POOL, 30);
+
+	/*Many turnstiles at once never let more than the capacity in*/
+	atomic<int> admitted(0);
+	vector<thread> turnstiles;
+	for (unsigned long t = 0; t < 4; t++)
+	{
+		turnstiles.push_back(thread([&occupancy, &admitted, t]()
+		{
+			for (unsigned long b = 1; b <= 300; b++)
+			{
+				if (occupancy.tapIn(t * 1000 + b, WEIGHT_ROOM) == ZoneOccupancy::Admission::ADMITTED)
+					admitted++;
+			}
+		}));
+	}
+	for (size_t t = 0; t < turnstiles.size(); t++)
+		turnstiles[t].join();
+	EXPECT_EQ(100, admitted.load());
+	EXPECT_EQ(100, occupancy.getOccupancy(WEIGHT_ROOM));
+
+	Customer c;
+	c.initialize("John Doe", "123 Maple Rd", 123456789, 5555, Customer::SubscriptionLevel::BASIC);
+	EXPECT_EQ(ZoneOccupancy::Admission::ZONE_FULL, occupancy.tapIn(&c, WEIGHT_ROOM));
+
+	/*Moving someone from the weight room to the pool frees a place*/
+	size_t zone = 99;
+	unsigned long inside = 0;
+	for (unsigned long b = 1; b <= 4300 && inside == 0; b++)
+	{
+		if (occupancy.getZoneOf(b, zone))
+			inside = b;
+	}
+	ASSERT_NE(0, inside);
+	EXPECT_EQ(WEIGHT_ROOM, zone);
+	EXPECT_EQ(ZoneOccupancy::Admission::ALREADY_INSIDE, occupancy.tapIn(inside, WEIGHT_ROOM));
+	EXPECT_EQ(ZoneOccupancy::Admission::ADMITTED, occupancy.tapIn(inside, POOL));
+	EXPECT_EQ(99, occupancy.getOccupancy(WEIGHT_ROOM));
+	EXPECT_EQ(1, occupancy.getOccupancy(POOL));
+	EXPECT_FALSE(occupancy.tapOut(inside, WEIGHT_ROOM));
+	EXPECT_EQ(ZoneOccupancy::Admission::ADMITTED, occupancy.tapIn(&c, WEIGHT_ROOM));
+	EXPECT_TRUE(occupancy.tapOut(&c, WEIGHT_ROOM));
+
+	/*Lowering the capacity below the occupancy admits no one until enough people leave*/
+	occupancy.setCapacity(WEIGHT_ROOM, 50);
+	EXPECT_EQ(ZoneOccupancy::Admission::ZONE_FULL, occupancy.tapIn(&c, WEIGHT_ROOM));
+	size_t left = 0;
+	for (unsigned long b = 1; b <= 4300; b++)
+	{
+		if (b != inside && left < 50 && occupancy.tapOut(b, WEIGHT_ROOM))
+			left++;
+	}
+	EXPECT_EQ(49, occupancy.getOccupancy(WEIGHT_ROOM));
+	EXPECT_EQ(ZoneOccupancy::Admission::ADMITTED, occupancy.tapIn(&c, WEIGHT_ROOM));
+	EXPECT_EQ(ZoneOccupancy::Admission::ZONE_FULL, occupancy.tapIn(9999, WEIGHT_ROOM));
+	EXPECT_EQ(ZoneOccupancy::Admission::UNKNOWN_BRACELET, occupancy.tapIn(0ul, POOL));
+
+	/*Turnstiles refilling their shards while the capacity keeps changing leave no tokens behind that beat the last cap*/
+	ZoneOccupancy busy(1, 10000, 4);
+	busy.setCapacity(0, 64);
+	atomic<bool> churning(true);
+	vector<thread> churners;
+	for (unsigned long t = 0; t < 4; t++)
+	{
+		churners.push_back(thread([&busy, &churning, t]()
+		{
+			for (unsigned long b = 1; churning.load(); b = b % 100 + 1)
+			{
+				if (busy.tapIn(t * 1000 + b, 0) == ZoneOccupancy::Admission::ADMITTED)
+					busy.tapOut(t * 1000 + b, 0);
+			}
+		}));
+	}
+	for (int round = 0; round < 2000; round++)
+		busy.setCapacity(0, round % 2 == 0 ? 1 : 64);
+	churning = false;
+	for (size_t t = 0; t < churners.size(); t++)
+		churners[t].join();
 
-	Name
-	Address
-	Membership ID
-	Bracelet ID
-	Employee ID
-	*/
-	void print(void)
+	for (unsigned long t = 0; t < 4; t++)
 	{
-		cout << getName() << endl << getAddress() << endl << getMembershipID() << endl << getBraceletID()
-			<< endl << getEmployeeID() << endl;
+		for (unsigned long b = 1; b <= 100; b++)
+			busy.tapOut(t * 1000 + b, 0);
+	}
+	ASSERT_EQ(0, busy.getOccupancy(0));
+	busy.setCapacity(0, 5);
+	int let_in = 0;
+	for (unsigned long b = 5001; b <= 5100; b++)
+		let_in += busy.tapIn(b, 0) == ZoneOccupancy::Admission::ADMITTED ? 1 : 0;
+	EXPECT_EQ(5, let_in);
+}
+
+/*Testing that generated populations are reproducible, follow the configured distributions and load into a registry and snapshot*/
+TEST(test_population_case1, test_population)
+{
+	PopulationOptions options;
+	options.address_count = 1000;
+	PopulationGenerator generator(options);
+	ThreadPool pool(4);
+
+	vector<Member*> serial, parallel;
+	generator.generate(0, 100000, serial, NULL);
+	generator.generate(0, 100000, parallel, &pool);
+
+	map<string, int> by_address;
+	size_t staff = 0, deluxe = 0;
+	for (size_t i = 0; i < serial.size(); i++)
+	{
+		EXPECT_STREQ(serial[i]->getName().c_str(), parallel[i]->getName().c_str());
+		EXPECT_STREQ(serial[i]->getAddress().c_str(), parallel[i]->getAddress().c_str());
+		EXPECT_EQ(serial[i]->getMemberType(), parallel[i]->getMemberType());
+		EXPECT_EQ(i + 1, serial[i]->getMembershipID());
+
+		by_address[serial[i]->getAddress()]++;
+		if (serial[i]->getMemberType() == Member::Type::STAFF)
+			staff++;
+		else if (((Customer*)serial[i])->getSubscriptionLevel() == Customer::SubscriptionLevel::DELUXE)
+			deluxe++;
 	}
 
-	/**
-	To be used by the MemberFactory, the clone() function returns another instance of the current Staff.
-	*/
-	Staff* clone()
+	/*2% staff, and 10% of customers on DELUXE*/
+	EXPECT_NEAR(2000, staff, 300);
+	EXPECT_NEAR(9800, deluxe, 600);
+
+	/*Zipfian addresses: the most shared address has far more members than the typical one*/
+	vector<int> counts;
+	for (map<string, int>::iterator a = by_address.begin(); a != by_address.end(); a++)
+		counts.push_back(a->second);
+	sort(counts.begin(), counts.end());
+	EXPECT_GT(counts.back(), 50 * counts[counts.size() / 2]);
+
+	/*A different seed makes different members*/
+	options.seed = 331;
+	PopulationGenerator other(options);
+	Member* different = other.generate(0);
+	Member* same = generator.generate(0);
+	EXPECT_STREQ(serial[0]->getName().c_str(), same->getName().c_str());
+	EXPECT_TRUE(different->getName() != same->getName() || different->getAddress() != same->getAddress());
+	delete different;
+	delete same;
+
+	for (size_t i = 0; i < serial.size(); i++)
 	{
-		return new Staff(*this);
+		delete serial[i];
+		delete parallel[i];
 	}
 
-	/**
-	Serializes the current Staff object into a structured object to be stored in text.
-	*/
-	void serialize(string file_name)
+	MemberRegistry registry;
+	generator.generateInto(registry, 150000, &pool);
+	EXPECT_EQ(150000, registry.size());
+
+	ASSERT_TRUE(generator.generateSnapshot("population_test.snap", 1000, MemberSnapshot::Codec::FIXED_WIDTH, &pool));
+	vector<Member*> loaded;
+	ASSERT_TRUE(MemberSnapshot::load("population_test.snap", loaded));
+	ASSERT_EQ(1000, loaded.size());
 	{
-		/*Create a customer protobuff object*/
-		seng330a2::Staff s;
-		s.set_employee_id(getEmployeeID());
-		
+		MemberRegistry::ReadGuard guard(registry);
+		EXPECT_STREQ(guard.findByMembershipID(500)->getName().c_str(), loaded[499]->getName().c_str());
+	}
+	for (size_t i = 0; i < loaded.size(); i++)
+		delete loaded[i];
+	remove("population_test.snap");
+}
+
+/*Benchmark: generating 2 million members straight into a registry. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_population, DISABLED_bench_population_2m)
+{
+	PopulationOptions options;
+	PopulationGenerator generator(options);
+	ThreadPool pool;
+	MemberRegistry registry;
+
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	generator.generateInto(registry, 2000000, &pool);
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+	EXPECT_EQ(2000000, registry.size());
+	cout << "Generated " << registry.size() << " members in " << seconds << " s (" << (long long)(registry.size() / seconds) << " members/s)" << endl;
+}
+
+/*Testing that a tap trace survives a save and load, and that replays of it make the same decisions on the same members*/
+TEST(test_tap_trace_case1, test_tap_trace)
+{
+	PopulationOptions options;
+	PopulationGenerator generator(options);
 
-		/*Set the staff clearance for protobuff*/
-		switch (getStaffClearance())
+	/*5000 taps, one every 20us, one in ten from a bracelet nobody wears*/
+	vector<TapEvent> events(5000);
+	size_t unknown = 0;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		events[i].time_us = i * 20;
+		events[i].reader_id = (unsigned int)(i % 12);
+		events[i].bracelet_id = options.first_bracelet_id + (unsigned long)((i * 7919) % 2000);
+		if (i % 10 == 0)
 		{
-			case Staff::Clearance::MANAGER:
-				s.set_staff_clearance(seng330a2::Staff_Clearance::Staff_Clearance_MANAGER);
-				break;
-			case Staff::Clearance::ADMINISTRATOR:
-				s.set_staff_clearance(seng330a2::Staff_Clearance::Staff_Clearance_ADMINISTRATOR);
-				break;
-			default:
-				s.set_staff_clearance(seng330a2::Staff_Clearance::Staff_Clearance_GENERAL);
-				break;
+			events[i].bracelet_id = 42;
+			unknown++;
 		}
+	}
 
-		/*Create a Member protobuff object*/
-		seng330a2::Member m;
-		m.set_name(getName());
-		m.set_address(getAddress());
-		m.set_membership_id(getMembershipID());
-		m.set_bracelet_id(getBraceletID());
+	ASSERT_TRUE(TapTrace::save("tap_test.trace", events));
+	vector<TapEvent> loaded;
+	ASSERT_TRUE(TapTrace::load("tap_test.trace", loaded));
+	ASSERT_EQ(events.size(), loaded.size());
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		EXPECT_EQ(events[i].time_us, loaded[i].time_us);
+		EXPECT_EQ(events[i].bracelet_id, loaded[i].bracelet_id);
+		EXPECT_EQ(events[i].reader_id, loaded[i].reader_id);
+	}
+
+	/*Each replay gets its own copy of the same members, since these replays spend credits*/
+	MemberRegistry baseline_registry, candidate_registry, free_registry;
+	generator.generateInto(baseline_registry, 2000, NULL);
+	generator.generateInto(candidate_registry, 2000, NULL);
+	generator.generateInto(free_registry, 2000, NULL);
+
+	long long credits_before = 0;
+	{
+		MemberRegistry::ReadGuard guard(baseline_registry);
+		guard.forEach([&](Member* m) { if (m->getMemberType() == Member::Type::CUSTOMER) credits_before += ((Customer*)m)->getGymCredits(); });
+	}
 
-		/*Set the member type for protobuff*/
-		switch (getMemberType())
+	TapReplayer baseline_replayer(baseline_registry, true);
+	ReplayResult baseline = baseline_replayer.replay(loaded, 0);
+	EXPECT_EQ(events.size(), baseline.taps);
+	EXPECT_EQ(unknown, baseline.denied[AdmissionPolicy::UNKNOWN_BRACELET]);
+	EXPECT_GT(baseline.denied[AdmissionPolicy::NO_CREDITS], 0);
+	EXPECT_EQ(events.size(), baseline.admitted + baseline.denied[AdmissionPolicy::UNKNOWN_BRACELET]
+		+ baseline.denied[AdmissionPolicy::INACTIVE_SUBSCRIPTION] + baseline.denied[AdmissionPolicy::NO_CREDITS]);
+	EXPECT_LE(baseline.latency_p50, baseline.latency_p99);
+	EXPECT_LE(baseline.latency_p99, baseline.latency_max);
+
+	/*Every admitted customer paid one credit*/
+	long long credits_after = 0;
+	unsigned long long staff_taps = 0;
+	{
+		MemberRegistry::ReadGuard guard(baseline_registry);
+		guard.forEach([&](Member* m) { if (m->getMemberType() == Member::Type::CUSTOMER) credits_after += ((Customer*)m)->getGymCredits(); });
+		for (size_t i = 0; i < loaded.size(); i++)
 		{
-		case Member::Type::STAFF:
-			m.set_member_type(seng330a2::Member_Type::Member_Type_STAFF);
-			break;
-		default:
-			m.set_member_type(seng330a2::Member_Type::Member_Type_CUSTOMER);
-			break;
+			Member* m = guard.findByBraceletID(loaded[i].bracelet_id);
+			if (m != NULL && m->getMemberType() == Member::Type::STAFF)
+				staff_taps++;
 		}
+	}
+	EXPECT_EQ(baseline.admitted - staff_taps, (unsigned long long)(credits_before - credits_after));
+
+	/*At 10x the 100ms trace takes at least 10ms, and makes the same decisions as at full speed*/
+	TapReplayer candidate_replayer(candidate_registry, true);
+	ReplayResult candidate = candidate_replayer.replay(loaded, 10);
+	EXPECT_GE(candidate.seconds, 0.0099);
+	EXPECT_EQ(baseline.digest, candidate.digest);
+
+	ASSERT_TRUE(TapReplayer::saveResult("tap_test.result", baseline));
+	ReplayResult reloaded;
+	ASSERT_TRUE(TapReplayer::loadResult("tap_test.result", reloaded));
+	EXPECT_EQ(baseline.admitted, reloaded.admitted);
+	EXPECT_EQ(baseline.latency_p999, reloaded.latency_p999);
+	EXPECT_EQ(baseline.digest, reloaded.digest);
+
+	stringstream report;
+	EXPECT_TRUE(TapReplayer::compare(reloaded, candidate, report));
+	EXPECT_NE(string::npos, report.str().find("decisions identical"));
+
+	/*Without charging credits, as the live service does, nobody runs out, so the decisions differ*/
+	TapReplayer free_replayer(free_registry);
+	ReplayResult free_result = free_replayer.replay(loaded, 0);
+	EXPECT_LT(free_result.denied[AdmissionPolicy::NO_CREDITS], baseline.denied[AdmissionPolicy::NO_CREDITS]);
+	stringstream other_report;
+	EXPECT_FALSE(TapReplayer::compare(baseline, free_result, other_report));
+
+	/*Live taps are recorded with their arrival times*/
+	TapRecorder recorder;
+	recorder.record(options.first_bracelet_id, 1);
+	this_thread::sleep_for(chrono::milliseconds(2));
+	recorder.record(options.first_bracelet_id + 1, 2);
+	EXPECT_EQ(2, recorder.size());
+	ASSERT_TRUE(recorder.save("tap_test.trace"));
+	ASSERT_TRUE(TapTrace::load("tap_test.trace", loaded));
+	ASSERT_EQ(2, loaded.size());
+	EXPECT_GE(loaded[1].time_us - loaded[0].time_us, 2000);
+	EXPECT_EQ(2, loaded[1].reader_id);
+
+	remove("tap_test.trace");
+	remove("tap_test.result");
+}
+
+/*Benchmark: replaying a million taps of a 6pm rush against a million members at full speed. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_tap_trace, DISABLED_bench_tap_replay_1m)
+{
+	PopulationOptions options;
+	PopulationGenerator generator(options);
+	ThreadPool pool;
+	MemberRegistry registry;
+	generator.generateInto(registry, 1000000, &pool);
+
+	vector<TapEvent> events(1000000);
+	unsigned long long state = 330;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		events[i].time_us = i * 3;
+		events[i].reader_id = (unsigned int)(i % 64);
+		events[i].bracelet_id = options.first_bracelet_id + (unsigned long)((state >> 33) % 1000000);
+	}
+
+	TapReplayer replayer(registry);
+	ReplayResult result = replayer.replay(events, 0);
+	EXPECT_EQ(events.size(), result.taps);
+	cout << "Replayed " << result.taps << " taps in " << result.seconds << " s (" << (long long)result.taps_per_second << " taps/s), admitted "
+		<< result.admitted << ", p50 " << result.latency_p50 << " ns, p99 " << result.latency_p99 << " ns, p999 " << result.latency_p999
+		<< " ns, max " << result.latency_max << " ns" << endl;
+}
+
+/*Testing that latency percentiles stay within a bucket of the truth, that stripes merge, and that member operations record themselves*/
+TEST(test_latency_histogram_case1, test_latency_histogram)
+{
+	/*Values under 128 are exact, larger ones within 1/64*/
+	EXPECT_EQ(100, LatencyHistogram::bucketTop(LatencyHistogram::bucketOf(100)));
+	for (unsigned long long v = 128; v < 100000000000ull; v = v * 3 + 1)
+	{
+		unsigned long long top = LatencyHistogram::bucketTop(LatencyHistogram::bucketOf(v));
+		EXPECT_GE(top, v);
+		EXPECT_LE(top - v, v / 64);
+	}
 
-		/*Insert the Staff protobuff object into the Member object*/
-		m.set_allocated_staff(&s);
+	/*Four threads record 1..100000 between them*/
+	LatencyHistogram histogram;
+	vector<thread> threads;
+	for (int t = 0; t < 4; t++)
+	{
+		threads.push_back(thread([&histogram, t]()
+		{
+			for (unsigned long long v = t + 1; v <= 100000; v += 4)
+				histogram.record(v);
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+
+	LatencyHistogram::Snapshot snapshot = histogram.getSnapshot();
+	EXPECT_EQ(100000, snapshot.getCount());
+	EXPECT_EQ(100000, snapshot.getMax());
+	EXPECT_NEAR(50000, (double)snapshot.percentile(0.5), 50000 / 64.0);
+	EXPECT_NEAR(99000, (double)snapshot.percentile(0.99), 99000 / 64.0);
+	EXPECT_NEAR(99900, (double)snapshot.percentile(0.999), 99900 / 64.0);
+	EXPECT_EQ(100000, snapshot.percentile(1.0));
+
+	/*Taking a snapshot starts a new interval*/
+	LatencyHistogram::Snapshot interval = histogram.takeSnapshot();
+	EXPECT_EQ(100000, interval.getCount());
+	EXPECT_EQ(0, histogram.getSnapshot().getCount());
+	histogram.record(5000000);
+	LatencyHistogram::Snapshot next = histogram.takeSnapshot();
+	EXPECT_EQ(1, next.getCount());
+	EXPECT_EQ(5000000, next.percentile(0.5));
+
+	interval.merge(next);
+	EXPECT_EQ(100001, interval.getCount());
+	EXPECT_EQ(5000000, interval.getMax());
+
+	/*The member operations record into the process-wide stats*/
+	LatencyStats& stats = LatencyStats::instance();
+	stats.reset();
+	MemberFactory factory;
+	Customer* c = factory.getCustomer();
+	Staff* s = factory.getStaff();
+	c->setMembershipID(1);
+	c->setBraceletID(100);
+	EXPECT_EQ(2, stats.getHistogram(LatencyStats::FACTORY_CREATE).getSnapshot().getCount());
+
+	/*Constructing and deserializing a customer set its credits without counting as credit mutations*/
+	c->addGymCredits(5);
+	c->deductGymCredits(1);
+	EXPECT_EQ(2, stats.getHistogram(LatencyStats::CREDIT_MUTATION).getSnapshot().getCount());
+	c->serialize("latency_test.bin");
+	delete c->deserialize("latency_test.bin");
+	EXPECT_EQ(2, stats.getHistogram(LatencyStats::CREDIT_MUTATION).getSnapshot().getCount());
+
+	MemberRegistry registry;
+	registry.publish(c);
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		EXPECT_TRUE(guard.findByMembershipID(1) != NULL);
+		EXPECT_TRUE(guard.findByBraceletID(100) != NULL);
+		EXPECT_TRUE(guard.findByBraceletID(101) == NULL);
+	}
 
-		/*Save the created Member protobuff object to file*/
-		fstream output(file_name, ios::out | ios::trunc | ios::binary);
-		m.SerializeToOstream(&output);
+	EXPECT_EQ(1, stats.getHistogram(LatencyStats::SERIALIZE).getSnapshot().getCount());
+	EXPECT_EQ(1, stats.getHistogram(LatencyStats::DESERIALIZE).getSnapshot().getCount());
+	EXPECT_EQ(3, stats.getHistogram(LatencyStats::LOOKUP).getSnapshot().getCount());
+	EXPECT_GT(stats.getHistogram(LatencyStats::DESERIALIZE).getSnapshot().percentile(0.99), 0);
+
+	/*Neither does loading a fixed width snapshot or merging a delta log on top of it*/
+	Customer stored;
+	stored.setMembershipID(2);
+	stored.addGymCredits(10);
+	vector<Member*> saved(1, &stored);
+	ASSERT_TRUE(MemberSnapshot::save("latency_test.snap", saved, MemberSnapshot::Codec::FIXED_WIDTH));
+	stored.deductGymCredits(3);
+	string delta;
+	DeltaLog::encodeUpsert(delta, &stored, Member::Field::GYM_CREDITS);
+	remove("latency_test.delta");
+	DeltaLog::appendBlock("latency_test.delta", delta);
+	EXPECT_EQ(4, stats.getHistogram(LatencyStats::CREDIT_MUTATION).getSnapshot().getCount());
+
+	vector<Member*> loaded;
+	ASSERT_TRUE(DeltaLog::load("latency_test.snap", "latency_test.delta", loaded));
+	ASSERT_EQ(1, loaded.size());
+	EXPECT_EQ(27, ((Customer*)loaded[0])->getGymCredits());
+	EXPECT_EQ(4, stats.getHistogram(LatencyStats::CREDIT_MUTATION).getSnapshot().getCount());
+	delete loaded[0];
+	remove("latency_test.snap");
+	remove("latency_test.delta");
+
+	/*Switched off, nothing is recorded, but operations are still counted, and resetting the histograms keeps the counts*/
+	unsigned long long creations = stats.getOperationCount(LatencyStats::FACTORY_CREATE);
+	stats.setEnabled(false);
+	delete factory.getCustomer();
+	stats.setEnabled(true);
+	EXPECT_EQ(2, stats.getHistogram(LatencyStats::FACTORY_CREATE).getSnapshot().getCount());
+	EXPECT_EQ(creations + 1, stats.getOperationCount(LatencyStats::FACTORY_CREATE));
+	stats.reset();
+	stats.getHistogram(LatencyStats::FACTORY_CREATE).takeSnapshot();
+	EXPECT_EQ(creations + 1, stats.getOperationCount(LatencyStats::FACTORY_CREATE));
+
+	delete s;
+	remove("latency_test.bin");
+}
+
+/*Testing that cache aligned arrays start every element on a cache line of its own*/
+TEST(test_cache_aligned_case1, test_cache_aligned)
+{
+	/*Every element starts on a line of its own, however the allocator aligned the block*/
+	struct Counter
+	{
+		atomic<long> value;
+		char padding[64 - sizeof(atomic<long>)];
+	};
+	for (size_t count = 1; count <= 9; count++)
+	{
+		CacheAlignedArray<Counter> counters(count);
+		EXPECT_EQ(count, counters.size());
+		for (size_t i = 0; i < count; i++)
+		{
+			EXPECT_EQ(0u, (size_t)&counters[i] % CacheAlignedArray<Counter>::LINE_SIZE);
+			counters[i].value.store((long)i);
+		}
+		for (size_t i = 0; i < count; i++)
+			EXPECT_EQ((long)i, counters[i].value.load());
+	}
+}
+
+/*Testing that exported metrics follow the registry, and that the text is served over a file and loopback HTTP*/
+TEST(test_metrics_exporter_case1, test_metrics_exporter)
+{
+	MemberRegistry registry;
+	MemberFactory factory;
+	for (unsigned long i = 1; i <= 10; i++)
+	{
+		Customer* c = factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(100 + i);
+		c->setSubscriptionLevel(i <= 6 ? Customer::SubscriptionLevel::BASIC : Customer::SubscriptionLevel::DELUXE);
+		c->setGymCredits(10);
+		registry.publish(c);
+	}
+	Staff* s = factory.getStaff();
+	s->setMembershipID(11);
+	s->setBraceletID(111);
+	registry.publish(s);
+
+	/*Members published before the exporter existed are counted too*/
+	MetricsExporter exporter(registry);
+	registry.update(1, [](Member* m) { ((Customer*)m)->deductGymCredits(3); });
+	registry.update(2, [](Member* m) { ((Customer*)m)->addGymCredits(5); });
+	registry.update(7, [](Member* m) { ((Customer*)m)->setSubscriptionLevel(Customer::SubscriptionLevel::INACTIVE); });
+	registry.remove(10);
+
+	unsigned long long lookups = LatencyStats::instance().getOperationCount(LatencyStats::LOOKUP);
+	LatencyStats::instance().reset();
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		guard.findByBraceletID(101);
 	}
 
-	/**
-	Reads a structured serialized file and returns an appropriate Staff object from it
-	*/
-	Staff* deserialize(string file_name)
+	string text = exporter.render();
+	EXPECT_NE(string::npos, text.find("# TYPE s330_registry_members gauge\ns330_registry_members 10\n"));
+	EXPECT_NE(string::npos, text.find("s330_members{type=\"customer\",subscription_level=\"basic\"} 6\n"));
+	EXPECT_NE(string::npos, text.find("s330_members{type=\"customer\",subscription_level=\"deluxe\"} 2\n"));
+	EXPECT_NE(string::npos, text.find("s330_members{type=\"customer\",subscription_level=\"inactive\"} 1\n"));
+	EXPECT_NE(string::npos, text.find("s330_members{type=\"staff\"} 1\n"));
+	EXPECT_NE(string::npos, text.find("s330_gym_credits_outstanding 92\n"));
+	EXPECT_NE(string::npos, text.find("s330_gym_credits_added_total 5\n"));
+	EXPECT_NE(string::npos, text.find("s330_gym_credits_deducted_total 3\n"));
+	EXPECT_NE(string::npos, text.find("s330_operations_total{operation=\"lookup\"} " + to_string(lookups + 1) + "\n"));
+	EXPECT_NE(string::npos, text.find("s330_operation_duration_seconds_bucket{operation=\"lookup\",le=\"+Inf\"} 1\n"));
+	EXPECT_NE(string::npos, text.find("s330_operation_duration_seconds_bucket{operation=\"lookup\",le=\"1\"} 1\n"));
+	EXPECT_NE(string::npos, text.find("s330_operation_duration_seconds_count{operation=\"serialize\"} 0\n"));
+
+	ASSERT_TRUE(exporter.writeFile("metrics_test.prom"));
+	ASSERT_TRUE(exporter.writeFile("metrics_test.prom"));
 	{
-		/*Read serialized file for the current Member and extract it*/
-		fstream input(file_name, ios::in | ios::binary);
-		seng330a2::Member m;
-		m.ParseFromIstream(&input);
+		fstream input("metrics_test.prom", ios::in | ios::binary);
+		string written((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+		EXPECT_EQ(text.substr(0, 200), written.substr(0, 200));
+	}
+	remove("metrics_test.prom");
+
+	ASSERT_TRUE(exporter.startFileWriter("metrics_test.prom", chrono::milliseconds(10)));
+	EXPECT_FALSE(exporter.startFileWriter("metrics_test.prom", chrono::milliseconds(10)));
+	this_thread::sleep_for(chrono::milliseconds(50));
+	exporter.stop();
+	EXPECT_EQ(0, remove("metrics_test.prom"));
 
-		/*Extract the Staff from the Member protobuff object*/
-		seng330a2::Staff s;
-		s = m.staff();
+#ifdef __linux__
+	ASSERT_TRUE(exporter.startHttp(0));
+	ASSERT_NE(0, exporter.getPort());
 
-		/*Create a new Staff object and returns it*/
-		Staff sr;
-		sr.setName(m.name());
-		sr.setAddress(m.address());
-		sr.setMembershipID(m.membership_id());
-		sr.setBraceletID(m.bracelet_id());
-		sr.setMemberType(Member::Type::CUSTOMER);
-		sr.setEmployeeID(s.employee_id());
+	function<string(string)> fetch = [&](string path)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(exporter.getPort());
+		string response;
+		if (connect(fd, (sockaddr*)&address, sizeof(address)) == 0)
+		{
+			string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+			send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+			char buffer[4096];
+			ssize_t n;
+			while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+				response.append(buffer, n);
+		}
+		close(fd);
+		return response;
+	};
+
+	string scraped = fetch("/metrics");
+	EXPECT_EQ(0, scraped.find("HTTP/1.1 200 OK\r\n"));
+	EXPECT_NE(string::npos, scraped.find("s330_registry_members 10\n"));
+	EXPECT_EQ(0, fetch("/other").find("HTTP/1.1 404"));
+	exporter.stop();
+	EXPECT_EQ(0, exporter.getPort());
+#endif
+}
+
+/*Testing that a traced import, save and billing run show up phase by phase, and that the rings keep only recent spans*/
+TEST(test_trace_spans_case1, test_trace_spans)
+{
+	SpanTracer& tracer = SpanTracer::instance();
+	tracer.clear();
+	tracer.setEnabled(true);
+
+	PopulationOptions options;
+	PopulationGenerator generator(options);
+	ThreadPool pool(2);
+	vector<Member*> members;
+	generator.generate(0, 20000, members, &pool);
+
+	LZCodec lz;
+	ASSERT_TRUE(MemberSnapshot::save("trace_test.snap", members, MemberSnapshot::Codec::PROTOBUF, lz, &pool, 16384));
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+	members.clear();
+
+	ASSERT_TRUE(MemberSnapshot::load("trace_test.snap", members, &pool));
+	MemberRegistry registry;
+	registry.publishBatch(members);
+
+	BillingEngine billing(registry, pool);
+	ASSERT_TRUE(billing.run("2015-11", "trace_test.checkpoint", ""));
+	tracer.setEnabled(false);
+
+	ASSERT_TRUE(tracer.dump("trace_test.json"));
+	fstream input("trace_test.json", ios::in | ios::binary);
+	string json((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+	input.close();
+
+	EXPECT_EQ(0, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+	EXPECT_EQ(json.size() - 4, json.rfind("\n]}\n"));
+	const char* phases[] = { "snapshot.encode", "snapshot.compress", "snapshot.write", "block.compress", "snapshot.read", "snapshot.decompress",
+		"block.decompress", "snapshot.parse", "snapshot.convert", "registry.index", "billing.collect", "billing.chunk", "billing.checkpoint" };
+	for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++)
+		EXPECT_NE(string::npos, json.find(string("{\"name\":\"") + phases[i] + "\""));
+
+	/*Blocks are decompressed on the pool's threads, each on a row of its own next to the main thread*/
+	size_t rows = 0;
+	for (size_t at = json.find("\"thread_name\""); at != string::npos; at = json.find("\"thread_name\"", at + 1))
+		rows++;
+	EXPECT_GE(rows, 2);
+
+	/*Cleared spans are gone, and only the newest RING_SIZE spans of a thread are kept*/
+	tracer.clear();
+	EXPECT_EQ(string::npos, tracer.toJson().find("snapshot.read"));
+	tracer.setEnabled(true);
+	for (size_t i = 0; i < SpanTracer::RING_SIZE + 100; i++)
+		TraceSpan span("test.span", "test");
+	tracer.setEnabled(false);
+	{
+		TraceSpan span("test.untraced", "test");
+	}
 
-		/*Set Subscription Level*/
-		switch (s.staff_clearance())
+	string recent = tracer.toJson();
+	size_t spans = 0;
+	for (size_t at = recent.find("\"test.span\""); at != string::npos; at = recent.find("\"test.span\"", at + 1))
+		spans++;
+	EXPECT_EQ((size_t)SpanTracer::RING_SIZE, spans);
+	EXPECT_EQ(string::npos, recent.find("test.untraced"));
+	tracer.clear();
+
+	remove("trace_test.snap");
+	remove("trace_test.checkpoint");
+	remove("trace_test.json");
+}
+
+/*Testing that every subsystem charges the memory it allocates and releases it when freed*/
+TEST(test_memory_stats_case1, test_memory_stats)
+{
+	MemoryStats& stats = MemoryStats::instance();
+	MemberFactory member_factory;
+
+	/*Every Customer is charged while it lives, and so is a name too long to be stored inside the string*/
+	MemoryStats::Usage objects = stats.getUsage(MemoryStats::MEMBER_OBJECTS);
+	MemoryStats::Usage strings = stats.getUsage(MemoryStats::STRINGS);
+	Customer* c = member_factory.getCustomer();
+	EXPECT_EQ(objects.live_bytes + (long long)sizeof(Customer), stats.getUsage(MemoryStats::MEMBER_OBJECTS).live_bytes);
+	EXPECT_EQ(objects.allocations + 1, stats.getUsage(MemoryStats::MEMBER_OBJECTS).allocations);
+	c->setName("Bob");
+	EXPECT_EQ(strings.live_bytes, stats.getUsage(MemoryStats::STRINGS).live_bytes);
+	c->setName("Bartholomew Montgomery-Smythe");
+	EXPECT_EQ(strings.live_bytes + 30, stats.getUsage(MemoryStats::STRINGS).live_bytes);
+	c->setName("Bob");
+	EXPECT_EQ(strings.live_bytes, stats.getUsage(MemoryStats::STRINGS).live_bytes);
+	delete c;
+	EXPECT_EQ(objects.live_bytes, stats.getUsage(MemoryStats::MEMBER_OBJECTS).live_bytes);
+	EXPECT_EQ(objects.frees + 1, stats.getUsage(MemoryStats::MEMBER_OBJECTS).frees);
+
+	/*A registry's records and indexes, and a permission cache's tables, are charged until they are destroyed*/
+	MemoryStats::Usage records = stats.getUsage(MemoryStats::REGISTRY_RECORDS);
+	MemoryStats::Usage index = stats.getUsage(MemoryStats::REGISTRY_INDEX);
+	MemoryStats::Usage cache = stats.getUsage(MemoryStats::PERMISSION_CACHE);
+	vector<Member*> members;
+	{
+		MemberRegistry registry;
+		PermissionCache permissions(registry);
+		for (unsigned long i = 1; i <= 1000; i++)
 		{
-		case seng330a2::Staff_Clearance::Staff_Clearance_ADMINISTRATOR:
-			sr.setStaffClearance(Staff::Clearance::ADMINISTRATOR);
-			break;
-		case seng330a2::Staff_Clearance::Staff_Clearance_MANAGER:
-			sr.setStaffClearance(Staff::Clearance::MANAGER);
-			break;
-		default:
-			sr.setStaffClearance(Staff::Clearance::GENERAL);
-			break;
+			Customer* customer = member_factory.getCustomer();
+			customer->setMembershipID(i);
+			customer->setBraceletID(100000 + i);
+			registry.publish(customer);
 		}
+		EXPECT_GE(stats.getUsage(MemoryStats::REGISTRY_RECORDS).live_bytes, records.live_bytes + 1000);
+		EXPECT_GE(stats.getUsage(MemoryStats::REGISTRY_INDEX).live_bytes, index.live_bytes + 2000);
+		EXPECT_GT(stats.getUsage(MemoryStats::PERMISSION_CACHE).live_bytes, cache.live_bytes);
 
-		return &sr;
+		MemberRegistry::ReadGuard guard(registry);
+		guard.forEach([&](Member* member) { members.push_back(member->clone()); });
+	}
+	EXPECT_EQ(records.live_bytes, stats.getUsage(MemoryStats::REGISTRY_RECORDS).live_bytes);
+	EXPECT_EQ(index.live_bytes, stats.getUsage(MemoryStats::REGISTRY_INDEX).live_bytes);
+	EXPECT_EQ(cache.live_bytes, stats.getUsage(MemoryStats::PERMISSION_CACHE).live_bytes);
+	EXPECT_GE(stats.getUsage(MemoryStats::REGISTRY_INDEX).peak_bytes, index.live_bytes + 2000);
+
+	/*So are the indexes kept beside a registry, and the tap analytics*/
+	MemoryStats::Usage indexes = stats.getUsage(MemoryStats::MEMBER_INDEXES);
+	MemoryStats::Usage analytics = stats.getUsage(MemoryStats::TAP_ANALYTICS);
+	{
+		MemberRegistry registry;
+		CreditIndex credits(registry);
+		StaffDirectory directory(registry);
+		for (size_t i = 0; i < members.size(); i++)
+			registry.publish(members[i]->clone());
+		Staff* staff = member_factory.getStaff();
+		staff->setMembershipID(5000);
+		staff->setEmployeeID(7);
+		registry.publish(staff);
+		long long registry_indexes = stats.getUsage(MemoryStats::MEMBER_INDEXES).live_bytes;
+		EXPECT_GE(registry_indexes, indexes.live_bytes + 1000 * (long long)sizeof(int));
+
+		BraceletIndex bracelets;
+		bracelets.build(members);
+		EXPECT_EQ(registry_indexes + (long long)bracelets.getBytes(), stats.getUsage(MemoryStats::MEMBER_INDEXES).live_bytes);
+
+		HeavyHitters hitters(64, 1000000, 4, 2);
+		EXPECT_GE(stats.getUsage(MemoryStats::TAP_ANALYTICS).live_bytes, analytics.live_bytes + 2 * 4 * 2 * (long long)SpaceSaving::getBytesFor(64));
+		long long hitter_bytes = stats.getUsage(MemoryStats::TAP_ANALYTICS).live_bytes;
+		DistinctVisitors visitors(2);
+		visitors.record(1, 1, Customer::SubscriptionLevel::BASIC, 1);
+		visitors.record(1, 1, Customer::SubscriptionLevel::BASIC, 2);
+		EXPECT_GT(stats.getUsage(MemoryStats::TAP_ANALYTICS).live_bytes, hitter_bytes + (long long)HyperLogLog::REGISTER_COUNT);
+		visitors.dropBefore(2);
+		EXPECT_EQ(hitter_bytes, stats.getUsage(MemoryStats::TAP_ANALYTICS).live_bytes);
+	}
+	EXPECT_EQ(indexes.live_bytes, stats.getUsage(MemoryStats::MEMBER_INDEXES).live_bytes);
+	EXPECT_EQ(analytics.live_bytes, stats.getUsage(MemoryStats::TAP_ANALYTICS).live_bytes);
+
+	/*Strings short enough to be stored inside the string object take no heap, however long that is for the library*/
+	EXPECT_EQ(0, MemoryStats::stringBytes(string(string().capacity(), 'x')));
+	EXPECT_EQ(string().capacity() + 2, MemoryStats::stringBytes(string(string().capacity() + 1, 'x')));
+
+	/*Persistence buffers are only held while a snapshot is being written or read*/
+	stats.resetPeaks();
+	MemoryStats::Usage buffers = stats.getUsage(MemoryStats::PERSISTENCE_BUFFERS);
+	EXPECT_EQ(buffers.live_bytes, buffers.peak_bytes);
+	ASSERT_TRUE(MemberSnapshot::save("memory_test.snap", members, MemberSnapshot::Codec::PROTOBUF));
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+	members.clear();
+	ASSERT_TRUE(MemberSnapshot::load("memory_test.snap", members));
+	EXPECT_EQ(1000, members.size());
+	EXPECT_EQ(buffers.live_bytes, stats.getUsage(MemoryStats::PERSISTENCE_BUFFERS).live_bytes);
+	EXPECT_GT(stats.getUsage(MemoryStats::PERSISTENCE_BUFFERS).peak_bytes, buffers.live_bytes + 1000);
+	EXPECT_GT(stats.getUsage(MemoryStats::PERSISTENCE_BUFFERS).allocations, buffers.allocations);
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+
+	/*The same numbers are exported with the other metrics*/
+	MemberRegistry registry;
+	MetricsExporter exporter(registry);
+	string text = exporter.render();
+	EXPECT_NE(string::npos, text.find("s330_memory_live_bytes{subsystem=\"member_objects\"}"));
+	EXPECT_NE(string::npos, text.find("s330_memory_peak_bytes{subsystem=\"persistence_buffers\"}"));
+	EXPECT_NE(string::npos, text.find("s330_memory_allocations_total{subsystem=\"registry_index\"}"));
+	EXPECT_NE(string::npos, text.find("s330_memory_live_bytes{subsystem=\"tap_analytics\"}"));
+
+	remove("memory_test.snap");
+}
+
+/*Testing that the bracelet filter passes every inserted bracelet and few unknown ones*/
+TEST(test_bracelet_filter_case1, test_bracelet_filter)
+{
+	/*Every inserted bracelet passes, and few unknown ones do*/
+	BraceletFilter filter(100000);
+	EXPECT_GE(filter.getCapacity(), 100000);
+	EXPECT_LE(filter.getBytes(), 100000 * BraceletFilter::BITS_PER_KEY / 4);
+	for (unsigned long id = 1; id <= 100000; id++)
+		filter.insert(id * 7);
+	for (unsigned long id = 1; id <= 100000; id++)
+		ASSERT_TRUE(filter.mayContain(id * 7));
+
+	unsigned long long seed = 330;
+	size_t passed = 0;
+	for (int i = 0; i < 1000000; i++)
+	{
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		unsigned long id = (unsigned long)((seed >> 33) * 7 + 1 + i % 6);
+		if (filter.mayContain(id))
+			passed++;
 	}
+	EXPECT_LT(passed, 2000);
 
-	/*Other functions*/
+	/*The registry's filter follows new, moved and removed bracelets, and is rebuilt as they pile up*/
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	for (unsigned long i = 1; i <= 5000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(1000000 + i);
+		registry.publish(c);
+	}
+	for (unsigned long i = 1; i <= 5000; i += 2)
+		registry.update(i, [i](Member* m) { m->setBraceletID(2000000 + i); });
+	for (unsigned long i = 1; i <= 5000; i += 10)
+		registry.remove(i + 1);
 
-	/**
-	Since the default constructor does not take paramters, this function must be ran to add the necessary data needed for a Customer.
-	Alternatively, the data can be added individually using each of the set functions.
-	*/
-	void initialize(string name, string address, unsigned long credit_card_num, unsigned long bracelet_id, Clearance staff_clearance)
+	MemberRegistry::ReadGuard guard(registry);
+	for (unsigned long i = 1; i <= 5000; i++)
 	{
-		srand(time(NULL));
-		setMembershipID(rand());
-		setEmployeeID(rand());
+		bool removed = i % 10 == 2;
+		bool moved = i % 2 == 1;
+		Member* by_new = guard.findByBraceletID(2000000 + i);
+		Member* by_old = guard.findByBraceletID(1000000 + i);
+		EXPECT_EQ(moved ? i : 0, by_new == NULL ? 0 : by_new->getMembershipID());
+		EXPECT_EQ(!moved && !removed ? i : 0, by_old == NULL ? 0 : by_old->getMembershipID());
+	}
+	EXPECT_EQ(NULL, guard.findByBraceletID(3000000));
+}
 
-		setName(name);
-		setAddress(address);
-		setBraceletID(bracelet_id);
-		setStaffClearance(staff_clearance);
+/*Testing that a saved bracelet index finds every snapshot bracelet, follows registry changes and only loads with its own snapshot*/
+TEST(test_bracelet_index_case1, test_bracelet_index)
+{
+	MemberFactory member_factory;
+	vector<Member*> members;
+	for (unsigned long i = 1; i <= 20000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(5000000 + i * 13);
+		members.push_back(c);
 	}
 
-	/**
-	Sets the employee ID for the current Staff.
-	*/
-	void setEmployeeID(unsigned long employee_id)
+	ASSERT_TRUE(MemberSnapshot::save("index_test.snap", members, MemberSnapshot::Codec::FIXED_WIDTH));
+	ASSERT_TRUE(MemberSnapshot::saveIndex("index_test.snap", members));
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+	members.clear();
+
+	/*The loaded index finds every bracelet of the snapshot, in about 3.5 bits of hash per bracelet*/
+	vector<Member*> loaded;
+	MemberRegistry registry;
+	BraceletIndex index;
+	ASSERT_TRUE(MemberSnapshot::load("index_test.snap", loaded));
+	ASSERT_TRUE(MemberSnapshot::loadIndex("index_test.snap", loaded, index));
+	EXPECT_EQ(20000, index.getKeyCount());
+	EXPECT_LT(index.getHashBits(), 20000 * 4);
+	for (size_t i = 0; i < loaded.size(); i++)
+		ASSERT_EQ(loaded[i], index.find(loaded[i]->getBraceletID()));
+	for (unsigned long id = 1; id <= 20000; id++)
+		ASSERT_EQ(NULL, index.find(5000000 + id * 13 + 1));
+
+	/*Following a registry loaded from the same snapshot, changes published since go through the overlay*/
+	vector<Member*> published;
+	for (size_t i = 0; i < loaded.size(); i++)
+		published.push_back(loaded[i]->clone());
+	registry.publishBatch(published);
+	index.follow(registry);
+	EXPECT_EQ(0, index.getOverlaySize());
+
+	Customer* added = member_factory.getCustomer();
+	added->setMembershipID(20001);
+	added->setBraceletID(77);
+	registry.publish(added);
+	registry.update(loaded[5]->getMembershipID(), [](Member* m) { m->setBraceletID(88); });
+	registry.remove(loaded[6]->getMembershipID());
+	registry.update(loaded[8]->getMembershipID(), [](Member* m) { m->setName("Renamed"); });
 	{
-		this->employee_id = employee_id;
+		MemberRegistry::ReadGuard guard(registry);
+		ASSERT_TRUE(index.find(77) != NULL);
+		EXPECT_EQ(20001, index.find(77)->getMembershipID());
+		ASSERT_TRUE(index.find(88) != NULL);
+		EXPECT_EQ(loaded[5]->getMembershipID(), index.find(88)->getMembershipID());
+		EXPECT_EQ(NULL, index.find(loaded[5]->getBraceletID()));
+		EXPECT_EQ(NULL, index.find(loaded[6]->getBraceletID()));
+		EXPECT_EQ(loaded[7], index.find(loaded[7]->getBraceletID()));
+		EXPECT_STREQ("Renamed", index.find(loaded[8]->getBraceletID())->getName().c_str());
+		EXPECT_EQ(NULL, index.find(78));
 	}
+	EXPECT_EQ(5, index.getOverlaySize());
 
-	/**
-	Sets the current staff's security clearance/role.
-	*/
-	void setStaffClearance(Clearance staff_clearance)
+	/*Lookups run alongside registry writes, and the copies they find stay valid under their guard*/
+	unsigned long moved_id = loaded[5]->getMembershipID();
+	atomic<bool> writing(true);
+	thread reader([&index, &registry, &writing, moved_id]()
+	{
+		while (writing.load())
+		{
+			MemberRegistry::ReadGuard guard(registry);
+			Member* m = index.find(88);
+			ASSERT_TRUE(m != NULL);
+			EXPECT_EQ(moved_id, m->getMembershipID());
+		}
+	});
+	for (int i = 0; i < 2000; i++)
+		registry.update(moved_id, [i](Member* m) { m->setName(to_string(i)); });
+	writing = false;
+	reader.join();
+
+	/*A truncated or foreign index file is rejected*/
+	string encoded;
+	index.encode(encoded);
+	BraceletIndex other;
+	EXPECT_TRUE(other.decode(encoded));
+	EXPECT_FALSE(other.decode(encoded.substr(0, encoded.size() - 4)));
+	EXPECT_FALSE(other.decode("S330SNAP" + encoded.substr(8)));
+	EXPECT_EQ(NULL, other.find(loaded[7]->getBraceletID()));
+
+	/*An index only loads with the members it was built over, and saving the snapshot again removes it*/
+	vector<Member*> reversed(loaded.rbegin(), loaded.rend());
+	EXPECT_FALSE(MemberSnapshot::loadIndex("index_test.snap", reversed, other));
+	EXPECT_FALSE(MemberSnapshot::loadIndex("index_test.snap", vector<Member*>(loaded.begin(), loaded.end() - 1), other));
+	EXPECT_TRUE(MemberSnapshot::loadIndex("index_test.snap", loaded, other));
+	ASSERT_TRUE(MemberSnapshot::save("index_test.snap", reversed, MemberSnapshot::Codec::FIXED_WIDTH));
+	EXPECT_FALSE(MemberSnapshot::loadIndex("index_test.snap", loaded, other));
+
+	for (size_t i = 0; i < loaded.size(); i++)
+		delete loaded[i];
+	remove("index_test.snap");
+	remove(MemberSnapshot::indexFileName("index_test.snap").c_str());
+}
+
+/*Benchmark: perfect hash against unordered_map lookups over 1M bracelets. Run with --gtest_also_run_disabled_tests*/
+TEST(bench_bracelet_index, DISABLED_bench_bracelet_index_1m)
+{
+	MemberFactory member_factory;
+	vector<Member*> members;
+	unordered_map<unsigned long, Member*> map;
+	for (unsigned long i = 1; i <= 1000000; i++)
 	{
-		this->staff_clearance = staff_clearance;
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(i * 2654435761ul % 4294967291ul);
+		members.push_back(c);
+		map[c->getBraceletID()] = c;
 	}
 
-	/**
-	Retreives the employee ID for the current Staff.
-	*/
-	unsigned long getEmployeeID()
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	BraceletIndex index;
+	index.build(members);
+	long long build_ms = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
+
+	/*Look the bracelets up in a scrambled order, so neither structure is helped by the order they were inserted in.
+	Both read the member found, as admitting a tap would*/
+	vector<unsigned long> lookups;
+	for (size_t i = 0; i < members.size(); i++)
+		lookups.push_back(members[i * 7919 % members.size()]->getBraceletID());
+
+	size_t found = 0;
+	start = chrono::high_resolution_clock::now();
+	for (int round = 0; round < 5; round++)
+		for (size_t i = 0; i < lookups.size(); i++)
+			found += index.find(lookups[i])->getBraceletID() == lookups[i];
+	double index_ns = chrono::duration<double, nano>(chrono::high_resolution_clock::now() - start).count() / (5 * lookups.size());
+
+	start = chrono::high_resolution_clock::now();
+	for (int round = 0; round < 5; round++)
+		for (size_t i = 0; i < lookups.size(); i++)
+			found += map.find(lookups[i])->second->getBraceletID() == lookups[i];
+	double map_ns = chrono::duration<double, nano>(chrono::high_resolution_clock::now() - start).count() / (5 * lookups.size());
+	EXPECT_EQ(10 * lookups.size(), found);
+
+	/*Each unordered_map node holds its key, value and next pointer, plus about 16 bytes of allocator overhead*/
+	size_t map_bytes = map.bucket_count() * sizeof(void*) + map.size() * (sizeof(unsigned long) + 2 * sizeof(void*) + 16);
+	cout << "Perfect hash: built in " << build_ms << "ms, " << index_ns << "ns per lookup, " << index.getBytes() << " bytes ("
+		<< (double)index.getHashBits() / members.size() << " bits of hash per bracelet)" << endl;
+	cout << "unordered_map: " << map_ns << "ns per lookup, about " << map_bytes << " bytes" << endl;
+	EXPECT_LT(index.getBytes(), map_bytes);
+
+	for (size_t i = 0; i < members.size(); i++)
+		delete members[i];
+}
+
+/*Testing that staff are found by current and former employee IDs, singly, in batches and across restarts*/
+TEST(test_staff_directory_case1, test_staff_directory)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	for (unsigned long i = 1; i <= 3000; i++)
 	{
-		return employee_id;
+		Staff* s = member_factory.getStaff();
+		s->setMembershipID(i);
+		s->setBraceletID(i);
+		s->setEmployeeID(100000 + i);
+		registry.publish(s);
+	}
+	Customer* c = member_factory.getCustomer();
+	c->setMembershipID(5000);
+	registry.publish(c);
+
+	/*Staff already in the registry are indexed, and later changes follow setEmployeeID()*/
+	StaffDirectory directory(registry);
+	EXPECT_EQ(3000, directory.getActiveCount());
+	registry.update(1, [](Member* m) { ((Staff*)m)->setEmployeeID(900001); });
+	registry.update(2, [](Member* m) { m->setName("Renamed"); });
+	registry.remove(3);
+
+	StaffDirectory::Entry entry;
+	ASSERT_TRUE(directory.findByEmployeeID(900001, entry));
+	EXPECT_EQ(StaffDirectory::ACTIVE, entry.status);
+	EXPECT_EQ(1, entry.staff.getMembershipID());
+	ASSERT_TRUE(directory.findByEmployeeID(100001, entry));
+	EXPECT_EQ(StaffDirectory::FORMER, entry.status);
+	EXPECT_EQ(1, entry.staff.getMembershipID());
+	ASSERT_TRUE(directory.findByEmployeeID(100002, entry));
+	EXPECT_EQ("Renamed", entry.staff.getName());
+	ASSERT_TRUE(directory.findByEmployeeID(100003, entry));
+	EXPECT_EQ(StaffDirectory::FORMER, entry.status);
+	EXPECT_FALSE(directory.findByEmployeeID(0, entry));
+	EXPECT_EQ(StaffDirectory::UNKNOWN, entry.status);
+	EXPECT_EQ(2999, directory.getActiveCount());
+	EXPECT_EQ(2, directory.getFormerCount());
+
+	/*A payroll run looks thousands of IDs up at once*/
+	vector<unsigned long> payroll;
+	for (unsigned long i = 1; i <= 3000; i++)
+		payroll.push_back(100000 + i);
+	payroll.push_back(42);
+	vector<StaffDirectory::Entry> entries;
+	EXPECT_EQ(3000, directory.findByEmployeeIDs(payroll, entries));
+	ASSERT_EQ(payroll.size(), entries.size());
+	EXPECT_EQ(StaffDirectory::FORMER, entries[0].status);
+	EXPECT_EQ(StaffDirectory::ACTIVE, entries[1000].status);
+	EXPECT_EQ(1001, entries[1000].staff.getMembershipID());
+	EXPECT_EQ(StaffDirectory::UNKNOWN, entries[3000].status);
+
+	/*Former staff are kept across restarts, unless their ID is active again*/
+	ASSERT_TRUE(directory.saveHistory("staff_history.snap"));
+	MemberRegistry restarted;
+	Staff* rehired = member_factory.getStaff();
+	rehired->setMembershipID(3);
+	rehired->setEmployeeID(100003);
+	restarted.publish(rehired);
+	StaffDirectory reloaded(restarted);
+	ASSERT_TRUE(reloaded.loadHistory("staff_history.snap"));
+	EXPECT_EQ(1, reloaded.getActiveCount());
+	EXPECT_EQ(1, reloaded.getFormerCount());
+	ASSERT_TRUE(reloaded.findByEmployeeID(100001, entry));
+	EXPECT_EQ(StaffDirectory::FORMER, entry.status);
+	ASSERT_TRUE(reloaded.findByEmployeeID(100003, entry));
+	EXPECT_EQ(StaffDirectory::ACTIVE, entry.status);
+
+	remove("staff_history.snap");
+}
+
+/*Testing that credit balance queries follow registry changes and agree with a scan of every balance*/
+TEST(test_credit_index_case1, test_credit_index)
+{
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	map<unsigned long, int> expected;
+	for (unsigned long i = 1; i <= 2000; i++)
+	{
+		if (i % 50 == 0)
+		{
+			Staff* s = member_factory.getStaff();
+			s->setMembershipID(i);
+			registry.publish(s);
+			continue;
+		}
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setGymCredits((int)(i * 37 % 100));
+		registry.publish(c);
+		expected[i] = (int)(i * 37 % 100);
 	}
 
-	/**
-	Retreives the security clearance for the current Staff.
-	*/
-	Clearance getStaffClearance()
+	/*Customers already in the registry are indexed, and later balance changes reorder them*/
+	CreditIndex index(registry);
+	EXPECT_EQ(expected.size(), index.size());
+
+	unsigned long long seed = 47;
+	for (int step = 0; step < 3000; step++)
 	{
-		return staff_clearance;
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		unsigned long id = (unsigned long)(seed >> 33) % 2000 + 1;
+		int amount = (int)(seed >> 20) % 30;
+		if (expected.count(id) == 0)
+			continue;
+
+		switch (step % 4)
+		{
+		case 0:
+			registry.update(id, [amount](Member* m) { ((Customer*)m)->addGymCredits(amount); });
+			expected[id] += amount;
+			break;
+		case 1:
+			registry.update(id, [amount](Member* m) { ((Customer*)m)->deductGymCredits(amount); });
+			expected[id] -= amount;
+			break;
+		case 2:
+			registry.update(id, [amount](Member* m) { ((Customer*)m)->setGymCredits(amount * 4); });
+			expected[id] = amount * 4;
+			break;
+		default:
+			if (step % 40 == 3)
+			{
+				registry.remove(id);
+				expected.erase(id);
+			}
+			else
+				registry.update(id, [](Member* m) { m->setName("Unchanged balance"); });
+		}
 	}
+	ASSERT_EQ(expected.size(), index.size());
 
-private:
-	unsigned long employee_id;
-	Clearance staff_clearance;
+	/*Every query agrees with a scan of the expected balances*/
+	vector<pair<int, unsigned long> > ordered;
+	for (map<unsigned long, int>::iterator it = expected.begin(); it != expected.end(); ++it)
+		ordered.push_back(make_pair(it->second, it->first));
+	sort(ordered.begin(), ordered.end());
+
+	for (int credits = -40; credits <= 200; credits += 7)
+	{
+		size_t below = lower_bound(ordered.begin(), ordered.end(), make_pair(credits, 0ul)) - ordered.begin();
+		EXPECT_EQ(below, index.countBelow(credits));
+		size_t upto = lower_bound(ordered.begin(), ordered.end(), make_pair(credits + 10, 0ul)) - ordered.begin();
+		EXPECT_EQ(upto - below, index.countInRange(credits, credits + 9));
+
+		vector<unsigned long> found;
+		EXPECT_EQ(upto - below, index.findInRange(credits, credits + 9, found));
+		for (size_t i = 0; i < found.size(); i++)
+			EXPECT_EQ(ordered[below + i].second, found[i]);
+	}
 
-};
+	for (size_t rank = 0; rank < ordered.size(); rank += 13)
+	{
+		size_t found_rank;
+		unsigned long membership_id;
+		ASSERT_TRUE(index.getRank(ordered[rank].second, found_rank));
+		EXPECT_EQ(rank, found_rank);
+		ASSERT_TRUE(index.getByRank(rank, membership_id));
+		EXPECT_EQ(ordered[rank].second, membership_id);
+	}
 
-/**
-The MemberFactory class makes clones of a templated Customer and Staff to return new objects back to the caller.
-Two templates are created, Customer* CustomerClone and Staff* StaffClone. They are both initialized upon constructing the factory.
+	vector<unsigned long> lowest;
+	EXPECT_EQ(5, index.findInRange(-1000, 1000, lowest, 5));
 
-Once an instance of the MemberFactory has been constructed, copies of Customer can be created by calling the getCustomer() function.
-Similarily, copies of Staff can also be created by calling the getStaff() function.
-Both functions will only return a barebone template. The corresponding "initialize" function for each class must be called after to fill them with data.
-*/
-class MemberFactory
-{
+	/*Appending to a list that already has IDs in it, with and without a limit*/
+	size_t in_range = index.countInRange(0, 100);
+	EXPECT_EQ(in_range, index.findInRange(0, 100, lowest));
+	EXPECT_EQ(5 + in_range, lowest.size());
+	EXPECT_EQ(3, index.findInRange(0, 100, lowest, 3));
+	EXPECT_EQ(8 + in_range, lowest.size());
+	for (size_t i = 0; i < 3; i++)
+		EXPECT_EQ(lowest[5 + i], lowest[5 + in_range + i]);
 
-private:
-	/*Default templates to used for cloning*/
-	Customer* CustomerClone;
-	Staff* StaffClone;
+	size_t rank;
+	EXPECT_FALSE(index.getRank(50, rank));
+	unsigned long membership_id;
+	EXPECT_FALSE(index.getByRank(ordered.size(), membership_id));
+}
 
-public:
+/*Testing that heavy hitter counts stay within their error bound, merge, and forget taps that left the window*/
+TEST(test_heavy_hitters_case1, test_heavy_hitters)
+{
+	/*A skewed stream: key k is seen about 1/k as often as key 1, among 5000 keys*/
+	map<unsigned long long, unsigned long long> exact;
+	SpaceSaving whole(200), first_half(200), second_half(200);
+	unsigned long long seed = 48;
+	for (int i = 0; i < 200000; i++)
+	{
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		unsigned long long key = 5000 / ((seed >> 33) % 5000 + 1);
+		exact[key]++;
+		whole.offer(key);
+		(i % 2 == 0 ? first_half : second_half).offer(key);
+	}
 
-	/**
-	Constructor for MemberFactory.
-	*/
-	MemberFactory()
+	/*Counts are never too low, and too high by at most total / capacity*/
+	vector<SpaceSaving::Item> top = whole.top(10);
+	ASSERT_EQ(10, top.size());
+	for (size_t i = 0; i < top.size(); i++)
 	{
-		CustomerClone = new Customer();
-		StaffClone = new Staff();
+		EXPECT_EQ(i + 1, top[i].key);
+		EXPECT_GE(top[i].count, exact[top[i].key]);
+		EXPECT_LE(top[i].count - top[i].error, exact[top[i].key]);
+		EXPECT_LE(top[i].count, exact[top[i].key] + whole.getTotal() / whole.getCapacity());
 	}
 
-	/**
-	Destructor for MemberFactory.
-	*/
-	~MemberFactory()
+	/*Merged summaries of two halves of the stream agree with the summary of the whole stream*/
+	first_half.merge(second_half);
+	EXPECT_EQ(200000, first_half.getTotal());
+	vector<SpaceSaving::Item> merged = first_half.top(10);
+	for (size_t i = 0; i < merged.size(); i++)
 	{
-		delete CustomerClone;
-		delete StaffClone;
+		EXPECT_EQ(top[i].key, merged[i].key);
+		EXPECT_GE(merged[i].count, exact[merged[i].key]);
+		EXPECT_LE(merged[i].count, exact[merged[i].key] + 2 * whole.getTotal() / whole.getCapacity());
 	}
 
-	/**
-	Returns a "new" Customer by cloning a barebone template of one.
-	*/
-	Customer* getCustomer()
+	/*A sliding window of 10 one-second slices forgets taps older than ten seconds*/
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	for (unsigned long i = 1; i <= 100; i++)
 	{
-		return CustomerClone->clone();
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(1000 + i);
+		registry.publish(c);
 	}
 
-	/**
-	Returns a "new" Staff by cloning a barebone template of one.
-	*/
-	Staff* getStaff()
+	HeavyHitters hitters(100, 10000000, 10);
+	for (int i = 0; i < 500; i++)
+		hitters.record(7, 70, 1000000);
+	vector<thread> threads;
+	for (int t = 0; t < 4; t++)
 	{
-		return StaffClone->clone();
+		threads.push_back(thread([&hitters, &registry, t]()
+		{
+			MemberRegistry::ReadGuard guard(registry);
+			for (int i = 0; i < 1000; i++)
+			{
+				TapEvent tap = { 12000000 + (unsigned long long)i * 1000, (unsigned long)(1000 + 1 + (i % 10 == 0 ? 0 : t + 1)), (unsigned int)t };
+				hitters.record(guard, tap);
+			}
+			TapEvent unknown = { 12500000, 999999, 9 };
+			hitters.record(guard, unknown);
+		}));
 	}
-};
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+
+	vector<SpaceSaving::Item> members = hitters.topMembers(3, 1000000);
+	ASSERT_EQ(1, members.size());
+	EXPECT_EQ(7, members[0].key);
+	EXPECT_EQ(500, members[0].count);
+
+	members = hitters.topMembers(3, 13000000);
+	ASSERT_EQ(3, members.size());
+	EXPECT_EQ(2, members[0].key);
+	EXPECT_EQ(900, members[0].count);
+	EXPECT_EQ(400, hitters.topMembers(10, 13000000).back().count);
+
+	vector<SpaceSaving::Item> machines = hitters.topMachines(10, 13000000);
+	ASSERT_EQ(5, machines.size());
+	EXPECT_EQ(1000, machines[0].count);
+	EXPECT_EQ(9, machines.back().key);
+	EXPECT_TRUE(hitters.topMachines(10, 30000000).empty());
+}
+
+/*Testing that distinct counts stay within a few percent, survive encoding, and merge across days, sites and levels*/
+TEST(test_hyperloglog_case1, test_hyperloglog)
+{
+	/*Estimates stay within a few percent of the true count, and adding a key again changes nothing*/
+	HyperLogLog small, large;
+	for (unsigned long long i = 1; i <= 100000; i++)
+	{
+		if (i <= 1000)
+			small.add(i);
+		large.add(i);
+		large.add(i);
+	}
+	EXPECT_NEAR(1000, small.estimate(), 1000 * 0.05);
+	EXPECT_NEAR(100000, large.estimate(), 100000 * 0.05);
+	EXPECT_TRUE(HyperLogLog().isEmpty());
+	EXPECT_EQ(0, HyperLogLog().estimate());
+
+	/*Sketches with few keys are written sparse, and both forms read back the same*/
+	string small_bytes, large_bytes;
+	small.encode(small_bytes);
+	large.encode(large_bytes);
+	EXPECT_LT(small_bytes.size(), large_bytes.size());
+	EXPECT_EQ(1 + HyperLogLog::REGISTER_COUNT * 6 / 8, large_bytes.size());
+	HyperLogLog decoded;
+	size_t position = 0;
+	ASSERT_TRUE(decoded.decode(small_bytes, position));
+	EXPECT_EQ(small_bytes.size(), position);
+	EXPECT_EQ(small.estimate(), decoded.estimate());
+	position = 0;
+	ASSERT_TRUE(decoded.decode(large_bytes, position));
+	EXPECT_EQ(large.estimate(), decoded.estimate());
+	position = 0;
+	EXPECT_FALSE(decoded.decode(large_bytes.substr(0, 100), position));
+
+	/*Visits by 3000 customers over 7 days at 4 sites. Customer i has level i % 4 and visits sites i % 4 and (i + 1) % 4 every day,
+	so each site sees two levels*/
+	MemberFactory member_factory;
+	MemberRegistry registry;
+	for (unsigned long i = 1; i <= 3000; i++)
+	{
+		Customer* c = member_factory.getCustomer();
+		c->setMembershipID(i);
+		c->setBraceletID(100000 + i);
+		c->setSubscriptionLevel((Customer::SubscriptionLevel)(i % 4));
+		registry.publish(c);
+	}
+	Staff* s = member_factory.getStaff();
+	s->setMembershipID(5000);
+	s->setBraceletID(105000);
+	registry.publish(s);
 
-int main(int argc, char** argv)
+	DistinctVisitors visitors, other_server;
+	{
+		MemberRegistry::ReadGuard guard(registry);
+		for (unsigned int day = 100; day < 107; day++)
+		{
+			for (unsigned long i = 1; i <= 3000; i++)
+			{
+				TapEvent tap = { 0, 100000 + i, 1 };
+				visitors.record(guard, tap, day, i % 4);
+				(day < 103 ? visitors : other_server).record(guard, tap, day, (i + 1) % 4);
+			}
+			TapEvent staff_tap = { 0, 105000, 1 };
+			TapEvent unknown_tap = { 0, 999999, 1 };
+			visitors.record(guard, staff_tap, day, 0);
+			visitors.record(guard, unknown_tap, day, 0);
+		}
+	}
+	visitors.merge(other_server);
+	EXPECT_EQ(7 * 4 * 2, visitors.getSketchCount());
+
+	/*Members seen on several days and at several sites are counted once*/
+	unsigned int all = DistinctVisitors::ALL_SITES;
+	unsigned int levels = DistinctVisitors::ALL_LEVELS;
+	EXPECT_NEAR(3000, visitors.estimate(100, 106, all, levels), 3000 * 0.05);
+	EXPECT_NEAR(3000, visitors.estimate(103, 103, all, levels), 3000 * 0.05);
+	EXPECT_NEAR(1500, visitors.estimate(100, 106, 2, levels), 1500 * 0.05);
+	EXPECT_NEAR(750, visitors.estimate(100, 106, all, 1 << Customer::SubscriptionLevel::PREMIUM), 750 * 0.05);
+	EXPECT_NEAR(1500, visitors.estimate(100, 100, all, (1 << Customer::SubscriptionLevel::INACTIVE) | (1 << Customer::SubscriptionLevel::DELUXE)), 1500 * 0.05);
+	EXPECT_NEAR(750, visitors.estimate(104, 105, 1, 1 << Customer::SubscriptionLevel::BASIC), 750 * 0.05);
+	EXPECT_EQ(0, visitors.estimate(107, 200, all, levels));
+
+	/*Sketches survive a save and load, and old days can be dropped*/
+	string file_name = "visitors_test.hll";
+	ASSERT_TRUE(visitors.save(file_name));
+	DistinctVisitors loaded;
+	ASSERT_TRUE(loaded.load(file_name));
+	EXPECT_EQ(visitors.getSketchCount(), loaded.getSketchCount());
+	EXPECT_EQ(visitors.estimate(100, 106, all, levels), loaded.estimate(100, 106, all, levels));
+	EXPECT_EQ(visitors.estimate(102, 104, 3, 1 << Customer::SubscriptionLevel::BASIC), loaded.estimate(102, 104, 3, 1 << Customer::SubscriptionLevel::BASIC));
+	loaded.dropBefore(105);
+	EXPECT_EQ(2 * 4 * 2, loaded.getSketchCount());
+	EXPECT_EQ(0, loaded.estimate(100, 104, all, levels));
+	remove(file_name.c_str());
+	EXPECT_FALSE(loaded.load(file_name));
+}
+
+/*Testing that threads recording the same days and sites share one sketch each and are counted once, and that sites past MAX_SITE are refused*/
+TEST(test_distinct_visitors_case1, test_distinct_visitors)
 {
-	/*Test stuff*/
-	testing::InitGoogleTest(&argc, argv);
-	RUN_ALL_TESTS();
+	long long before = MemoryStats::instance().getUsage(MemoryStats::TAP_ANALYTICS).live_bytes;
+	DistinctVisitors visitors(4);
+	EXPECT_FALSE(visitors.record(100, DistinctVisitors::MAX_SITE + 1, Customer::SubscriptionLevel::BASIC, 1));
+	EXPECT_FALSE(visitors.record(100, DistinctVisitors::ALL_SITES, Customer::SubscriptionLevel::BASIC, 1));
+	EXPECT_EQ(0, visitors.getSketchCount());
+	EXPECT_TRUE(visitors.record(100, DistinctVisitors::MAX_SITE, Customer::SubscriptionLevel::BASIC, 1));
+	EXPECT_NEAR(1, visitors.estimate(100, 100, DistinctVisitors::MAX_SITE, DistinctVisitors::ALL_LEVELS), 0.01);
+	EXPECT_EQ(0, visitors.estimate(100, 100, 0, DistinctVisitors::ALL_LEVELS));
+
+	/*Eight threads record the same 4000 members at two sites over two days, while another thread queries*/
+	vector<thread> threads;
+	atomic<bool> recording(true);
+	for (int t = 0; t < 8; t++)
+	{
+		threads.push_back(thread([&visitors, t]()
+		{
+			for (unsigned long i = 1; i <= 4000; i++)
+				visitors.record(200 + (unsigned int)(i % 2), (unsigned int)(i + t) % 2, Customer::SubscriptionLevel::PREMIUM, i);
+		}));
+	}
+	thread reader([&visitors, &recording]()
+	{
+		while (recording.load())
+			EXPECT_LE(visitors.estimate(200, 201, DistinctVisitors::ALL_SITES, DistinctVisitors::ALL_LEVELS), 4000 * 1.05);
+	});
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+	recording = false;
+	reader.join();
+
+	EXPECT_EQ(1 + 2 * 2, visitors.getSketchCount());
+	EXPECT_LT(MemoryStats::instance().getUsage(MemoryStats::TAP_ANALYTICS).live_bytes - before, 5 * 2 * (long long)HyperLogLog::REGISTER_COUNT);
+	EXPECT_NEAR(4000, visitors.estimate(200, 201, DistinctVisitors::ALL_SITES, DistinctVisitors::ALL_LEVELS), 4000 * 0.05);
+	EXPECT_NEAR(2000, visitors.estimate(201, 201, 1, 1 << Customer::SubscriptionLevel::PREMIUM), 2000 * 0.05);
+}
+
+/*Testing that retention cohorts worked out from monthly snapshots match counting one customer at a time*/
+TEST(test_retention_case1, test_retention)
+{
+	/*Eight monthly snapshots of up to 20000 customers with random levels, and a staff in every one.
+	Every month some customers leave the registry, some come back, and new ones join*/
+	MemberFactory member_factory;
+	vector<string> files;
+	vector<map<unsigned long, Customer::SubscriptionLevel> > months(8);
+	unsigned long long seed = 50;
+	for (size_t month = 0; month < months.size(); month++)
+	{
+		vector<Member*> members;
+		for (unsigned long i = 1; i <= 2500 * (month + 1); i++)
+		{
+			seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+			if ((seed >> 33) % 10 == 0)
+				continue;
+			Customer::SubscriptionLevel level = (Customer::SubscriptionLevel)((seed >> 40) % 4);
+			months[month][i] = level;
+
+			Customer* c = member_factory.getCustomer();
+			c->setMembershipID(i);
+			c->setSubscriptionLevel(level);
+			members.push_back(c);
+		}
+		Staff* s = member_factory.getStaff();
+		s->setMembershipID(100000);
+		members.push_back(s);
+
+		stringstream file_name;
+		file_name << "retention_test_" << month << ".snap";
+		files.push_back(file_name.str());
+		ASSERT_TRUE(MemberSnapshot::save(files.back(), members, MemberSnapshot::Codec::FIXED_WIDTH));
+		for (size_t i = 0; i < members.size(); i++)
+			delete members[i];
+	}
 
-	/*Use as a pause*/
-	getchar(); 
-}
\ No newline at end of file
+	ThreadPool pool(4);
+	RetentionAnalysis retention(pool);
+	ASSERT_TRUE(retention.run(files, 3));
+
+	/*Work out the same table one customer at a time*/
+	map<pair<size_t, int>, vector<size_t> > expected;
+	for (unsigned long i = 1; i <= 20000; i++)
+	{
+		if (months[0].count(i) != 0)
+			continue;
+		size_t joined = 0;
+		for (size_t month = 1; month < months.size(); month++)
+		{
+			if (months[month].count(i) == 0)
+				continue;
+			if (joined == 0 && months[month][i] != Customer::SubscriptionLevel::INACTIVE)
+			{
+				joined = month;
+				expected[make_pair(joined, (int)months[month][i])].resize(1 + min((size_t)3, months.size() - 1 - joined));
+				expected[make_pair(joined, (int)months[month][i])][0]++;
+			}
+			else if (joined != 0 && months[month][i] == Customer::SubscriptionLevel::INACTIVE)
+			{
+				for (size_t k = month - joined; k <= 3 && joined + k < months.size(); k++)
+					expected[make_pair(joined, (int)months[joined][i])][k]++;
+				break;
+			}
+		}
+	}
+
+	const vector<RetentionAnalysis::Cohort>& cohorts = retention.getCohorts();
+	ASSERT_EQ(expected.size(), cohorts.size());
+	map<pair<size_t, int>, vector<size_t> >::iterator it = expected.begin();
+	for (size_t i = 0; i < cohorts.size(); i++, ++it)
+	{
+		EXPECT_EQ(it->first.first, cohorts[i].joined_snapshot);
+		EXPECT_EQ(it->first.second, cohorts[i].initial_level);
+		EXPECT_EQ(it->second[0], cohorts[i].customers);
+		EXPECT_EQ(vector<size_t>(it->second.begin() + 1, it->second.end()), cohorts[i].inactive_within);
+	}
+	EXPECT_EQ(3, cohorts[0].inactive_within.size());
+	EXPECT_TRUE(cohorts.back().inactive_within.empty());
+	EXPECT_GT(cohorts[0].inactive_within[0], 0);
+
+	/*One line per cohort*/
+	ASSERT_TRUE(retention.writeTable("retention_test.csv"));
+	fstream table("retention_test.csv", ios::in);
+	string line;
+	getline(table, line);
+	stringstream first_line;
+	first_line << "1," << cohorts[0].initial_level << "," << cohorts[0].customers << "," << cohorts[0].inactive_within[0] << ","
+		<< cohorts[0].inactive_within[1] << "," << cohorts[0].inactive_within[2];
+	EXPECT_EQ(first_line.str(), line);
+	table.close();
+	remove("retention_test.csv");
+
+	/*A missing snapshot fails the run*/
+	remove(files[3].c_str());
+	EXPECT_FALSE(retention.run(files, 3));
+	EXPECT_TRUE(retention.getCohorts().empty());
+	for (size_t month = 0; month < files.size(); month++)
+		remove(files[month].c_str());
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Member.h"
+#include "MemberSnapshot.h"
+#include "ThreadPool.h"
+#include "TraceSpans.h"
+
+using namespace std;
+
+/**
+The RetentionAnalysis class is a batch job that measures customer churn from a series of monthly member snapshots:
+of the customers who joined in a given month at a given subscription level, how many had downgraded to INACTIVE
+one month later, two months later, and so on.
+
+A customer joins in the first snapshot where they appear as a customer with a level other than INACTIVE, and that level is
+their initial level. The first snapshot of the series only serves as a baseline: customers already in it joined at an unknown
+time before it and are left out. A customer churns in the first later snapshot where their level is INACTIVE; later
+reactivations do not undo that. Members missing from a snapshot are skipped for that month, not counted as churned.
+
+The job runs on a ThreadPool in two parallel phases. The snapshots are loaded, reduced to (membership ID, level) pairs of
+their customers and sorted by membership ID, one snapshot per task. The sorted snapshots are then split into ranges of
+membership IDs, and each range is joined by a merge walk over every snapshot at once, tallying into a table of its own.
+*/
+class RetentionAnalysis
+{
+public:
+
+	/**
+	The Cohort struct is one row of the cohort table: the customers who joined in one snapshot at one subscription level.
+	"inactive_within[k - 1]" is the number of them who were INACTIVE within k months of joining. It has fewer than the asked
+	number of months for cohorts that joined too late in the series to be followed that long.
+	*/
+	struct Cohort
+	{
+		size_t joined_snapshot;
+		Customer::SubscriptionLevel initial_level;
+		size_t customers;
+		vector<size_t> inactive_within;
+	};
+
+	/**
+	Constructor for RetentionAnalysis.
+	*/
+	RetentionAnalysis(ThreadPool& pool) : pool(pool)
+	{
+	}
+
+	/**
+	Builds the cohort table from "snapshot_files", one snapshot per month, oldest first, following each cohort for at most
+	"months" months after joining. Returns false, leaving the table empty, if a snapshot could not be read.
+	*/
+	bool run(const vector<string>& snapshot_files, size_t months)
+	{
+		cohorts.clear();
+		size_t snapshot_count = snapshot_files.size();
+		vector<vector<Entry> > snapshots(snapshot_count);
+
+		/*Load every snapshot and sort its customers by membership ID, a snapshot per task*/
+		atomic<bool> failed(false);
+		{
+			TraceSpan span("retention.load", "analytics");
+			pool.parallelFor(snapshot_count, [&](size_t s)
+			{
+				vector<Member*> members;
+				if (!MemberSnapshot::load(snapshot_files[s], members))
+					failed = true;
+
+				vector<Entry>& entries = snapshots[s];
+				for (size_t i = 0; i < members.size(); i++)
+				{
+					if (members[i]->getMemberType() == Member::Type::CUSTOMER)
+					{
+						Entry entry = { members[i]->getMembershipID(), ((Customer*)members[i])->getSubscriptionLevel() };
+						entries.push_back(entry);
+					}
+					delete members[i];
+				}
+				sort(entries.begin(), entries.end(), byMembershipID);
+			});
+		}
+		if (failed.load())
+			return false;
+
+		/*Split the membership IDs into ranges of roughly equal size, using evenly spaced IDs of every snapshot as samples*/
+		size_t range_count = 4 * pool.size();
+		vector<unsigned long> samples;
+		for (size_t s = 0; s < snapshot_count; s++)
+		{
+			for (size_t r = 1; r < range_count && !snapshots[s].empty(); r++)
+				samples.push_back(snapshots[s][r * snapshots[s].size() / range_count].membership_id);
+		}
+		sort(samples.begin(), samples.end());
+		vector<unsigned long> boundaries;
+		for (size_t r = 1; r < range_count && !samples.empty(); r++)
+			boundaries.push_back(samples[r * samples.size() / range_count]);
+		boundaries.erase(unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+		/*Join each range across every snapshot. tallies[range][cell(joined, level) + k] counts the cohort's customers for k = 0,
+		and those who churned exactly k months after joining for k >= 1*/
+		size_t row_size = months + 1;
+		vector<vector<size_t> > tallies(boundaries.size() + 1, vector<size_t>(snapshot_count * 4 * row_size, 0));
+		{
+			TraceSpan span("retention.join", "analytics");
+			pool.parallelFor(tallies.size(), [&](size_t range)
+			{
+				joinRange(snapshots, boundaries, range, months, tallies[range]);
+			});
+		}
+
+		/*Sum the ranges' tallies into the cohort table*/
+		for (size_t joined = 1; joined < snapshot_count; joined++)
+		{
+			for (int level = Customer::SubscriptionLevel::BASIC; level <= Customer::SubscriptionLevel::DELUXE; level++)
+			{
+				size_t cell = (joined * 4 + level) * row_size;
+				Cohort cohort = { joined, (Customer::SubscriptionLevel)level, 0, vector<size_t>() };
+				for (size_t range = 0; range < tallies.size(); range++)
+					cohort.customers += tallies[range][cell];
+				if (cohort.customers == 0)
+					continue;
+
+				size_t inactive = 0;
+				for (size_t k = 1; k <= months && joined + k < snapshot_count; k++)
+				{
+					for (size_t range = 0; range < tallies.size(); range++)
+						inactive += tallies[range][cell + k];
+					cohort.inactive_within.push_back(inactive);
+				}
+				cohorts.push_back(cohort);
+			}
+		}
+		return true;
+	}
+
+	/**
+	Retreives the cohort table built by the last call to run(), ordered by joining snapshot, then initial level.
+	Cohorts without customers are left out.
+	*/
+	const vector<Cohort>& getCohorts()
+	{
+		return cohorts;
+	}
+
+	/**
+	Writes the cohort table to a file as comma separated lines of joining snapshot, initial level, customers,
+	and the number of them INACTIVE within 1, 2, ... months. Returns false if the file could not be written.
+	*/
+	bool writeTable(string file_name)
+	{
+		fstream output(file_name, ios::out | ios::trunc);
+		for (size_t i = 0; i < cohorts.size(); i++)
+		{
+			output << cohorts[i].joined_snapshot << "," << cohorts[i].initial_level << "," << cohorts[i].customers;
+			for (size_t k = 0; k < cohorts[i].inactive_within.size(); k++)
+				output << "," << cohorts[i].inactive_within[k];
+			output << "\n";
+		}
+		return output.good();
+	}
+
+private:
+
+	/*A customer as of one snapshot*/
+	struct Entry
+	{
+		unsigned long membership_id;
+		Customer::SubscriptionLevel level;
+	};
+
+	static const size_t NOT_JOINED = (size_t)-1;
+
+	ThreadPool& pool;
+	vector<Cohort> cohorts;
+
+	static bool byMembershipID(const Entry& a, const Entry& b)
+	{
+		return a.membership_id < b.membership_id;
+	}
+
+	/*Merge walk over the membership IDs in [boundaries[range - 1], boundaries[range]) of every snapshot, following one customer
+	at a time through the series*/
+	void joinRange(const vector<vector<Entry> >& snapshots, const vector<unsigned long>& boundaries, size_t range, size_t months,
+		vector<size_t>& tally)
+	{
+		size_t snapshot_count = snapshots.size();
+		size_t row_size = months + 1;
+		vector<size_t> cursors(snapshot_count), ends(snapshot_count);
+		for (size_t s = 0; s < snapshot_count; s++)
+		{
+			Entry low = { range == 0 ? 0 : boundaries[range - 1], Customer::SubscriptionLevel::INACTIVE };
+			Entry high = { range < boundaries.size() ? boundaries[range] : 0, Customer::SubscriptionLevel::INACTIVE };
+			cursors[s] = lower_bound(snapshots[s].begin(), snapshots[s].end(), low, byMembershipID) - snapshots[s].begin();
+			ends[s] = range < boundaries.size()
+				? lower_bound(snapshots[s].begin(), snapshots[s].end(), high, byMembershipID) - snapshots[s].begin()
+				: snapshots[s].size();
+		}
+
+		for (;;)
+		{
+			/*The next customer is the lowest membership ID under any cursor*/
+			bool found = false;
+			unsigned long membership_id = 0;
+			for (size_t s = 0; s < snapshot_count; s++)
+			{
+				if (cursors[s] < ends[s] && (!found || snapshots[s][cursors[s]].membership_id < membership_id))
+				{
+					membership_id = snapshots[s][cursors[s]].membership_id;
+					found = true;
+				}
+			}
+			if (!found)
+				return;
+
+			size_t joined = NOT_JOINED;
+			Customer::SubscriptionLevel initial_level = Customer::SubscriptionLevel::INACTIVE;
+			bool baseline = false, churned = false;
+			for (size_t s = 0; s < snapshot_count; s++)
+			{
+				if (cursors[s] >= ends[s] || snapshots[s][cursors[s]].membership_id != membership_id)
+					continue;
+				Customer::SubscriptionLevel level = snapshots[s][cursors[s]++].level;
+
+				if (s == 0)
+					baseline = true;
+				else if (baseline || churned)
+					continue;
+				else if (joined == NOT_JOINED && level != Customer::SubscriptionLevel::INACTIVE)
+				{
+					joined = s;
+					initial_level = level;
+					tally[(joined * 4 + level) * row_size]++;
+				}
+				else if (joined != NOT_JOINED && level == Customer::SubscriptionLevel::INACTIVE)
+				{
+					churned = true;
+					if (s - joined <= months)
+						tally[(joined * 4 + initial_level) * row_size + s - joined]++;
+				}
+			}
+		}
+	}
+
+	RetentionAnalysis(const RetentionAnalysis&);
+	RetentionAnalysis& operator=(const RetentionAnalysis&);
+};
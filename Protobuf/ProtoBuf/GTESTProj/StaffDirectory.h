@@ -0,0 +1,253 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Member.h"
+#include "MemberRegistry.h"
+#include "MemberSnapshot.h"
+#include "MemoryStats.h"
+
+using namespace std;
+
+/**
+The StaffDirectory class finds staff by employee ID, the identifier payroll and the staff portal use, for current and former staff alike.
+
+The directory registers itself as a MemberRegistry::Listener, so a new employee ID given with setEmployeeID() is indexed as soon as
+the changed staff is published. An employee ID stops being active when its staff is removed, becomes a customer or is given
+another ID; it is then kept as a former entry, holding the staff as they last were under it. Former entries can be saved with
+saveHistory() and read back after a restart with loadHistory().
+
+Lookups return copies, so they stay valid after the directory changes. Every function can be called from any thread;
+batch lookups take the directory's lock once for the whole batch. Employee ID 0 marks staff without one, and is not indexed.
+*/
+class StaffDirectory : public MemberRegistry::Listener
+{
+public:
+
+	/**
+	The enumerated "Status" type tells whether an employee ID is unknown, held by a current staff, or was held by a former one.
+	*/
+	enum Status { UNKNOWN, ACTIVE, FORMER };
+
+	/**
+	The Entry struct is the result of a lookup. "staff" is only filled in when "status" is not UNKNOWN.
+	*/
+	struct Entry
+	{
+		Status status;
+		Staff staff;
+	};
+
+	/**
+	Constructor for StaffDirectory. Indexes every staff already in "registry" and keeps the index up to date from then on.
+	*/
+	StaffDirectory(MemberRegistry& registry) : registry(registry)
+	{
+		active_count = 0;
+		registry.addListener(this);
+	}
+
+	/**
+	Destructor for StaffDirectory.
+	*/
+	~StaffDirectory()
+	{
+		registry.removeListener(this);
+		for (unordered_map<unsigned long, Record>::iterator it = records.begin(); it != records.end(); ++it)
+			delete it->second.staff;
+	}
+
+	/**
+	Looks up one employee ID. Returns false, with the entry's status set to UNKNOWN, if no staff has ever held it.
+	*/
+	bool findByEmployeeID(unsigned long employee_id, Entry& entry)
+	{
+		lock_guard<mutex> lock(directory_lock);
+		return lookup(employee_id, entry);
+	}
+
+	/**
+	Looks up many employee IDs at once, e.g. for a payroll run. "entries" is resized to match "employee_ids", entry for entry.
+	Returns the number of IDs that were found.
+	*/
+	size_t findByEmployeeIDs(const vector<unsigned long>& employee_ids, vector<Entry>& entries)
+	{
+		entries.resize(employee_ids.size());
+
+		size_t found = 0;
+		lock_guard<mutex> lock(directory_lock);
+		for (size_t i = 0; i < employee_ids.size(); i++)
+		{
+			if (lookup(employee_ids[i], entries[i]))
+				found++;
+		}
+		return found;
+	}
+
+	/**
+	Retreives the number of employee IDs held by current staff.
+	*/
+	size_t getActiveCount()
+	{
+		lock_guard<mutex> lock(directory_lock);
+		return active_count;
+	}
+
+	/**
+	Retreives the number of employee IDs held by former staff.
+	*/
+	size_t getFormerCount()
+	{
+		lock_guard<mutex> lock(directory_lock);
+		return records.size() - active_count;
+	}
+
+	/**
+	Saves every former entry to a snapshot file. Returns false if the file could not be written.
+	*/
+	bool saveHistory(string file_name)
+	{
+		vector<Member*> former;
+		{
+			lock_guard<mutex> lock(directory_lock);
+			for (unordered_map<unsigned long, Record>::iterator it = records.begin(); it != records.end(); ++it)
+			{
+				if (!it->second.active)
+					former.push_back(it->second.staff->clone());
+			}
+		}
+
+		bool saved = MemberSnapshot::save(file_name, former, MemberSnapshot::Codec::PROTOBUF);
+		for (size_t i = 0; i < former.size(); i++)
+			delete former[i];
+		return saved;
+	}
+
+	/**
+	Adds the former entries saved by saveHistory() to the directory. Employee IDs that are active again are left as they are.
+	Returns false if the file could not be read.
+	*/
+	bool loadHistory(string file_name)
+	{
+		vector<Member*> former;
+		if (!MemberSnapshot::load(file_name, former))
+			return false;
+
+		lock_guard<mutex> lock(directory_lock);
+		for (size_t i = 0; i < former.size(); i++)
+		{
+			if (former[i]->getMemberType() != Member::Type::STAFF)
+			{
+				delete former[i];
+				continue;
+			}
+
+			Staff* staff = (Staff*)former[i];
+			unordered_map<unsigned long, Record>::iterator it = records.find(staff->getEmployeeID());
+			if (staff->getEmployeeID() == 0 || (it != records.end() && it->second.active))
+			{
+				delete staff;
+				continue;
+			}
+
+			if (it != records.end())
+				delete it->second.staff;
+			Record record = { staff, false };
+			records[staff->getEmployeeID()] = record;
+		}
+		table_charge.resize(MemoryStats::hashMapBytes(records));
+		return true;
+	}
+
+	/*Implementing MemberRegistry::Listener*/
+
+	/**
+	Indexes the employee ID of a newly published staff, and retires the ID it held before if it changed or is no longer a staff.
+	*/
+	void onPublish(Member* old_version, Member* new_version)
+	{
+		lock_guard<mutex> lock(directory_lock);
+
+		bool still_staff = new_version->getMemberType() == Member::Type::STAFF;
+		if (old_version != NULL && old_version->getMemberType() == Member::Type::STAFF
+			&& (!still_staff || ((Staff*)old_version)->getEmployeeID() != ((Staff*)new_version)->getEmployeeID()))
+			retire((Staff*)old_version);
+
+		if (!still_staff)
+			return;
+
+		Staff* staff = (Staff*)new_version;
+		if (staff->getEmployeeID() == 0)
+			return;
+
+		Record& record = records[staff->getEmployeeID()];
+		table_charge.resize(MemoryStats::hashMapBytes(records));
+		if (record.staff == NULL)
+			active_count++;
+		else
+		{
+			if (!record.active)
+				active_count++;
+			delete record.staff;
+		}
+		record.staff = staff->clone();
+		record.active = true;
+	}
+
+	/**
+	Keeps the employee ID of a removed staff as a former entry.
+	*/
+	void onRemove(Member* old_version)
+	{
+		lock_guard<mutex> lock(directory_lock);
+		if (old_version->getMemberType() == Member::Type::STAFF)
+			retire((Staff*)old_version);
+	}
+
+private:
+
+	/*The latest known version of whoever holds, or last held, an employee ID. The directory owns "staff"*/
+	struct Record
+	{
+		Staff* staff;
+		bool active;
+	};
+
+	MemberRegistry& registry;
+	mutex directory_lock;
+	unordered_map<unsigned long, Record> records;
+	size_t active_count;
+	MemoryCharge<MemoryStats::MEMBER_INDEXES> table_charge;
+
+	bool lookup(unsigned long employee_id, Entry& entry)
+	{
+		unordered_map<unsigned long, Record>::iterator it = records.find(employee_id);
+		if (it == records.end())
+		{
+			entry.status = UNKNOWN;
+			return false;
+		}
+
+		entry.status = it->second.active ? ACTIVE : FORMER;
+		entry.staff = *it->second.staff;
+		return true;
+	}
+
+	/*Turns the active entry of a staff's employee ID into a former one, unless the ID has since been given to someone else*/
+	void retire(Staff* last_version)
+	{
+		unordered_map<unsigned long, Record>::iterator it = records.find(last_version->getEmployeeID());
+		if (it == records.end() || !it->second.active || it->second.staff->getMembershipID() != last_version->getMembershipID())
+			return;
+
+		delete it->second.staff;
+		it->second.staff = last_version->clone();
+		it->second.active = false;
+		active_count--;
+	}
+
+	StaffDirectory(const StaffDirectory&);
+	StaffDirectory& operator=(const StaffDirectory&);
+};
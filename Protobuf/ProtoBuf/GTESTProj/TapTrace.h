@@ -0,0 +1,392 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "AdmissionPolicy.h"
+#include "LatencyHistogram.h"
+#include "Member.h"
+#include "MemberRegistry.h"
+
+using namespace std;
+
+/**
+The TapEvent struct is one bracelet tap on a reader, "time_us" microseconds after the start of its trace.
+*/
+struct TapEvent
+{
+	unsigned long long time_us;
+	unsigned long bracelet_id;
+	unsigned int reader_id;
+};
+
+/**
+The TapTrace class reads and writes tap traces, so that real traffic such as the Monday 6pm rush can be captured once
+and replayed against any build.
+
+Traces are compact: after the magic "S330TRCE" (8), each tap is three varints of 7 bits per byte, low bits first,
+holding the time since the previous tap, the bracelet ID and the reader ID. A busy reader's tap typically takes 6 to 8 bytes.
+*/
+class TapTrace
+{
+public:
+
+	/**
+	Writes taps to a file, in time order. Returns false if the file could not be written.
+	*/
+	static bool save(string file_name, const vector<TapEvent>& events)
+	{
+		vector<TapEvent> sorted(events);
+		stable_sort(sorted.begin(), sorted.end(), earlier);
+
+		string out("S330TRCE", 8);
+		unsigned long long last_time = 0;
+		for (size_t i = 0; i < sorted.size(); i++)
+		{
+			putVarint(out, sorted[i].time_us - last_time);
+			putVarint(out, sorted[i].bracelet_id);
+			putVarint(out, sorted[i].reader_id);
+			last_time = sorted[i].time_us;
+		}
+
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(out.data(), out.size());
+		return output.good();
+	}
+
+	/**
+	Reads the taps of a file written by save() into "events", replacing its contents.
+	Returns false if the file could not be read or is malformed.
+	*/
+	static bool load(string file_name, vector<TapEvent>& events)
+	{
+		events.clear();
+		fstream input(file_name, ios::in | ios::binary);
+		if (!input)
+			return false;
+		string in((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+		if (in.size() < 8 || memcmp(in.data(), "S330TRCE", 8) != 0)
+			return false;
+
+		size_t position = 8;
+		unsigned long long time = 0;
+		while (position < in.size())
+		{
+			unsigned long long delta, bracelet_id, reader_id;
+			if (!getVarint(in, position, delta) || !getVarint(in, position, bracelet_id) || !getVarint(in, position, reader_id))
+			{
+				events.clear();
+				return false;
+			}
+
+			TapEvent event;
+			time += delta;
+			event.time_us = time;
+			event.bracelet_id = (unsigned long)bracelet_id;
+			event.reader_id = (unsigned int)reader_id;
+			events.push_back(event);
+		}
+		return true;
+	}
+
+	static bool earlier(const TapEvent& a, const TapEvent& b)
+	{
+		return a.time_us < b.time_us;
+	}
+
+private:
+
+	static void putVarint(string& out, unsigned long long value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back((char)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((char)value);
+	}
+
+	static bool getVarint(const string& in, size_t& position, unsigned long long& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && position < in.size(); shift += 7)
+		{
+			unsigned char byte = (unsigned char)in[position++];
+			value |= (unsigned long long)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+};
+
+/**
+The TapRecorder class captures live taps with their arrival times, e.g. every tap answered by a BraceletReaderService
+it is given to with setRecorder(). It can be called from any thread.
+*/
+class TapRecorder
+{
+public:
+
+	/**
+	Constructor for TapRecorder. Times are measured from the moment the recorder is made.
+	*/
+	TapRecorder()
+	{
+		start = chrono::steady_clock::now();
+	}
+
+	/**
+	Records a tap happening now.
+	*/
+	void record(unsigned long bracelet_id, unsigned int reader_id)
+	{
+		TapEvent event;
+		event.time_us = (unsigned long long)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		event.bracelet_id = bracelet_id;
+		event.reader_id = reader_id;
+
+		lock_guard<mutex> lock(events_lock);
+		events.push_back(event);
+	}
+
+	/**
+	Retreives the number of taps recorded so far.
+	*/
+	size_t size()
+	{
+		lock_guard<mutex> lock(events_lock);
+		return events.size();
+	}
+
+	/**
+	Writes the recorded taps to a trace file. Returns false if the file could not be written.
+	*/
+	bool save(string file_name)
+	{
+		lock_guard<mutex> lock(events_lock);
+		return TapTrace::save(file_name, events);
+	}
+
+private:
+	chrono::steady_clock::time_point start;
+	mutex events_lock;
+	vector<TapEvent> events;
+
+	TapRecorder(const TapRecorder&);
+	TapRecorder& operator=(const TapRecorder&);
+};
+
+/**
+The ReplayResult struct sums up one replay of a trace. Latencies are in nanoseconds; percentiles are read from a LatencyHistogram,
+so they are at most 1.6% high, and the maximum is exact.
+"digest" is a hash of every decision and reason in trace order, so two replays made the same decisions exactly when their digests match.
+*/
+struct ReplayResult
+{
+	unsigned long long taps;
+	unsigned long long admitted;
+	unsigned long long denied[AdmissionPolicy::REASON_COUNT];
+	double seconds;
+	double taps_per_second;
+	unsigned long long latency_p50;
+	unsigned long long latency_p90;
+	unsigned long long latency_p99;
+	unsigned long long latency_p999;
+	unsigned long long latency_max;
+	unsigned long long digest;
+
+	ReplayResult()
+	{
+		taps = 0;
+		admitted = 0;
+		for (int i = 0; i < AdmissionPolicy::REASON_COUNT; i++)
+			denied[i] = 0;
+		seconds = 0;
+		taps_per_second = 0;
+		latency_p50 = latency_p90 = latency_p99 = latency_p999 = latency_max = 0;
+		digest = 0;
+	}
+};
+
+/**
+The TapReplayer class replays a tap trace against a MemberRegistry, deciding each tap with the AdmissionPolicy,
+the same decision the BraceletReaderService makes for a live tap. It can also take a gym credit from each admitted customer,
+to try out charging per visit; the live service does not, so replays that charge make decisions of their own.
+
+A trace can be replayed at its recorded pace (speed 1), faster (e.g. speed 10) or as fast as possible (speed 0).
+When paced, a tap's latency is counted from the moment it was due, so a build that falls behind the trace shows it in its latencies;
+at full speed it is the time taken to answer the tap.
+Results can be saved, so the results of two builds replaying the same trace on the same members can be compared.
+*/
+class TapReplayer
+{
+public:
+
+	/**
+	Constructor for TapReplayer. Admitted customers are only charged one gym credit if "charge_credits" is true.
+	*/
+	TapReplayer(MemberRegistry& registry, bool charge_credits = false) : registry(registry), charge_credits(charge_credits)
+	{
+	}
+
+	/**
+	Replays the taps of "events", which must be in time order, at the given speed. Returns the result of the replay.
+	*/
+	ReplayResult replay(const vector<TapEvent>& events, double speed)
+	{
+		ReplayResult result;
+		LatencyHistogram latencies(1);
+		unsigned long long digest = 14695981039346656037ull;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		unsigned long long first_time = events.empty() ? 0 : events[0].time_us;
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			chrono::steady_clock::time_point due = chrono::steady_clock::now();
+			if (speed > 0)
+			{
+				due = start + chrono::duration_cast<chrono::steady_clock::duration>(
+					chrono::duration<double, micro>((events[i].time_us - first_time) / speed));
+				if (due > chrono::steady_clock::now())
+					this_thread::sleep_until(due);
+			}
+
+			AdmissionPolicy::Reason reason;
+			AdmissionPolicy::Decision decision = tap(events[i].bracelet_id, reason);
+			latencies.record((unsigned long long)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - due).count());
+
+			if (decision == AdmissionPolicy::ADMIT)
+				result.admitted++;
+			else
+				result.denied[reason]++;
+			digest = (digest ^ (unsigned long long)(decision * AdmissionPolicy::REASON_COUNT + reason)) * 1099511628211ull;
+		}
+
+		result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		result.taps = events.size();
+		result.taps_per_second = result.seconds > 0 ? result.taps / result.seconds : 0;
+		result.digest = digest;
+
+		LatencyHistogram::Snapshot snapshot = latencies.getSnapshot();
+		result.latency_p50 = snapshot.percentile(0.5);
+		result.latency_p90 = snapshot.percentile(0.9);
+		result.latency_p99 = snapshot.percentile(0.99);
+		result.latency_p999 = snapshot.percentile(0.999);
+		result.latency_max = snapshot.getMax();
+		return result;
+	}
+
+	/**
+	Writes a result to a file, one "name value" line per field. Returns false if the file could not be written.
+	*/
+	static bool saveResult(string file_name, const ReplayResult& result)
+	{
+		fstream output(file_name, ios::out | ios::trunc);
+		output << "taps " << result.taps << "\n";
+		output << "admitted " << result.admitted << "\n";
+		for (int i = 0; i < AdmissionPolicy::REASON_COUNT; i++)
+			output << "denied_" << i << " " << result.denied[i] << "\n";
+		output << "seconds " << result.seconds << "\n";
+		output << "taps_per_second " << result.taps_per_second << "\n";
+		output << "latency_p50 " << result.latency_p50 << "\n";
+		output << "latency_p90 " << result.latency_p90 << "\n";
+		output << "latency_p99 " << result.latency_p99 << "\n";
+		output << "latency_p999 " << result.latency_p999 << "\n";
+		output << "latency_max " << result.latency_max << "\n";
+		output << "digest " << result.digest << "\n";
+		return output.good();
+	}
+
+	/**
+	Reads a result written by saveResult(). Returns false if the file could not be read or is malformed.
+	*/
+	static bool loadResult(string file_name, ReplayResult& result)
+	{
+		fstream input(file_name, ios::in);
+		string name;
+		string denied_names[AdmissionPolicy::REASON_COUNT];
+		for (int i = 0; i < AdmissionPolicy::REASON_COUNT; i++)
+			denied_names[i] = "denied_" + to_string(i);
+
+		bool ok = (input >> name) && name == "taps" && (input >> result.taps)
+			&& (input >> name) && name == "admitted" && (input >> result.admitted);
+		for (int i = 0; ok && i < AdmissionPolicy::REASON_COUNT; i++)
+			ok = (input >> name) && name == denied_names[i] && (input >> result.denied[i]);
+		return ok && (input >> name) && name == "seconds" && (input >> result.seconds)
+			&& (input >> name) && name == "taps_per_second" && (input >> result.taps_per_second)
+			&& (input >> name) && name == "latency_p50" && (input >> result.latency_p50)
+			&& (input >> name) && name == "latency_p90" && (input >> result.latency_p90)
+			&& (input >> name) && name == "latency_p99" && (input >> result.latency_p99)
+			&& (input >> name) && name == "latency_p999" && (input >> result.latency_p999)
+			&& (input >> name) && name == "latency_max" && (input >> result.latency_max)
+			&& (input >> name) && name == "digest" && (input >> result.digest);
+	}
+
+	/**
+	Writes a side by side report of a baseline and a candidate result to "report".
+	Returns true if both made the same decisions, so that only their speed differs.
+	*/
+	static bool compare(const ReplayResult& baseline, const ReplayResult& candidate, ostream& report)
+	{
+		const char* reasons[] = { "OK", "UNKNOWN_BRACELET", "INACTIVE_SUBSCRIPTION", "NO_CREDITS" };
+		report << "metric baseline candidate change\n";
+		line(report, "taps_per_second", baseline.taps_per_second, candidate.taps_per_second);
+		line(report, "latency_p50_ns", (double)baseline.latency_p50, (double)candidate.latency_p50);
+		line(report, "latency_p90_ns", (double)baseline.latency_p90, (double)candidate.latency_p90);
+		line(report, "latency_p99_ns", (double)baseline.latency_p99, (double)candidate.latency_p99);
+		line(report, "latency_p999_ns", (double)baseline.latency_p999, (double)candidate.latency_p999);
+		line(report, "latency_max_ns", (double)baseline.latency_max, (double)candidate.latency_max);
+		line(report, "admitted", (double)baseline.admitted, (double)candidate.admitted);
+		for (int i = 1; i < AdmissionPolicy::REASON_COUNT; i++)
+			line(report, string("denied_") + reasons[i], (double)baseline.denied[i], (double)candidate.denied[i]);
+
+		bool same = baseline.taps == candidate.taps && baseline.digest == candidate.digest;
+		report << (same ? "decisions identical\n" : "decisions differ\n");
+		return same;
+	}
+
+private:
+	MemberRegistry& registry;
+	bool charge_credits;
+
+	AdmissionPolicy::Decision tap(unsigned long bracelet_id, AdmissionPolicy::Reason& reason)
+	{
+		unsigned long membership_id = 0;
+		bool charge = false;
+		AdmissionPolicy::Decision decision;
+		{
+			MemberRegistry::ReadGuard guard(registry);
+			Member* member = guard.findByBraceletID(bracelet_id);
+			decision = AdmissionPolicy::decide(member, reason);
+			if (decision == AdmissionPolicy::ADMIT && member->getMemberType() == Member::Type::CUSTOMER)
+			{
+				membership_id = member->getMembershipID();
+				charge = charge_credits;
+			}
+		}
+
+		if (charge)
+			registry.update(membership_id, [](Member* member) { ((Customer*)member)->deductGymCredits(1); });
+		return decision;
+	}
+
+	static void line(ostream& report, string name, double baseline, double candidate)
+	{
+		report << name << " " << baseline << " " << candidate << " ";
+		if (baseline > 0)
+			report << (candidate - baseline) * 100 / baseline << "%\n";
+		else
+			report << "-\n";
+	}
+
+	TapReplayer(const TapReplayer&);
+	TapReplayer& operator=(const TapReplayer&);
+};
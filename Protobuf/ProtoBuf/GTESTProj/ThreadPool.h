@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+The ThreadPool class runs tasks on a fixed set of worker threads.
+
+Tasks can be submitted one at a time with submit(), which returns a future for the task's completion,
+or a range of indexes can be processed in parallel with parallelFor(), which blocks until every index has been handled.
+*/
+class ThreadPool
+{
+public:
+
+	/**
+	Constructor for ThreadPool. Starts "thread_count" workers, or one per hardware thread if "thread_count" is 0.
+	*/
+	ThreadPool(size_t thread_count = 0)
+	{
+		if (thread_count == 0)
+			thread_count = max(1u, thread::hardware_concurrency());
+
+		stopping = false;
+		for (size_t i = 0; i < thread_count; i++)
+			workers.push_back(thread(&ThreadPool::workerLoop, this));
+	}
+
+	/**
+	Destructor for ThreadPool. Finishes every queued task, then joins the workers.
+	*/
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> lock(queue_lock);
+			stopping = true;
+		}
+		queue_ready.notify_all();
+
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	/**
+	Queues a task to be run by a worker. The returned future becomes ready once the task has finished,
+	and rethrows any exception the task threw.
+	*/
+	future<void> submit(function<void()> task)
+	{
+		shared_ptr<packaged_task<void()> > packaged(new packaged_task<void()>(task));
+		future<void> result = packaged->get_future();
+
+		{
+			lock_guard<mutex> lock(queue_lock);
+			tasks.push([packaged]() { (*packaged)(); });
+		}
+		queue_ready.notify_one();
+
+		return result;
+	}
+
+	/**
+	Calls "body" once for every index in [0, count), spread across the workers, and waits for all of them to finish.
+	Indexes are handed out dynamically, so uneven work is balanced between threads.
+	Must not be called from inside a task running on the same pool.
+	*/
+	void parallelFor(size_t count, function<void(size_t)> body)
+	{
+		shared_ptr<atomic<size_t> > next(new atomic<size_t>(0));
+		vector<future<void> > done;
+
+		size_t runners = min(count, workers.size());
+		for (size_t r = 0; r < runners; r++)
+		{
+			done.push_back(submit([next, count, body]()
+			{
+				for (size_t i = next->fetch_add(1); i < count; i = next->fetch_add(1))
+					body(i);
+			}));
+		}
+
+		for (size_t r = 0; r < done.size(); r++)
+			done[r].get();
+	}
+
+	/**
+	Returns the number of worker threads.
+	*/
+	size_t size()
+	{
+		return workers.size();
+	}
+
+private:
+	vector<thread> workers;
+	queue<function<void()> > tasks;
+	mutex queue_lock;
+	condition_variable queue_ready;
+	bool stopping;
+
+	void workerLoop()
+	{
+		for (;;)
+		{
+			function<void()> task;
+			{
+				unique_lock<mutex> lock(queue_lock);
+				while (!stopping && tasks.empty())
+					queue_ready.wait(lock);
+
+				if (tasks.empty())
+					return;
+
+				task = tasks.front();
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+The SpanTracer class records timed spans of work, e.g. the file read, protobuf parse, member conversion and index build
+phases of a bulk import, and dumps them as Chrome trace JSON, which chrome://tracing and Perfetto show as one timeline
+with a row per thread.
+
+Spans are recorded with a TraceSpan. Each thread writes into a ring buffer of its own, holding its last RING_SIZE spans,
+so recording never waits on another thread. Dumping can happen at any time, while spans are still being recorded;
+a span that is overwritten while it is being read is left out.
+
+There is one process-wide instance. Tracing is off until setEnabled(true), and while off a TraceSpan costs one flag check.
+Span names and categories must be string literals, or otherwise outlive the tracer.
+*/
+class SpanTracer
+{
+public:
+
+	static const size_t RING_SIZE = 16384;
+	static const size_t MAX_THREADS = 256;
+
+private:
+
+	/*Every field is written by the ring's own thread and may be read concurrently by a dump*/
+	struct Event
+	{
+		atomic<const char*> name;
+		atomic<const char*> category;
+		atomic<unsigned long long> start;
+		atomic<unsigned long long> duration;
+	};
+
+	/*"begun" and "ended" count the spans started and finished writing, "cleared" is where the last clear() cut the ring*/
+	struct Ring
+	{
+		atomic<unsigned long long> begun;
+		atomic<unsigned long long> ended;
+		atomic<unsigned long long> cleared;
+		Event events[RING_SIZE];
+	};
+
+	struct Slot
+	{
+		atomic<size_t> owner;
+		atomic<Ring*> ring;
+	};
+
+public:
+
+	/**
+	Returns the process-wide SpanTracer.
+	*/
+	static SpanTracer& instance()
+	{
+		static SpanTracer tracer;
+		return tracer;
+	}
+
+	/**
+	Turns recording on or off. It is off by default.
+	*/
+	void setEnabled(bool enabled)
+	{
+		this->enabled.store(enabled, memory_order_relaxed);
+	}
+
+	/**
+	Returns whether recording is on.
+	*/
+	bool isEnabled()
+	{
+		return enabled.load(memory_order_relaxed);
+	}
+
+	/**
+	Returns the time since the tracer was made, in nanoseconds, as used for span start times.
+	*/
+	unsigned long long now()
+	{
+		return (unsigned long long)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+	}
+
+	/**
+	Records a finished span on the calling thread's ring. Spans from threads beyond the first MAX_THREADS are dropped.
+	*/
+	void record(const char* name, const char* category, unsigned long long start, unsigned long long duration)
+	{
+		Ring* ring = ringOfThisThread();
+		if (ring == NULL)
+			return;
+
+		unsigned long long index = ring->ended.load(memory_order_relaxed);
+		ring->begun.store(index + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		Event& event = ring->events[index % RING_SIZE];
+		event.name.store(name, memory_order_relaxed);
+		event.category.store(category, memory_order_relaxed);
+		event.start.store(start, memory_order_relaxed);
+		event.duration.store(duration, memory_order_relaxed);
+		ring->ended.store(index + 1, memory_order_release);
+	}
+
+	/**
+	Forgets every span recorded so far.
+	*/
+	void clear()
+	{
+		for (size_t s = 0; s < MAX_THREADS; s++)
+		{
+			Ring* ring = slots[s].ring.load(memory_order_acquire);
+			if (ring != NULL)
+				ring->cleared.store(ring->ended.load(memory_order_acquire), memory_order_relaxed);
+		}
+	}
+
+	/**
+	Returns every recorded span as Chrome trace JSON. Times are in microseconds since the tracer was made,
+	and each thread that recorded spans is a row named "thread <n>".
+	*/
+	string toJson()
+	{
+		ostringstream out;
+		out.setf(ios::fixed);
+		out.precision(3);
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+		bool first = true;
+		for (size_t s = 0; s < MAX_THREADS; s++)
+		{
+			Ring* ring = slots[s].ring.load(memory_order_acquire);
+			if (ring == NULL)
+				continue;
+
+			out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << s + 1
+				<< ",\"args\":{\"name\":\"thread " << s + 1 << "\"}}";
+			first = false;
+
+			/*Read the newest RING_SIZE spans, then keep those the writer cannot have started overwriting meanwhile*/
+			unsigned long long end = ring->ended.load(memory_order_acquire);
+			unsigned long long begin = max(ring->cleared.load(memory_order_relaxed), end > RING_SIZE ? end - RING_SIZE : 0);
+			vector<Span> spans;
+			for (unsigned long long i = begin; i < end; i++)
+			{
+				Event& event = ring->events[i % RING_SIZE];
+				Span span = { i, event.name.load(memory_order_relaxed), event.category.load(memory_order_relaxed),
+					event.start.load(memory_order_relaxed), event.duration.load(memory_order_relaxed) };
+				spans.push_back(span);
+			}
+			atomic_thread_fence(memory_order_acquire);
+			unsigned long long begun = ring->begun.load(memory_order_relaxed);
+
+			for (size_t i = 0; i < spans.size(); i++)
+			{
+				if (spans[i].index + RING_SIZE < begun)
+					continue;
+				out << ",\n{\"name\":\"" << escape(spans[i].name) << "\",\"cat\":\"" << escape(spans[i].category)
+					<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s + 1
+					<< ",\"ts\":" << spans[i].start / 1000.0 << ",\"dur\":" << spans[i].duration / 1000.0 << "}";
+			}
+		}
+
+		out << "\n]}\n";
+		return out.str();
+	}
+
+	/**
+	Writes every recorded span to a Chrome trace JSON file. Returns false if the file could not be written.
+	*/
+	bool dump(string file_name)
+	{
+		string json = toJson();
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(json.data(), json.size());
+		return output.good();
+	}
+
+private:
+	atomic<bool> enabled;
+	chrono::steady_clock::time_point epoch;
+	Slot slots[MAX_THREADS];
+
+	struct Span
+	{
+		unsigned long long index;
+		const char* name;
+		const char* category;
+		unsigned long long start;
+		unsigned long long duration;
+	};
+
+	SpanTracer()
+	{
+		enabled.store(false);
+		epoch = chrono::steady_clock::now();
+		for (size_t s = 0; s < MAX_THREADS; s++)
+		{
+			slots[s].owner.store(0);
+			slots[s].ring.store(NULL);
+		}
+	}
+
+	~SpanTracer()
+	{
+		for (size_t s = 0; s < MAX_THREADS; s++)
+			delete slots[s].ring.load();
+	}
+
+	/*Threads are told apart by the hash of their ID. A thread claims a slot the first time it records and keeps it*/
+	Ring* ringOfThisThread()
+	{
+		size_t owner = hash<thread::id>()(this_thread::get_id());
+		if (owner == 0)
+			owner = 1;
+
+		for (size_t probes = 0, s = owner % MAX_THREADS; probes < MAX_THREADS; probes++, s = (s + 1) % MAX_THREADS)
+		{
+			size_t current = slots[s].owner.load(memory_order_acquire);
+			if (current == owner)
+				return slots[s].ring.load(memory_order_acquire);
+			if (current != 0 || !slots[s].owner.compare_exchange_strong(current, owner))
+				continue;
+
+			Ring* ring = new Ring();
+			ring->begun.store(0);
+			ring->ended.store(0);
+			ring->cleared.store(0);
+			for (size_t i = 0; i < RING_SIZE; i++)
+			{
+				ring->events[i].name.store("");
+				ring->events[i].category.store("");
+				ring->events[i].start.store(0);
+				ring->events[i].duration.store(0);
+			}
+			slots[s].ring.store(ring, memory_order_release);
+			return ring;
+		}
+		return NULL;
+	}
+
+	static string escape(const char* text)
+	{
+		string escaped;
+		for (; *text != 0; text++)
+		{
+			if (*text == '"' || *text == '\\')
+				escaped.push_back('\\');
+			escaped.push_back(*text);
+		}
+		return escaped;
+	}
+
+	SpanTracer(const SpanTracer&);
+	SpanTracer& operator=(const SpanTracer&);
+};
+
+/*The tracer is created before main() runs, as two threads opening the first spans at once could both construct it under VS2013*/
+static SpanTracer& span_tracer = SpanTracer::instance();
+
+/**
+The TraceSpan class records the scope it is declared in as a span of the SpanTracer, if tracing is on when the scope starts.
+*/
+class TraceSpan
+{
+public:
+
+	TraceSpan(const char* name, const char* category) : name(name), category(category)
+	{
+		running = SpanTracer::instance().isEnabled();
+		if (running)
+			start = SpanTracer::instance().now();
+	}
+
+	~TraceSpan()
+	{
+		if (running)
+			SpanTracer::instance().record(name, category, start, SpanTracer::instance().now() - start);
+	}
+
+private:
+	const char* name;
+	const char* category;
+	bool running;
+	unsigned long long start;
+
+	TraceSpan(const TraceSpan&);
+	TraceSpan& operator=(const TraceSpan&);
+};
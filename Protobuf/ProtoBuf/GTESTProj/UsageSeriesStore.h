@@ -0,0 +1,533 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include "ByteOrder.h"
+
+using namespace std;
+
+/**
+The UsageSession struct is one bracelet tap at a machine: who used which machine, when (seconds since the epoch) and for how long (seconds).
+*/
+struct UsageSession
+{
+	unsigned long bracelet_id;
+	unsigned long machine_id;
+	unsigned long long timestamp;
+	unsigned int duration;
+};
+
+/**
+The UsageSeriesStore class keeps machine usage sessions for months in little memory, and answers range scans by member or by machine.
+
+Sessions are split into time partitions of "partition_seconds" each. Within a partition, the sessions of one member on one machine
+form a series, stored as one compressed block that appends go straight into:
+timestamps are delta-of-delta encoded and durations are XORed with the previous duration, both Gorilla style.
+Each partition also indexes its blocks by member and by machine, so a scan only decodes the blocks of the partitions it overlaps
+that belong to the member or machine asked for.
+
+Timestamp encoding, per session after the first: delta-of-delta 0 as '0', within [-64, 63] as '10' and 7 bits,
+within [-256, 255] as '110' and 9 bits, within [-2048, 2047] as '1110' and 12 bits, otherwise '1111' and 32 bits.
+The first session stores its timestamp as 32 bits of offset from the start of its partition, and its delta is taken to be 0.
+Duration encoding: '0' if equal to the previous duration, '10' and the XOR's meaningful bits if they fit in the previous
+window of leading and trailing zeros, otherwise '11', 5 bits of leading zeros, 6 bits of meaningful bit count and the meaningful bits.
+
+All functions can be called from any thread.
+*/
+class UsageSeriesStore
+{
+private:
+
+	/*Bits are written and read most significant first*/
+	struct BitWriter
+	{
+		string bytes;
+		unsigned long long bit_count;
+
+		BitWriter() : bit_count(0)
+		{
+		}
+
+		void write(unsigned long long value, int bits)
+		{
+			for (int i = bits - 1; i >= 0; i--)
+			{
+				if (bit_count % 8 == 0)
+					bytes.push_back(0);
+				if ((value >> i) & 1)
+					bytes[bytes.size() - 1] |= (char)(0x80 >> (bit_count % 8));
+				bit_count++;
+			}
+		}
+	};
+
+	/*Reads past "bit_count" return zero bits and set "overrun" instead of leaving the bytes*/
+	struct BitReader
+	{
+		const string& bytes;
+		unsigned long long bit_count;
+		unsigned long long position;
+		bool overrun;
+
+		BitReader(const string& bytes, unsigned long long bit_count) : bytes(bytes), bit_count(bit_count), position(0), overrun(false)
+		{
+		}
+
+		unsigned long long read(int bits)
+		{
+			if (bit_count - position < (unsigned long long)bits)
+			{
+				overrun = true;
+				position = bit_count;
+				return 0;
+			}
+
+			unsigned long long value = 0;
+			for (int i = 0; i < bits; i++)
+			{
+				value = (value << 1) | (((unsigned char)bytes[(size_t)(position / 8)] >> (7 - position % 8)) & 1);
+				position++;
+			}
+			return value;
+		}
+	};
+
+	/*One compressed series, and the state the next append continues from*/
+	struct Block
+	{
+		BitWriter bits;
+		size_t count;
+		unsigned long long last_timestamp;
+		long long last_delta;
+		unsigned int last_duration;
+		int leading_zeros;
+		int trailing_zeros;
+	};
+
+	typedef pair<unsigned long, unsigned long> SeriesKey;
+
+	struct Partition
+	{
+		map<SeriesKey, Block> blocks;
+		map<unsigned long, vector<unsigned long> > machines_by_member;
+		map<unsigned long, vector<unsigned long> > members_by_machine;
+	};
+
+public:
+
+	/*A member taps a machine a few times a week at most, so weekly partitions keep blocks long enough to compress well*/
+	static const unsigned long long DEFAULT_PARTITION_SECONDS = 7 * 24 * 60 * 60;
+
+	/**
+	Constructor for UsageSeriesStore. A "partition_seconds" of 0 uses DEFAULT_PARTITION_SECONDS.
+	*/
+	UsageSeriesStore(unsigned long long partition_seconds = DEFAULT_PARTITION_SECONDS)
+		: partition_seconds(partition_seconds == 0 ? DEFAULT_PARTITION_SECONDS : partition_seconds)
+	{
+		session_count = 0;
+		blocks_decoded = 0;
+	}
+
+	/**
+	Appends a session to the series of its member and machine.
+	*/
+	void append(const UsageSession& session)
+	{
+		lock_guard<mutex> lock(store_lock);
+		Partition& partition = partitions[session.timestamp / partition_seconds];
+		SeriesKey key(session.bracelet_id, session.machine_id);
+
+		map<SeriesKey, Block>::iterator found = partition.blocks.find(key);
+		if (found == partition.blocks.end())
+		{
+			found = partition.blocks.insert(make_pair(key, Block())).first;
+			partition.machines_by_member[session.bracelet_id].push_back(session.machine_id);
+			partition.members_by_machine[session.machine_id].push_back(session.bracelet_id);
+		}
+
+		appendToBlock(found->second, session.timestamp / partition_seconds * partition_seconds, session.timestamp, session.duration);
+		session_count++;
+	}
+
+	/**
+	Appends every session of the given member with a timestamp in [from, to) to "out", ordered by machine, then by time.
+	Returns the number of sessions found.
+	*/
+	size_t scanMember(unsigned long bracelet_id, unsigned long long from, unsigned long long to, vector<UsageSession>& out)
+	{
+		lock_guard<mutex> lock(store_lock);
+		size_t found = out.size();
+		for (map<unsigned long long, Partition>::iterator p = firstPartition(from); p != partitions.end() && p->first * partition_seconds < to; p++)
+		{
+			map<unsigned long, vector<unsigned long> >::iterator machines = p->second.machines_by_member.find(bracelet_id);
+			if (machines == p->second.machines_by_member.end())
+				continue;
+
+			for (size_t m = 0; m < machines->second.size(); m++)
+			{
+				decodeBlock(p->second.blocks[SeriesKey(bracelet_id, machines->second[m])], p->first * partition_seconds, bracelet_id, machines->second[m], from, to, out);
+				blocks_decoded++;
+			}
+		}
+		return out.size() - found;
+	}
+
+	/**
+	Appends every session on the given machine with a timestamp in [from, to) to "out", ordered by member, then by time.
+	Returns the number of sessions found.
+	*/
+	size_t scanMachine(unsigned long machine_id, unsigned long long from, unsigned long long to, vector<UsageSession>& out)
+	{
+		lock_guard<mutex> lock(store_lock);
+		size_t found = out.size();
+		for (map<unsigned long long, Partition>::iterator p = firstPartition(from); p != partitions.end() && p->first * partition_seconds < to; p++)
+		{
+			map<unsigned long, vector<unsigned long> >::iterator members = p->second.members_by_machine.find(machine_id);
+			if (members == p->second.members_by_machine.end())
+				continue;
+
+			for (size_t m = 0; m < members->second.size(); m++)
+			{
+				decodeBlock(p->second.blocks[SeriesKey(members->second[m], machine_id)], p->first * partition_seconds, members->second[m], machine_id, from, to, out);
+				blocks_decoded++;
+			}
+		}
+		return out.size() - found;
+	}
+
+	/**
+	Drops every partition that ends at or before "timestamp", e.g. to only keep the last few months. Returns the number of sessions dropped.
+	*/
+	size_t dropBefore(unsigned long long timestamp)
+	{
+		lock_guard<mutex> lock(store_lock);
+		size_t dropped = 0;
+		while (!partitions.empty() && (partitions.begin()->first + 1) * partition_seconds <= timestamp)
+		{
+			map<SeriesKey, Block>& blocks = partitions.begin()->second.blocks;
+			for (map<SeriesKey, Block>::iterator b = blocks.begin(); b != blocks.end(); b++)
+				dropped += b->second.count;
+			partitions.erase(partitions.begin());
+		}
+		session_count -= dropped;
+		return dropped;
+	}
+
+	/**
+	Retreives the number of sessions in the store.
+	*/
+	size_t size()
+	{
+		lock_guard<mutex> lock(store_lock);
+		return session_count;
+	}
+
+	/**
+	Retreives the number of bytes taken by the compressed blocks.
+	*/
+	size_t getCompressedBytes()
+	{
+		lock_guard<mutex> lock(store_lock);
+		size_t bytes = 0;
+		for (map<unsigned long long, Partition>::iterator p = partitions.begin(); p != partitions.end(); p++)
+		{
+			for (map<SeriesKey, Block>::iterator b = p->second.blocks.begin(); b != p->second.blocks.end(); b++)
+				bytes += b->second.bits.bytes.size();
+		}
+		return bytes;
+	}
+
+	/**
+	Retreives the number of blocks scans have decoded so far, to check that scans skip unrelated blocks.
+	*/
+	unsigned long long getBlocksDecoded()
+	{
+		return blocks_decoded.load();
+	}
+
+	/**
+	Writes every session to a file, keeping the blocks compressed. Returns false if the file could not be written.
+
+	Layout, all integers little-endian: magic "S330TSDB" (8), partition seconds (8), block count (8), then per block:
+	partition (8), bracelet ID (8), machine ID (8), session count (8), bit count (8), the block's bytes,
+	and its append state: last timestamp (8), last delta (8), last duration (4), leading zeros (1), trailing zeros (1).
+	*/
+	bool save(string file_name)
+	{
+		lock_guard<mutex> lock(store_lock);
+		string out("S330TSDB", 8);
+		size_t block_count = 0;
+		for (map<unsigned long long, Partition>::iterator p = partitions.begin(); p != partitions.end(); p++)
+			block_count += p->second.blocks.size();
+		ByteOrder::appendU64(out, partition_seconds);
+		ByteOrder::appendU64(out, block_count);
+
+		for (map<unsigned long long, Partition>::iterator p = partitions.begin(); p != partitions.end(); p++)
+		{
+			for (map<SeriesKey, Block>::iterator b = p->second.blocks.begin(); b != p->second.blocks.end(); b++)
+			{
+				const Block& block = b->second;
+				ByteOrder::appendU64(out, p->first);
+				ByteOrder::appendU64(out, b->first.first);
+				ByteOrder::appendU64(out, b->first.second);
+				ByteOrder::appendU64(out, block.count);
+				ByteOrder::appendU64(out, block.bits.bit_count);
+				out += block.bits.bytes;
+				ByteOrder::appendU64(out, block.last_timestamp);
+				ByteOrder::appendU64(out, (unsigned long long)block.last_delta);
+				ByteOrder::appendU64(out, block.last_duration, 4);
+				out.push_back((char)block.leading_zeros);
+				out.push_back((char)block.trailing_zeros);
+			}
+		}
+
+		fstream output(file_name, ios::out | ios::trunc | ios::binary);
+		output.write(out.data(), out.size());
+		return output.good();
+	}
+
+	/**
+	Replaces the contents of the store with a file written by save(). The partition length is taken from the file.
+	Returns false, leaving the store unchanged, if the file could not be read or is malformed: every block is decoded once
+	to check that its sessions take up exactly its bits, so later scans never read past a block.
+	*/
+	bool load(string file_name)
+	{
+		fstream input(file_name, ios::in | ios::binary);
+		if (!input)
+			return false;
+		string in((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+
+		size_t position = 8;
+		unsigned long long file_partition_seconds, block_count;
+		if (in.size() < 24 || memcmp(in.data(), "S330TSDB", 8) != 0
+			|| !ByteOrder::readU64(in, position, file_partition_seconds) || !ByteOrder::readU64(in, position, block_count) || file_partition_seconds == 0)
+			return false;
+
+		map<unsigned long long, Partition> loaded;
+		size_t loaded_sessions = 0;
+		for (unsigned long long i = 0; i < block_count; i++)
+		{
+			unsigned long long partition, bracelet_id, machine_id, count, bit_count, last_timestamp, last_delta, last_duration;
+			if (!ByteOrder::readU64(in, position, partition) || !ByteOrder::readU64(in, position, bracelet_id) || !ByteOrder::readU64(in, position, machine_id)
+				|| !ByteOrder::readU64(in, position, count) || !ByteOrder::readU64(in, position, bit_count))
+				return false;
+
+			size_t byte_count = (size_t)((bit_count + 7) / 8);
+			if (in.size() - position < byte_count)
+				return false;
+
+			Partition& p = loaded[partition];
+			SeriesKey key((unsigned long)bracelet_id, (unsigned long)machine_id);
+			if (count == 0 || p.blocks.count(key) != 0)
+				return false;
+			Block& block = p.blocks[key];
+			block.bits.bytes = in.substr(position, byte_count);
+			block.bits.bit_count = bit_count;
+			block.count = (size_t)count;
+			position += byte_count;
+
+			if (!ByteOrder::readU64(in, position, last_timestamp) || !ByteOrder::readU64(in, position, last_delta)
+				|| !ByteOrder::readU64(in, position, last_duration, 4) || in.size() - position < 2)
+				return false;
+			block.last_timestamp = last_timestamp;
+			block.last_delta = (long long)last_delta;
+			block.last_duration = (unsigned int)last_duration;
+			block.leading_zeros = in[position++];
+			block.trailing_zeros = in[position++];
+			if (block.leading_zeros < 0 || block.trailing_zeros < 0 || block.leading_zeros + block.trailing_zeros > 32)
+				return false;
+
+			vector<UsageSession> none;
+			if (!decodeBlock(block, partition * file_partition_seconds, key.first, key.second, 0, 0, none))
+				return false;
+
+			p.machines_by_member[key.first].push_back(key.second);
+			p.members_by_machine[key.second].push_back(key.first);
+			loaded_sessions += block.count;
+		}
+		if (position != in.size())
+			return false;
+
+		lock_guard<mutex> lock(store_lock);
+		partitions.swap(loaded);
+		partition_seconds = file_partition_seconds;
+		session_count = loaded_sessions;
+		return true;
+	}
+
+private:
+	mutex store_lock;
+	unsigned long long partition_seconds;
+	map<unsigned long long, Partition> partitions;
+	size_t session_count;
+	atomic<unsigned long long> blocks_decoded;
+
+	map<unsigned long long, Partition>::iterator firstPartition(unsigned long long from)
+	{
+		return partitions.lower_bound(from / partition_seconds);
+	}
+
+	static int leadingZeros(unsigned int value)
+	{
+		int count = 0;
+		for (unsigned int bit = 0x80000000u; bit != 0 && !(value & bit); bit >>= 1)
+			count++;
+		return count;
+	}
+
+	static int trailingZeros(unsigned int value)
+	{
+		int count = 0;
+		for (unsigned int bit = 1; bit != 0 && !(value & bit); bit <<= 1)
+			count++;
+		return count;
+	}
+
+	static void appendToBlock(Block& block, unsigned long long partition_start, unsigned long long timestamp, unsigned int duration)
+	{
+		BitWriter& bits = block.bits;
+		if (block.count == 0)
+		{
+			bits.write(timestamp - partition_start, 32);
+			bits.write(duration, 32);
+			block.last_timestamp = timestamp;
+			block.last_delta = 0;
+			block.last_duration = duration;
+			block.leading_zeros = 32;
+			block.trailing_zeros = 0;
+			block.count = 1;
+			return;
+		}
+
+		long long delta = (long long)(timestamp - block.last_timestamp);
+		long long dod = delta - block.last_delta;
+		if (dod == 0)
+			bits.write(0, 1);
+		else if (dod >= -64 && dod <= 63)
+		{
+			bits.write(2, 2);
+			bits.write((unsigned long long)dod, 7);
+		}
+		else if (dod >= -256 && dod <= 255)
+		{
+			bits.write(6, 3);
+			bits.write((unsigned long long)dod, 9);
+		}
+		else if (dod >= -2048 && dod <= 2047)
+		{
+			bits.write(14, 4);
+			bits.write((unsigned long long)dod, 12);
+		}
+		else
+		{
+			bits.write(15, 4);
+			bits.write((unsigned long long)dod, 32);
+		}
+
+		unsigned int xored = duration ^ block.last_duration;
+		if (xored == 0)
+			bits.write(0, 1);
+		else
+		{
+			int leading = min(leadingZeros(xored), 31);
+			int trailing = trailingZeros(xored);
+			if (leading >= block.leading_zeros && trailing >= block.trailing_zeros)
+			{
+				bits.write(2, 2);
+				bits.write(xored >> block.trailing_zeros, 32 - block.leading_zeros - block.trailing_zeros);
+			}
+			else
+			{
+				/*The meaningful bit count is 1 to 32, so it takes 6 bits*/
+				int meaningful = 32 - leading - trailing;
+				bits.write(3, 2);
+				bits.write(leading, 5);
+				bits.write(meaningful, 6);
+				bits.write(xored >> trailing, meaningful);
+				block.leading_zeros = leading;
+				block.trailing_zeros = trailing;
+			}
+		}
+
+		block.last_timestamp = timestamp;
+		block.last_delta = delta;
+		block.last_duration = duration;
+		block.count++;
+	}
+
+	static long long signExtend(unsigned long long value, int bits)
+	{
+		unsigned long long sign = 1ull << (bits - 1);
+		return (long long)((value ^ sign) - sign);
+	}
+
+	/*Decodes a whole block, appending the sessions in [from, to) to "out". Returns false if the block's sessions
+	do not take up exactly its bits, or a duration window is out of range*/
+	static bool decodeBlock(const Block& block, unsigned long long partition_start, unsigned long bracelet_id, unsigned long machine_id, unsigned long long from,
+		unsigned long long to, vector<UsageSession>& out)
+	{
+		BitReader bits(block.bits.bytes, block.bits.bit_count);
+
+		unsigned long long timestamp = 0;
+		long long delta = 0;
+		unsigned int duration = 0;
+		int leading = 32, trailing = 0;
+		for (size_t i = 0; i < block.count && !bits.overrun; i++)
+		{
+			if (i == 0)
+			{
+				timestamp = partition_start + bits.read(32);
+				duration = (unsigned int)bits.read(32);
+			}
+			else
+			{
+				long long dod;
+				if (bits.read(1) == 0)
+					dod = 0;
+				else if (bits.read(1) == 0)
+					dod = signExtend(bits.read(7), 7);
+				else if (bits.read(1) == 0)
+					dod = signExtend(bits.read(9), 9);
+				else if (bits.read(1) == 0)
+					dod = signExtend(bits.read(12), 12);
+				else
+					dod = signExtend(bits.read(32), 32);
+				delta += dod;
+				timestamp += delta;
+
+				if (bits.read(1) == 1)
+				{
+					if (bits.read(1) == 1)
+					{
+						leading = (int)bits.read(5);
+						int meaningful = (int)bits.read(6);
+						if (meaningful == 0 || meaningful > 32 - leading)
+							return false;
+						trailing = 32 - leading - meaningful;
+					}
+					else if (leading + trailing >= 32)
+						return false;
+					duration ^= (unsigned int)bits.read(32 - leading - trailing) << trailing;
+				}
+			}
+
+			if (timestamp >= from && timestamp < to)
+			{
+				UsageSession session = { bracelet_id, machine_id, timestamp, duration };
+				out.push_back(session);
+			}
+		}
+		return !bits.overrun && bits.position == bits.bit_count;
+	}
+
+	UsageSeriesStore(const UsageSeriesStore&);
+	UsageSeriesStore& operator=(const UsageSeriesStore&);
+};
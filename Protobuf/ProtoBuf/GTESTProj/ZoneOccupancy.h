@@ -0,0 +1,332 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "CacheAligned.h"
+#include "Member.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace std;
+
+/**
+The ZoneOccupancy class counts how many people are in each zone of the gym, such as the weight room and the pool,
+from tap-in and tap-out events, and refuses tap-ins that would take a zone over its capacity.
+
+Every zone's counters are split into shards, one per core, each on its own cache line. A turnstile updates the shard of the core
+it runs on, and getOccupancy() adds the shards up. The capacity cap works the same way: a zone's free places are tokens,
+kept in a shared pool and handed to shards in batches of TOKEN_BATCH. A tap-in takes a token from its own shard,
+only going to the pool when the shard runs out, and to the other shards when the pool is empty too,
+so the zone can never go over capacity, yet turnstiles rarely touch a shared cache line.
+
+Each bracelet can be in one zone at a time; tapping into another zone moves it there. Which zone a bracelet is in is kept in a
+lock-free open addressing table sized for "max_bracelets" bracelets. Bracelet ID 0 is reserved to mark empty slots.
+All functions are lock-free and can be called from any thread.
+*/
+class ZoneOccupancy
+{
+private:
+
+	/*One core's share of a zone, on a cache line of its own so turnstiles on different cores do not share one*/
+	struct Shard
+	{
+		atomic<long> occupancy;
+		atomic<long> tokens;
+		char padding[64 - sizeof(atomic<long>) * 2];
+	};
+
+	struct Zone
+	{
+		atomic<long> capacity;
+		atomic<long> pool;
+		CacheAlignedArray<Shard>* shards;
+		char padding[64 - sizeof(atomic<long>) * 2 - sizeof(void*)];
+	};
+
+	/*"zone" holds the zone index plus one, or 0 while the bracelet is in no zone*/
+	struct Presence
+	{
+		atomic<unsigned long> bracelet_id;
+		atomic<unsigned int> zone;
+	};
+
+public:
+
+	/**
+	The enumerated "Admission" type tells the outcome of a tap-in.
+	*/
+	enum Admission { ADMITTED, ZONE_FULL, ALREADY_INSIDE, UNKNOWN_BRACELET };
+
+	static const long TOKEN_BATCH = 8;
+
+	/**
+	Constructor for ZoneOccupancy. Every zone starts empty with a capacity of 0, until setCapacity() is called.
+	Up to "max_bracelets" different bracelets can be tracked. "shard_count" defaults to one shard per hardware thread.
+	*/
+	ZoneOccupancy(size_t zone_count, size_t max_bracelets, size_t shard_count = 0) : zones(zone_count)
+	{
+		if (shard_count == 0)
+			shard_count = max(1u, thread::hardware_concurrency());
+		this->shard_count = shard_count;
+
+		this->zone_count = zone_count;
+		for (size_t z = 0; z < zone_count; z++)
+		{
+			zones[z].capacity.store(0);
+			zones[z].pool.store(0);
+			zones[z].shards = new CacheAlignedArray<Shard>(shard_count);
+			for (size_t s = 0; s < shard_count; s++)
+			{
+				(*zones[z].shards)[s].occupancy.store(0);
+				(*zones[z].shards)[s].tokens.store(0);
+			}
+		}
+
+		/*At most half full, so probe sequences stay short*/
+		size_t slots = 16;
+		while (slots < max_bracelets * 2)
+			slots *= 2;
+		presence_mask = slots - 1;
+		presence = new Presence[slots];
+		for (size_t i = 0; i < slots; i++)
+		{
+			presence[i].bracelet_id.store(0);
+			presence[i].zone.store(0);
+		}
+	}
+
+	/**
+	Destructor for ZoneOccupancy.
+	*/
+	~ZoneOccupancy()
+	{
+		for (size_t z = 0; z < zone_count; z++)
+			delete zones[z].shards;
+		delete[] presence;
+	}
+
+	/**
+	Sets the most people allowed in a zone at once. Lowering it below the current occupancy admits no one until enough people leave.
+	*/
+	void setCapacity(size_t zone, long capacity)
+	{
+		Zone& z = zones[zone];
+		long old_capacity = z.capacity.exchange(capacity);
+		z.pool.fetch_add(capacity - old_capacity);
+
+		/*Tokens parked in shards must pay off a negative pool, or they could still admit people over the new capacity*/
+		for (size_t s = 0; s < shard_count && z.pool.load() < 0; s++)
+			z.pool.fetch_add((*z.shards)[s].tokens.exchange(0));
+	}
+
+	/**
+	Retreives the capacity of a zone.
+	*/
+	long getCapacity(size_t zone)
+	{
+		return zones[zone].capacity.load();
+	}
+
+	/**
+	Retreives the number of people in a zone, adding up every shard.
+	*/
+	long getOccupancy(size_t zone)
+	{
+		long occupancy = 0;
+		for (size_t s = 0; s < shard_count; s++)
+			occupancy += (*zones[zone].shards)[s].occupancy.load(memory_order_relaxed);
+		return occupancy;
+	}
+
+	/**
+	Retreives the zone the given bracelet is in. Returns false if it is in no zone.
+	*/
+	bool getZoneOf(unsigned long bracelet_id, size_t& zone)
+	{
+		Presence* slot = findSlot(bracelet_id, false);
+		unsigned int current = slot == NULL ? 0 : slot->zone.load();
+		if (current == 0)
+			return false;
+		zone = current - 1;
+		return true;
+	}
+
+	/**
+	Lets the wearer of a bracelet into a zone if there is room, moving them out of the zone they were in, if any.
+	*/
+	Admission tapIn(unsigned long bracelet_id, size_t zone)
+	{
+		Presence* slot = findSlot(bracelet_id, true);
+		if (slot == NULL)
+			return UNKNOWN_BRACELET;
+
+		unsigned int current = slot->zone.load();
+		if (current == zone + 1)
+			return ALREADY_INSIDE;
+
+		size_t shard = currentShard();
+		if (!takeToken(zones[zone], shard))
+			return ZONE_FULL;
+
+		/*A concurrent tap of the same bracelet may get in first, in which case the token goes back*/
+		while (!slot->zone.compare_exchange_weak(current, (unsigned int)zone + 1))
+		{
+			if (current == zone + 1)
+			{
+				returnToken(zones[zone], shard);
+				return ALREADY_INSIDE;
+			}
+		}
+
+		(*zones[zone].shards)[shard].occupancy.fetch_add(1, memory_order_relaxed);
+		if (current != 0)
+			leave(current - 1, shard);
+		return ADMITTED;
+	}
+
+	/**
+	Lets a member into a zone by their bracelet. See tapIn(unsigned long, size_t).
+	*/
+	Admission tapIn(Member* member, size_t zone)
+	{
+		return tapIn(member->getBraceletID(), zone);
+	}
+
+	/**
+	Records the wearer of a bracelet leaving a zone. Returns false if they were not in that zone.
+	*/
+	bool tapOut(unsigned long bracelet_id, size_t zone)
+	{
+		Presence* slot = findSlot(bracelet_id, false);
+		unsigned int expected = (unsigned int)zone + 1;
+		if (slot == NULL || !slot->zone.compare_exchange_strong(expected, 0))
+			return false;
+
+		leave(zone, currentShard());
+		return true;
+	}
+
+	/**
+	Records a member leaving a zone by their bracelet. See tapOut(unsigned long, size_t).
+	*/
+	bool tapOut(Member* member, size_t zone)
+	{
+		return tapOut(member->getBraceletID(), zone);
+	}
+
+private:
+	CacheAlignedArray<Zone> zones;
+	size_t zone_count;
+	size_t shard_count;
+	Presence* presence;
+	size_t presence_mask;
+
+	size_t currentShard()
+	{
+#ifdef __linux__
+		int cpu = sched_getcpu();
+		if (cpu >= 0)
+			return (size_t)cpu % shard_count;
+#endif
+		return hash<thread::id>()(this_thread::get_id()) % shard_count;
+	}
+
+	/*Returns the slot of a bracelet, claiming an empty one for it if "claim" is set. Returns NULL if not found or the table is full*/
+	Presence* findSlot(unsigned long bracelet_id, bool claim)
+	{
+		if (bracelet_id == 0)
+			return NULL;
+
+		size_t start = (size_t)(((unsigned long long)bracelet_id * 11400714819323198485ull) >> 32) & presence_mask;
+		for (size_t probes = 0, i = start; probes <= presence_mask; probes++, i = (i + 1) & presence_mask)
+		{
+			unsigned long key = presence[i].bracelet_id.load();
+			if (key == bracelet_id)
+				return &presence[i];
+			if (key != 0)
+				continue;
+			if (!claim)
+				return NULL;
+
+			/*Another tap may claim the same empty slot first, maybe for this very bracelet*/
+			if (presence[i].bracelet_id.compare_exchange_strong(key, bracelet_id) || key == bracelet_id)
+				return &presence[i];
+		}
+		return NULL;
+	}
+
+	bool takeToken(Zone& z, size_t shard)
+	{
+		if (takeFrom((*z.shards)[shard].tokens, 1))
+			return true;
+
+		/*Refill this shard from the pool, keeping one of the batch for this tap-in*/
+		long pooled = z.pool.load();
+		while (pooled > 0)
+		{
+			long batch = min(pooled, (long)TOKEN_BATCH);
+			if (z.pool.compare_exchange_weak(pooled, pooled - batch))
+			{
+				(*z.shards)[shard].tokens.fetch_add(batch - 1);
+				payDeficit(z, shard);
+				return true;
+			}
+		}
+
+		/*The last few places may be parked in other shards*/
+		for (size_t s = 1; s < shard_count; s++)
+		{
+			if (takeFrom((*z.shards)[(shard + s) % shard_count].tokens, 1))
+				return true;
+		}
+		return false;
+	}
+
+	static bool takeFrom(atomic<long>& tokens, long count)
+	{
+		long available = tokens.load();
+		while (available >= count)
+		{
+			if (tokens.compare_exchange_weak(available, available - count))
+				return true;
+		}
+		return false;
+	}
+
+	void returnToken(Zone& z, size_t shard)
+	{
+		/*Pay off a pool that a lowered capacity made negative before keeping the token*/
+		long pooled = z.pool.load();
+		while (pooled < 0)
+		{
+			if (z.pool.compare_exchange_weak(pooled, pooled + 1))
+				return;
+		}
+
+		/*Hand surplus tokens back to the pool, so other shards can get them without stealing*/
+		if ((*z.shards)[shard].tokens.fetch_add(1) + 1 > 2 * TOKEN_BATCH && takeFrom((*z.shards)[shard].tokens, TOKEN_BATCH))
+			z.pool.fetch_add(TOKEN_BATCH);
+		payDeficit(z, shard);
+	}
+
+	/*A setCapacity() that lowered the cap may have scanned this shard before tokens were just parked in it;
+	those tokens pay off the pool first, so they cannot admit anyone over the new capacity*/
+	static void payDeficit(Zone& z, size_t shard)
+	{
+		while (z.pool.load() < 0 && takeFrom((*z.shards)[shard].tokens, 1))
+			z.pool.fetch_add(1);
+	}
+
+	void leave(size_t zone, size_t shard)
+	{
+		(*zones[zone].shards)[shard].occupancy.fetch_sub(1, memory_order_relaxed);
+		returnToken(zones[zone], shard);
+	}
+
+	ZoneOccupancy(const ZoneOccupancy&);
+	ZoneOccupancy& operator=(const ZoneOccupancy&);
+};